@@ -269,10 +269,13 @@ void Soundscape_Update( audioparams_t &audio )
 
 void C_SoundscapeSystem::AddSoundScapeFile( const char *filename )
 {
-	KeyValues *script = new KeyValues( filename );
 #ifndef _XBOX
+	// The scripts are only read from here and released at shutdown, so they can live in an arena
+	KeyValues *script = KeyValues::CreateArenaRoot( filename );
 	if ( script->LoadFromFile( filesystem, filename ) )
 #else
+	// LoadKeyValues() parses in the filesystem's module, which can't fill an arena
+	KeyValues *script = new KeyValues( filename );
 	if ( filesystem->LoadKeyValues( *script, IFileSystem::TYPE_SOUNDSCAPE, filename, "GAME" ) )
 #endif
 	{
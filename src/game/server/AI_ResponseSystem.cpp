@@ -29,6 +29,8 @@
 ConVar rr_debugresponses( "rr_debugresponses", "0", FCVAR_NONE, "Show verbose matching output (1 for simple, 2 for rule scoring). If set to 3, it will only show response success/failure for npc_selected NPCs." );
 ConVar rr_debugrule( "rr_debugrule", "", FCVAR_NONE, "If set to the name of the rule, that rule's score will be shown whenever a concept is passed into the response rules system.");
 ConVar rr_dumpresponses( "rr_dumpresponses", "0", FCVAR_NONE, "Dump all response_rules.txt and rules (requires restart)" );
+ConVar rr_index_rules( "rr_index_rules", "1", FCVAR_NONE, "Only score the rules whose required concept/classname/map criteria can match the criteria set." );
+ConVar rr_record_criteria( "rr_record_criteria", "0", FCVAR_NONE, "Log up to this many criteria sets per response system for rr_benchmark_rule_index." );
 
 static CUtlSymbolTable g_RS;
 
@@ -59,6 +61,7 @@ public:
 		maxequals = false;
 		maxval = 0.0f;
 		minval = 0.0f;
+		tokenval = 0.0f;
 
 		token = UTL_INVAL_SYMBOL;
 		rawtoken = UTL_INVAL_SYMBOL;
@@ -110,6 +113,7 @@ public:
 
 	float	maxval;
 	float	minval;
+	float	tokenval;	// token pre-parsed for numeric compares
 
 	bool	valid : 1;      //1
 	bool	isnumeric : 1;  //2
@@ -122,6 +126,12 @@ public:
 	void	SetToken( char const *s )
 	{
 		token = g_RS.AddString( s );
+		tokenval = (float)atof( s );
+	}
+
+	float	GetTokenValue() const
+	{
+		return tokenval;
 	}
 
 	char const *GetToken()
@@ -575,6 +585,9 @@ public:
 
 	void		DumpDictionary( const char *pszName );
 
+	void		BenchmarkRuleIndex( const char *pszName, int nIterations );
+	void		ClearRecordedCriteria()	{ m_RecordedCriteria.PurgeAndDeleteElements(); }
+
 protected:
 
 	virtual const char *GetScriptFile( void ) = 0;
@@ -683,6 +696,10 @@ public:
 	float		LookupEnumeration( const char *name, bool& found );
 
 	int			FindBestMatchingRule( const AI_CriteriaSet& set, bool verbose );
+	float		CollectBestMatchingRules( const AI_CriteriaSet& set, CUtlVector< int >& bestrules, bool bUseIndex, bool verbose );
+
+	bool		IsIndexableCriterion( Criteria *c, const char *pszKey );
+	void		BuildRuleIndex();
 
 	float		ScoreCriteriaAgainstRule( const AI_CriteriaSet& set, int irule, bool verbose = false );
 	float		RecursiveScoreSubcriteriaAgainstRule( const AI_CriteriaSet& set, Criteria *parent, bool& exclude, bool verbose /*=false*/ );
@@ -710,6 +727,14 @@ public:
 	CUtlDict< Rule, short >	m_Rules;
 	CUtlDict< Enumeration, short > m_Enumerations;
 
+	// Rules bucketed by their first plain "key=value" required criterion, see BuildRuleIndex()
+	CUtlDict< CCopyableUtlVector< int >, int >	m_RuleIndex;
+	CUtlVector< int >		m_UnindexedRules;
+	bool		m_bRuleIndexValid;
+
+	// Criteria sets logged for rr_benchmark_rule_index
+	CUtlVector< AI_CriteriaSet * >	m_RecordedCriteria;
+
 	char		token[ 1204 ];
 
 	bool		m_bUnget;
@@ -762,6 +787,7 @@ CResponseSystem::CResponseSystem()
 	m_bUnget = false;
 	m_bPrecache = true;
 	m_bCustomManagable = false;
+	m_bRuleIndexValid = false;
 }
 
 //-----------------------------------------------------------------------------
@@ -769,6 +795,7 @@ CResponseSystem::CResponseSystem()
 //-----------------------------------------------------------------------------
 CResponseSystem::~CResponseSystem()
 {
+	ClearRecordedCriteria();
 }
 
 //-----------------------------------------------------------------------------
@@ -817,6 +844,9 @@ void CResponseSystem::Clear()
 	m_Criteria.RemoveAll();
 	m_Rules.RemoveAll();
 	m_Enumerations.RemoveAll();
+	m_RuleIndex.RemoveAll();
+	m_UnindexedRules.RemoveAll();
+	m_bRuleIndexValid = false;
 }
 
 //-----------------------------------------------------------------------------
@@ -1047,7 +1077,7 @@ bool CResponseSystem::CompareUsingMatcher( const char *setValue, Matcher& m, boo
 	{
 		if ( m.isnumeric )
 		{
-			if ( v == (float)atof( m.GetToken() ) )
+			if ( v == m.GetTokenValue() )
 				return false;
 		}
 		else
@@ -1066,7 +1096,7 @@ bool CResponseSystem::CompareUsingMatcher( const char *setValue, Matcher& m, boo
 		if ( !setValue || !setValue[0] )
 			return false;
 
-		return v == (float)atof( m.GetToken() );
+		return v == m.GetTokenValue();
 	}
 
 	return !Q_stricmp( setValue, m.GetToken() ) ? true : false;
@@ -1677,36 +1707,208 @@ bool CResponseSystem::GetBestResponse( ResponseSearchResult& searchResult, Rule
 }
 
 //-----------------------------------------------------------------------------
-// Purpose: 
-// Input  : set - 
-//			verbose - 
-// Output : int
+// Purpose: Index keys, in priority order.  A rule is filed under the first one
+//  it has a plain string equality requirement on.
 //-----------------------------------------------------------------------------
-int CResponseSystem::FindBestMatchingRule( const AI_CriteriaSet& set, bool verbose )
+static const char *g_pszRuleIndexKeys[] =
 {
-	CUtlVector< int >	bestrules;
-	float bestscore = 0.001f;
+	"concept",
+	"classname",
+	"map",
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Can a set only score a rule with this criterion if the set's value
+//  for pszKey is exactly the criterion's token?
+//-----------------------------------------------------------------------------
+bool CResponseSystem::IsIndexableCriterion( Criteria *c, const char *pszKey )
+{
+	if ( !c->required || c->IsSubCriteriaType() || !c->name || Q_stricmp( c->name, pszKey ) )
+		return false;
+
+	Matcher& m = c->matcher;
+	if ( !m.valid || m.isnumeric || m.notequal || m.usemin || m.usemax )
+		return false;
+
+	// An empty token would also match sets that don't have the key at all
+	return m.GetToken()[0] ? true : false;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Buckets the rules by the "key=value" of their first indexable required
+//  criterion.  Any other value for that key fails the criterion and excludes the
+//  rule, so a set only has to score its own buckets plus the unindexed rules.
+//-----------------------------------------------------------------------------
+void CResponseSystem::BuildRuleIndex()
+{
+	m_RuleIndex.RemoveAll();
+	m_UnindexedRules.RemoveAll();
+
+	char key[ 256 ];
 
 	int c = m_Rules.Count();
-	int i;
-	for ( i = 0; i < c; i++ )
+	for ( int i = 0; i < c; i++ )
 	{
+		Rule *rule = &m_Rules[ i ];
+
+		bool bIndexed = false;
+		for ( int k = 0; k < ARRAYSIZE( g_pszRuleIndexKeys ) && !bIndexed; k++ )
+		{
+			int count = rule->m_Criteria.Count();
+			for ( int j = 0; j < count; j++ )
+			{
+				Criteria *crit = &m_Criteria[ rule->m_Criteria[ j ] ];
+				if ( !IsIndexableCriterion( crit, g_pszRuleIndexKeys[ k ] ) )
+					continue;
+
+				Q_snprintf( key, sizeof( key ), "%s=%s", g_pszRuleIndexKeys[ k ], crit->matcher.GetToken() );
+
+				int idx = m_RuleIndex.Find( key );
+				if ( idx == m_RuleIndex.InvalidIndex() )
+				{
+					idx = m_RuleIndex.Insert( key );
+				}
+
+				// Rules are visited in order, so every bucket stays sorted
+				m_RuleIndex[ idx ].AddToTail( i );
+				bIndexed = true;
+				break;
+			}
+		}
+
+		if ( !bIndexed )
+		{
+			m_UnindexedRules.AddToTail( i );
+		}
+	}
+
+	m_bRuleIndexValid = true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Scores the rules and fills in the ones tied for the best score, in
+//  rule order.  The indexed path visits a subset of the rules in the same order
+//  and produces the same list as the full scan.
+// Output : best score
+//-----------------------------------------------------------------------------
+float CResponseSystem::CollectBestMatchingRules( const AI_CriteriaSet& set, CUtlVector< int >& bestrules, bool bUseIndex, bool verbose )
+{
+	bestrules.RemoveAll();
+	float bestscore = 0.001f;
+
+	if ( !bUseIndex )
+	{
+		int c = m_Rules.Count();
+		int i;
+		for ( i = 0; i < c; i++ )
+		{
+			float score = ScoreCriteriaAgainstRule( set, i, verbose );
+			// Check equals so that we keep track of all matching rules
+			if ( score >= bestscore )
+			{
+				// Reset bucket
+				if( score != bestscore )
+				{
+					bestscore = score;
+					bestrules.RemoveAll();
+				}
+
+				// Add to bucket
+				bestrules.AddToTail( i );
+			}
+		}
+
+		return bestscore;
+	}
+
+	if ( !m_bRuleIndexValid )
+	{
+		BuildRuleIndex();
+	}
+
+	// Gather the buckets this set can match
+	const CUtlVector< int > *lists[ ARRAYSIZE( g_pszRuleIndexKeys ) + 1 ];
+	int heads[ ARRAYSIZE( g_pszRuleIndexKeys ) + 1 ];
+	int nLists = 0;
+
+	lists[ nLists++ ] = &m_UnindexedRules;
+
+	char key[ 256 ];
+	for ( int k = 0; k < ARRAYSIZE( g_pszRuleIndexKeys ); k++ )
+	{
+		int found = set.FindCriterionIndex( g_pszRuleIndexKeys[ k ] );
+		if ( found == -1 )
+			continue;
+
+		const char *value = set.GetValue( found );
+		if ( !value || !value[0] )
+			continue;
+
+		Q_snprintf( key, sizeof( key ), "%s=%s", g_pszRuleIndexKeys[ k ], value );
+		int idx = m_RuleIndex.Find( key );
+		if ( idx != m_RuleIndex.InvalidIndex() )
+		{
+			lists[ nLists++ ] = &m_RuleIndex[ idx ];
+		}
+	}
+
+	for ( int l = 0; l < nLists; l++ )
+	{
+		heads[ l ] = 0;
+	}
+
+	// Merge the sorted buckets so ties come out in the same order as the full scan
+	for ( ;; )
+	{
+		int best = -1;
+		for ( int l = 0; l < nLists; l++ )
+		{
+			if ( heads[ l ] >= lists[ l ]->Count() )
+				continue;
+
+			if ( best == -1 || (*lists[ l ])[ heads[ l ] ] < (*lists[ best ])[ heads[ best ] ] )
+			{
+				best = l;
+			}
+		}
+
+		if ( best == -1 )
+			break;
+
+		int i = (*lists[ best ])[ heads[ best ]++ ];
+
 		float score = ScoreCriteriaAgainstRule( set, i, verbose );
-		// Check equals so that we keep track of all matching rules
 		if ( score >= bestscore )
 		{
-			// Reset bucket
 			if( score != bestscore )
 			{
 				bestscore = score;
 				bestrules.RemoveAll();
 			}
 
-			// Add to bucket
 			bestrules.AddToTail( i );
 		}
 	}
 
+	return bestscore;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: 
+// Input  : set - 
+//			verbose - 
+// Output : int
+//-----------------------------------------------------------------------------
+int CResponseSystem::FindBestMatchingRule( const AI_CriteriaSet& set, bool verbose )
+{
+	CUtlVector< int >	bestrules;
+
+	// Verbose and rr_debugrule output describe every rule, so those take the full scan
+	const char *pszDebugRule = rr_debugrule.GetString();
+	bool bUseIndex = rr_index_rules.GetBool() && !verbose && !( pszDebugRule && pszDebugRule[0] );
+
+	CollectBestMatchingRules( set, bestrules, bUseIndex, verbose );
+
 	int bestCount = bestrules.Count();
 	if ( bestCount <= 0 )
 		return -1;
@@ -1736,6 +1938,11 @@ bool CResponseSystem::FindBestResponse( const AI_CriteriaSet& set, AI_Response&
 	bool showRules = ( iDbgResponse == 2 );
 	bool showResult = ( iDbgResponse == 1 || iDbgResponse == 2 );
 
+	if ( m_RecordedCriteria.Count() < rr_record_criteria.GetInt() )
+	{
+		m_RecordedCriteria.AddToTail( new AI_CriteriaSet( set ) );
+	}
+
 	// Look for match. verbose mode used to be at level 2, but disabled because the writers don't actually care for that info.
 	int bestRule = FindBestMatchingRule( set, iDbgResponse == 3 ); 
 
@@ -2004,6 +2211,8 @@ void CResponseSystem::LoadRuleSet( const char *basescript )
 	UTIL_FreeFile( buffer );
 
 	Assert( m_ScriptStack.Count() == 0 );
+
+	BuildRuleIndex();
 }
 
 static ResponseType_t ComputeResponseType( const char *s )
@@ -2607,6 +2816,7 @@ void CResponseSystem::ParseRule( void )
 	if ( validRule )
 	{
 		m_Rules.Insert( ruleName, newRule );
+		m_bRuleIndexValid = false;
 	}
 	else
 	{
@@ -2804,6 +3014,7 @@ void CResponseSystem::CopyRuleFrom( Rule *pSrcRule, int iRule, CResponseSystem *
 
 	// Add rule.
 	pCustomSystem->m_Rules.Insert( m_Rules.GetElementName( iRule ), dstRule );
+	pCustomSystem->m_bRuleIndexValid = false;
 }
 
 //-----------------------------------------------------------------------------
@@ -2928,6 +3139,32 @@ public:
 	IResponseSystem *BuildCustomResponseSystemGivenCriteria( const char *pszBaseFile, const char *pszCustomName, AI_CriteriaSet &criteriaSet, float flCriteriaScore );
 	void DestroyCustomResponseSystems();
 
+	void BenchmarkAllRuleIndices( int nIterations, bool bReset )
+	{
+		if ( bReset )
+		{
+			ClearRecordedCriteria();
+		}
+		else
+		{
+			BenchmarkRuleIndex( GetScriptFile(), nIterations );
+		}
+
+		int c = m_InstancedSystems.Count();
+		for ( int i = 0; i < c; i++ )
+		{
+			CInstancedResponseSystem *sys = m_InstancedSystems[ i ];
+			if ( bReset )
+			{
+				sys->ClearRecordedCriteria();
+			}
+			else
+			{
+				sys->BenchmarkRuleIndex( m_InstancedSystems.GetElementName( i ), nIterations );
+			}
+		}
+	}
+
 	virtual void LevelInitPreEntity()
 	{
 		// This will precache the default system
@@ -3051,6 +3288,22 @@ CON_COMMAND( rr_reloadresponsesystems, "Reload all response system scripts." )
 #endif
 }
 
+CON_COMMAND( rr_benchmark_rule_index, "Replay the criteria sets logged by rr_record_criteria through the indexed and full rule scans, check both pick the same rules and time them.\nUsage: rr_benchmark_rule_index [iterations | reset]" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( args.ArgC() > 1 && !Q_stricmp( args[1], "reset" ) )
+	{
+		defaultresponsesytem.BenchmarkAllRuleIndices( 0, true );
+		Msg( "Cleared recorded criteria sets\n" );
+		return;
+	}
+
+	int nIterations = ( args.ArgC() > 1 ) ? MAX( atoi( args[1] ), 1 ) : 10;
+	defaultresponsesytem.BenchmarkAllRuleIndices( nIterations, false );
+}
+
 static short RESPONSESYSTEM_SAVE_RESTORE_VERSION = 1;
 
 // note:  this won't save/restore settings from instanced response systems.  Could add that with a CDefSaveRestoreOps implementation if needed
@@ -3364,6 +3617,94 @@ void CResponseSystem::DumpRules()
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Replays the recorded criteria sets through both rule scans, reports
+//  any set where they disagree and times each over nIterations passes
+//-----------------------------------------------------------------------------
+void CResponseSystem::BenchmarkRuleIndex( const char *pszName, int nIterations )
+{
+	int c = m_RecordedCriteria.Count();
+	if ( c <= 0 )
+	{
+		Msg( "%s: no recorded criteria sets (set rr_record_criteria)\n", pszName );
+		return;
+	}
+
+	if ( !m_bRuleIndexValid )
+	{
+		BuildRuleIndex();
+	}
+
+	CUtlVector< int > fullRules;
+	CUtlVector< int > indexedRules;
+
+	int nMismatches = 0;
+	int nMatched = 0;
+	int i;
+	for ( i = 0; i < c; i++ )
+	{
+		const AI_CriteriaSet &set = *m_RecordedCriteria[ i ];
+		float flFullScore = CollectBestMatchingRules( set, fullRules, false, false );
+		float flIndexedScore = CollectBestMatchingRules( set, indexedRules, true, false );
+
+		if ( fullRules.Count() )
+		{
+			++nMatched;
+		}
+
+		bool bSame = ( flFullScore == flIndexedScore ) && ( fullRules.Count() == indexedRules.Count() );
+		for ( int j = 0; bSame && j < fullRules.Count(); j++ )
+		{
+			bSame = ( fullRules[ j ] == indexedRules[ j ] );
+		}
+
+		if ( !bSame )
+		{
+			if ( nMismatches < 8 )
+			{
+				int idx = set.FindCriterionIndex( "concept" );
+				Msg( "  mismatch on set %d (concept '%s'): full %d rules (%.3f), indexed %d rules (%.3f)\n",
+					i, ( idx != -1 ) ? set.GetValue( idx ) : "", fullRules.Count(), flFullScore, indexedRules.Count(), flIndexedScore );
+			}
+			++nMismatches;
+		}
+	}
+
+	CFastTimer fullTimer;
+	fullTimer.Start();
+	for ( int iter = 0; iter < nIterations; iter++ )
+	{
+		for ( i = 0; i < c; i++ )
+		{
+			CollectBestMatchingRules( *m_RecordedCriteria[ i ], fullRules, false, false );
+		}
+	}
+	fullTimer.End();
+
+	CFastTimer indexedTimer;
+	indexedTimer.Start();
+	for ( int iter = 0; iter < nIterations; iter++ )
+	{
+		for ( i = 0; i < c; i++ )
+		{
+			CollectBestMatchingRules( *m_RecordedCriteria[ i ], indexedRules, true, false );
+		}
+	}
+	indexedTimer.End();
+
+	float flFullMS = fullTimer.GetDuration().GetMillisecondsF();
+	float flIndexedMS = indexedTimer.GetDuration().GetMillisecondsF();
+	int nQueries = c * nIterations;
+
+	Msg( "%s: %d rules, %d buckets, %d unindexed\n", pszName, m_Rules.Count(), m_RuleIndex.Count(), m_UnindexedRules.Count() );
+	Msg( "  %d sets (%d matched) x %d: full scan %.3f ms (%.2f us/query), indexed %.3f ms (%.2f us/query), %.1fx, %d mismatches\n",
+		c, nMatched, nIterations,
+		flFullMS, 1000.0f * flFullMS / nQueries,
+		flIndexedMS, 1000.0f * flIndexedMS / nQueries,
+		( flIndexedMS > 0.0f ) ? flFullMS / flIndexedMS : 0.0f,
+		nMismatches );
+}
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 void CResponseSystem::DumpDictionary( const char *pszName )
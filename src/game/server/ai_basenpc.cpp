@@ -3251,14 +3251,15 @@ void CAI_BaseNPC::UpdateEfficiency( bool bInPVS )
 	
 	if ( GetSoundInterests() & SOUND_DANGER )
 	{
-		int	iSound = CSoundEnt::ActiveList();
-		
-		while ( iSound != SOUNDLIST_EMPTY )
-		{
-			CSound *pCurrentSound = CSoundEnt::SoundPointerForIndex( iSound );
+		float hearingSensitivity = HearingSensitivity();
+		Vector vEarPosition = EarPosition();
 
-			float hearingSensitivity = HearingSensitivity();
-			Vector vEarPosition = EarPosition();
+		SoundCandidateList_t candidates;
+		CSoundEnt::GetAudibleSoundCandidates( vEarPosition, hearingSensitivity, &candidates );
+
+		for ( int i = 0; i < candidates.Count(); i++ )
+		{
+			CSound *pCurrentSound = CSoundEnt::SoundPointerForIndex( candidates[i] );
 
 			if ( pCurrentSound && (SOUND_DANGER & pCurrentSound->SoundType()) )
 			{
@@ -3270,8 +3271,6 @@ void CAI_BaseNPC::UpdateEfficiency( bool bInPVS )
 					break;
 				}
 			}
-			
-			iSound = pCurrentSound->NextSound();
 		}
 	}
 
@@ -3720,8 +3719,80 @@ void CAI_BaseNPC::RebalanceThinks()
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Frame think budget. NPC thinks share a per-frame time budget, and once it
+// is spent further NPCs are bumped to the next frame. Part of the next
+// frame's budget is reserved for the NPCs that were bumped, so the backlog
+// drains in turn rather than the same NPCs losing out every frame, and
+// efficient (distant or out of PVS) NPCs give way first.
+//-----------------------------------------------------------------------------
+
+ConVar	ai_think_budget( "ai_think_budget", "0", FCVAR_NONE, "Per-frame time budget for NPC thinks, in milliseconds (0 = default)" );
+ConVar	ai_think_budget_efficient( "ai_think_budget_efficient", "0.5", FCVAR_NONE, "Fraction of the NPC think budget efficient (distant or out of PVS) NPCs may run in" );
+
+struct AIThinkBudgetStats_t
+{
+	int		nFrames;
+	int		nFramesOverBudget;
+	int		nThinks;
+	int		nBumps;
+	int		nMaxWaiting;			// Most NPCs bumped in a single frame
+	int		nDeferredThinks;		// Thinks that ran after being bumped
+	float	flTotalDeferral;
+	float	flMaxDeferral;
+};
+
 static float g_NpcTimeThisFrame;
 static float g_StartTimeCurThink;
+static int g_nNpcThinksThisFrame;
+static int g_nNpcBumpedThisFrame;
+static float g_flNpcThinkReserve;
+static float g_flNpcThinkBudget;
+static AIThinkBudgetStats_t g_AIThinkBudgetStats;
+
+//-------------------------------------
+
+static void BeginNPCThinkFrame( float flBudget )
+{
+	AIThinkBudgetStats_t &stats = g_AIThinkBudgetStats;
+
+	if ( g_nNpcThinksThisFrame || g_nNpcBumpedThisFrame )
+	{
+		stats.nFrames++;
+		if ( g_nNpcBumpedThisFrame )
+			stats.nFramesOverBudget++;
+		stats.nMaxWaiting = MAX( stats.nMaxWaiting, g_nNpcBumpedThisFrame );
+	}
+
+	// Hold back enough of the budget for the NPCs bumped last frame to run at
+	// last frame's average cost, up to half the budget
+	float flAverageThink = ( g_nNpcThinksThisFrame ) ? g_NpcTimeThisFrame / g_nNpcThinksThisFrame : 0;
+	g_flNpcThinkReserve = MIN( g_nNpcBumpedThisFrame * flAverageThink, flBudget * 0.5f );
+	g_flNpcThinkBudget = flBudget;
+
+	g_NpcTimeThisFrame = 0;
+	g_nNpcThinksThisFrame = 0;
+	g_nNpcBumpedThisFrame = 0;
+}
+
+//-------------------------------------
+
+CON_COMMAND( ai_think_budget_report, "Reports how often the NPC think budget ran out and how long bumped NPCs waited.\n\tArguments:	'reset' to clear the counts" )
+{
+	AIThinkBudgetStats_t &stats = g_AIThinkBudgetStats;
+
+	if ( args.ArgC() > 1 && !Q_stricmp( args[1], "reset" ) )
+	{
+		memset( &stats, 0, sizeof(stats) );
+		return;
+	}
+
+	Msg( "NPC think budget %.2fms (%.2fms reserved for bumped NPCs this frame)\n", g_flNpcThinkBudget * 1000.0f, g_flNpcThinkReserve * 1000.0f );
+	Msg( "   %d frames, %d over budget (%.1f%%)\n", stats.nFrames, stats.nFramesOverBudget, ( stats.nFrames ) ? 100.0f * stats.nFramesOverBudget / stats.nFrames : 0.0f );
+	Msg( "   %d thinks, %d bumps, at most %d NPCs bumped in a frame\n", stats.nThinks, stats.nBumps, stats.nMaxWaiting );
+	Msg( "   %d thinks ran late, waiting %.1fms on average, %.1fms at most\n", stats.nDeferredThinks,
+		 ( stats.nDeferredThinks ) ? 1000.0f * stats.flTotalDeferral / stats.nDeferredThinks : 0.0f, 1000.0f * stats.flMaxDeferral );
+}
 
 bool CAI_BaseNPC::PreNPCThink()
 {
@@ -3761,18 +3832,31 @@ bool CAI_BaseNPC::PreNPCThink()
 
 			iPrevFrame = gpGlobals->framecount;
 			frameTimeLimit = NPC_THINK_LIMIT * timescale;
-			g_NpcTimeThisFrame = 0;
+			BeginNPCThinkFrame( ( ai_think_budget.GetFloat() > 0 ) ? ai_think_budget.GetFloat() / 1000.0 : NPC_THINK_LIMIT );
 		}
 		else
 		{
-			if ( g_NpcTimeThisFrame > NPC_THINK_LIMIT )
+			// NPCs waiting from an earlier frame may use the whole budget
+			float flLimit = g_flNpcThinkBudget;
+			if ( m_iFrameBlocked == -1 )
+			{
+				flLimit -= g_flNpcThinkReserve;
+				if ( GetEfficiency() > AIE_NORMAL )
+					flLimit *= ai_think_budget_efficient.GetFloat();
+			}
+
+			if ( g_NpcTimeThisFrame > flLimit )
 			{
 				float timeSinceLastRealThink = gpGlobals->curtime - m_flLastRealThinkTime;
 				// Don't bump anyone more that a quarter second
 				if ( timeSinceLastRealThink <= .25 )
 				{
 					DbgFrameLimitMsg( "Bumped %d (%d)\n", this, gpGlobals->framecount );
+					if ( m_iFrameBlocked == -1 )
+						m_flThinkBumpedTime = gpGlobals->curtime;
 					m_iFrameBlocked = gpGlobals->framecount;
+					g_nNpcBumpedThisFrame++;
+					g_AIThinkBudgetStats.nBumps++;
 					SetNextThink( gpGlobals->curtime );
 					return false;
 				}
@@ -3786,6 +3870,14 @@ bool CAI_BaseNPC::PreNPCThink()
 		DbgFrameLimitMsg( "Running %d (%d)\n", this, gpGlobals->framecount );
 		g_StartTimeCurThink = engine->Time();
 
+		if ( m_iFrameBlocked != -1 )
+		{
+			float flDeferral = gpGlobals->curtime - m_flThinkBumpedTime;
+			g_AIThinkBudgetStats.nDeferredThinks++;
+			g_AIThinkBudgetStats.flTotalDeferral += flDeferral;
+			g_AIThinkBudgetStats.flMaxDeferral = MAX( g_AIThinkBudgetStats.flMaxDeferral, flDeferral );
+		}
+
 		m_iFrameBlocked = -1;
 		m_nLastThinkTick = TIME_TO_TICKS( m_flLastRealThinkTime );
 	}
@@ -3798,6 +3890,8 @@ void CAI_BaseNPC::PostNPCThink( void )
 	if ( g_StartTimeCurThink != 0.0 && VCRGetMode() == VCR_Disabled )
 	{
 		g_NpcTimeThisFrame += engine->Time() - g_StartTimeCurThink;
+		g_nNpcThinksThisFrame++;
+		g_AIThinkBudgetStats.nThinks++;
 	}
 }
 
@@ -10599,6 +10693,7 @@ BEGIN_DATADESC( CAI_BaseNPC )
 	DEFINE_FIELD( m_bUsingStandardThinkTime,	FIELD_BOOLEAN ),
 	DEFINE_FIELD( m_flLastRealThinkTime,		FIELD_TIME ),
 	//								m_iFrameBlocked (not saved)
+	//								m_flThinkBumpedTime (not saved)
 	//								m_bInChoreo (not saved)
 	//								m_bDoPostRestoreRefindPath (not saved)
 	//								gm_flTimeLastSpawn (static)
@@ -11420,6 +11515,7 @@ CAI_BaseNPC::CAI_BaseNPC(void)
 	}
 
 	m_iFrameBlocked = -1;
+	m_flThinkBumpedTime = 0;
 	m_bInChoreo = true; // assume so until call to UpdateEfficiency()
 	
 	SetCollisionGroup( COLLISION_GROUP_NPC );
@@ -767,6 +767,7 @@ private:
 	bool				m_bUsingStandardThinkTime;
 	float				m_flLastRealThinkTime;
 	int					m_iFrameBlocked;
+	float				m_flThinkBumpedTime;		// When the think budget first bumped this NPC
 	bool				m_bInChoreo;
 
 	static int			gm_iNextThinkRebalanceTick;
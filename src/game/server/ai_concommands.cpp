@@ -286,6 +286,25 @@ CON_COMMAND(ai_show_node, "Highlight the specified node")
 	}
 }
 
+CON_COMMAND(ai_show_node_cache, "Display nearest node cache hit and miss counts.\n\tArguments:	'reset' to clear the counts")
+{
+	if ( !g_pBigAINet )
+		return;
+
+	if ( args.ArgC() > 1 && !Q_stricmp( args[1], "reset" ) )
+	{
+		g_pBigAINet->ResetNearestNodeCacheStats();
+		return;
+	}
+
+	int hits = g_pBigAINet->GetNearestNodeCacheHits();
+	int misses = g_pBigAINet->GetNearestNodeCacheMisses();
+	int total = hits + misses;
+
+	Msg( "Nearest node cache: %d hits, %d misses (%.1f%% hit rate), %d invalidations\n",
+		 hits, misses, ( total ) ? 100.0f * hits / total : 0.0f, g_pBigAINet->GetNearestNodeCacheInvalidations() );
+}
+
 //------------------------------------------------------------------------------
 // Purpose: Show visibility from selected node to all other nodes
 //------------------------------------------------------------------------------
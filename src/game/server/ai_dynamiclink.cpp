@@ -486,6 +486,7 @@ void CAI_DynamicLink::SetLinkState(void)
 		if ( pLink )
 		{
 			pLink->m_pDynamicLink = this;
+			int oldLinkInfo = pLink->m_LinkInfo;
 			if (m_nLinkState == LINK_OFF)
 			{
 				pLink->m_LinkInfo |=  bits_LINK_OFF;
@@ -494,6 +495,12 @@ void CAI_DynamicLink::SetLinkState(void)
 			{
 				pLink->m_LinkInfo &= ~bits_LINK_OFF;
 			}
+
+			// Cached nearest nodes may have been chosen with the old link state
+			if ( pLink->m_LinkInfo != oldLinkInfo )
+			{
+				g_pBigAINet->InvalidateNearestNodeCache();
+			}
 		}
 		else
 		{
@@ -102,6 +102,11 @@ public:
 // PERFORMANCE: Tune this number
 #define MAX_NEAR_NODES	10			// Trace to 10 nodes at most
 
+// Node grid cells are at least this size, and grown so a side of the grid
+// never has more than AI_NODE_GRID_MAX_DIM cells
+#define AI_NODE_GRID_CELL_SIZE	256.0f
+#define AI_NODE_GRID_MAX_DIM	256
+
 //-----------------------------------------------------------------------------
 
 CAI_Network::CAI_Network()
@@ -109,13 +114,22 @@ CAI_Network::CAI_Network()
 	m_iNumNodes				= 0;		// Number of nodes in this network
 	m_pAInode				= NULL;		// Array of all nodes in this network
 
-	m_iNearestCacheNext	= NEARNODE_CACHE_SIZE - 1;
+	m_iNearestCacheGeneration = 0;
 	// Force empty node caches to be rebuild
 	for (int node=0;node<NEARNODE_CACHE_SIZE;node++)
 	{
 		m_NearestCache[node].hull = HULL_NONE;
-		m_NearestCache[node].expiration	= FLT_MIN;
+		m_NearestCache[node].lastUsed = FLT_MIN;
+		m_NearestCache[node].generation = -1;
 	}
+	ResetNearestNodeCacheStats();
+
+	m_bNodeGridDirty		= true;
+	m_nNodeGridNodes		= 0;
+	m_vecNodeGridMins.Init();
+	m_flNodeGridCellSize	= AI_NODE_GRID_CELL_SIZE;
+	m_nNodeGridCols			= 0;
+	m_nNodeGridRows			= 0;
 
 #ifdef AI_NODE_TREE
 	m_pNodeTree = NULL;
@@ -190,6 +204,98 @@ int	CAI_Network::FindBSSmallest(CVarBitVec *bitString, float *float_array, int a
 	return winIndex;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Rebuild the node grid if nodes were added or the network was
+//			rebuilt since it was last built
+//-----------------------------------------------------------------------------
+
+void CAI_Network::UpdateNodeGrid()
+{
+	if ( !m_bNodeGridDirty && m_nNodeGridNodes == m_iNumNodes )
+		return;
+
+	AI_PROFILE_SCOPE( CAI_Network_UpdateNodeGrid );
+
+	m_bNodeGridDirty = false;
+	m_nNodeGridNodes = m_iNumNodes;
+	m_nNodeGridCols = 0;
+	m_nNodeGridRows = 0;
+	m_NodeGridStart.RemoveAll();
+	m_NodeGridEntries.RemoveAll();
+
+	if ( !m_iNumNodes )
+		return;
+
+	Vector2D mins( FLT_MAX, FLT_MAX );
+	Vector2D maxs( -FLT_MAX, -FLT_MAX );
+
+	int node;
+	for ( node = 0; node < m_iNumNodes; node++ )
+	{
+		const Vector &origin = m_pAInode[node]->GetOrigin();
+		mins.x = MIN( mins.x, origin.x );
+		mins.y = MIN( mins.y, origin.y );
+		maxs.x = MAX( maxs.x, origin.x );
+		maxs.y = MAX( maxs.y, origin.y );
+	}
+
+	float flExtent = MAX( maxs.x - mins.x, maxs.y - mins.y );
+
+	m_vecNodeGridMins = mins;
+	m_flNodeGridCellSize = MAX( AI_NODE_GRID_CELL_SIZE, flExtent / ( AI_NODE_GRID_MAX_DIM - 1 ) );
+	m_nNodeGridCols = MIN( (int)( ( maxs.x - mins.x ) / m_flNodeGridCellSize ) + 1, AI_NODE_GRID_MAX_DIM );
+	m_nNodeGridRows = MIN( (int)( ( maxs.y - mins.y ) / m_flNodeGridCellSize ) + 1, AI_NODE_GRID_MAX_DIM );
+
+	// Counting sort the nodes by cell, which keeps each cell in node order
+	int nCells = m_nNodeGridCols * m_nNodeGridRows;
+	m_NodeGridStart.SetCount( nCells + 1 );
+	memset( m_NodeGridStart.Base(), 0, m_NodeGridStart.Count() * sizeof(int) );
+
+	CUtlVector<int> nodeCells;
+	nodeCells.SetCount( m_iNumNodes );
+	for ( node = 0; node < m_iNumNodes; node++ )
+	{
+		int col, row;
+		GetNodeGridCell( m_pAInode[node]->GetOrigin(), &col, &row );
+		nodeCells[node] = row * m_nNodeGridCols + col;
+		m_NodeGridStart[nodeCells[node] + 1]++;
+	}
+
+	for ( int cell = 0; cell < nCells; cell++ )
+	{
+		m_NodeGridStart[cell + 1] += m_NodeGridStart[cell];
+	}
+
+	CUtlVector<int> next;
+	next.AddMultipleToTail( nCells, m_NodeGridStart.Base() );
+
+	m_NodeGridEntries.SetCount( m_iNumNodes );
+	for ( node = 0; node < m_iNumNodes; node++ )
+	{
+		m_NodeGridEntries[next[nodeCells[node]]++] = node;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Cell containing the position, clamped to the grid
+//-----------------------------------------------------------------------------
+
+void CAI_Network::GetNodeGridCell( const Vector &vecPos, int *pCol, int *pRow ) const
+{
+	int col = (int)floorf( ( vecPos.x - m_vecNodeGridMins.x ) / m_flNodeGridCellSize );
+	int row = (int)floorf( ( vecPos.y - m_vecNodeGridMins.y ) / m_flNodeGridCellSize );
+
+	*pCol = clamp( col, 0, m_nNodeGridCols - 1 );
+	*pRow = clamp( row, 0, m_nNodeGridRows - 1 );
+}
+
+//-------------------------------------
+
+static int __cdecl CompareNodeIDs( const int *pLeft, const int *pRight )
+{
+	return *pLeft - *pRight;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Build a list of nearby nodes sorted by distance
 // Input  : &list - 
@@ -209,16 +315,44 @@ int CAI_Network::ListNodesInBox( CNodeList &list, int maxListCount, const Vector
 	float flClosest = 1000000.0 * 1000000;
 	int closest = 0;
 
-// UNDONE: Store the nodes in a tree and query the tree instead of the entire list!!!
-	for ( int node = 0; node < m_iNumNodes; node++ )
+	UpdateNodeGrid();
+
+	// Gather the nodes in the box from the grid cells it overlaps
+	CUtlVectorFixedGrowable<int, 256> candidates;
+	if ( m_nNodeGridCols )
 	{
+		int colMin, rowMin, colMax, rowMax;
+		GetNodeGridCell( mins, &colMin, &rowMin );
+		GetNodeGridCell( maxs, &colMax, &rowMax );
+
+		for ( int row = rowMin; row <= rowMax; row++ )
+		{
+			for ( int col = colMin; col <= colMax; col++ )
+			{
+				int cell = row * m_nNodeGridCols + col;
+				for ( int i = m_NodeGridStart[cell]; i < m_NodeGridStart[cell + 1]; i++ )
+				{
+					int node = m_NodeGridEntries[i];
+					const Vector &origin = m_pAInode[node]->GetOrigin();
+					// in box?
+					if ( origin.x < mins.x || origin.x > maxs.x ||
+						 origin.y < mins.y || origin.y > maxs.y ||
+						 origin.z < mins.z || origin.z > maxs.z )
+						continue;
+
+					candidates.AddToTail( node );
+				}
+			}
+		}
+
+		// Visit in node order, so ties resolve the same as a walk of the whole list
+		candidates.Sort( CompareNodeIDs );
+	}
+
+	for ( int iCandidate = 0; iCandidate < candidates.Count(); iCandidate++ )
+	{
+		int node = candidates[iCandidate];
 		CAI_Node *pNode = m_pAInode[node];
-		const Vector &origin = pNode->GetOrigin();
-		// in box?
-		if ( origin.x < mins.x || origin.x > maxs.x ||
-			 origin.y < mins.y || origin.y > maxs.y ||
-			 origin.z < mins.z || origin.z > maxs.z )
-			continue;
 
 		if ( !pFilter->NodeIsValid(*pNode) )
 			continue;
@@ -252,6 +386,101 @@ int CAI_Network::ListNodesInBox( CNodeList &list, int maxListCount, const Vector
 	return list.Count();
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Build a list of the maxListCount undeleted nodes nearest to
+//			vecOrigin, measured to the node origins, within flMaxDist.
+//			Searches outward from the origin's grid cell a ring at a time,
+//			stopping once no unvisited cell can hold a closer node.
+// Output : int - count of list
+//-----------------------------------------------------------------------------
+
+int CAI_Network::ListNearestNodes( CNodeList &list, int maxListCount, const Vector &vecOrigin, float flMaxDist )
+{
+	AI_PROFILE_SCOPE( CAI_Network_ListNearestNodes );
+
+	list.RemoveAll();
+
+	UpdateNodeGrid();
+
+	if ( !m_nNodeGridCols || maxListCount <= 0 )
+		return 0;
+
+	CNodeList result;
+	result.SetLessFunc( CNodeList::RevIsLowerPriority );
+
+	bool full = false;
+	float flMaxDistSqr = flMaxDist * flMaxDist;
+
+	// Not clamped, the origin may be outside the grid
+	int originCol = (int)floorf( ( vecOrigin.x - m_vecNodeGridMins.x ) / m_flNodeGridCellSize );
+	int originRow = (int)floorf( ( vecOrigin.y - m_vecNodeGridMins.y ) / m_flNodeGridCellSize );
+
+	int maxRing = MAX( MAX( abs( originCol ), abs( m_nNodeGridCols - 1 - originCol ) ),
+					   MAX( abs( originRow ), abs( m_nNodeGridRows - 1 - originRow ) ) );
+
+	for ( int ring = 0; ring <= maxRing; ring++ )
+	{
+		// Nodes in this ring and beyond are further away than the width of
+		// the rings already searched
+		if ( ring > 0 )
+		{
+			float flSearchedDist = ( ring - 1 ) * m_flNodeGridCellSize;
+			float flSearchedDistSqr = flSearchedDist * flSearchedDist;
+			if ( flSearchedDistSqr > flMaxDistSqr )
+				break;
+			if ( full && result.ElementAtHead().dist <= flSearchedDistSqr )
+				break;
+		}
+
+		int rowMin = MAX( originRow - ring, 0 );
+		int rowMax = MIN( originRow + ring, m_nNodeGridRows - 1 );
+
+		for ( int row = rowMin; row <= rowMax; row++ )
+		{
+			// Only the edge of the square is new in this ring
+			int colStep = ( abs( row - originRow ) == ring ) ? 1 : MAX( ring * 2, 1 );
+
+			for ( int col = originCol - ring; col <= originCol + ring; col += colStep )
+			{
+				if ( col < 0 || col >= m_nNodeGridCols )
+					continue;
+
+				int cell = row * m_nNodeGridCols + col;
+				for ( int i = m_NodeGridStart[cell]; i < m_NodeGridStart[cell + 1]; i++ )
+				{
+					int node = m_NodeGridEntries[i];
+					CAI_Node *pNode = m_pAInode[node];
+
+					if ( pNode->GetType() == NODE_DELETED )
+						continue;
+
+					float flDist = ( pNode->GetOrigin() - vecOrigin ).LengthSqr();
+					if ( flDist > flMaxDistSqr )
+						continue;
+
+					if ( !full || (flDist < result.ElementAtHead().dist) )
+					{
+						if ( full )
+							result.RemoveAtHead();
+
+						result.Insert( AI_NearNode_t(node, flDist) );
+
+						full = (result.Count() == maxListCount);
+					}
+				}
+			}
+		}
+	}
+
+	while ( result.Count() )
+	{
+		list.Insert( result.ElementAtHead() );
+		result.RemoveAtHead();
+	}
+
+	return list.Count();
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Return ID of node nearest of vecOrigin for pNPC with the given
 //			tolerance distance.  If a route is required to get to the node
@@ -292,11 +521,15 @@ int	CAI_Network::NearestNodeToPoint( CAI_BaseNPC *pNPC, const Vector &vecOrigin,
 
 		if ( cachedNode != NO_NODE && ( !pFilter || pFilter->IsValid( m_pAInode[cachedNode] ) ) )
 		{
-			m_NearestCache[cachePos].expiration	= gpGlobals->curtime + NEARNODE_CACHE_LIFE;
+			m_NearestCache[cachePos].lastUsed = gpGlobals->curtime;
+			m_nNearestCacheHits++;
 			return cachedNode;
 		}
 	}
 
+	if ( pNPC )
+		m_nNearestCacheMisses++;
+
 	// ---------------------------------------------------------------
 	// First get nodes distances and eliminate those that are beyond 
 	// the maximum allowed distance for local movements
@@ -318,7 +551,15 @@ int	CAI_Network::NearestNodeToPoint( CAI_BaseNPC *pNPC, const Vector &vecOrigin,
 		ext.Init( MAX_AIR_NODE_LINK_DIST, MAX_AIR_NODE_LINK_DIST, MAX_AIR_NODE_LINK_DIST );
 	}
 
-	ListNodesInBox( list, MAX_NEAR_NODES, vecOrigin - ext, vecOrigin + ext, &filter );
+	if ( pNPC )
+	{
+		ListNodesInBox( list, MAX_NEAR_NODES, vecOrigin - ext, vecOrigin + ext, &filter );
+	}
+	else
+	{
+		// Without an NPC only the distance to the node origin matters
+		ListNearestNodes( list, MAX_NEAR_NODES, vecOrigin, MAX_NODE_LINK_DIST );
+	}
 
 	// --------------------------------------------------------------
 	//  Now find a reachable node searching the close nodes first
@@ -386,6 +627,16 @@ int	CAI_Network::NearestNodeToPoint(const Vector &vPosition, bool bCheckVisibili
 	return NearestNodeToPoint( NULL, vPosition, bCheckVisibility );
 }
 	
+//-----------------------------------------------------------------------------
+// Purpose: Bucket of the nearest node cache holding a quantized position and
+//			hull
+//-----------------------------------------------------------------------------
+int CAI_Network::GetNearestCacheBucket( int x, int y, int z, int hull )
+{
+	unsigned hash = ( (unsigned)x * 73856093u ) ^ ( (unsigned)y * 19349663u ) ^ ( (unsigned)z * 83492791u ) ^ ( (unsigned)hull * 2654435761u );
+	return ( hash ^ ( hash >> 16 ) ) % NEARNODE_CACHE_BUCKETS;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Check nearest node cache for checkPos and return cached nearest
 //			node if it exists in the cache.  Doesn't care about reachability,
@@ -393,28 +644,36 @@ int	CAI_Network::NearestNodeToPoint(const Vector &vPosition, bool bCheckVisibili
 //-----------------------------------------------------------------------------
 int	CAI_Network::GetCachedNode(const Vector &checkPos, Hull_t nHull, int *pCachePos )
 {
+	if ( pCachePos )
+		*pCachePos = -1;
+
 	if ( ai_no_node_cache.GetBool() )
 		return NOT_CACHED;
 
-	// Walk from newest to oldest.
-	int iNewest = m_iNearestCacheNext + 1;
-	for ( int i = 0; i < NEARNODE_CACHE_SIZE; i++ )
+	int key[3];
+	for ( int i = 0; i < 3; i++ )
+	{
+		key[i] = (int)floorf( checkPos[i] / NEARNODE_CACHE_GRID );
+	}
+
+	int iFirst = GetNearestCacheBucket( key[0], key[1], key[2], nHull ) * NEARNODE_CACHE_WAYS;
+	for ( int i = iFirst; i < iFirst + NEARNODE_CACHE_WAYS; i++ )
 	{
-		int iCurrent = ( iNewest + i ) % NEARNODE_CACHE_SIZE;
-		if ( m_NearestCache[iCurrent].hull == nHull && m_NearestCache[iCurrent].expiration > gpGlobals->curtime )
+		const NearNodeCache_T &entry = m_NearestCache[i];
+		if ( entry.generation != m_iNearestCacheGeneration || entry.hull != nHull )
+			continue;
+
+		if ( entry.key[0] != key[0] || entry.key[1] != key[1] || entry.key[2] != key[2] )
+			continue;
+
+		if ( (entry.vTestPosition - checkPos).LengthSqr() < Square(24.0) )
 		{
-			if ( (m_NearestCache[iCurrent].vTestPosition - checkPos).LengthSqr() < Square(24.0) )
-			{
-				if ( pCachePos )
-					*pCachePos = iCurrent;
-				return m_NearestCache[iCurrent].node;
-			}
+			if ( pCachePos )
+				*pCachePos = i;
+			return entry.node;
 		}
 	}
 
-
-	if ( pCachePos )
-		*pCachePos = -1;
 	return NOT_CACHED;
 }
 
@@ -446,16 +705,66 @@ void CAI_Network::SetCachedNearestNode(const Vector &checkPos, int nodeID, Hull_
 	if ( ai_no_node_cache.GetBool() )
 		return;
 
-	m_NearestCache[m_iNearestCacheNext].vTestPosition	= checkPos;
-	m_NearestCache[m_iNearestCacheNext].node			= nodeID;
-	m_NearestCache[m_iNearestCacheNext].hull			= nHull;
-	m_NearestCache[m_iNearestCacheNext].expiration		= gpGlobals->curtime + NEARNODE_CACHE_LIFE;
+	int key[3];
+	for ( int i = 0; i < 3; i++ )
+	{
+		key[i] = (int)floorf( checkPos[i] / NEARNODE_CACHE_GRID );
+	}
 
-	m_iNearestCacheNext--;
-	if ( m_iNearestCacheNext < 0 )
+	// Reuse the entry for this key if there is one, otherwise replace a stale
+	// entry or the least recently used
+	int iFirst = GetNearestCacheBucket( key[0], key[1], key[2], nHull ) * NEARNODE_CACHE_WAYS;
+	int iReplace = iFirst;
+	for ( int i = iFirst; i < iFirst + NEARNODE_CACHE_WAYS; i++ )
 	{
-		m_iNearestCacheNext = NEARNODE_CACHE_SIZE - 1;
+		const NearNodeCache_T &entry = m_NearestCache[i];
+		if ( entry.generation != m_iNearestCacheGeneration )
+		{
+			iReplace = i;
+			break;
+		}
+
+		if ( entry.hull == nHull && entry.key[0] == key[0] && entry.key[1] == key[1] && entry.key[2] == key[2] )
+		{
+			iReplace = i;
+			break;
+		}
+
+		if ( entry.lastUsed < m_NearestCache[iReplace].lastUsed )
+		{
+			iReplace = i;
+		}
 	}
+
+	NearNodeCache_T &entry = m_NearestCache[iReplace];
+	entry.vTestPosition	= checkPos;
+	entry.node			= nodeID;
+	entry.hull			= nHull;
+	entry.lastUsed		= gpGlobals->curtime;
+	entry.key[0]		= key[0];
+	entry.key[1]		= key[1];
+	entry.key[2]		= key[2];
+	entry.generation	= m_iNearestCacheGeneration;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Drop all cached nearest nodes. Called when dynamic links change
+//			what an NPC can see or reach from a node.
+//-----------------------------------------------------------------------------
+
+void CAI_Network::InvalidateNearestNodeCache()
+{
+	m_iNearestCacheGeneration++;
+	m_nNearestCacheInvalidations++;
+}
+
+//-----------------------------------------------------------------------------
+
+void CAI_Network::ResetNearestNodeCacheStats()
+{
+	m_nNearestCacheHits = 0;
+	m_nNearestCacheMisses = 0;
+	m_nNearestCacheInvalidations = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -105,6 +105,15 @@ public:
 	int				NearestNodeToPoint( CAI_BaseNPC* pNPC, const Vector &vecOrigin, bool bCheckVisiblity, INearestNodeFilter *pFilter );
 	int				NearestNodeToPoint( CAI_BaseNPC* pNPC, const Vector &vecOrigin, bool bCheckVisiblity = true ) { return NearestNodeToPoint( pNPC, vecOrigin, bCheckVisiblity, NULL ); }
 	int				NearestNodeToPoint(const Vector &vPosition, bool bCheckVisiblity = true );
+
+	int				ListNearestNodes( CNodeList &list, int maxListCount, const Vector &vecOrigin, float flMaxDist );
+	void			InvalidateNodeGrid()	{ m_bNodeGridDirty = true; }
+
+	void			InvalidateNearestNodeCache();
+	int				GetNearestNodeCacheHits() const		{ return m_nNearestCacheHits; }
+	int				GetNearestNodeCacheMisses() const	{ return m_nNearestCacheMisses; }
+	int				GetNearestNodeCacheInvalidations() const { return m_nNearestCacheInvalidations; }
+	void			ResetNearestNodeCacheStats();
 	
 	int				NumNodes() const 	{ return m_iNumNodes; }
 	CAI_Node*		GetNode( int id, bool bHandleError = true )
@@ -136,24 +145,34 @@ private:
 	int				GetCachedNearestNode(const Vector &checkPos, CAI_BaseNPC *pNPC, int *pCachePos );
 	void			SetCachedNearestNode(const Vector &checkPos, int nodeID, Hull_t nHull);
 	int				GetCachedNode(const Vector &checkPos, Hull_t nHull, int *pCachePos);
+	static int		GetNearestCacheBucket( int x, int y, int z, int hull );
 
 	int				ListNodesInBox( CNodeList &list, int maxListCount, const Vector &mins, const Vector &maxs, INodeListFilter *pFilter );
 
+	void			UpdateNodeGrid();
+	void			GetNodeGridCell( const Vector &vecPos, int *pCol, int *pRow ) const;
+
 	//---------------------------------
 
+	// Entries are keyed on the test position quantized to NEARNODE_CACHE_GRID
+	// units plus the hull, and hashed into buckets of NEARNODE_CACHE_WAYS
+	// entries. Entries stay valid until the network's dynamic links change.
 	enum
 	{
-		NEARNODE_CACHE_SIZE = 32,
-		NEARNODE_CACHE_LIFE = 10,
+		NEARNODE_CACHE_SIZE = 1024,
+		NEARNODE_CACHE_WAYS = 4,
+		NEARNODE_CACHE_BUCKETS = NEARNODE_CACHE_SIZE / NEARNODE_CACHE_WAYS,
+		NEARNODE_CACHE_GRID = 24,
 	};
 
 	struct NearNodeCache_T
 	{
 		Vector	vTestPosition;		
-		float	expiration;				// Time tested
+		float	lastUsed;				// Time last stored or hit, for replacement
 		int		node;					// Nearest Node to position
 		int		hull;					// Hull	type tested (or HULL_NONE is only visibility tested)
-
+		int		key[3];					// Quantized test position
+		int		generation;				// Cache generation the entry was stored in
 	};
 
 	int					m_iNumNodes;				// Number of nodes in this network
@@ -165,7 +184,22 @@ private:
 	};
 
 	NearNodeCache_T		m_NearestCache[NEARNODE_CACHE_SIZE];	// Cache of nearest nodes
-	int					m_iNearestCacheNext;					// Oldest record in the cache
+	int					m_iNearestCacheGeneration;				// Entries from older generations are stale
+	int					m_nNearestCacheHits;
+	int					m_nNearestCacheMisses;
+	int					m_nNearestCacheInvalidations;
+
+	// Uniform grid over the node origins on the XY plane. Nodes don't move
+	// once the network is loaded, so it is only rebuilt when nodes are added
+	// or the network is rebuilt.
+	bool				m_bNodeGridDirty;
+	int					m_nNodeGridNodes;			// Node count when the grid was built
+	Vector2D			m_vecNodeGridMins;
+	float				m_flNodeGridCellSize;
+	int					m_nNodeGridCols;
+	int					m_nNodeGridRows;
+	CUtlVector<int>		m_NodeGridStart;			// First entry of each cell in m_NodeGridEntries, plus an end marker
+	CUtlVector<int>		m_NodeGridEntries;			// Node IDs ordered by cell
 
 #ifdef AI_NODE_TREE
 	ISpatialPartition * m_pNodeTree;
@@ -25,6 +25,7 @@
 #include "ndebugoverlay.h"
 #include "ai_hint.h"
 #include "tier0/icommandline.h"
+#include "vstdlib/jobthread.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -70,6 +71,8 @@ CON_COMMAND( ai_debug_node_connect, "Debug the attempted connection between two
 
 ConVar g_ai_norebuildgraph( "ai_norebuildgraph", "0" );
 
+ConVar ai_network_build_threaded( "ai_network_build_threaded", "1", 0, "Run the node graph visibility traces on the worker threads when building the graph" );
+
 
 //-----------------------------------------------------------------------------
 // CAI_NetworkManager
@@ -2185,6 +2188,7 @@ void CAI_NetworkBuilder::Rebuild( CAI_Network *pNetwork )
 	// ---------------------------
 	// Initialize accepted hulls
 	// ---------------------------
+	ResetNodeHullTests( nNodes );
 	for (i = 0; i < nNodes; i++)
 	{
 		if (ppNodes[i]->NeedsRebuild())
@@ -2200,6 +2204,9 @@ void CAI_NetworkBuilder::Rebuild( CAI_Network *pNetwork )
 		}
 	}
 
+	pNetwork->InvalidateNodeGrid();
+	pNetwork->InvalidateNearestNodeCache();
+
 	g_pAINetworkManager->FixupHints();
 
 	EndBuild();
@@ -2218,6 +2225,9 @@ void CAI_NetworkBuilder::EndBuild()
 {
 	m_NeighborsTable.SetSize(0);
 	m_DidSetNeighborsTable.Resize(0);
+	m_VisibilityTable.Purge();
+	m_bPrecomputedVisibility = false;
+	m_NodeHullTests.Purge();
 	CAI_TestHull::ReturnTestHull();
 }
 
@@ -2276,10 +2286,20 @@ void CAI_NetworkBuilder::Build( CAI_Network *pNetwork )
 		m_NeighborsTable[i].Resize( nNodes );
 		m_NeighborsTable[i].ClearAll();
 	}
+	if ( ai_network_build_threaded.GetBool() )
+	{
+		CFastTimer visTimer;
+		visTimer.Start();
+		PrecomputeVisibility( pNetwork );
+		visTimer.End();
+		DevMsg( "...computed node visibility. %f seconds\n", visTimer.GetDuration().GetSeconds() );
+	}
 	for (i = 0; i < nNodes; i++)
 	{	
 		InitNeighbors( pNetwork, ppNodes[i] );
 	}
+	m_VisibilityTable.Purge();
+	m_bPrecomputedVisibility = false;
 	timer.End();
 	DevMsg( "...done initializing node neighbors. %f seconds\n", timer.GetDuration().GetSeconds() );
 
@@ -2297,6 +2317,7 @@ void CAI_NetworkBuilder::Build( CAI_Network *pNetwork )
 	// ---------------------------
 	DevMsg( "Determining links...\n" );
 	timer.Start();
+	ResetNodeHullTests( nNodes );
 	for (i = 0; i < nNodes; i++)
 	{	
 		// Make sure all the links are clear
@@ -2307,7 +2328,7 @@ void CAI_NetworkBuilder::Build( CAI_Network *pNetwork )
 		InitLinks( pNetwork, ppNodes[i] );
 	}
 	timer.End();
-	DevMsg( "...done determining links. %f seconds\n", timer.GetDuration().GetSeconds() );
+	DevMsg( "...done determining links. %f seconds (%d of %d hull fit tests cached)\n", timer.GetDuration().GetSeconds(), m_nNodeHullTestHits, m_nNodeHullTestHits + m_nNodeHullTestMisses );
 
 	// ------------------------------
 	// Initialize disconnected nodes
@@ -2320,6 +2341,9 @@ void CAI_NetworkBuilder::Build( CAI_Network *pNetwork )
 	DevMsg( "...done determining zones. %f seconds\n", timer.GetDuration().GetSeconds() );
 	DevMsg( "...done building AI node graph, %f seconds\n", masterTimer.GetDuration().GetSeconds() );
 
+	pNetwork->InvalidateNodeGrid();
+	pNetwork->InvalidateNearestNodeCache();
+
 	g_pAINetworkManager->FixupHints();
 
 	EndBuild();
@@ -2606,6 +2630,116 @@ void CAI_NetworkBuilder::InitNodePosition(CAI_Network *pNetwork, CAI_Node *pNode
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Is the test node close enough to the source node to be worth a
+//			line of sight test
+// Input  :
+// Output :
+//-----------------------------------------------------------------------------
+static bool IsInVisibilityRange( CAI_Node *pNode, CAI_Node *pTestNode )
+{
+	float flDistToCheckNode = ( pTestNode->GetOrigin() - pNode->GetOrigin() ).LengthSqr(); 
+
+	if ( pTestNode->GetType() == NODE_AIR )
+	{
+		if (flDistToCheckNode > MAX_AIR_NODE_LINK_DIST_SQ) 
+			return false;
+	}
+	else
+	{
+		if (flDistToCheckNode > MAX_NODE_LINK_DIST_SQ) 
+			return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Traces one of the node line of sight lines.  A world only trace
+//			never touches the entity list, so it is safe to run from the worker
+//			threads.  It only sees a subset of what the full trace sees, so a
+//			line that is blocked in the world is blocked for the full trace too.
+// Input  :
+// Output :
+//-----------------------------------------------------------------------------
+static void TraceNodeLine( const Vector &vecStart, const Vector &vecEnd, bool bWorldOnly, trace_t *pTrace )
+{
+	if ( bWorldOnly )
+	{
+		Ray_t ray;
+		ray.Init( vecStart, vecEnd );
+		CTraceFilterWorldOnly traceFilter;
+		enginetrace->TraceRay( ray, MASK_NPCWORLDSTATIC, &traceFilter, pTrace );
+	}
+	else
+	{
+		AI_TraceLine( vecStart, vecEnd, MASK_NPCWORLDSTATIC, NULL, COLLISION_GROUP_NONE, pTrace );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Line of sight test between two node positions.  With bWorldOnly it
+//			only traces the world, see TraceNodeLine()
+// Input  :
+// Output :
+//-----------------------------------------------------------------------------
+static bool TestNodeLineOfSight( const Vector &srcPos, const Vector &destPos, bool bWorldOnly )
+{
+	trace_t	tr;
+	tr.m_pEnt = NULL;
+
+	// Try several line of sight checks
+
+	bool isVisible = false;
+
+	// ------------------
+	//  Bottom to bottom
+	// ------------------
+	TraceNodeLine( srcPos, destPos, bWorldOnly, &tr );
+	if (!tr.startsolid && tr.fraction == 1.0)
+	{
+		isVisible = true;
+	}
+
+	// ------------------
+	//  Top to top
+	// ------------------
+	if (!isVisible)
+	{
+		TraceNodeLine( srcPos + Vector( 0, 0, 70 ), destPos + Vector( 0, 0, 70 ), bWorldOnly, &tr );
+		if (!tr.startsolid && tr.fraction == 1.0)
+		{	
+			isVisible = true;
+		}
+	}
+
+	// ------------------
+	//  Top to Bottom
+	// ------------------
+	if (!isVisible)
+	{
+		TraceNodeLine( srcPos + Vector( 0, 0, 70 ), destPos, bWorldOnly, &tr );
+		if (!tr.startsolid && tr.fraction == 1.0)
+		{	
+			isVisible = true;
+		}
+	}
+
+	// ------------------
+	//  Bottom to Top
+	// ------------------
+	if (!isVisible)
+	{
+		TraceNodeLine( srcPos, destPos + Vector( 0, 0, 70 ), bWorldOnly, &tr );
+		if (!tr.startsolid && tr.fraction == 1.0)
+		{	
+			isVisible = true;
+		}
+	}
+
+	return isVisible;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Set the visibility for this node.  (What nodes it can see with a
 //			line trace)
@@ -2665,74 +2799,24 @@ void CAI_NetworkBuilder::InitVisibility(CAI_Network *pNetwork, CAI_Node *pNode)
 			continue;
 		}
 
-		float flDistToCheckNode = ( testNode->GetOrigin() - pNode->GetOrigin() ).LengthSqr(); 
-
-		if ( testNode->GetType() == NODE_AIR )
-		{
-			if (flDistToCheckNode > MAX_AIR_NODE_LINK_DIST_SQ) 
-				continue;
-		}
-		else
-		{
-			if (flDistToCheckNode > MAX_NODE_LINK_DIST_SQ) 
-				continue;
-		}
+		if ( !IsInVisibilityRange( pNode, testNode ) )
+			continue;
 
 		// The actual position of some nodes may be inside geometry as they have
 		// hull specific position offsets (e.g. climb nodes).  Get the hull specific 
 		// position using the smallest hull to make sure were not in geometry
 		Vector destPos = pNetwork->GetNode( testnode )->GetPosition(HULL_SMALL_CENTERED);
 
-		trace_t	tr;
-		tr.m_pEnt = NULL;
-
-		// Try several line of sight checks
-
-		bool isVisible = false;
-
-		// ------------------
-		//  Bottom to bottom
-		// ------------------
-		AI_TraceLine ( srcPos, destPos,MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
-		if (!tr.startsolid && tr.fraction == 1.0)
-		{
-			isVisible = true;
-		}
-
-		// ------------------
-		//  Top to top
-		// ------------------
-		if (!isVisible)
+		// The worker threads have already thrown out the pairs the world blocks.
+		// The ones left still need the full trace, which also sees entities.
+		bool isVisible;
+		if ( m_bPrecomputedVisibility && !m_VisibilityTable[pNode->m_iID].IsBitSet( testnode ) )
 		{
-			AI_TraceLine ( srcPos + Vector( 0, 0, 70 ),destPos + Vector( 0, 0, 70 ),MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
-			if (!tr.startsolid && tr.fraction == 1.0)
-			{	
-				isVisible = true;
-			}
-		}
-
-		// ------------------
-		//  Top to Bottom
-		// ------------------
-		if (!isVisible)
-		{
-			AI_TraceLine ( srcPos + Vector( 0, 0, 70 ),destPos,MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
-			if (!tr.startsolid && tr.fraction == 1.0)
-			{	
-				isVisible = true;
-			}
+			isVisible = false;
 		}
-
-		// ------------------
-		//  Bottom to Top
-		// ------------------
-		if (!isVisible)
+		else
 		{
-			AI_TraceLine ( srcPos,destPos + Vector( 0, 0, 70 ),MASK_NPCWORLDSTATIC,NULL,COLLISION_GROUP_NONE, &tr );
-			if (!tr.startsolid && tr.fraction == 1.0)
-			{	
-				isVisible = true;
-			}
+			isVisible = TestNodeLineOfSight( srcPos, destPos, false );
 		}
 
 		// ------------------
@@ -2793,6 +2877,114 @@ void CAI_NetworkBuilder::InitVisibility(CAI_Network *pNetwork, CAI_Node *pNode)
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Run the world half of the line of sight tests InitVisibility()
+//			will ask for ahead of time, spread across the worker threads, so
+//			that only the pairs the world doesn't block are traced again in
+//			full on the main thread.  Walks the nodes in the
+//			same order as InitNeighbors() so duplicate node removal and the
+//			reuse of already computed neighbor tables mark exactly the pairs
+//			the serial build would trace, which keeps the graph identical.
+// Input  :
+// Output :
+//-----------------------------------------------------------------------------
+void CAI_NetworkBuilder::PrecomputeVisibility( CAI_Network *pNetwork )
+{
+	int nNodes = pNetwork->NumNodes();
+	int i;
+
+	m_VisibilityTable.SetSize( nNodes );
+	for ( i = 0; i < nNodes; i++ )
+	{
+		m_VisibilityTable[i].Resize( nNodes );
+		m_VisibilityTable[i].ClearAll();
+	}
+
+	// Node deletion happens as the serial pass goes, so track it here rather
+	// than touching the nodes
+	CVarBitVec deleted( nNodes );
+	for ( i = 0; i < nNodes; i++ )
+	{
+		if ( pNetwork->GetNode( i )->GetType() == NODE_DELETED )
+			deleted.Set( i );
+	}
+
+	CUtlVector<int> rows;
+	int nPairs = 0;
+
+	for ( i = 0; i < nNodes; i++ )
+	{
+		if ( deleted.IsBitSet( i ) )
+			continue;
+
+		CAI_Node *pNode = pNetwork->GetNode( i );
+		bool bHasPairs = false;
+
+		for ( int testnode = 0; testnode < nNodes; testnode++ )
+		{
+			if ( testnode == i )
+				continue;
+
+			CAI_Node *pTestNode = pNetwork->GetNode( testnode );
+
+			if ( pTestNode->GetOrigin() == pNode->GetOrigin() && pTestNode->GetType() != NODE_CLIMB )
+			{
+				deleted.Set( testnode );
+				continue;
+			}
+
+			// Nodes before this one already have their neighbors, which InitVisibility() reuses
+			if ( deleted.IsBitSet( testnode ) || testnode < i )
+				continue;
+
+			if ( !IsInVisibilityRange( pNode, pTestNode ) )
+				continue;
+
+			m_VisibilityTable[i].Set( testnode );
+			bHasPairs = true;
+			nPairs++;
+		}
+
+		if ( bHasPairs )
+			rows.AddToTail( i );
+	}
+
+	m_pVisibilityNetwork = pNetwork;
+	ParallelProcess( "CAI_NetworkBuilder::PrecomputeVisibility", rows.Base(), rows.Count(), this, &CAI_NetworkBuilder::ComputeVisibilityRow );
+	m_pVisibilityNetwork = NULL;
+
+	m_bPrecomputedVisibility = true;
+
+	DevMsg( "...traced %d node pairs from %d nodes\n", nPairs, rows.Count() );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Worker for PrecomputeVisibility().  Clears the pairs of one row of
+//			the visibility table that fail the line of sight test against the
+//			world.  Entity traces walk shared state, so the pairs that pass are
+//			traced again in full by InitVisibility() on the main thread.  Only
+//			that row is written, so rows may be processed concurrently.
+// Input  :
+// Output :
+//-----------------------------------------------------------------------------
+void CAI_NetworkBuilder::ComputeVisibilityRow( int &iNode )
+{
+	CAI_Network *pNetwork = m_pVisibilityNetwork;
+	CVarBitVec &row = m_VisibilityTable[iNode];
+
+	Vector srcPos = pNetwork->GetNode( iNode )->GetPosition(HULL_SMALL_CENTERED);
+
+	for ( int testnode = row.FindNextSetBit( iNode + 1 ); testnode != -1; testnode = row.FindNextSetBit( testnode + 1 ) )
+	{
+		Vector destPos = pNetwork->GetNode( testnode )->GetPosition(HULL_SMALL_CENTERED);
+
+		if ( !TestNodeLineOfSight( srcPos, destPos, true ) )
+		{
+			row.Clear( testnode );
+		}
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Initializes the neighbors list
 // Input  :
@@ -2956,6 +3148,84 @@ static bool IsInLineForClimb( const Vector &srcPos, const Vector &srcFacing, con
 	return true;
 }
 
+//-------------------------------------
+// The fit and stand tests only depend on the node and the hull, but are
+// repeated for every pair of nodes the node is tested against. Results are
+// kept for the duration of the build.
+
+enum NodeHullTestBits_t
+{
+	NODE_HULL_FIT_TESTED	= 0x01,
+	NODE_HULL_CAN_FIT		= 0x02,
+	NODE_HULL_STAND_TESTED	= 0x04,
+	NODE_HULL_CAN_STAND		= 0x08,
+};
+
+void CAI_NetworkBuilder::ResetNodeHullTests( int nNodes )
+{
+	m_NodeHullTests.SetCount( nNodes * NUM_HULLS );
+	if ( nNodes )
+	{
+		memset( m_NodeHullTests.Base(), 0, m_NodeHullTests.Count() * sizeof(byte) );
+	}
+	m_nNodeHullTestHits = 0;
+	m_nNodeHullTestMisses = 0;
+}
+
+//-------------------------------------
+// Expects the test hull to already be set to the given hull
+
+bool CAI_NetworkBuilder::CanFitAtNode( CAI_Node *pNode, Hull_t hull )
+{
+	int index = pNode->m_iID * NUM_HULLS + hull;
+	if ( index >= m_NodeHullTests.Count() )
+	{
+		return m_pTestHull->GetNavigator()->CanFitAtNode( pNode->m_iID, MASK_NPCWORLDSTATIC );
+	}
+
+	byte &tests = m_NodeHullTests[index];
+	if ( tests & NODE_HULL_FIT_TESTED )
+	{
+		m_nNodeHullTestHits++;
+	}
+	else
+	{
+		m_nNodeHullTestMisses++;
+		tests |= NODE_HULL_FIT_TESTED;
+		if ( m_pTestHull->GetNavigator()->CanFitAtNode( pNode->m_iID, MASK_NPCWORLDSTATIC ) )
+			tests |= NODE_HULL_CAN_FIT;
+	}
+
+	return ( tests & NODE_HULL_CAN_FIT ) != 0;
+}
+
+//-------------------------------------
+// Expects the test hull to already be set to the given hull
+
+bool CAI_NetworkBuilder::CanStandAtNode( CAI_Node *pNode, Hull_t hull )
+{
+	int index = pNode->m_iID * NUM_HULLS + hull;
+	if ( index >= m_NodeHullTests.Count() )
+	{
+		return m_pTestHull->GetMoveProbe()->CheckStandPosition( pNode->GetPosition( hull ), MASK_NPCWORLDSTATIC );
+	}
+
+	byte &tests = m_NodeHullTests[index];
+	if ( tests & NODE_HULL_STAND_TESTED )
+	{
+		m_nNodeHullTestHits++;
+	}
+	else
+	{
+		m_nNodeHullTestMisses++;
+		tests |= NODE_HULL_STAND_TESTED;
+		if ( m_pTestHull->GetMoveProbe()->CheckStandPosition( pNode->GetPosition( hull ), MASK_NPCWORLDSTATIC ) )
+			tests |= NODE_HULL_CAN_STAND;
+	}
+
+	return ( tests & NODE_HULL_CAN_STAND ) != 0;
+}
+
 //-------------------------------------
 
 int CAI_NetworkBuilder::ComputeConnection( CAI_Node *pSrcNode, CAI_Node *pDestNode, Hull_t hull )
@@ -2981,16 +3251,15 @@ int CAI_NetworkBuilder::ComputeConnection( CAI_Node *pSrcNode, CAI_Node *pDestNo
 	// ==============================================================
 	// FIRST CHECK IF HULL CAN EVEN FIT AT THESE NODES
 	// ==============================================================
-	// @Note (toml 02-10-03): this should be optimized, caching the results of CanFitAtNode() 
 	if ( !( pSrcNode->m_eNodeInfo & ( HullToBit( hull ) << NODE_ENT_FLAGS_SHIFT ) ) &&
-		 !m_pTestHull->GetNavigator()->CanFitAtNode(srcId,MASK_NPCWORLDSTATIC) )
+		 !CanFitAtNode( pSrcNode, hull ) )
 	{
 		DebugConnectMsg( srcId, destId, "      Cannot fit at node %d\n", srcId );
 		return 0;
 	}
 	
 	if (  !( pDestNode->m_eNodeInfo & ( HullToBit( hull ) << NODE_ENT_FLAGS_SHIFT ) ) &&
-		 !m_pTestHull->GetNavigator()->CanFitAtNode(destId,MASK_NPCWORLDSTATIC) )
+		 !CanFitAtNode( pDestNode, hull ) )
 	{
 		DebugConnectMsg( srcId, destId, "      Cannot fit at node %d\n", destId );
 		return 0;
@@ -3075,13 +3344,13 @@ int CAI_NetworkBuilder::ComputeConnection( CAI_Node *pSrcNode, CAI_Node *pDestNo
 		Vector srcPos	 = pSrcNode->GetPosition(hull);
 		Vector destPos	 = pDestNode->GetPosition(hull);
 
-		if (!m_pTestHull->GetMoveProbe()->CheckStandPosition( srcPos, MASK_NPCWORLDSTATIC))
+		if ( !CanStandAtNode( pSrcNode, hull ) )
 		{
 			DebugConnectMsg( srcId, destId, "      Failed to stand at %d\n", srcId );
 			fStandFailed = true;
 		}
 
-		if (!m_pTestHull->GetMoveProbe()->CheckStandPosition( destPos, MASK_NPCWORLDSTATIC))
+		if ( !CanStandAtNode( pDestNode, hull ) )
 		{
 			DebugConnectMsg( srcId, destId, "      Failed to stand at %d\n", destId );
 			fStandFailed = true;
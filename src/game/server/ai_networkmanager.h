@@ -105,6 +105,8 @@ public:
 private:
 	void			InitVisibility( CAI_Network *pNetwork, CAI_Node *pNode );
 	void			InitNeighbors( CAI_Network *pNetwork, CAI_Node *pNode );
+	void			PrecomputeVisibility( CAI_Network *pNetwork );
+	void			ComputeVisibilityRow( int &iNode );
 	void			InitClimbNodePosition( CAI_Network *pNetwork, CAI_Node *pNode );
 	void			InitGroundNodePosition( CAI_Network *pNetwork, CAI_Node *pNode );
 	void			InitLinks( CAI_Network *pNetwork, CAI_Node *pNode );
@@ -113,6 +115,9 @@ private:
 	void			FloodFillZone( CAI_Node **ppNodes, CAI_Node *pNode, int zone );
 
 	int				ComputeConnection( CAI_Node *pSrcNode, CAI_Node *pDestNode, Hull_t hull );
+	bool			CanFitAtNode( CAI_Node *pNode, Hull_t hull );
+	bool			CanStandAtNode( CAI_Node *pNode, Hull_t hull );
+	void			ResetNodeHullTests( int nNodes );
 	
 	void 			BeginBuild();
 	void			EndBuild();
@@ -120,6 +125,16 @@ private:
 	CUtlVector<CVarBitVec>	m_NeighborsTable;
 	CVarBitVec				m_DidSetNeighborsTable;
 	CAI_TestHull *			m_pTestHull;
+
+	// Line of sight results computed ahead of InitNeighbors() by worker threads
+	CAI_Network *			m_pVisibilityNetwork;
+	CUtlVector<CVarBitVec>	m_VisibilityTable;
+	bool					m_bPrecomputedVisibility;
+
+	// Per node, per hull results of the fit and stand tests made by ComputeConnection()
+	CUtlVector<byte>		m_NodeHullTests;
+	int						m_nNodeHullTestHits;
+	int						m_nNodeHullTestMisses;
 };
 
 extern CAI_NetworkBuilder g_AINetworkBuilder;
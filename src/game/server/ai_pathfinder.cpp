@@ -21,6 +21,8 @@
 #include "ai_dynamiclink.h"
 #include "ai_hint.h"
 #include "bitstring.h"
+#include "tier0/fasttimer.h"
+#include "vstdlib/random.h"
 
 //@todo: bad dependency!
 #include "ai_navigator.h"
@@ -30,6 +32,8 @@
 
 #define NUM_NPC_DEBUG_OVERLAYS	  50
 
+extern CBaseEntity *FindPickerEntity( CBasePlayer *pPlayer );
+
 const float MAX_LOCAL_NAV_DIST_GROUND[2] = { (50*12), (25*12) };
 const float MAX_LOCAL_NAV_DIST_FLY[2] = { (750*12), (750*12) };
 
@@ -272,6 +276,178 @@ int CAI_Pathfinder::NearestNodeToPoint( const Vector &vecOrigin )
 	return GetNetwork()->NearestNodeToPoint( GetOuter(), vecOrigin );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Per-node A* scratch state shared by all pathfinders. Entries are
+//			stamped with a search generation so a search only touches the
+//			nodes it actually visits instead of clearing NumNodes() entries
+//			up front. The open list is an indexed binary heap ordered on
+//			(F, node ID), which picks the same node the old linear
+//			FindBSSmallest() scan did.
+//-----------------------------------------------------------------------------
+
+class CAI_PathfindScratch
+{
+public:
+	CAI_PathfindScratch()
+	 :	m_iGeneration( 0 ),
+		m_nLastExpanded( 0 )
+	{
+	}
+
+	void BeginSearch( int nNodes )
+	{
+		if ( m_Generation.Count() < nNodes )
+		{
+			int nOld = m_Generation.Count();
+			m_Generation.SetCount( nNodes );
+			m_G.SetCount( nNodes );
+			m_F.SetCount( nNodes );
+			m_Parent.SetCount( nNodes );
+			m_HeapIndex.SetCount( nNodes );
+			for ( int i = nOld; i < nNodes; i++ )
+				m_Generation[i] = 0;
+		}
+
+		if ( ++m_iGeneration == 0 )
+		{
+			// Wrapped, so stale stamps could alias the new generation
+			for ( int i = 0; i < m_Generation.Count(); i++ )
+				m_Generation[i] = 0;
+			m_iGeneration = 1;
+		}
+
+		m_Heap.RemoveAll();
+		m_nLastExpanded = 0;
+	}
+
+	// A node that hasn't been touched this search has not been seen (G = FLT_MAX, no parent)
+	bool WasSeen( int node ) const		{ return ( m_Generation[node] == m_iGeneration ); }
+	float GetG( int node ) const		{ return ( WasSeen( node ) ) ? m_G[node] : FLT_MAX; }
+
+	void Update( int node, int parent, float g, float f )
+	{
+		m_Generation[node] = m_iGeneration;
+		m_Parent[node] = parent;
+		m_G[node] = g;
+		m_F[node] = f;
+	}
+
+	bool IsOpenEmpty() const	{ return ( m_Heap.Count() == 0 ); }
+	int *GetParents()			{ return m_Parent.Base(); }
+
+	void Open( int node, bool bWasSeen )
+	{
+		if ( bWasSeen && m_HeapIndex[node] != -1 )
+		{
+			// Already open, F can only have gone down
+			SiftUp( m_HeapIndex[node] );
+			return;
+		}
+
+		int i = m_Heap.AddToTail( node );
+		m_HeapIndex[node] = i;
+		SiftUp( i );
+	}
+
+	int PopSmallest()
+	{
+		int node = m_Heap[0];
+		int last = m_Heap.Count() - 1;
+		m_HeapIndex[node] = -1;
+		if ( last > 0 )
+		{
+			m_Heap[0] = m_Heap[last];
+			m_HeapIndex[m_Heap[0]] = 0;
+			m_Heap.FastRemove( last );
+			SiftDown( 0 );
+		}
+		else
+		{
+			m_Heap.RemoveAll();
+		}
+		m_nLastExpanded++;
+		return node;
+	}
+
+	int GetLastExpanded() const	{ return m_nLastExpanded; }
+
+private:
+	bool IsLess( int a, int b ) const
+	{
+		if ( m_F[a] != m_F[b] )
+			return ( m_F[a] < m_F[b] );
+		return ( a < b );
+	}
+
+	void Swap( int i, int j )
+	{
+		int a = m_Heap[i];
+		int b = m_Heap[j];
+		m_Heap[i] = b;
+		m_Heap[j] = a;
+		m_HeapIndex[b] = i;
+		m_HeapIndex[a] = j;
+	}
+
+	void SiftUp( int i )
+	{
+		while ( i > 0 )
+		{
+			int parent = ( i - 1 ) / 2;
+			if ( !IsLess( m_Heap[i], m_Heap[parent] ) )
+				break;
+			Swap( i, parent );
+			i = parent;
+		}
+	}
+
+	void SiftDown( int i )
+	{
+		int count = m_Heap.Count();
+		for ( ;; )
+		{
+			int smallest = i;
+			int left = 2 * i + 1;
+			int right = left + 1;
+			if ( left < count && IsLess( m_Heap[left], m_Heap[smallest] ) )
+				smallest = left;
+			if ( right < count && IsLess( m_Heap[right], m_Heap[smallest] ) )
+				smallest = right;
+			if ( smallest == i )
+				break;
+			Swap( i, smallest );
+			i = smallest;
+		}
+	}
+
+	unsigned			m_iGeneration;
+	int					m_nLastExpanded;
+
+	CUtlVector<unsigned>	m_Generation;
+	CUtlVector<float>		m_G;
+	CUtlVector<float>		m_F;
+	CUtlVector<int>			m_Parent;
+	CUtlVector<int>			m_HeapIndex;
+
+	CUtlVector<int>			m_Heap;
+};
+
+static CAI_PathfindScratch g_AI_PathfindScratch;
+
+//-----------------------------------------------------------------------------
+// Recording of start/end pairs for ai_pathfind_benchmark
+//-----------------------------------------------------------------------------
+
+struct AI_PathfindQuery_t
+{
+	int iStartID;
+	int iEndID;
+};
+
+static CUtlVector<AI_PathfindQuery_t> g_AI_PathfindQueries;
+
+ConVar ai_pathfind_record( "ai_pathfind_record", "0", FCVAR_CHEAT, "Record the start/end node pairs of node graph pathfinds for replay with ai_pathfind_benchmark" );
+
 //-----------------------------------------------------------------------------
 // Purpose: Build a path between two nodes
 //-----------------------------------------------------------------------------
@@ -287,38 +463,30 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 	m_nPerfStatPB++;
 #endif
 
+	if ( ai_pathfind_record.GetBool() )
+	{
+		AI_PathfindQuery_t query = { startID, endID };
+		g_AI_PathfindQueries.AddToTail( query );
+	}
+
 	int nNodes = GetNetwork()->NumNodes();
 	CAI_Node **pAInode = GetNetwork()->AccessNodes();
 
-	CVarBitVec	openBS(nNodes);
-	CVarBitVec	closeBS(nNodes);
+	CAI_PathfindScratch &scratch = g_AI_PathfindScratch;
 
 	// ------------- INITIALIZE ------------------------
-	float* nodeG = (float *)stackalloc( nNodes * sizeof(float) );
-	float* nodeH = (float *)stackalloc( nNodes * sizeof(float) );
-	float* nodeF = (float *)stackalloc( nNodes * sizeof(float) );
-	int*   nodeP = (int *)stackalloc( nNodes * sizeof(int) );		// Node parent 
-
-	for (int node=0;node<nNodes;node++)
-	{
-		nodeG[node] = FLT_MAX;
-		nodeP[node] = -1;
-	}
-
-	nodeG[startID] = 0;
+	scratch.BeginSearch( nNodes );
 
-	nodeH[startID] = 0.1*(pAInode[startID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length(); // Don't want to over estimate
-	nodeF[startID] = nodeG[startID] + nodeH[startID];
+	Vector vecEnd = pAInode[endID]->GetPosition(GetHullType());
 
-	openBS.Set(startID);
-	closeBS.Set( startID );
+	float startH = 0.1*(pAInode[startID]->GetPosition(GetHullType())-vecEnd).Length(); // Don't want to over estimate
+	scratch.Update( startID, NO_NODE, 0, startH );
+	scratch.Open( startID, false );
 
 	// --------------- FIND BEST PATH ------------------
-	while (!openBS.IsAllClear()) 
+	while (!scratch.IsOpenEmpty()) 
 	{
-		int smallestID = CAI_Network::FindBSSmallest(&openBS,nodeF,nNodes);
-	
-		openBS.Clear(smallestID);
+		int smallestID = scratch.PopSmallest();
 
 		CAI_Node *pSmallestNode = pAInode[smallestID];
 		
@@ -327,10 +495,13 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 
 		if (smallestID == endID) 
 		{
-			AI_Waypoint_t* route = MakeRouteFromParents(&nodeP[0], endID);
+			AI_Waypoint_t* route = MakeRouteFromParents(scratch.GetParents(), endID);
 			return route;
 		}
 
+		float smallestG = scratch.GetG( smallestID );
+		Vector r1 = pSmallestNode->GetPosition(GetHullType());
+
 		// Check this if the node is immediately in the path after the startNode 
 		// that it isn't blocked
 		for (int link=0; link < pSmallestNode->NumLinks();link++) 
@@ -344,24 +515,20 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 			int moveType = nodeLink->m_iAcceptedMoveTypes[GetHullType()] & CapabilitiesGet();
 			int testID	 = nodeLink->DestNodeID(smallestID);
 
-			Vector r1 = pSmallestNode->GetPosition(GetHullType());
 			Vector r2 = pAInode[testID]->GetPosition(GetHullType());
 			float dist   = GetOuter()->GetNavigator()->MovementCost( moveType, r1, r2 ); // MovementCost takes ref parameters!!
 
 			if ( dist == FLT_MAX )
 				continue;
 
-			float new_g  = nodeG[smallestID] + dist;
+			float new_g  = smallestG + dist;
 
-			if ( !closeBS.IsBitSet(testID) || (new_g < nodeG[testID]) ) 
+			bool bWasSeen = scratch.WasSeen( testID );
+			if ( !bWasSeen || (new_g < scratch.GetG( testID )) ) 
 			{
-				nodeP[testID] = smallestID;
-				nodeG[testID] = new_g;
-				nodeH[testID] = (pAInode[testID]->GetPosition(GetHullType())-pAInode[endID]->GetPosition(GetHullType())).Length();
-				nodeF[testID] = nodeG[testID] + nodeH[testID];
-
-				closeBS.Set( testID );
-				openBS.Set( testID );
+				float new_h = (pAInode[testID]->GetPosition(GetHullType())-vecEnd).Length();
+				scratch.Update( testID, smallestID, new_g, new_g + new_h );
+				scratch.Open( testID, bWasSeen );
 			}
 		}
 	}
@@ -369,6 +536,114 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 	return NULL;   
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Replays recorded (or random) node pairs through the pathfinder of
+//			the NPC under the crosshair and reports the cost per query
+//-----------------------------------------------------------------------------
+
+CON_COMMAND( ai_pathfind_benchmark, "Replays node graph pathfinds recorded with ai_pathfind_record through the NPC under the crosshair and reports nodes expanded and time per query.\n\tArguments:	[iterations] / 'clear' / 'random' <count>" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( args.ArgC() > 1 && !Q_stricmp( args[1], "clear" ) )
+	{
+		Msg( "Cleared %d recorded pathfinds\n", g_AI_PathfindQueries.Count() );
+		g_AI_PathfindQueries.RemoveAll();
+		return;
+	}
+
+	CAI_BaseNPC *pNPC = NULL;
+	CBaseEntity *pEntity = FindPickerEntity( UTIL_GetCommandClient() );
+	if ( pEntity )
+		pNPC = pEntity->MyNPCPointer();
+
+	if ( !pNPC && g_AI_Manager.NumAIs() )
+		pNPC = g_AI_Manager.AccessAIs()[0];
+
+	if ( !pNPC || !pNPC->GetPathfinder() || !g_pBigAINet->NumNodes() )
+	{
+		Msg( "ai_pathfind_benchmark: need an NPC and a node graph\n" );
+		return;
+	}
+
+	CUtlVector<AI_PathfindQuery_t> queries;
+	int nIterations = 1;
+
+	if ( args.ArgC() > 1 && !Q_stricmp( args[1], "random" ) )
+	{
+		int nCount = ( args.ArgC() > 2 ) ? atoi( args[2] ) : 100;
+		int nNodes = g_pBigAINet->NumNodes();
+
+		// Fixed seed so repeated runs replay the same pairs
+		CUniformRandomStream randomStream;
+		randomStream.SetSeed( 0 );
+		for ( int i = 0; i < nCount; i++ )
+		{
+			AI_PathfindQuery_t query = { randomStream.RandomInt( 0, nNodes - 1 ), randomStream.RandomInt( 0, nNodes - 1 ) };
+			queries.AddToTail( query );
+		}
+	}
+	else
+	{
+		if ( args.ArgC() > 1 )
+			nIterations = MAX( 1, atoi( args[1] ) );
+		queries.AddVectorToTail( g_AI_PathfindQueries );
+	}
+
+	if ( !queries.Count() )
+	{
+		Msg( "ai_pathfind_benchmark: no recorded pathfinds (set ai_pathfind_record 1, or use 'random')\n" );
+		return;
+	}
+
+	// Don't let the replay feed back into the recording
+	bool bWasRecording = ai_pathfind_record.GetBool();
+	ai_pathfind_record.SetValue( 0 );
+
+	CAI_Pathfinder *pPathfinder = pNPC->GetPathfinder();
+	int nNodes = g_pBigAINet->NumNodes();
+	int64 nExpanded = 0;
+	int nFound = 0;
+	int nQueries = 0;
+
+	CFastTimer timer;
+	CCycleCount total;
+	for ( int iter = 0; iter < nIterations; iter++ )
+	{
+		for ( int i = 0; i < queries.Count(); i++ )
+		{
+			if ( queries[i].iStartID >= nNodes || queries[i].iEndID >= nNodes )
+				continue;
+
+			timer.Start();
+			AI_Waypoint_t *pRoute = pPathfinder->FindBestPath( queries[i].iStartID, queries[i].iEndID );
+			timer.End();
+			total += timer.GetDuration();
+
+			nExpanded += g_AI_PathfindScratch.GetLastExpanded();
+			nQueries++;
+			if ( pRoute )
+			{
+				nFound++;
+				DeleteAll( pRoute );
+			}
+		}
+	}
+
+	ai_pathfind_record.SetValue( bWasRecording );
+
+	if ( !nQueries )
+	{
+		Msg( "ai_pathfind_benchmark: recorded pathfinds don't match the current node graph\n" );
+		return;
+	}
+
+	Msg( "ai_pathfind_benchmark: %s, %d nodes, %d queries (%d found)\n", pNPC->GetClassname(), nNodes, nQueries, nFound );
+	Msg( "  %.1f nodes expanded/query, %.2f us/query, %.3f ms total\n",
+		 (float)nExpanded / nQueries, total.GetMicrosecondsF() / nQueries, total.GetMillisecondsF() );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Find a short random path of at least pathLength distance.  If
 //			vDirection is given random path will expand in the given direction,
@@ -54,6 +54,228 @@ struct AISightIterVal_t
 #pragma pack(pop)
 
 
+//-----------------------------------------------------------------------------
+// CAI_SensedEntityGrid
+//
+// Purpose: Per-tick, cell-bucketed index of the players, NPCs and objects
+//			that senses look for, so a Look() only considers candidates in
+//			the cells its look distance reaches. Candidates are returned in
+//			the order the brute-force scans visited them, so the seen lists
+//			come out identical.
+//-----------------------------------------------------------------------------
+
+ConVar ai_senses_spatial_index( "ai_senses_spatial_index", "1", 0, "Use a per-tick spatial grid to find look candidates (0 = scan every NPC/object)" );
+
+// Query() results live on the caller's stack unless there are a lot of them
+typedef CUtlVectorFixedGrowable<CBaseEntity *, 64> SensedCandidateList_t;
+
+enum SensedEntityType_t
+{
+	SENSED_PLAYERS,
+	SENSED_NPCS,
+	SENSED_OBJECTS,
+
+	NUM_SENSED_TYPES
+};
+
+class CAI_SensedEntityGrid
+{
+public:
+	CAI_SensedEntityGrid()
+	 :	m_iTickBuilt( -1 ),
+		m_iQueryStamp( 0 )
+	{
+		memset( m_BucketQueryStamp, 0, sizeof( m_BucketQueryStamp ) );
+	}
+
+	void Query( SensedEntityType_t type, const Vector &origin, float flRadius, SensedCandidateList_t *pResult );
+
+private:
+	enum
+	{
+		CELL_SIZE = 512,
+		NUM_BUCKETS = 1024,		// must be power of 2
+		BUCKET_MASK = NUM_BUCKETS - 1,
+
+		// Entities move during the tick after the grid is built
+		QUERY_SLOP = 128,
+	};
+
+	struct Entry_t
+	{
+		EHANDLE hEntity;
+		int		iOrder;			// position in the brute-force scan
+		int		iBucket;
+	};
+
+	struct Bucketed_t
+	{
+		CUtlVector<Entry_t> entries;	// sorted by bucket
+		CUtlVector<Entry_t> unculled;	// always candidates regardless of distance
+		int					bucketStart[NUM_BUCKETS + 1];
+	};
+
+	static int CellCoord( float f )	{ return (int)floor( f / CELL_SIZE ); }
+	static int BucketForCell( int x, int y ) { return ( ( x * 73856093 ) ^ ( y * 19349663 ) ) & BUCKET_MASK; }
+	static int BucketForPoint( const Vector &v ) { return BucketForCell( CellCoord( v.x ), CellCoord( v.y ) ); }
+	static int __cdecl EntryCompare( const Entry_t *pLeft, const Entry_t *pRight ) { return pLeft->iOrder - pRight->iOrder; }
+
+	void EnsureBuilt();
+	void Add( SensedEntityType_t type, CBaseEntity *pEntity, int iOrder, bool bUnculled = false );
+	void Finish( SensedEntityType_t type );
+
+	int				m_iTickBuilt;
+	unsigned		m_iQueryStamp;
+	unsigned		m_BucketQueryStamp[NUM_BUCKETS];
+	Bucketed_t		m_Types[NUM_SENSED_TYPES];
+	CUtlVector<Entry_t> m_Candidates;
+	CUtlVector<Entry_t> m_SortScratch;	// reused by Finish() so rebuilds don't reallocate
+};
+
+static CAI_SensedEntityGrid g_AI_SensedEntityGrid;
+
+//-------------------------------------
+
+void CAI_SensedEntityGrid::Add( SensedEntityType_t type, CBaseEntity *pEntity, int iOrder, bool bUnculled )
+{
+	Entry_t entry;
+	entry.hEntity = pEntity;
+	entry.iOrder = iOrder;
+	entry.iBucket = BucketForPoint( pEntity->GetAbsOrigin() );
+
+	if ( bUnculled )
+		m_Types[type].unculled.AddToTail( entry );
+	else
+		m_Types[type].entries.AddToTail( entry );
+}
+
+//-------------------------------------
+
+void CAI_SensedEntityGrid::Finish( SensedEntityType_t type )
+{
+	// Counting sort of the entries into their buckets
+	Bucketed_t &bucketed = m_Types[type];
+	int *pStart = bucketed.bucketStart;
+	memset( pStart, 0, sizeof( bucketed.bucketStart ) );
+
+	int i;
+	for ( i = 0; i < bucketed.entries.Count(); i++ )
+		pStart[bucketed.entries[i].iBucket + 1]++;
+	for ( i = 0; i < NUM_BUCKETS; i++ )
+		pStart[i + 1] += pStart[i];
+
+	int next[NUM_BUCKETS];
+	memcpy( next, pStart, sizeof( next ) );
+
+	CUtlVector<Entry_t> &sorted = m_SortScratch;
+	sorted.SetCount( bucketed.entries.Count() );
+	for ( i = 0; i < bucketed.entries.Count(); i++ )
+		sorted[next[bucketed.entries[i].iBucket]++] = bucketed.entries[i];
+
+	// the old entries' memory becomes the scratch for the next type
+	bucketed.entries.Swap( sorted );
+}
+
+//-------------------------------------
+
+void CAI_SensedEntityGrid::EnsureBuilt()
+{
+	if ( m_iTickBuilt == gpGlobals->tickcount )
+		return;
+
+	AI_PROFILE_SCOPE( CAI_SensedEntityGrid_Build );
+
+	m_iTickBuilt = gpGlobals->tickcount;
+	for ( int i = 0; i < NUM_SENSED_TYPES; i++ )
+	{
+		m_Types[i].entries.RemoveAll();
+		m_Types[i].unculled.RemoveAll();
+	}
+
+	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
+	{
+		CBaseEntity *pPlayer = UTIL_PlayerByIndex( i );
+		if ( pPlayer )
+			Add( SENSED_PLAYERS, pPlayer, i );
+	}
+
+	CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
+	for ( int i = 0; i < g_AI_Manager.NumAIs(); i++ )
+	{
+		Add( SENSED_NPCS, ppAIs[i], i, ppAIs[i]->ShouldNotDistanceCull() );
+	}
+
+	int iter;
+	int iOrder = 0;
+	CBaseEntity *pEnt = g_AI_SensedObjectsManager.GetFirst( &iter );
+	while ( pEnt )
+	{
+		Add( SENSED_OBJECTS, pEnt, iOrder++ );
+		pEnt = g_AI_SensedObjectsManager.GetNext( &iter );
+	}
+
+	for ( int i = 0; i < NUM_SENSED_TYPES; i++ )
+		Finish( (SensedEntityType_t)i );
+}
+
+//-------------------------------------
+
+void CAI_SensedEntityGrid::Query( SensedEntityType_t type, const Vector &origin, float flRadius, SensedCandidateList_t *pResult )
+{
+	EnsureBuilt();
+
+	const Bucketed_t &bucketed = m_Types[type];
+	m_Candidates.RemoveAll();
+	m_Candidates.AddMultipleToTail( bucketed.unculled.Count(), bucketed.unculled.Base() );
+
+	flRadius += QUERY_SLOP;
+	int xMin = CellCoord( origin.x - flRadius );
+	int xMax = CellCoord( origin.x + flRadius );
+	int yMin = CellCoord( origin.y - flRadius );
+	int yMax = CellCoord( origin.y + flRadius );
+
+	if ( ( xMax - xMin + 1 ) * ( yMax - yMin + 1 ) >= NUM_BUCKETS )
+	{
+		m_Candidates.AddMultipleToTail( bucketed.entries.Count(), bucketed.entries.Base() );
+	}
+	else
+	{
+		// Several cells can hash to the same bucket, only visit each bucket once
+		if ( ++m_iQueryStamp == 0 )
+		{
+			memset( m_BucketQueryStamp, 0, sizeof( m_BucketQueryStamp ) );
+			m_iQueryStamp = 1;
+		}
+
+		for ( int x = xMin; x <= xMax; x++ )
+		{
+			for ( int y = yMin; y <= yMax; y++ )
+			{
+				int iBucket = BucketForCell( x, y );
+				if ( m_BucketQueryStamp[iBucket] == m_iQueryStamp )
+					continue;
+				m_BucketQueryStamp[iBucket] = m_iQueryStamp;
+
+				int iFirst = bucketed.bucketStart[iBucket];
+				int nCount = bucketed.bucketStart[iBucket + 1] - iFirst;
+				if ( nCount )
+					m_Candidates.AddMultipleToTail( nCount, bucketed.entries.Base() + iFirst );
+			}
+		}
+	}
+
+	if ( m_Candidates.Count() > 1 )
+		m_Candidates.Sort( EntryCompare );
+
+	pResult->EnsureCapacity( m_Candidates.Count() );
+	for ( int i = 0; i < m_Candidates.Count(); i++ )
+	{
+		CBaseEntity *pEntity = m_Candidates[i].hEntity;
+		if ( pEntity )
+			pResult->AddToTail( pEntity );
+	}
+}
+
 //=============================================================================
 //
 // CAI_Senses
@@ -120,10 +342,13 @@ void CAI_Senses::Listen( void )
 	
 	if ( iSoundMask != SOUND_NONE && !(GetOuter()->HasSpawnFlags(SF_NPC_WAIT_TILL_SEEN)) )
 	{
-		int	iSound = CSoundEnt::ActiveList();
-		
-		while ( iSound != SOUNDLIST_EMPTY )
+		// Only the sounds whose volume can reach our ears
+		SoundCandidateList_t candidates;
+		CSoundEnt::GetAudibleSoundCandidates( GetOuter()->EarPosition(), GetOuter()->HearingSensitivity(), &candidates );
+
+		for ( int i = 0; i < candidates.Count(); i++ )
 		{
+			int iSound = candidates[i];
 			CSound *pCurrentSound = CSoundEnt::SoundPointerForIndex( iSound );
 
 			if ( pCurrentSound	&& (iSoundMask & pCurrentSound->SoundType()) && CanHearSound( pCurrentSound ) )
@@ -132,8 +357,6 @@ void CAI_Senses::Listen( void )
 				pCurrentSound->m_iNextAudible = m_iAudibleList;
 				m_iAudibleList = iSound;
 			}
-
-			iSound = pCurrentSound->NextSound();
 		}
 	}
 	
@@ -398,6 +621,25 @@ int CAI_Senses::LookForHighPriorityEntities( int iDistance )
 		float distSq = ( iDistance * iDistance );
 		const Vector &origin = GetAbsOrigin();
 		
+#ifndef PORTAL // players can be seen through portals from beyond the look distance
+		if ( ai_senses_spatial_index.GetBool() )
+		{
+			SensedCandidateList_t candidates;
+			g_AI_SensedEntityGrid.Query( SENSED_PLAYERS, origin, iDistance, &candidates );
+
+			for ( int i = 0; i < candidates.Count(); i++ )
+			{
+				if ( origin.DistToSqr(candidates[i]->GetAbsOrigin()) < distSq && Look( candidates[i] ) )
+				{
+					nSeen++;
+				}
+			}
+
+			EndGather( nSeen, &m_SeenHighPriority );
+			return nSeen;
+		}
+#endif
+
 		// Players
 		for ( int i = 1; i <= gpGlobals->maxClients; i++ )
 		{
@@ -458,6 +700,28 @@ int CAI_Senses::LookForNPCs( int iDistance )
 
 			BeginGather();
 
+			if ( ai_senses_spatial_index.GetBool() )
+			{
+				SensedCandidateList_t candidates;
+				g_AI_SensedEntityGrid.Query( SENSED_NPCS, origin, iDistance, &candidates );
+
+				for ( i = 0; i < candidates.Count(); i++ )
+				{
+					CAI_BaseNPC *pNPC = candidates[i]->MyNPCPointer();
+					if ( pNPC && pNPC != GetOuter() && ( pNPC->ShouldNotDistanceCull() || origin.DistToSqr(pNPC->GetAbsOrigin()) < distSq ) )
+					{
+						if ( Look( pNPC ) )
+						{
+							nSeen++;
+						}
+					}
+				}
+
+				EndGather( nSeen, &m_SeenNPCs );
+
+				return nSeen;
+			}
+
 			CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
 			
 			for ( i = 0; i < g_AI_Manager.NumAIs(); i++ )
@@ -516,18 +780,38 @@ int CAI_Senses::LookForObjects( int iDistance )
 
 		float distSq = ( iDistance * iDistance );
 		const Vector &origin = GetAbsOrigin();
-		int iter;
-		CBaseEntity *pEnt = g_AI_SensedObjectsManager.GetFirst( &iter );
-		while ( pEnt )
+		if ( ai_senses_spatial_index.GetBool() )
 		{
-			if ( pEnt->GetFlags() & BOX_QUERY_MASK )
+			SensedCandidateList_t candidates;
+			g_AI_SensedEntityGrid.Query( SENSED_OBJECTS, origin, iDistance, &candidates );
+
+			for ( int i = 0; i < candidates.Count(); i++ )
 			{
-				if ( origin.DistToSqr(pEnt->GetAbsOrigin()) < distSq && Look( pEnt) )
+				CBaseEntity *pEnt = candidates[i];
+				if ( pEnt->GetFlags() & BOX_QUERY_MASK )
 				{
-					nSeen++;
+					if ( origin.DistToSqr(pEnt->GetAbsOrigin()) < distSq && Look( pEnt) )
+					{
+						nSeen++;
+					}
+				}
+			}
+		}
+		else
+		{
+			int iter;
+			CBaseEntity *pEnt = g_AI_SensedObjectsManager.GetFirst( &iter );
+			while ( pEnt )
+			{
+				if ( pEnt->GetFlags() & BOX_QUERY_MASK )
+				{
+					if ( origin.DistToSqr(pEnt->GetAbsOrigin()) < distSq && Look( pEnt) )
+					{
+						nSeen++;
+					}
 				}
+				pEnt = g_AI_SensedObjectsManager.GetNext( &iter );
 			}
-			pEnt = g_AI_SensedObjectsManager.GetNext( &iter );
 		}
 		
 		EndGather( nSeen, &m_SeenMisc );
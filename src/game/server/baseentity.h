@@ -1922,6 +1922,7 @@ inline string_t CBaseEntity::GetEntityName()
 inline void CBaseEntity::SetName( string_t newName )
 {
 	m_iName = newName;
+	gEntList.UpdateEntityNameIndex( this );
 }
 
 
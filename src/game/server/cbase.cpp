@@ -644,8 +644,8 @@ CEventQueue g_EventQueue;
 
 CEventQueue::CEventQueue()
 {
-	m_Events.m_flFireTime = -FLT_MAX;
-	m_Events.m_pNext = NULL;
+	m_nNextSequence = 0;
+	m_iListCount = 0;
 
 	Init();
 }
@@ -759,21 +759,43 @@ void CEventQueue::Init( void )
 void CEventQueue::Clear( void )
 {
 	// delete all the events in the queue
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
-	
-	while ( pe != NULL )
+	for ( int i = 0; i < m_Events.Count(); i++ )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
-		delete pe;
-		pe = next;
+		delete m_Events[i];
 	}
 
-	m_Events.m_pNext = NULL;
+	m_Events.Purge();
+	m_EventsByCaller.Purge();
+	m_EventsByTarget.Purge();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: copies the pending events out in the order they will fire
+//-----------------------------------------------------------------------------
+static CEventQueue *s_pSortingEventQueue = NULL;
+
+void CEventQueue::GetSortedEvents( CUtlVector< EventQueuePrioritizedEvent_t * > &events )
+{
+	struct _Local {
+		static int __cdecl F( EventQueuePrioritizedEvent_t * const *a, EventQueuePrioritizedEvent_t * const *b )
+		{
+			if ( s_pSortingEventQueue->IsEarlier( *a, *b ) )
+				return -1;
+			return s_pSortingEventQueue->IsEarlier( *b, *a ) ? 1 : 0;
+		}
+	};
+
+	events.CopyArray( m_Events.Base(), m_Events.Count() );
+
+	s_pSortingEventQueue = this;
+	events.Sort( _Local::F );
+	s_pSortingEventQueue = NULL;
 }
 
 void CEventQueue::Dump( void )
 {
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
+	CUtlVector< EventQueuePrioritizedEvent_t * > events;
+	GetSortedEvents( events );
 
 	Msg("Dumping event queue. Current time is: %.2f\n",
 #ifdef TF_DLL
@@ -783,9 +805,9 @@ void CEventQueue::Dump( void )
 #endif
 		);
 
-	while ( pe != NULL )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
+		EventQueuePrioritizedEvent_t *pe = events[i];
 
 		Msg("   (%.2f) Target: '%s', Input: '%s', Parameter '%s'. Activator: '%s', Caller '%s'.  \n", 
 			pe->m_flFireTime, 
@@ -794,8 +816,6 @@ void CEventQueue::Dump( void )
 			pe->m_VariantValue.String(),
 			pe->m_pActivator ? pe->m_pActivator->GetDebugName() : "None", 
 			pe->m_pCaller ? pe->m_pCaller->GetDebugName() : "None"  );
-
-		pe = next;
 	}
 
 	Msg("Finished dump.\n");
@@ -857,40 +877,170 @@ void CEventQueue::AddEvent( CBaseEntity *target, const char *action, float fireD
 
 
 //-----------------------------------------------------------------------------
-// Purpose: private function, adds an event into the list
-// Input  : *newEvent - the (already built) event to add
+// Purpose: orders the heap by fire time, breaking ties by the order events were
+//			added so events due on the same tick still fire first in, first out
 //-----------------------------------------------------------------------------
-void CEventQueue::AddEvent( EventQueuePrioritizedEvent_t *newEvent )
+bool CEventQueue::IsEarlier( const EventQueuePrioritizedEvent_t *a, const EventQueuePrioritizedEvent_t *b ) const
+{
+	if ( a->m_flFireTime != b->m_flFireTime )
+		return a->m_flFireTime < b->m_flFireTime;
+
+	return (int)( a->m_nSequence - b->m_nSequence ) < 0;
+}
+
+void CEventQueue::HeapSet( int i, EventQueuePrioritizedEvent_t *pe )
+{
+	m_Events[i] = pe;
+	pe->m_iHeapIndex = i;
+}
+
+void CEventQueue::HeapMoveUp( int i )
 {
-	// loop through the actions looking for a place to insert
-	EventQueuePrioritizedEvent_t *pe;
-	for ( pe = &m_Events; pe->m_pNext != NULL; pe = pe->m_pNext )
+	EventQueuePrioritizedEvent_t *pe = m_Events[i];
+	while ( i > 0 )
 	{
-		if ( pe->m_pNext->m_flFireTime > newEvent->m_flFireTime )
-		{
+		int parent = ( i - 1 ) / 2;
+		if ( !IsEarlier( pe, m_Events[parent] ) )
 			break;
+
+		HeapSet( i, m_Events[parent] );
+		i = parent;
+	}
+	HeapSet( i, pe );
+}
+
+void CEventQueue::HeapMoveDown( int i )
+{
+	EventQueuePrioritizedEvent_t *pe = m_Events[i];
+	int count = m_Events.Count();
+	while ( 1 )
+	{
+		int child = 2 * i + 1;
+		if ( child >= count )
+			break;
+
+		if ( child + 1 < count && IsEarlier( m_Events[child + 1], m_Events[child] ) )
+		{
+			child++;
 		}
+
+		if ( !IsEarlier( m_Events[child], pe ) )
+			break;
+
+		HeapSet( i, m_Events[child] );
+		i = child;
 	}
+	HeapSet( i, pe );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: threads the event onto the list of pending events for an entity
+//-----------------------------------------------------------------------------
+typedef EventQueuePrioritizedEvent_t *EventQueuePrioritizedEvent_t::*EventQueueLink_t;
 
-	Assert( pe );
+static void LinkIndexedEvent( EventQueueIndex_t &index, unsigned int key, EventQueuePrioritizedEvent_t *pe, EventQueueLink_t pNext, EventQueueLink_t pPrev )
+{
+	UtlHashHandle_t h = index.Find( key );
+	EventQueuePrioritizedEvent_t *pHead = ( h != index.InvalidHandle() ) ? index[h] : NULL;
 
-	// insert
-	newEvent->m_pNext = pe->m_pNext;
-	newEvent->m_pPrev = pe;
-	pe->m_pNext = newEvent;
-	if ( newEvent->m_pNext )
+	pe->*pPrev = NULL;
+	pe->*pNext = pHead;
+	if ( pHead )
+	{
+		pHead->*pPrev = pe;
+		index[h] = pe;
+	}
+	else
 	{
-		newEvent->m_pNext->m_pPrev = newEvent;
+		index.Insert( key, pe );
 	}
 }
 
+static void UnlinkIndexedEvent( EventQueueIndex_t &index, unsigned int key, EventQueuePrioritizedEvent_t *pe, EventQueueLink_t pNext, EventQueueLink_t pPrev )
+{
+	if ( pe->*pNext )
+	{
+		(pe->*pNext)->*pPrev = pe->*pPrev;
+	}
+
+	if ( pe->*pPrev )
+	{
+		(pe->*pPrev)->*pNext = pe->*pNext;
+	}
+	else if ( pe->*pNext )
+	{
+		index[ index.Find( key ) ] = pe->*pNext;
+	}
+	else
+	{
+		index.Remove( key );
+	}
+
+	pe->*pNext = pe->*pPrev = NULL;
+}
+
+static EventQueuePrioritizedEvent_t *FirstIndexedEvent( EventQueueIndex_t &index, CBaseEntity *pEntity )
+{
+	UtlHashHandle_t h = index.Find( pEntity->GetRefEHandle().ToInt() );
+	return ( h != index.InvalidHandle() ) ? index[h] : NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: private function, adds an event into the queue
+// Input  : *newEvent - the (already built) event to add
+//-----------------------------------------------------------------------------
+void CEventQueue::AddEvent( EventQueuePrioritizedEvent_t *newEvent )
+{
+	newEvent->m_nSequence = m_nNextSequence++;
+
+	newEvent->m_hIndexedCaller = newEvent->m_pCaller.ToInt();
+	newEvent->m_pNextByCaller = newEvent->m_pPrevByCaller = NULL;
+	if ( newEvent->m_pCaller.IsValid() )
+	{
+		LinkIndexedEvent( m_EventsByCaller, newEvent->m_hIndexedCaller, newEvent, &EventQueuePrioritizedEvent_t::m_pNextByCaller, &EventQueuePrioritizedEvent_t::m_pPrevByCaller );
+	}
+
+	newEvent->m_hIndexedTarget = newEvent->m_pEntTarget.ToInt();
+	newEvent->m_pNextByTarget = newEvent->m_pPrevByTarget = NULL;
+	if ( newEvent->m_pEntTarget.IsValid() )
+	{
+		LinkIndexedEvent( m_EventsByTarget, newEvent->m_hIndexedTarget, newEvent, &EventQueuePrioritizedEvent_t::m_pNextByTarget, &EventQueuePrioritizedEvent_t::m_pPrevByTarget );
+	}
+
+	int i = m_Events.AddToTail( newEvent );
+	HeapMoveUp( i );
+}
+
 void CEventQueue::RemoveEvent( EventQueuePrioritizedEvent_t *pe )
 {
-	Assert( pe->m_pPrev );
-	pe->m_pPrev->m_pNext = pe->m_pNext;
-	if ( pe->m_pNext )
+	int i = pe->m_iHeapIndex;
+	Assert( m_Events.IsValidIndex( i ) && m_Events[i] == pe );
+
+	// fill the hole with the last event and let it settle
+	EventQueuePrioritizedEvent_t *pLast = m_Events.Tail();
+	m_Events.RemoveMultipleFromTail( 1 );
+	if ( pLast != pe )
+	{
+		HeapSet( i, pLast );
+		if ( i > 0 && IsEarlier( pLast, m_Events[( i - 1 ) / 2] ) )
+		{
+			HeapMoveUp( i );
+		}
+		else
+		{
+			HeapMoveDown( i );
+		}
+	}
+	pe->m_iHeapIndex = -1;
+
+	if ( pe->m_hIndexedCaller != INVALID_EHANDLE_INDEX )
 	{
-		pe->m_pNext->m_pPrev = pe->m_pPrev;
+		UnlinkIndexedEvent( m_EventsByCaller, pe->m_hIndexedCaller, pe, &EventQueuePrioritizedEvent_t::m_pNextByCaller, &EventQueuePrioritizedEvent_t::m_pPrevByCaller );
+	}
+
+	if ( pe->m_hIndexedTarget != INVALID_EHANDLE_INDEX )
+	{
+		UnlinkIndexedEvent( m_EventsByTarget, pe->m_hIndexedTarget, pe, &EventQueuePrioritizedEvent_t::m_pNextByTarget, &EventQueuePrioritizedEvent_t::m_pPrevByTarget );
 	}
 }
 
@@ -905,16 +1055,18 @@ void CEventQueue::ServiceEvents( void )
 		return;
 	}
 
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
-
 #ifdef TF_DLL
-	while ( pe != NULL && pe->m_flFireTime <= engine->GetServerTime() )
+	while ( m_Events.Count() && m_Events[0]->m_flFireTime <= engine->GetServerTime() )
 #else
-	while ( pe != NULL && pe->m_flFireTime <= gpGlobals->curtime )
+	while ( m_Events.Count() && m_Events[0]->m_flFireTime <= gpGlobals->curtime )
 #endif
 	{
 		MDLCACHE_CRITICAL_SECTION();
 
+		// take the event off the queue before firing it, since the inputs may add or cancel events
+		EventQueuePrioritizedEvent_t *pe = m_Events[0];
+		RemoveEvent( pe );
+
 		bool targetFound = false;
 
 		// find the targets
@@ -978,8 +1130,6 @@ void CEventQueue::ServiceEvents( void )
 			ADD_DEBUG_HISTORY( HISTORY_ENTITY_IO, szBuffer );
 		}
 
-		// remove the event from the list (remembering that the queue may have been added to)
-		RemoveEvent( pe );
 		delete pe;
 
 		//
@@ -992,9 +1142,6 @@ void CEventQueue::ServiceEvents( void )
 				break;
 			}
 		}
-
-		// restart the list (to catch any new items have probably been added to the queue)
-		pe = m_Events.m_pNext;	
 	}
 }
 
@@ -1022,7 +1169,7 @@ void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 	if (!pCaller)
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	EventQueuePrioritizedEvent_t *pCur = FirstIndexedEvent( m_EventsByCaller, pCaller );
 
 	while (pCur != NULL)
 	{
@@ -1039,7 +1186,7 @@ void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 		}
 
 		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextByCaller;
 
 		if (bDelete)
 		{
@@ -1060,7 +1207,7 @@ void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 	if (!pTarget)
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	EventQueuePrioritizedEvent_t *pCur = FirstIndexedEvent( m_EventsByTarget, pTarget );
 
 	while (pCur != NULL)
 	{
@@ -1075,7 +1222,7 @@ void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 		}
 
 		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextByTarget;
 
 		if (bDelete)
 		{
@@ -1095,7 +1242,7 @@ bool CEventQueue::HasEventPending( CBaseEntity *pTarget, const char *sInputName
 	if (!pTarget)
 		return false;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	EventQueuePrioritizedEvent_t *pCur = FirstIndexedEvent( m_EventsByTarget, pTarget );
 
 	while (pCur != NULL)
 	{
@@ -1108,7 +1255,7 @@ bool CEventQueue::HasEventPending( CBaseEntity *pTarget, const char *sInputName
 				return true;
 		}
 
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextByTarget;
 	}
 
 	return false;
@@ -1143,29 +1290,33 @@ BEGIN_SIMPLE_DATADESC( EventQueuePrioritizedEvent_t )
 	DEFINE_FIELD( m_iOutputID, FIELD_INTEGER ),
 	DEFINE_CUSTOM_FIELD( m_VariantValue, variantFuncs ),
 
-//	DEFINE_FIELD( m_pNext, FIELD_??? ),
-//	DEFINE_FIELD( m_pPrev, FIELD_??? ),
+//	DEFINE_FIELD( m_nSequence, FIELD_INTEGER ),		// rebuilt in save order on restore
+//	DEFINE_FIELD( m_iHeapIndex, FIELD_INTEGER ),
+//	DEFINE_FIELD( m_hIndexedCaller, FIELD_INTEGER ),
+//	DEFINE_FIELD( m_hIndexedTarget, FIELD_INTEGER ),
+//	DEFINE_FIELD( m_pNextByCaller, FIELD_??? ),
+//	DEFINE_FIELD( m_pPrevByCaller, FIELD_??? ),
+//	DEFINE_FIELD( m_pNextByTarget, FIELD_??? ),
+//	DEFINE_FIELD( m_pPrevByTarget, FIELD_??? ),
 END_DATADESC()
 
 
 int CEventQueue::Save( ISave &save )
 {
-	// count the number of items in the queue
-	EventQueuePrioritizedEvent_t *pe;
+	// save in firing order, so restoring re-adds ties in the same order
+	CUtlVector< EventQueuePrioritizedEvent_t * > events;
+	GetSortedEvents( events );
 
-	m_iListCount = 0;
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
-	{
-		m_iListCount++;
-	}
+	m_iListCount = events.Count();
 
 	// save that value out to disk, so we know how many to restore
 	if ( !save.WriteFields( "EventQueue", this, NULL, m_DataMap.dataDesc, m_DataMap.dataNumFields ) )
 		return 0;
 	
 	// cycle through all the events, saving them all
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
+		EventQueuePrioritizedEvent_t *pe = events[i];
 		if ( !save.WriteFields( "PEvent", pe, NULL, pe->m_DataMap.dataDesc, pe->m_DataMap.dataNumFields ) )
 			return 0;
 	}
@@ -17,6 +17,7 @@
 #include "ai_initutils.h"
 #include "globalstate.h"
 #include "datacache/imdlcache.h"
+#include "tier1/generichash.h"
 
 #ifdef HL2_DLL
 #include "npc_playercompanion.h"
@@ -123,6 +124,273 @@ void AimTarget_ForceRepopulateList()
 }
 
 
+// Hashes entities by name and by classname so exact searches only visit the
+// entities that can match.  Each hash bucket keeps its entities in global list
+// order, so walking a bucket finds the same entities in the same order as
+// walking the whole list.  Wildcard searches still walk the whole list.
+ConVar ent_name_index( "ent_name_index", "1", 0, "Use the name/classname hash index for entity searches." );
+
+#define ENTITY_INDEX_BUCKET_BITS	12
+#define ENTITY_INDEX_BUCKETS		(1 << ENTITY_INDEX_BUCKET_BITS)
+
+enum EntityIndexKey_t
+{
+	ENTITY_INDEX_NAME = 0,
+	ENTITY_INDEX_CLASSNAME,
+
+	NUM_ENTITY_INDEX_KEYS
+};
+
+struct entityindexlink_t
+{
+	string_t	key;		// value the entity is filed under
+	int			bucket;		// -1 if not linked
+	int			prev;		// entity slots, -1 terminates
+	int			next;
+};
+
+class CEntityNameIndex
+{
+public:
+	CEntityNameIndex()
+	{
+		m_nNextSerial = 0;
+		ResetStats();
+		for ( int k = 0; k < NUM_ENTITY_INDEX_KEYS; k++ )
+		{
+			for ( int i = 0; i < ENTITY_INDEX_BUCKETS; i++ )
+			{
+				m_head[k][i] = m_tail[k][i] = -1;
+			}
+			for ( int i = 0; i < NUM_ENT_ENTRIES; i++ )
+			{
+				m_links[k][i].key = NULL_STRING;
+				m_links[k][i].bucket = -1;
+				m_links[k][i].prev = m_links[k][i].next = -1;
+			}
+		}
+		memset( m_pEntities, 0, sizeof(m_pEntities) );
+		memset( m_serial, 0, sizeof(m_serial) );
+	}
+
+	void AddEntity( CBaseEntity *pEntity, int slot )
+	{
+		// Entities are appended to the global list, so serials follow list order
+		m_pEntities[slot] = pEntity;
+		m_serial[slot] = ++m_nNextSerial;
+		UpdateEntity( pEntity, slot );
+	}
+
+	void RemoveEntity( int slot )
+	{
+		for ( int k = 0; k < NUM_ENTITY_INDEX_KEYS; k++ )
+		{
+			Unlink( (EntityIndexKey_t)k, slot );
+		}
+		m_pEntities[slot] = NULL;
+	}
+
+	// Refiles the entity if its name or classname changed since it was last indexed
+	void UpdateEntity( CBaseEntity *pEntity, int slot )
+	{
+		if ( m_pEntities[slot] != pEntity )
+			return;
+
+		string_t keys[NUM_ENTITY_INDEX_KEYS];
+		keys[ENTITY_INDEX_NAME] = pEntity->GetEntityName();
+		keys[ENTITY_INDEX_CLASSNAME] = pEntity->m_iClassname;
+
+		for ( int k = 0; k < NUM_ENTITY_INDEX_KEYS; k++ )
+		{
+			entityindexlink_t &link = m_links[k][slot];
+			if ( link.bucket != -1 && link.key == keys[k] )
+				continue;
+
+			Unlink( (EntityIndexKey_t)k, slot );
+			Link( (EntityIndexKey_t)k, slot, keys[k] );
+		}
+	}
+
+	// Index searches only handle exact (case insensitive) names
+	static bool CanSearch( const char *szName )
+	{
+		if ( !szName || !szName[0] || !ent_name_index.GetBool() )
+			return false;
+		return strchr( szName, '*' ) == NULL;
+	}
+
+	// First entity after pStartEntity in list order that could be called szName.
+	// The caller still has to check the name, since buckets are shared.
+	CBaseEntity *FirstCandidate( EntityIndexKey_t k, const char *szName, CBaseEntity *pStartEntity )
+	{
+		++m_nIndexedSearches;
+
+		int bucket = Bucket( szName );
+		int slot = m_head[k][bucket];
+		if ( pStartEntity )
+		{
+			int startSlot = pStartEntity->GetRefEHandle().GetEntryIndex();
+			if ( m_links[k][startSlot].bucket == bucket )
+			{
+				slot = m_links[k][startSlot].next;
+			}
+			else
+			{
+				unsigned int startSerial = m_serial[startSlot];
+				while ( slot != -1 && m_serial[slot] <= startSerial )
+				{
+					slot = m_links[k][slot].next;
+				}
+			}
+		}
+
+		return ( slot != -1 ) ? Candidate( slot ) : NULL;
+	}
+
+	CBaseEntity *NextCandidate( EntityIndexKey_t k, CBaseEntity *pEntity )
+	{
+		int slot = m_links[k][pEntity->GetRefEHandle().GetEntryIndex()].next;
+		return ( slot != -1 ) ? Candidate( slot ) : NULL;
+	}
+
+	void CountScan()
+	{
+		++m_nScannedSearches;
+	}
+
+	void ResetStats()
+	{
+		m_nIndexedSearches = 0;
+		m_nScannedSearches = 0;
+		m_nCandidates = 0;
+	}
+
+	void Report()
+	{
+		int nLinked[NUM_ENTITY_INDEX_KEYS] = { 0, 0 };
+		int nUsedBuckets[NUM_ENTITY_INDEX_KEYS] = { 0, 0 };
+		int nLongest[NUM_ENTITY_INDEX_KEYS] = { 0, 0 };
+		for ( int k = 0; k < NUM_ENTITY_INDEX_KEYS; k++ )
+		{
+			for ( int i = 0; i < ENTITY_INDEX_BUCKETS; i++ )
+			{
+				int nChain = 0;
+				for ( int slot = m_head[k][i]; slot != -1; slot = m_links[k][slot].next )
+				{
+					++nChain;
+				}
+				if ( nChain )
+				{
+					nUsedBuckets[k]++;
+					nLinked[k] += nChain;
+					nLongest[k] = MAX( nLongest[k], nChain );
+				}
+			}
+		}
+
+		// Anything not filed under its current name was renamed behind the index's back
+		int nStale = 0;
+		for ( CBaseEntity *pEntity = gEntList.FirstEnt(); pEntity; pEntity = gEntList.NextEnt( pEntity ) )
+		{
+			int slot = pEntity->GetRefEHandle().GetEntryIndex();
+			if ( m_links[ENTITY_INDEX_NAME][slot].key != pEntity->GetEntityName() ||
+				 m_links[ENTITY_INDEX_CLASSNAME][slot].key != pEntity->m_iClassname )
+			{
+				if ( nStale < 10 )
+				{
+					Msg( "  stale: %s (%s)\n", pEntity->GetDebugName(), pEntity->GetClassname() );
+				}
+				++nStale;
+			}
+		}
+
+		int nSearches = m_nIndexedSearches + m_nScannedSearches;
+		Msg( "Entity name index (%s):\n", ent_name_index.GetBool() ? "on" : "off" );
+		Msg( "  names:      %d entities in %d buckets, longest chain %d\n", nLinked[ENTITY_INDEX_NAME], nUsedBuckets[ENTITY_INDEX_NAME], nLongest[ENTITY_INDEX_NAME] );
+		Msg( "  classnames: %d entities in %d buckets, longest chain %d\n", nLinked[ENTITY_INDEX_CLASSNAME], nUsedBuckets[ENTITY_INDEX_CLASSNAME], nLongest[ENTITY_INDEX_CLASSNAME] );
+		Msg( "  %d searches: %d from the index (%.1f%%, %.2f entities visited each), %d full scans\n",
+			nSearches, m_nIndexedSearches, nSearches ? 100.0f * m_nIndexedSearches / nSearches : 0.0f,
+			m_nIndexedSearches ? (float)m_nCandidates / m_nIndexedSearches : 0.0f, m_nScannedSearches );
+		Msg( "  %d stale entries\n", nStale );
+	}
+
+private:
+	static int Bucket( const char *szName )
+	{
+		return HashStringCaseless( szName ) & ( ENTITY_INDEX_BUCKETS - 1 );
+	}
+
+	CBaseEntity *Candidate( int slot )
+	{
+		++m_nCandidates;
+		return m_pEntities[slot];
+	}
+
+	void Link( EntityIndexKey_t k, int slot, string_t key )
+	{
+		entityindexlink_t &link = m_links[k][slot];
+		link.key = key;
+		link.bucket = Bucket( STRING(key) ? STRING(key) : "" );
+
+		// Walk back from the tail to keep the bucket in list order.  New
+		// entities have the highest serial, so this is usually immediate.
+		int prev = m_tail[k][link.bucket];
+		while ( prev != -1 && m_serial[prev] > m_serial[slot] )
+		{
+			prev = m_links[k][prev].prev;
+		}
+
+		int next = ( prev != -1 ) ? m_links[k][prev].next : m_head[k][link.bucket];
+		link.prev = prev;
+		link.next = next;
+
+		if ( prev != -1 )
+			m_links[k][prev].next = slot;
+		else
+			m_head[k][link.bucket] = slot;
+
+		if ( next != -1 )
+			m_links[k][next].prev = slot;
+		else
+			m_tail[k][link.bucket] = slot;
+	}
+
+	void Unlink( EntityIndexKey_t k, int slot )
+	{
+		entityindexlink_t &link = m_links[k][slot];
+		if ( link.bucket == -1 )
+			return;
+
+		if ( link.prev != -1 )
+			m_links[k][link.prev].next = link.next;
+		else
+			m_head[k][link.bucket] = link.next;
+
+		if ( link.next != -1 )
+			m_links[k][link.next].prev = link.prev;
+		else
+			m_tail[k][link.bucket] = link.prev;
+
+		link.key = NULL_STRING;
+		link.bucket = -1;
+		link.prev = link.next = -1;
+	}
+
+	CBaseEntity			*m_pEntities[NUM_ENT_ENTRIES];
+	unsigned int		m_serial[NUM_ENT_ENTRIES];
+	entityindexlink_t	m_links[NUM_ENTITY_INDEX_KEYS][NUM_ENT_ENTRIES];
+	int					m_head[NUM_ENTITY_INDEX_KEYS][ENTITY_INDEX_BUCKETS];
+	int					m_tail[NUM_ENTITY_INDEX_KEYS][ENTITY_INDEX_BUCKETS];
+	unsigned int		m_nNextSerial;
+
+	int					m_nIndexedSearches;
+	int					m_nScannedSearches;
+	int					m_nCandidates;
+};
+
+static CEntityNameIndex g_EntityNameIndex;
+
+
 // Manages a list of all entities currently doing game simulation or thinking
 // NOTE: This is usually a small subset of the global entity list, so it's
 // an optimization to maintain this list incrementally rather than polling each
@@ -481,6 +749,19 @@ bool CGlobalEntityList::IsEntityPtr( void *pTest )
 //-----------------------------------------------------------------------------
 CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity, const char *szName )
 {
+	if ( CEntityNameIndex::CanSearch( szName ) )
+	{
+		CBaseEntity *pEntity = g_EntityNameIndex.FirstCandidate( ENTITY_INDEX_CLASSNAME, szName, pStartEntity );
+		for ( ; pEntity; pEntity = g_EntityNameIndex.NextCandidate( ENTITY_INDEX_CLASSNAME, pEntity ) )
+		{
+			if ( pEntity->ClassMatches(szName) )
+				return pEntity;
+		}
+		return NULL;
+	}
+
+	g_EntityNameIndex.CountScan();
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -590,6 +871,27 @@ CBaseEntity *CGlobalEntityList::FindEntityByName( CBaseEntity *pStartEntity, con
 
 		return NULL;
 	}
+
+	if ( CEntityNameIndex::CanSearch( szName ) )
+	{
+		CBaseEntity *ent = g_EntityNameIndex.FirstCandidate( ENTITY_INDEX_NAME, szName, pStartEntity );
+		for ( ; ent; ent = g_EntityNameIndex.NextCandidate( ENTITY_INDEX_NAME, ent ) )
+		{
+			if ( !ent->m_iName )
+				continue;
+
+			if ( ent->NameMatches( szName ) )
+			{
+				if ( pFilter && !pFilter->ShouldFindEntity(ent) )
+					continue;
+
+				return ent;
+			}
+		}
+		return NULL;
+	}
+
+	g_EntityNameIndex.CountScan();
 	
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
@@ -1095,6 +1397,7 @@ void CGlobalEntityList::OnAddEntity( IHandleEntity *pEnt, CBaseHandle handle )
 	
 	// NOTE: Must be a CBaseEntity on server
 	Assert( pBaseEnt );
+	g_EntityNameIndex.AddEntity( pBaseEnt, handle.GetEntryIndex() );
 	//DevMsg(2,"Created %s\n", pBaseEnt->GetClassname() );
 	for ( i = m_entityListeners.Count()-1; i >= 0; i-- )
 	{
@@ -1125,9 +1428,19 @@ void CGlobalEntityList::OnRemoveEntity( IHandleEntity *pEnt, CBaseHandle handle
 	if ( pBaseEnt->edict() )
 		m_iNumEdicts--;
 
+	g_EntityNameIndex.RemoveEntity( handle.GetEntryIndex() );
+
 	m_iNumEnts--;
 }
 
+void CGlobalEntityList::UpdateEntityNameIndex( CBaseEntity *pEntity )
+{
+	if ( pEntity->GetRefEHandle() == INVALID_EHANDLE_INDEX )
+		return;
+
+	g_EntityNameIndex.UpdateEntity( pEntity, pEntity->GetRefEHandle().GetEntryIndex() );
+}
+
 void CGlobalEntityList::NotifyCreateEntity( CBaseEntity *pEnt )
 {
 	if ( !pEnt )
@@ -1583,6 +1896,21 @@ CON_COMMAND(report_entities, "Lists all entities")
 }
 
 
+CON_COMMAND(report_entity_name_index, "Reports how many entity searches were served by the name/classname index.  Pass 'reset' to clear the counters.")
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( args.ArgC() > 1 && !Q_stricmp( args[1], "reset" ) )
+	{
+		g_EntityNameIndex.ResetStats();
+		return;
+	}
+
+	g_EntityNameIndex.Report();
+}
+
+
 CON_COMMAND(report_touchlinks, "Lists all touchlinks")
 {
 	if ( !UTIL_IsCommandIssuedByServerAdmin() )
@@ -15,6 +15,7 @@
 #endif
 
 #include "mempool.h"
+#include "utlhashtable.h"
 
 struct EventQueuePrioritizedEvent_t
 {
@@ -28,14 +29,24 @@ struct EventQueuePrioritizedEvent_t
 
 	variant_t m_VariantValue;	// variable-type parameter
 
-	EventQueuePrioritizedEvent_t *m_pNext;
-	EventQueuePrioritizedEvent_t *m_pPrev;
+	unsigned int m_nSequence;	// events with the same fire time fire in the order they were added
+	int m_iHeapIndex;			// position in CEventQueue::m_Events, -1 if not queued
+
+	// pending events sharing a caller / target, for cancelling without searching the queue
+	unsigned int m_hIndexedCaller;
+	unsigned int m_hIndexedTarget;
+	EventQueuePrioritizedEvent_t *m_pNextByCaller;
+	EventQueuePrioritizedEvent_t *m_pPrevByCaller;
+	EventQueuePrioritizedEvent_t *m_pNextByTarget;
+	EventQueuePrioritizedEvent_t *m_pPrevByTarget;
 
 	DECLARE_SIMPLE_DATADESC();
 
 	DECLARE_FIXEDSIZE_ALLOCATOR( PrioritizedEvent_t );
 };
 
+typedef CUtlHashtable< unsigned int, EventQueuePrioritizedEvent_t * > EventQueueIndex_t;
+
 class CEventQueue
 {
 public:
@@ -71,8 +82,19 @@ private:
 	void AddEvent( EventQueuePrioritizedEvent_t *event );
 	void RemoveEvent( EventQueuePrioritizedEvent_t *pe );
 
+	// binary heap ordered by fire time, then by sequence
+	bool IsEarlier( const EventQueuePrioritizedEvent_t *a, const EventQueuePrioritizedEvent_t *b ) const;
+	void HeapMoveUp( int i );
+	void HeapMoveDown( int i );
+	void HeapSet( int i, EventQueuePrioritizedEvent_t *pe );
+
+	void GetSortedEvents( CUtlVector< EventQueuePrioritizedEvent_t * > &events );
+
 	DECLARE_SIMPLE_DATADESC();
-	EventQueuePrioritizedEvent_t m_Events;
+	CUtlVector< EventQueuePrioritizedEvent_t * > m_Events;
+	EventQueueIndex_t m_EventsByCaller;	// head of each caller's list, keyed by the caller's EHANDLE
+	EventQueueIndex_t m_EventsByTarget;	// same for events aimed at an entity pointer
+	unsigned int m_nNextSequence;
 	int m_iListCount;
 };
 
@@ -89,6 +89,7 @@
 #include "tier3/tier3.h"
 #include "serverbenchmark_base.h"
 #include "querycache.h"
+#include "checksum_crc.h"
 
 
 #ifdef TF_DLL
@@ -240,6 +241,7 @@ static ConVar sv_showhitboxes( "sv_showhitboxes", "-1", FCVAR_CHEAT, "Send serve
 #endif
 
 void PrecachePointTemplates();
+void ClearTransmitPVSCache();
 
 static ClientPutInServerOverrideFn g_pClientPutInServerOverride = NULL;
 static void UpdateChapterRestrictions( const char *mapname );
@@ -1366,6 +1368,8 @@ void CServerGameDLL::OnQueryCvarValueFinished( QueryCvarCookie_t iCookie, edict_
 // Called when a level is shutdown (including changing levels)
 void CServerGameDLL::LevelShutdown( void )
 {
+	ClearTransmitPVSCache();
+
 #ifndef NO_STEAM
 	IGameSystem::LevelShutdownPreClearSteamAPIContextAllSystems();
 
@@ -2376,6 +2380,175 @@ CBaseEntity* CServerGameEnts::EdictToBaseEntity( edict_t *pEdict )
 }
 
 
+//-----------------------------------------------------------------------------
+// Transmit PVS cache: clients standing in the same visibility cluster get the
+// same PVS and area data from the engine, so an edict's IsInPVS answer is
+// computed once per tick for each distinct view and shared between them.
+//-----------------------------------------------------------------------------
+static ConVar sv_transmit_pvs_cache( "sv_transmit_pvs_cache", "1", 0, "Share entity PVS test results this tick between clients that have the same PVS." );
+static ConVar sv_transmit_stats( "sv_transmit_stats", "0", 0, "Once a second, print how many edicts CheckTransmit tested and how long it took." );
+
+enum
+{
+	TRANSMIT_PVS_UNKNOWN = 0,
+	TRANSMIT_PVS_HIDDEN,
+	TRANSMIT_PVS_VISIBLE,
+};
+
+struct TransmitPVSCacheEntry_t
+{
+	CRC32_t	m_nHash;
+	int		m_nPVSSize;
+	byte	m_PVS[PAD_NUMBER( MAX_MAP_CLUSTERS,8 ) / 8];
+	int		m_AreasNetworked;
+	int		m_Areas[MAX_WORLD_AREAS];
+
+	// TRANSMIT_PVS_* per edict. These are single bytes so clients sharing an
+	// entry from different threads never tear each other's answers.
+	byte	m_State[MAX_EDICTS];
+};
+
+struct TransmitStats_t
+{
+	int		m_nClients;
+	int		m_nEdicts;
+	int		m_nPVSTests;
+	int		m_nPVSShared;
+	double	m_flSeconds;
+};
+
+class CTransmitPVSCache
+{
+public:
+	CTransmitPVSCache()
+	{
+		m_nTick = -1;
+		m_nUsedEntries = 0;
+		m_flLastReport = 0.0;
+		memset( &m_Stats, 0, sizeof( m_Stats ) );
+	}
+
+	~CTransmitPVSCache()
+	{
+		m_Entries.PurgeAndDeleteElements();
+	}
+
+	void Clear()
+	{
+		AUTO_LOCK( m_Mutex );
+		m_nTick = -1;
+		m_nUsedEntries = 0;
+	}
+
+	// Returns the entry shared by every client with this PVS and area set this tick
+	TransmitPVSCacheEntry_t *FindOrAddEntry( const CCheckTransmitInfo *pInfo );
+
+	void AddStats( const TransmitStats_t &stats );
+
+private:
+	CThreadFastMutex m_Mutex;
+	CUtlVector< TransmitPVSCacheEntry_t * > m_Entries;
+	int		m_nUsedEntries;
+	int		m_nTick;
+
+	TransmitStats_t m_Stats;
+	double	m_flLastReport;
+};
+
+static CTransmitPVSCache g_TransmitPVSCache;
+
+void ClearTransmitPVSCache()
+{
+	g_TransmitPVSCache.Clear();
+}
+
+TransmitPVSCacheEntry_t *CTransmitPVSCache::FindOrAddEntry( const CCheckTransmitInfo *pInfo )
+{
+	CRC32_t nHash;
+	CRC32_Init( &nHash );
+	CRC32_ProcessBuffer( &nHash, pInfo->m_PVS, pInfo->m_nPVSSize );
+	CRC32_ProcessBuffer( &nHash, pInfo->m_Areas, pInfo->m_AreasNetworked * sizeof( int ) );
+	CRC32_Final( &nHash );
+
+	AUTO_LOCK( m_Mutex );
+
+	// Entity positions only change between ticks
+	if ( m_nTick != gpGlobals->tickcount )
+	{
+		m_nTick = gpGlobals->tickcount;
+		m_nUsedEntries = 0;
+	}
+
+	for ( int i = 0; i < m_nUsedEntries; i++ )
+	{
+		TransmitPVSCacheEntry_t *pEntry = m_Entries[i];
+		if ( pEntry->m_nHash != nHash || pEntry->m_nPVSSize != pInfo->m_nPVSSize || pEntry->m_AreasNetworked != pInfo->m_AreasNetworked )
+			continue;
+
+		if ( memcmp( pEntry->m_PVS, pInfo->m_PVS, pInfo->m_nPVSSize ) || memcmp( pEntry->m_Areas, pInfo->m_Areas, pInfo->m_AreasNetworked * sizeof( int ) ) )
+			continue;
+
+		return pEntry;
+	}
+
+	if ( m_nUsedEntries == m_Entries.Count() )
+	{
+		m_Entries.AddToTail( new TransmitPVSCacheEntry_t );
+	}
+
+	TransmitPVSCacheEntry_t *pEntry = m_Entries[m_nUsedEntries++];
+	pEntry->m_nHash = nHash;
+	pEntry->m_nPVSSize = pInfo->m_nPVSSize;
+	memcpy( pEntry->m_PVS, pInfo->m_PVS, pInfo->m_nPVSSize );
+	pEntry->m_AreasNetworked = pInfo->m_AreasNetworked;
+	memcpy( pEntry->m_Areas, pInfo->m_Areas, pInfo->m_AreasNetworked * sizeof( int ) );
+	memset( pEntry->m_State, TRANSMIT_PVS_UNKNOWN, sizeof( pEntry->m_State ) );
+	return pEntry;
+}
+
+void CTransmitPVSCache::AddStats( const TransmitStats_t &stats )
+{
+	AUTO_LOCK( m_Mutex );
+
+	m_Stats.m_nClients += stats.m_nClients;
+	m_Stats.m_nEdicts += stats.m_nEdicts;
+	m_Stats.m_nPVSTests += stats.m_nPVSTests;
+	m_Stats.m_nPVSShared += stats.m_nPVSShared;
+	m_Stats.m_flSeconds += stats.m_flSeconds;
+
+	double flNow = Plat_FloatTime();
+	if ( flNow - m_flLastReport < 1.0 )
+		return;
+
+	Msg( "CheckTransmit: %d client checks, %d edicts tested, %d PVS tests, %d shared from cache, %.3f ms (%d cache entries this tick)\n",
+		m_Stats.m_nClients, m_Stats.m_nEdicts, m_Stats.m_nPVSTests, m_Stats.m_nPVSShared, m_Stats.m_flSeconds * 1000.0, m_nUsedEntries );
+
+	memset( &m_Stats, 0, sizeof( m_Stats ) );
+	m_flLastReport = flNow;
+}
+
+static inline bool IsInPVSCached( CServerNetworkProperty *netProp, int iEdict, const CCheckTransmitInfo *pInfo, TransmitPVSCacheEntry_t *pCache, TransmitStats_t &stats )
+{
+	if ( pCache )
+	{
+		byte nState = pCache->m_State[iEdict];
+		if ( nState != TRANSMIT_PVS_UNKNOWN )
+		{
+			stats.m_nPVSShared++;
+			return ( nState == TRANSMIT_PVS_VISIBLE );
+		}
+	}
+
+	stats.m_nPVSTests++;
+	bool bInPVS = netProp->IsInPVS( pInfo );
+
+	if ( pCache )
+	{
+		pCache->m_State[iEdict] = bInPVS ? TRANSMIT_PVS_VISIBLE : TRANSMIT_PVS_HIDDEN;
+	}
+	return bInPVS;
+}
+
 /* Yuck.. ideally this would be in CServerNetworkProperty's header, but it requires CBaseEntity and
 // inlining it gives a nice speedup.
 inline void CServerNetworkProperty::CheckTransmit( CCheckTransmitInfo *pInfo )
@@ -2420,6 +2593,25 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 		    bIsReplay == ( pInfo->m_pTransmitAlways != NULL) );
 #endif
 
+	CFastTimer timer;
+	timer.Start();
+
+	TransmitStats_t stats;
+	memset( &stats, 0, sizeof( stats ) );
+	stats.m_nClients = 1;
+	stats.m_nEdicts = nEdicts;
+
+	// HLTV and replay don't cull against the PVS, so there's nothing to share
+	TransmitPVSCacheEntry_t *pPVSCache = NULL;
+#ifndef _X360
+	if ( sv_transmit_pvs_cache.GetBool() && !bIsHLTV && !bIsReplay )
+#else
+	if ( sv_transmit_pvs_cache.GetBool() )
+#endif
+	{
+		pPVSCache = g_TransmitPVSCache.FindOrAddEntry( pInfo );
+	}
+
 	for ( int i=0; i < nEdicts; i++ )
 	{
 		int iEdict = pEdictIndices[i];
@@ -2514,7 +2706,7 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 			continue;
 		}
 
-		bool bInPVS = netProp->IsInPVS( pInfo );
+		bool bInPVS = IsInPVSCached( netProp, iEdict, pInfo, pPVSCache, stats );
 		if ( bInPVS || sv_force_transmit_ents.GetBool() )
 		{
 			// only send if entity is in PVS
@@ -2569,7 +2761,7 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 			{
 				// Check pvs
 				check->RecomputePVSInformation();
-				bool bMoveParentInPVS = check->IsInPVS( pInfo );
+				bool bMoveParentInPVS = IsInPVSCached( check, checkIndex, pInfo, pPVSCache, stats );
 				if ( bMoveParentInPVS )
 				{
 					orig->SetTransmit( pInfo, true );
@@ -2582,6 +2774,13 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 		}
 	}
 
+	if ( sv_transmit_stats.GetBool() )
+	{
+		timer.End();
+		stats.m_flSeconds = timer.GetDuration().GetSeconds();
+		g_TransmitPVSCache.AddStats( stats );
+	}
+
 //	Msg("A:%i, N:%i, F: %i, P: %i\n", always, dontSend, fullCheck, PVS );
 }
 
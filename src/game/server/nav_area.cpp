@@ -44,8 +44,8 @@ unsigned int CNavArea::m_nextID = 1;
 NavAreaVector TheNavAreas;
 
 unsigned int CNavArea::m_masterMarker = 1;
-CNavArea *CNavArea::m_openList = NULL;
-CNavArea *CNavArea::m_openListTail = NULL;
+CUtlVector< CNavArea::OpenListEntry_t > CNavArea::m_openList;
+unsigned int CNavArea::m_openListSequence = 0;
 
 bool CNavArea::m_isReset = false;
 uint32 CNavArea::s_nCurrVisTestCounter = 0;
@@ -183,6 +183,7 @@ CNavArea::CNavArea( void )
 	m_nearNavSearchMarker = 0;
 	m_damagingTickCount = 0;
 	m_openMarker = 0;
+	m_openIndex = 0;
 
 	m_parent = NULL;
 	m_parentHow = GO_NORTH;
@@ -3355,190 +3356,174 @@ void CNavArea::DrawConnectedAreas( void ) const
 
 //--------------------------------------------------------------------------------------------------------------
 /**
- * Add to open list in decreasing value order
+ * Returns true if open list entry 'a' should be expanded before 'b'
  */
-void CNavArea::AddToOpenList( void )
+inline bool IsOpenListEntryLess( float aCost, unsigned int aSequence, float bCost, unsigned int bSequence )
 {
-	Assert( (m_openList && m_openList->m_prevOpen == NULL) || m_openList == NULL );
+	if ( aCost != bCost )
+		return aCost < bCost;
 
-	if ( IsOpen() )
-	{
-		// already on list
-		return;
-	}
+	return aSequence < bSequence;
+}
 
-	// mark as being on open list for quick check
-	m_openMarker = m_masterMarker;
 
-	// if list is empty, add and return
-	if ( m_openList == NULL )
+//--------------------------------------------------------------------------------------------------------------
+void CNavArea::OpenListSiftUp( int index )
+{
+	OpenListEntry_t entry = m_openList[ index ];
+
+	while( index > 0 )
 	{
-		m_openList = this;
-		m_openListTail = this;
-		this->m_prevOpen = NULL;
-		this->m_nextOpen = NULL;
-		return;
+		int parent = ( index - 1 ) / 2;
+		if ( !IsOpenListEntryLess( entry.cost, entry.sequence, m_openList[ parent ].cost, m_openList[ parent ].sequence ) )
+			break;
+
+		m_openList[ index ] = m_openList[ parent ];
+		m_openList[ index ].area->m_openIndex = index;
+		index = parent;
 	}
 
-	// insert self in ascending cost order
-	// Since costs are positive, IEEE754 let's us compare as integers (see http://www.cygnus-software.com/papers/comparingfloats/comparingfloats.htm)
-	CNavArea *area, *last = NULL;
-	int thisCostBits = *reinterpret_cast<const int *>(&m_totalCost);
+	m_openList[ index ] = entry;
+	entry.area->m_openIndex = index;
+}
+
 
-	Assert ( m_totalCost >= 0.0f );
-	for( area = m_openList; area; area = area->m_nextOpen )
+//--------------------------------------------------------------------------------------------------------------
+void CNavArea::OpenListSiftDown( int index )
+{
+	OpenListEntry_t entry = m_openList[ index ];
+	int count = m_openList.Count();
+
+	for( ;; )
 	{
-		Assert ( area->GetTotalCost() >= 0.0f );
-		int thoseCostBits = *reinterpret_cast<const int *>(&area->m_totalCost);
-		if ( thisCostBits < thoseCostBits )
-		{
+		int child = 2 * index + 1;
+		if ( child >= count )
 			break;
-		}
-		last = area;
-	}
 
-	if ( area )
-	{
-		// insert before this area
-		this->m_prevOpen = area->m_prevOpen;
+		if ( child + 1 < count && IsOpenListEntryLess( m_openList[ child + 1 ].cost, m_openList[ child + 1 ].sequence, m_openList[ child ].cost, m_openList[ child ].sequence ) )
+			++child;
 
-		if ( this->m_prevOpen )
-		{
-			this->m_prevOpen->m_nextOpen = this;
-		}
-		else
-		{
-			m_openList = this;
-		}
+		if ( !IsOpenListEntryLess( m_openList[ child ].cost, m_openList[ child ].sequence, entry.cost, entry.sequence ) )
+			break;
 
-		this->m_nextOpen = area;
-		area->m_prevOpen = this;
+		m_openList[ index ] = m_openList[ child ];
+		m_openList[ index ].area->m_openIndex = index;
+		index = child;
 	}
-	else
-	{
-		// append to end of list
-		last->m_nextOpen = this;
-		this->m_prevOpen = last;
-	
-		this->m_nextOpen = NULL;
 
-		m_openListTail = this;
-	}
+	m_openList[ index ] = entry;
+	entry.area->m_openIndex = index;
+}
+
 
-	Assert( (m_openList && m_openList->m_prevOpen == NULL) || m_openList == NULL );
+//--------------------------------------------------------------------------------------------------------------
+void CNavArea::InsertIntoOpenList( CNavArea *area, float cost )
+{
+	// mark as being on open list for quick check
+	area->m_openMarker = m_masterMarker;
+
+	OpenListEntry_t entry;
+	entry.area = area;
+	entry.cost = cost;
+	entry.sequence = m_openListSequence++;
+
+	area->m_openIndex = m_openList.AddToTail( entry );
+	OpenListSiftUp( area->m_openIndex );
 }
 
 
 //--------------------------------------------------------------------------------------------------------------
 /**
- * Add to tail of the open list
+ * Add to open list keyed on current total cost
  */
-void CNavArea::AddToOpenListTail( void )
+void CNavArea::AddToOpenList( void )
 {
-	Assert( (m_openList && m_openList->m_prevOpen == NULL) || m_openList == NULL );
-
 	if ( IsOpen() )
 	{
 		// already on list
 		return;
 	}
 
-	// mark as being on open list for quick check
-	m_openMarker = m_masterMarker;
+	Assert ( m_totalCost >= 0.0f );
+	InsertIntoOpenList( this, m_totalCost );
+}
 
-	// if list is empty, add and return
-	if ( m_openList == NULL )
-	{
-		m_openList = this;
-		m_openListTail = this;
-		this->m_prevOpen = NULL;
-		this->m_nextOpen = NULL;
 
-		Assert( (m_openList && m_openList->m_prevOpen == NULL) || m_openList == NULL );
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Add to the open list behind everything currently on it
+ */
+void CNavArea::AddToOpenListTail( void )
+{
+	if ( IsOpen() )
+	{
+		// already on list
 		return;
 	}
 
-	// append to end of list
-	m_openListTail->m_nextOpen = this;
-
-	this->m_prevOpen = m_openListTail;
-	this->m_nextOpen = NULL;
-
-	m_openListTail = this;
-
-	Assert( (m_openList && m_openList->m_prevOpen == NULL) || m_openList == NULL );
+	InsertIntoOpenList( this, FLT_MAX );
 }
 
 //--------------------------------------------------------------------------------------------------------------
 /**
  * A smaller value has been found, update this area on the open list
- * @todo "bubbling" does unnecessary work, since the order of all other nodes will be unchanged - only this node is altered
  */
 void CNavArea::UpdateOnOpenList( void )
 {
-	// since value can only decrease, bubble this area up from current spot
-	while( m_prevOpen && this->GetTotalCost() < m_prevOpen->GetTotalCost() )
-	{
-		// swap position with predecessor
-		CNavArea *other = m_prevOpen;
-		CNavArea *before = other->m_prevOpen;
-		CNavArea *after  = this->m_nextOpen;
-
-		this->m_nextOpen = other;
-		this->m_prevOpen = before;
-
-		other->m_prevOpen = this;
-		other->m_nextOpen = after;
-
-		if ( before )
-		{
-			before->m_nextOpen = this;
-		}
-		else
-		{
-			m_openList = this;
-		}
+	if ( m_openMarker == 0 || m_openIndex >= m_openList.Count() || m_openList[ m_openIndex ].area != this )
+		return;
 
-		if ( after )
-		{
-			after->m_prevOpen = other;
-		}
-		else
-		{
-			m_openListTail = this;
-		}
-	}
+	// since value can only decrease, sift this area up from current spot
+	Assert( GetTotalCost() <= m_openList[ m_openIndex ].cost );
+	m_openList[ m_openIndex ].cost = GetTotalCost();
+	OpenListSiftUp( m_openIndex );
 }
 
 //--------------------------------------------------------------------------------------------------------------
 void CNavArea::RemoveFromOpenList( void )
 {
-	if ( m_openMarker == 0 )
+	if ( m_openMarker == 0 || m_openIndex >= m_openList.Count() || m_openList[ m_openIndex ].area != this )
 	{
 		// not on the list
 		return;
 	}
 
-	if ( m_prevOpen )
-	{
-		m_prevOpen->m_nextOpen = m_nextOpen;
-	}
-	else
-	{
-		m_openList = m_nextOpen;
-	}
-	
-	if ( m_nextOpen )
+	int index = m_openIndex;
+	int last = m_openList.Count() - 1;
+
+	if ( index != last )
 	{
-		m_nextOpen->m_prevOpen = m_prevOpen;
+		CNavArea *moved = m_openList[ last ].area;
+		m_openList[ index ] = m_openList[ last ];
+		moved->m_openIndex = index;
+		m_openList.FastRemove( last );
+
+		// the moved entry may belong either above or below its new spot
+		OpenListSiftUp( index );
+		OpenListSiftDown( moved->m_openIndex );
 	}
 	else
 	{
-		m_openListTail = m_prevOpen;
+		m_openList.FastRemove( last );
 	}
-	
+
 	// zero is an invalid marker
 	m_openMarker = 0;
+	m_openIndex = 0;
+}
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Remove and return the lowest cost area on the open list
+ */
+CNavArea *CNavArea::PopOpenList( void )
+{
+	if ( m_openList.Count() == 0 )
+		return NULL;
+
+	CNavArea *area = m_openList[ 0 ].area;
+	area->RemoveFromOpenList();
+	return area;
 }
 
 //--------------------------------------------------------------------------------------------------------------
@@ -3547,11 +3532,11 @@ void CNavArea::RemoveFromOpenList( void )
  */
 void CNavArea::ClearSearchLists( void )
 {
-	// effectively clears all open list pointers and closed flags
+	// effectively clears all open list markers and closed flags
 	CNavArea::MakeNewMarker();
 
-	m_openList = NULL;
-	m_openListTail = NULL;
+	m_openList.RemoveAll();
+	m_openListSequence = 0;
 }
 
 //--------------------------------------------------------------------------------------------------------------
@@ -225,26 +225,26 @@ protected:
 	/* 60 */	float m_totalCost;											// the distance so far plus an estimate of the distance left
 	/* 64 */	float m_costSoFar;											// distance travelled so far
 
-	/* 68 */	CNavArea *m_nextOpen, *m_prevOpen;							// only valid if m_openMarker == m_masterMarker
-	/* 76 */	unsigned int m_openMarker;									// if this equals the current marker value, we are on the open list
+	/* 68 */	int m_openIndex;											// position in the open list heap, only valid if m_openMarker == m_masterMarker
+	/* 72 */	unsigned int m_openMarker;									// if this equals the current marker value, we are on the open list
 
-	/* 80 */	int	m_attributeFlags;										// set of attribute bit flags (see NavAttributeType)
+	/* 76 */	int	m_attributeFlags;										// set of attribute bit flags (see NavAttributeType)
 
 	//- connections to adjacent areas -------------------------------------------------------------------
-	/* 84 */	NavConnectVector m_connect[ NUM_DIRECTIONS ];				// a list of adjacent areas for each direction
-	/* 100*/	NavLadderConnectVector m_ladder[ CNavLadder::NUM_LADDER_DIRECTIONS ];	// list of ladders leading up and down from this area
-	/* 108*/	NavConnectVector m_elevatorAreas;							// a list of areas reachable via elevator from this area
+	/* 80 */	NavConnectVector m_connect[ NUM_DIRECTIONS ];				// a list of adjacent areas for each direction
+	/* 96 */	NavLadderConnectVector m_ladder[ CNavLadder::NUM_LADDER_DIRECTIONS ];	// list of ladders leading up and down from this area
+	/* 104*/	NavConnectVector m_elevatorAreas;							// a list of areas reachable via elevator from this area
 
-	/* 112*/	unsigned int m_nearNavSearchMarker;							// used in GetNearestNavArea()
+	/* 108*/	unsigned int m_nearNavSearchMarker;							// used in GetNearestNavArea()
 
-	/* 116*/	CNavArea *m_parent;											// the area just prior to this on in the search path
-	/* 120*/	NavTraverseType m_parentHow;								// how we get from parent to us
+	/* 112*/	CNavArea *m_parent;											// the area just prior to this on in the search path
+	/* 116*/	NavTraverseType m_parentHow;								// how we get from parent to us
 
-	/* 124*/	float m_pathLengthSoFar;									// length of path so far, needed for limiting pathfind max path length
+	/* 120*/	float m_pathLengthSoFar;									// length of path so far, needed for limiting pathfind max path length
 
-	/* *************** 360 cache line *************** */
+	/* 124*/	CFuncElevator *m_elevator;									// if non-NULL, this area is in an elevator's path. The elevator can transport us vertically to another area.
 
-	/* 128*/	CFuncElevator *m_elevator;									// if non-NULL, this area is in an elevator's path. The elevator can transport us vertically to another area.
+	/* *************** 360 cache line *************** */
 
 	// --- End critical data --- 
 };
@@ -432,8 +432,8 @@ public:
 	NavTraverseType GetParentHow( void ) const	{ return m_parentHow; }
 
 	bool IsOpen( void ) const;									// true if on "open list"
-	void AddToOpenList( void );									// add to open list in decreasing value order
-	void AddToOpenListTail( void );								// add to tail of the open list
+	void AddToOpenList( void );									// add to open list keyed on current total cost
+	void AddToOpenListTail( void );								// add to open list behind everything currently on it
 	void UpdateOnOpenList( void );								// a smaller value has been found, update this area on the open list
 	void RemoveFromOpenList( void );
 	static bool IsOpenListEmpty( void );
@@ -704,8 +704,21 @@ private:
 	//- A* pathfinding algorithm ------------------------------------------------------------------------
 	static unsigned int m_masterMarker;
 
-	static CNavArea *m_openList;
-	static CNavArea *m_openListTail;
+	// The open list is a binary min-heap on total cost. Each entry keeps the cost it
+	// was queued with, and equal costs pop in insertion order so breadth-first
+	// searches that queue everything at cost zero still expand first-in first-out.
+	struct OpenListEntry_t
+	{
+		CNavArea *area;
+		float cost;
+		unsigned int sequence;
+	};
+	static CUtlVector< OpenListEntry_t > m_openList;
+	static unsigned int m_openListSequence;
+
+	static void InsertIntoOpenList( CNavArea *area, float cost );
+	static void OpenListSiftUp( int index );
+	static void OpenListSiftDown( int index );
 
 	//- connections to adjacent areas -------------------------------------------------------------------
 	NavConnectVector m_incomingConnect[ NUM_DIRECTIONS ];		// a list of adjacent areas for each direction that connect TO us, but we have no connection back to them
@@ -833,32 +846,7 @@ inline bool CNavArea::IsOpen( void ) const
 //--------------------------------------------------------------------------------------------------------------
 inline bool CNavArea::IsOpenListEmpty( void )
 {
-	Assert( (m_openList && m_openList->m_prevOpen == NULL) || m_openList == NULL );
-	return (m_openList) ? false : true;
-}
-
-//--------------------------------------------------------------------------------------------------------------
-inline CNavArea *CNavArea::PopOpenList( void )
-{
-	Assert( (m_openList && m_openList->m_prevOpen == NULL) || m_openList == NULL );
-
-	if ( m_openList )
-	{
-		CNavArea *area = m_openList;
-	
-		// disconnect from list
-		area->RemoveFromOpenList();
-		area->m_prevOpen = NULL;
-		area->m_nextOpen = NULL;
-
-		Assert( (m_openList && m_openList->m_prevOpen == NULL) || m_openList == NULL );
-
-		return area;
-	}
-
-	Assert( (m_openList && m_openList->m_prevOpen == NULL) || m_openList == NULL );
-
-	return NULL;
+	return ( m_openList.Count() == 0 );
 }
 
 //--------------------------------------------------------------------------------------------------------------
@@ -16,6 +16,9 @@
 #include "fmtstr.h"
 #include "utlbuffer.h"
 #include "tier0/vprof.h"
+#include "tier0/fasttimer.h"
+#include "vstdlib/random.h"
+#include "nav_pathfind.h"
 #ifdef TERROR
 #include "func_simpleladder.h"
 #endif
@@ -1608,6 +1611,56 @@ CON_COMMAND_F( nav_flood_select, "Selects the current Area and all Areas connect
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Run a batch of random area-to-area path searches and report throughput
+ */
+CON_COMMAND_F( nav_bench_paths, "Runs N random area-to-area path searches (default 1000) and reports searches per second. Usage: nav_bench_paths [count] [seed]", FCVAR_GAMEDLL | FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( TheNavAreas.Count() < 2 )
+	{
+		Msg( "nav_bench_paths: no navigation mesh loaded\n" );
+		return;
+	}
+
+	int count = ( args.ArgC() > 1 ) ? MAX( 1, atoi( args[1] ) ) : 1000;
+	int seed = ( args.ArgC() > 2 ) ? atoi( args[2] ) : 0;
+
+	// seeded so repeated runs search the same area pairs
+	CUniformRandomStream randomStream;
+	randomStream.SetSeed( seed );
+
+	ShortestPathCost costFunc;
+	int reached = 0;
+	int pathAreas = 0;
+
+	CFastTimer timer;
+	timer.Start();
+	for( int i=0; i<count; ++i )
+	{
+		CNavArea *startArea = TheNavAreas[ randomStream.RandomInt( 0, TheNavAreas.Count()-1 ) ];
+		CNavArea *goalArea = TheNavAreas[ randomStream.RandomInt( 0, TheNavAreas.Count()-1 ) ];
+
+		if ( NavAreaBuildPath( startArea, goalArea, NULL, costFunc ) )
+		{
+			++reached;
+
+			for( CNavArea *area = goalArea; area; area = area->GetParent() )
+				++pathAreas;
+		}
+	}
+	timer.End();
+
+	float seconds = timer.GetDuration().GetSeconds();
+	Msg( "nav_bench_paths: %d searches over %d areas in %.3f ms (%.1f searches/sec, %.2f us/search)\n",
+		 count, TheNavAreas.Count(), seconds * 1000.0f, ( seconds > 0.0f ) ? count / seconds : 0.0f, seconds * 1000000.0f / count );
+	Msg( "  %d reached goal, average path length %.1f areas\n", reached, reached ? (float)pathAreas / reached : 0.0f );
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 void CommandNavToggleSelectedSet( void )
 {
@@ -10,8 +10,10 @@
 #include "igamesystem.h"
 #include "ilagcompensationmanager.h"
 #include "inetchannelinfo.h"
-#include "utllinkedlist.h"
+#include "utlhashtable.h"
 #include "BaseAnimatingOverlay.h"
+#include "ai_basenpc.h"
+#include "mathlib/ssemath.h"
 #include "tier0/vprof.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -164,6 +166,151 @@ static void RestorePlayerTo( CBasePlayer *pPlayer, const Vector &vWantedPos )
 }
 
 
+
+//-----------------------------------------------------------------------------
+// Purpose: Fixed capacity history of lag records for one entity, newest first.
+//			Records are only added with increasing simulation times, so the
+//			record for a target time is found with a binary search.
+//-----------------------------------------------------------------------------
+class CLagRecordTrack
+{
+public:
+	CLagRecordTrack()
+	{
+		m_pRecords = NULL;
+		m_nMask = 0;
+		m_nHead = 0;
+		m_nHeadSerial = 0;
+		RemoveAll();
+	}
+
+	~CLagRecordTrack()
+	{
+		Purge();
+	}
+
+	void RemoveAll()
+	{
+		m_nCount = 0;
+		m_bHasBreak = false;
+		m_nNewestBreak = 0;
+		m_flHistoryRadius = 0.0f;
+	}
+
+	void Purge()
+	{
+		delete[] m_pRecords;
+		m_pRecords = NULL;
+		m_nMask = 0;
+		RemoveAll();
+	}
+
+	int Count() const { return m_nCount; }
+
+	// 0 is the newest record
+	LagRecord &Element( int i )
+	{
+		Assert( i >= 0 && i < m_nCount );
+		return m_pRecords[ ( m_nHead - i ) & m_nMask ];
+	}
+
+	// Adds a blank record as the newest, overwriting the oldest one if the track is full
+	LagRecord &AddToHead()
+	{
+		if ( !m_pRecords )
+		{
+			// sv_maxunlag is clamped to a second, plus a record on either side to interpolate with
+			int nCapacity = SmallestPowerOfTwoGreaterOrEqual( TIME_TO_TICKS( 1.0f ) + 2 );
+			m_pRecords = new LagRecord[ nCapacity ];
+			m_nMask = nCapacity - 1;
+		}
+
+		m_nHead = ( m_nHead + 1 ) & m_nMask;
+		m_nHeadSerial++;
+		if ( m_nCount <= m_nMask )
+		{
+			m_nCount++;
+		}
+
+		LagRecord &record = m_pRecords[ m_nHead ];
+		record = LagRecord();
+		return record;
+	}
+
+	void RemoveTail()
+	{
+		Assert( m_nCount > 0 );
+		m_nCount--;
+	}
+
+	// Backtracking through record i loses track of the entity (it died or teleported)
+	void MarkBreak( int i )
+	{
+		unsigned int nSerial = m_nHeadSerial - i;
+		if ( !m_bHasBreak || (int)( nSerial - m_nNewestBreak ) > 0 )
+		{
+			m_nNewestBreak = nSerial;
+			m_bHasBreak = true;
+		}
+	}
+
+	// Is there a break anywhere between the newest record and record i?
+	bool HasBreakSince( int i ) const
+	{
+		return m_bHasBreak && (int)( m_nNewestBreak - ( m_nHeadSerial - i ) ) >= 0;
+	}
+
+	// Returns the newest record at or before the target time, or the oldest record if they're all newer
+	int FindRecord( float flTargetTime )
+	{
+		int lo = 0;
+		int hi = m_nCount - 1;
+		while ( lo < hi )
+		{
+			int mid = ( lo + hi ) / 2;
+			if ( Element( mid ).m_flSimulationTime <= flTargetTime )
+			{
+				hi = mid;
+			}
+			else
+			{
+				lo = mid + 1;
+			}
+		}
+		return lo;
+	}
+
+	// How far the recorded origins stray from the newest one, for culling
+	float					m_flHistoryRadius;
+
+private:
+	LagRecord				*m_pRecords;
+	int						m_nMask;
+	int						m_nHead;
+	int						m_nCount;
+
+	unsigned int			m_nHeadSerial;
+	unsigned int			m_nNewestBreak;
+	bool					m_bHasBreak;
+};
+
+
+//-----------------------------------------------------------------------------
+// Purpose: History and scratchpad for a lag compensated NPC
+//-----------------------------------------------------------------------------
+struct NPCLagTrack_t
+{
+	EHANDLE					m_hNPC;
+	CLagRecordTrack			*m_pTrack;
+	bool					m_bSeen;
+
+	LagRecord				m_RestoreData;
+	LagRecord				m_ChangeData;
+};
+
+ConVar sv_unlag_npcs( "sv_unlag_npcs", "1", FCVAR_DEVELOPMENTONLY, "Enables NPC lag compensation" );
+
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 //-----------------------------------------------------------------------------
@@ -177,12 +324,12 @@ public:
 	// IServerSystem stuff
 	virtual void Shutdown()
 	{
-		ClearHistory();
+		PurgeHistory();
 	}
 
 	virtual void LevelShutdownPostEntity()
 	{
-		ClearHistory();
+		PurgeHistory();
 	}
 
 	// called after entities think
@@ -195,19 +342,58 @@ public:
 	void			FinishLagCompensation( CBasePlayer *player );
 
 private:
+	void			RecordEntity( CBaseAnimatingOverlay *pEntity, CLagRecordTrack *track, float flDeadtime );
+	void			UpdateNPCTracks( float flDeadtime );
+
+	bool			GetBacktrackRecords( CBaseEntity *pEntity, CLagRecordTrack *track, float flTargetTime, LagRecord **ppRecord, LagRecord **ppPrevRecord, float *pFrac );
+	int				ApplyBacktrack( CBaseAnimatingOverlay *pEntity, LagRecord *record, LagRecord *prevRecord, float frac,
+						const Vector &org, const QAngle &ang, const Vector &minsPreScaled, const Vector &maxsPreScaled, LagRecord *restore, LagRecord *change );
+	void			RestoreEntity( CBaseAnimatingOverlay *pEntity, LagRecord *restore, LagRecord *change, bool bPlayer );
+
 	void			BacktrackPlayer( CBasePlayer *player, float flTargetTime );
+	void			BacktrackNPCs( CBasePlayer *player, CUserCmd *cmd, const CBitVec<MAX_EDICTS> *pEntityTransmitBits, float flTargetTime );
+	void			BacktrackNPC( int iTrack, float flTargetTime );
 
 	void ClearHistory()
+	{
+		for ( int i=0; i<MAX_PLAYERS; i++ )
+			m_PlayerTrack[i].RemoveAll();
+
+		RemoveNPCTracks();
+	}
+
+	void PurgeHistory()
 	{
 		for ( int i=0; i<MAX_PLAYERS; i++ )
 			m_PlayerTrack[i].Purge();
+
+		RemoveNPCTracks();
+		m_NPCTracks.Purge();
+		m_NPCTrackIndex.Purge();
+		m_NPCCandidates.Purge();
 	}
 
-	// keep a list of lag records for each player
-	CUtlFixedLinkedList< LagRecord >	m_PlayerTrack[ MAX_PLAYERS ];
+	void RemoveNPCTracks()
+	{
+		for ( int i=0; i<m_NPCTracks.Count(); i++ )
+			delete m_NPCTracks[i].m_pTrack;
+
+		m_NPCTracks.RemoveAll();
+		m_NPCTrackIndex.RemoveAll();
+		m_RestoreNPCs.RemoveAll();
+	}
+
+	// keep a history of lag records for each player
+	CLagRecordTrack			m_PlayerTrack[ MAX_PLAYERS ];
+
+	// and for each NPC, found by entity handle
+	CUtlVector< NPCLagTrack_t >	m_NPCTracks;
+	CUtlHashtable< unsigned int, int > m_NPCTrackIndex;
 
 	// Scratchpad for determining what needs to be restored
 	CBitVec<MAX_PLAYERS>	m_RestorePlayer;
+	CUtlVector< int >		m_RestoreNPCs;
+	CUtlVector< float >		m_NPCCandidates;	// BacktrackNPCs() culling input, x y z radius
 	bool					m_bNeedToRestore;
 	
 	LagRecord				m_RestoreData[ MAX_PLAYERS ];	// player data before we moved him back
@@ -238,14 +424,14 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 	VPROF_BUDGET( "FrameUpdatePostEntityThink", "CLagCompensationManager" );
 
 	// remove all records before that time:
-	int flDeadtime = gpGlobals->curtime - sv_maxunlag.GetFloat();
+	float flDeadtime = gpGlobals->curtime - sv_maxunlag.GetFloat();
 
 	// Iterate all active players
 	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
 	{
 		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
 
-		CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[i-1];
+		CLagRecordTrack *track = &m_PlayerTrack[i-1];
 
 		if ( !pPlayer )
 		{
@@ -257,66 +443,164 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 			continue;
 		}
 
-		Assert( track->Count() < 1000 ); // insanity check
+		RecordEntity( pPlayer, track, flDeadtime );
+	}
+
+	UpdateNPCTracks( flDeadtime );
+
+	//Clear the current player.
+	m_pCurrentPlayer = NULL;
+}
 
-		// remove tail records that are too old
-		int tailIndex = track->Tail();
-		while ( track->IsValidIndex( tailIndex ) )
+//-----------------------------------------------------------------------------
+// Purpose: Drops expired records and adds one for the entity's current state
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::RecordEntity( CBaseAnimatingOverlay *pEntity, CLagRecordTrack *track, float flDeadtime )
+{
+	// remove tail records that are too old
+	while ( track->Count() > 0 )
+	{
+		LagRecord &tail = track->Element( track->Count() - 1 );
+
+		// if tail is within limits, stop
+		if ( tail.m_flSimulationTime >= flDeadtime )
+			break;
+		
+		// remove tail, get new tail
+		track->RemoveTail();
+	}
+
+	// check if head has same simulation time
+	if ( track->Count() > 0 )
+	{
+		LagRecord &head = track->Element( 0 );
+
+		// check if entity changed simulation time since last time updated
+		if ( head.m_flSimulationTime >= pEntity->GetSimulationTime() )
+			return; // don't add new entry for same or older time
+	}
+
+	// add new record to entity track
+	LagRecord &record = track->AddToHead();
+
+	record.m_fFlags = 0;
+	if ( pEntity->IsAlive() )
+	{
+		record.m_fFlags |= LC_ALIVE;
+	}
+
+	record.m_flSimulationTime	= pEntity->GetSimulationTime();
+	record.m_vecAngles			= pEntity->GetLocalAngles();
+	record.m_vecOrigin			= pEntity->GetLocalOrigin();
+	record.m_vecMinsPreScaled	= pEntity->CollisionProp()->OBBMinsPreScaled();
+	record.m_vecMaxsPreScaled	= pEntity->CollisionProp()->OBBMaxsPreScaled();
+
+	int layerCount = pEntity->GetNumAnimOverlays();
+	for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
+	{
+		CAnimationLayer *currentLayer = pEntity->GetAnimOverlay(layerIndex);
+		if( currentLayer )
 		{
-			LagRecord &tail = track->Element( tailIndex );
-
-			// if tail is within limits, stop
-			if ( tail.m_flSimulationTime >= flDeadtime )
-				break;
-			
-			// remove tail, get new tail
-			track->Remove( tailIndex );
-			tailIndex = track->Tail();
+			record.m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
+			record.m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
+			record.m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
+			record.m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
 		}
+	}
+	record.m_masterSequence = pEntity->GetSequence();
+	record.m_masterCycle = pEntity->GetCycle();
 
-		// check if head has same simulation time
-		if ( track->Count() > 0 )
-		{
-			LagRecord &head = track->Element( track->Head() );
+	// Remember where backtracking will lose track, so lookups don't have to walk the history
+	if ( !( record.m_fFlags & LC_ALIVE ) )
+	{
+		// entity must be alive
+		track->MarkBreak( 0 );
+	}
 
-			// check if player changed simulation time since last time updated
-			if ( head.m_flSimulationTime >= pPlayer->GetSimulationTime() )
-				continue; // don't add new entry for same or older time
+	if ( track->Count() > 1 )
+	{
+		Vector delta = track->Element( 1 ).m_vecOrigin - record.m_vecOrigin;
+		if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
+		{
+			// too much difference to backtrack past the new record
+			track->MarkBreak( 1 );
 		}
+	}
 
-		// add new record to player track
-		LagRecord &record = track->Element( track->AddToHead() );
+	// farthest the entity has been from here within the history, one sqrt for the lot
+	float flMaxDistSqr = 0.0f;
+	for ( int i = 1; i < track->Count(); i++ )
+	{
+		flMaxDistSqr = MAX( flMaxDistSqr, track->Element( i ).m_vecOrigin.DistToSqr( record.m_vecOrigin ) );
+	}
+	track->m_flHistoryRadius = FastSqrt( flMaxDistSqr );
+}
 
-		record.m_fFlags = 0;
-		if ( pPlayer->IsAlive() )
+//-----------------------------------------------------------------------------
+// Purpose: Records every NPC, adding tracks for new ones and dropping the ones that are gone
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::UpdateNPCTracks( float flDeadtime )
+{
+	if ( !sv_unlag_npcs.GetBool() )
+	{
+		if ( m_NPCTracks.Count() )
 		{
-			record.m_fFlags |= LC_ALIVE;
+			RemoveNPCTracks();
 		}
+		return;
+	}
 
-		record.m_flSimulationTime	= pPlayer->GetSimulationTime();
-		record.m_vecAngles			= pPlayer->GetLocalAngles();
-		record.m_vecOrigin			= pPlayer->GetLocalOrigin();
-		record.m_vecMinsPreScaled	= pPlayer->CollisionProp()->OBBMinsPreScaled();
-		record.m_vecMaxsPreScaled	= pPlayer->CollisionProp()->OBBMaxsPreScaled();
+	for ( int i = 0; i < m_NPCTracks.Count(); i++ )
+	{
+		m_NPCTracks[i].m_bSeen = false;
+	}
 
-		int layerCount = pPlayer->GetNumAnimOverlays();
-		for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
+	CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
+	for ( int i = 0; i < g_AI_Manager.NumAIs(); i++ )
+	{
+		CAI_BaseNPC *pNPC = ppAIs[i];
+		if ( !pNPC || pNPC->IsMarkedForDeletion() )
+			continue;
+
+		unsigned int hNPC = pNPC->GetRefEHandle().ToInt();
+		int iTrack;
+		UtlHashHandle_t h = m_NPCTrackIndex.Find( hNPC );
+		if ( h != m_NPCTrackIndex.InvalidHandle() )
 		{
-			CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
-			if( currentLayer )
-			{
-				record.m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
-				record.m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
-				record.m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
-				record.m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
-			}
+			iTrack = m_NPCTrackIndex[h];
+		}
+		else
+		{
+			iTrack = m_NPCTracks.AddToTail();
+			m_NPCTracks[iTrack].m_hNPC = pNPC;
+			m_NPCTracks[iTrack].m_pTrack = new CLagRecordTrack;
+			m_NPCTrackIndex.Insert( hNPC, iTrack );
 		}
-		record.m_masterSequence = pPlayer->GetSequence();
-		record.m_masterCycle = pPlayer->GetCycle();
+
+		m_NPCTracks[iTrack].m_bSeen = true;
+		RecordEntity( pNPC, m_NPCTracks[iTrack].m_pTrack, flDeadtime );
 	}
 
-	//Clear the current player.
-	m_pCurrentPlayer = NULL;
+	// Drop the tracks of NPCs that have been removed
+	bool bRemoved = false;
+	for ( int i = m_NPCTracks.Count(); --i >= 0; )
+	{
+		if ( m_NPCTracks[i].m_bSeen )
+			continue;
+
+		delete m_NPCTracks[i].m_pTrack;
+		m_NPCTracks.FastRemove( i );
+		bRemoved = true;
+	}
+
+	if ( bRemoved )
+	{
+		m_NPCTrackIndex.RemoveAll();
+		for ( int i = 0; i < m_NPCTracks.Count(); i++ )
+		{
+			m_NPCTrackIndex.Insert( m_NPCTracks[i].m_hNPC.ToInt(), i );
+		}
+	}
 }
 
 // Called during player movement to set up/restore after lag compensation
@@ -333,6 +617,7 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 
 	// Assume no players need to be restored
 	m_RestorePlayer.ClearAll();
+	m_RestoreNPCs.RemoveAll();
 	m_bNeedToRestore = false;
 
 	m_pCurrentPlayer = player;
@@ -409,75 +694,40 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		// Move other player back in time
 		BacktrackPlayer( pPlayer, TICKS_TO_TIME( targettick ) );
 	}
+
+	if ( m_NPCTracks.Count() )
+	{
+		BacktrackNPCs( player, cmd, pEntityTransmitBits, TICKS_TO_TIME( targettick ) );
+	}
 }
 
-void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
+//-----------------------------------------------------------------------------
+// Purpose: Finds the records either side of the target time. Returns false if
+//			the entity can't be backtracked that far.
+//-----------------------------------------------------------------------------
+bool CLagCompensationManager::GetBacktrackRecords( CBaseEntity *pEntity, CLagRecordTrack *track, float flTargetTime, LagRecord **ppRecord, LagRecord **ppPrevRecord, float *pFrac )
 {
-	Vector org;
-	Vector minsPreScaled;
-	Vector maxsPreScaled;
-	QAngle ang;
-
-	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
-	int pl_index = pPlayer->entindex() - 1;
-
-	// get track history of this player
-	CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[ pl_index ];
-
 	// check if we have at leat one entry
 	if ( track->Count() <= 0 )
-		return;
+		return false;
 
-	int curr = track->Head();
-
-	LagRecord *prevRecord = NULL;
-	LagRecord *record = NULL;
-
-	Vector prevOrg = pPlayer->GetLocalOrigin();
-	
-	// Walk context looking for any invalidating event
-	while( track->IsValidIndex(curr) )
+	// The newest record must follow on from where the entity is now
+	Vector delta = track->Element( 0 ).m_vecOrigin - pEntity->GetLocalOrigin();
+	if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
 	{
-		// remember last record
-		prevRecord = record;
-
-		// get next record
-		record = &track->Element( curr );
-
-		if ( !(record->m_fFlags & LC_ALIVE) )
-		{
-			// player most be alive, lost track
-			return;
-		}
-
-		Vector delta = record->m_vecOrigin - prevOrg;
-		if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
-		{
-			// lost track, too much difference
-			return; 
-		}
-
-		// did we find a context smaller than target time ?
-		if ( record->m_flSimulationTime <= flTargetTime )
-			break; // hurra, stop
-
-		prevOrg = record->m_vecOrigin;
-
-		// go one step back
-		curr = track->Next( curr );
+		// lost track, too much difference
+		return false;
 	}
 
-	Assert( record );
+	// find the newest record at or before the target time
+	int iRecord = track->FindRecord( flTargetTime );
 
-	if ( !record )
-	{
-		if ( sv_unlag_debug.GetBool() )
-		{
-			DevMsg( "No valid positions in history for BacktrackPlayer client ( %s )\n", pPlayer->GetPlayerName() );
-		}
+	// and make sure the entity didn't die or teleport anywhere in between
+	if ( track->HasBreakSince( iRecord ) )
+		return false;
 
-		return; // that should never happen
-	}
+	LagRecord *record = &track->Element( iRecord );
+	LagRecord *prevRecord = ( iRecord > 0 ) ? &track->Element( iRecord - 1 ) : NULL;
 
 	float frac = 0.0f;
 	if ( prevRecord && 
@@ -495,7 +745,38 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			( prevRecord->m_flSimulationTime - record->m_flSimulationTime );
 
 		Assert( frac > 0 && frac < 1 ); // should never extrapolate
+	}
+
+	*ppRecord = record;
+	*ppPrevRecord = prevRecord;
+	*pFrac = frac;
+	return true;
+}
 
+void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
+{
+	Vector org;
+	Vector minsPreScaled;
+	Vector maxsPreScaled;
+	QAngle ang;
+
+	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
+	int pl_index = pPlayer->entindex() - 1;
+
+	// get track history of this player
+	CLagRecordTrack *track = &m_PlayerTrack[ pl_index ];
+
+	LagRecord *prevRecord = NULL;
+	LagRecord *record = NULL;
+	float frac = 0.0f;
+
+	if ( !GetBacktrackRecords( pPlayer, track, flTargetTime, &record, &prevRecord, &frac ) )
+		return;
+
+	if ( frac > 0.0f )
+	{
+		// we didn't find the exact time but have a valid previous record
+		// so interpolate between these two records;
 		ang				= Lerp( frac, record->m_vecAngles, prevRecord->m_vecAngles );
 		org				= Lerp( frac, record->m_vecOrigin, prevRecord->m_vecOrigin );
 		minsPreScaled	= Lerp( frac, record->m_vecMinsPreScaled, prevRecord->m_vecMinsPreScaled );
@@ -571,33 +852,173 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	}
 	
 	// See if this represents a change for the player
-	int flags = 0;
 	LagRecord *restore = &m_RestoreData[ pl_index ];
 	LagRecord *change  = &m_ChangeData[ pl_index ];
 
-	QAngle angdiff = pPlayer->GetLocalAngles() - ang;
-	Vector orgdiff = pPlayer->GetLocalOrigin() - org;
+	int flags = ApplyBacktrack( pPlayer, record, prevRecord, frac, org, ang, minsPreScaled, maxsPreScaled, restore, change );
+	if ( !flags )
+		return; // we didn't change anything
+
+	/*char text[256]; Q_snprintf( text, sizeof(text), "time %.2f", flTargetTime );
+	pPlayer->DrawServerHitboxes( 10 );
+	NDebugOverlay::Text( org, text, false, 10 );
+	NDebugOverlay::EntityBounds( pPlayer, 255, 0, 0, 32, 10 ); */
+
+	m_RestorePlayer.Set( pl_index ); //remember that we changed this player
+	m_bNeedToRestore = true;  // we changed at least one player
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Culls the NPCs four at a time against the shooter's view, then
+//			backtracks the ones that could be hit
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::BacktrackNPCs( CBasePlayer *player, CUserCmd *cmd, const CBitVec<MAX_EDICTS> *pEntityTransmitBits, float flTargetTime )
+{
+	VPROF_BUDGET( "BacktrackNPCs", "CLagCompensationManager" );
+
+	int nTracks = m_NPCTracks.Count();
+	int nPadded = ( nTracks + 3 ) & ~3;
+
+	// Gather the candidates as SoA, relative to the shooter's eye. This runs for every
+	// usercmd, so the buffer is kept between calls and only grows with the NPC count.
+	m_NPCCandidates.SetCount( nPadded * 4 );
+	float *pX = m_NPCCandidates.Base();
+	float *pY = pX + nPadded;
+	float *pZ = pY + nPadded;
+	float *pRadius = pZ + nPadded;
+
+	Vector vecEye = player->EyePosition();
+	for ( int i = 0; i < nPadded; i++ )
+	{
+		// Padding and NPCs we can't backtrack never pass the test below
+		pX[i] = pY[i] = pZ[i] = 0.0f;
+		pRadius[i] = -FLT_MAX;
+
+		if ( i >= nTracks )
+			continue;
+
+		CBaseEntity *pNPC = m_NPCTracks[i].m_hNPC;
+		if ( !pNPC || m_NPCTracks[i].m_pTrack->Count() <= 0 )
+			continue;
+
+		// If this entity hasn't been transmitted to us and acked, then don't bother lag compensating it.
+		if ( pEntityTransmitBits && !pEntityTransmitBits->Get( pNPC->entindex() ) )
+			continue;
+
+		Vector vecDelta = pNPC->WorldSpaceCenter() - vecEye;
+		pX[i] = vecDelta.x;
+		pY[i] = vecDelta.y;
+		pZ[i] = vecDelta.z;
+
+		// Same 1.5 slop as the player rule, over however far the NPC has been in the history window
+		pRadius[i] = 1.5f * ( m_NPCTracks[i].m_pTrack->m_flHistoryRadius + pNPC->BoundingRadius() );
+	}
+
+	// Within reach of the shooter, or inside the 45 degree cone in front of them
+	Vector vecForward;
+	AngleVectors( cmd->viewangles, &vecForward );
+
+	fltx4 fwdX = ReplicateX4( vecForward.x );
+	fltx4 fwdY = ReplicateX4( vecForward.y );
+	fltx4 fwdZ = ReplicateX4( vecForward.z );
+	fltx4 cosAngle = ReplicateX4( 0.707107f );
+
+	for ( int i = 0; i < nPadded; i += 4 )
+	{
+		fltx4 x = LoadUnalignedSIMD( pX + i );
+		fltx4 y = LoadUnalignedSIMD( pY + i );
+		fltx4 z = LoadUnalignedSIMD( pZ + i );
+		fltx4 radius = LoadUnalignedSIMD( pRadius + i );
+
+		fltx4 dist = SqrtSIMD( MaddSIMD( x, x, MaddSIMD( y, y, MulSIMD( z, z ) ) ) );
+		fltx4 dot = MaddSIMD( x, fwdX, MaddSIMD( y, fwdY, MulSIMD( z, fwdZ ) ) );
+
+		fltx4 inReach = CmpLtSIMD( dist, radius );
+		fltx4 inCone = CmpGeSIMD( dot, SubSIMD( MulSIMD( dist, cosAngle ), radius ) );
+
+		int nMask = TestSignSIMD( OrSIMD( inReach, inCone ) );
+		for ( int j = 0; nMask; j++, nMask >>= 1 )
+		{
+			if ( nMask & 1 )
+			{
+				BacktrackNPC( i + j, flTargetTime );
+			}
+		}
+	}
+}
+
+void CLagCompensationManager::BacktrackNPC( int iTrack, float flTargetTime )
+{
+	NPCLagTrack_t &npcTrack = m_NPCTracks[ iTrack ];
+	CAI_BaseNPC *pNPC = assert_cast< CAI_BaseNPC * >( npcTrack.m_hNPC.Get() );
+
+	LagRecord *prevRecord = NULL;
+	LagRecord *record = NULL;
+	float frac = 0.0f;
+
+	if ( !GetBacktrackRecords( pNPC, npcTrack.m_pTrack, flTargetTime, &record, &prevRecord, &frac ) )
+		return;
+
+	Vector org, minsPreScaled, maxsPreScaled;
+	QAngle ang;
+	if ( frac > 0.0f )
+	{
+		ang				= Lerp( frac, record->m_vecAngles, prevRecord->m_vecAngles );
+		org				= Lerp( frac, record->m_vecOrigin, prevRecord->m_vecOrigin );
+		minsPreScaled	= Lerp( frac, record->m_vecMinsPreScaled, prevRecord->m_vecMinsPreScaled );
+		maxsPreScaled	= Lerp( frac, record->m_vecMaxsPreScaled, prevRecord->m_vecMaxsPreScaled );
+	}
+	else
+	{
+		org				= record->m_vecOrigin;
+		ang				= record->m_vecAngles;
+		minsPreScaled	= record->m_vecMinsPreScaled;
+		maxsPreScaled	= record->m_vecMaxsPreScaled;
+	}
+
+	memset( &npcTrack.m_RestoreData, 0, sizeof( npcTrack.m_RestoreData ) );
+	memset( &npcTrack.m_ChangeData, 0, sizeof( npcTrack.m_ChangeData ) );
+
+	int flags = ApplyBacktrack( pNPC, record, prevRecord, frac, org, ang, minsPreScaled, maxsPreScaled, &npcTrack.m_RestoreData, &npcTrack.m_ChangeData );
+	if ( !flags )
+		return;
+
+	m_RestoreNPCs.AddToTail( iTrack );
+	m_bNeedToRestore = true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Moves the entity to the backtracked state, remembering what it was
+//			in restore and what we set in change. Returns the LC_ flags changed.
+//-----------------------------------------------------------------------------
+int CLagCompensationManager::ApplyBacktrack( CBaseAnimatingOverlay *pEntity, LagRecord *record, LagRecord *prevRecord, float frac,
+	const Vector &org, const QAngle &ang, const Vector &minsPreScaled, const Vector &maxsPreScaled, LagRecord *restore, LagRecord *change )
+{
+	int flags = 0;
+
+	QAngle angdiff = pEntity->GetLocalAngles() - ang;
+	Vector orgdiff = pEntity->GetLocalOrigin() - org;
 
 	// Always remember the pristine simulation time in case we need to restore it.
-	restore->m_flSimulationTime = pPlayer->GetSimulationTime();
+	restore->m_flSimulationTime = pEntity->GetSimulationTime();
 
 	if ( angdiff.LengthSqr() > LAG_COMPENSATION_EPS_SQR )
 	{
 		flags |= LC_ANGLES_CHANGED;
-		restore->m_vecAngles = pPlayer->GetLocalAngles();
-		pPlayer->SetLocalAngles( ang );
+		restore->m_vecAngles = pEntity->GetLocalAngles();
+		pEntity->SetLocalAngles( ang );
 		change->m_vecAngles = ang;
 	}
 
 	// Use absolute equality here
-	if ( minsPreScaled != pPlayer->CollisionProp()->OBBMinsPreScaled() || maxsPreScaled != pPlayer->CollisionProp()->OBBMaxsPreScaled() )
+	if ( minsPreScaled != pEntity->CollisionProp()->OBBMinsPreScaled() || maxsPreScaled != pEntity->CollisionProp()->OBBMaxsPreScaled() )
 	{
 		flags |= LC_SIZE_CHANGED;
 
-		restore->m_vecMinsPreScaled = pPlayer->CollisionProp()->OBBMinsPreScaled();
-		restore->m_vecMaxsPreScaled = pPlayer->CollisionProp()->OBBMaxsPreScaled();
+		restore->m_vecMinsPreScaled = pEntity->CollisionProp()->OBBMinsPreScaled();
+		restore->m_vecMaxsPreScaled = pEntity->CollisionProp()->OBBMaxsPreScaled();
 		
-		pPlayer->SetSize( minsPreScaled, maxsPreScaled );
+		pEntity->SetSize( minsPreScaled, maxsPreScaled );
 		
 		change->m_vecMinsPreScaled = minsPreScaled;
 		change->m_vecMaxsPreScaled = maxsPreScaled;
@@ -607,8 +1028,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	if ( orgdiff.LengthSqr() > LAG_COMPENSATION_EPS_SQR )
 	{
 		flags |= LC_ORIGIN_CHANGED;
-		restore->m_vecOrigin = pPlayer->GetLocalOrigin();
-		pPlayer->SetLocalOrigin( org );
+		restore->m_vecOrigin = pEntity->GetLocalOrigin();
+		pEntity->SetLocalOrigin( org );
 		change->m_vecOrigin = org;
 	}
 
@@ -616,8 +1037,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	// standing still, but you breathe even on the server.
 	// This is quicker than actually comparing all bazillion floats.
 	flags |= LC_ANIMATION_CHANGED;
-	restore->m_masterSequence = pPlayer->GetSequence();
-	restore->m_masterCycle = pPlayer->GetCycle();
+	restore->m_masterSequence = pEntity->GetSequence();
+	restore->m_masterCycle = pEntity->GetCycle();
 
 	bool interpolationAllowed = false;
 	if( prevRecord && (record->m_masterSequence == prevRecord->m_masterSequence) )
@@ -632,33 +1053,33 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	if( frac > 0.0f && interpolationAllowed )
 	{
 		interpolatedMasters = true;
-		pPlayer->SetSequence( Lerp( frac, record->m_masterSequence, prevRecord->m_masterSequence ) );
-		pPlayer->SetCycle( Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle ) );
+		pEntity->SetSequence( Lerp( frac, record->m_masterSequence, prevRecord->m_masterSequence ) );
+		pEntity->SetCycle( Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle ) );
 
 		if( record->m_masterCycle > prevRecord->m_masterCycle )
 		{
 			// the older record is higher in frame than the newer, it must have wrapped around from 1 back to 0
 			// add one to the newer so it is lerping from .9 to 1.1 instead of .9 to .1, for example.
 			float newCycle = Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle + 1 );
-			pPlayer->SetCycle(newCycle < 1 ? newCycle : newCycle - 1 );// and make sure .9 to 1.2 does not end up 1.05
+			pEntity->SetCycle(newCycle < 1 ? newCycle : newCycle - 1 );// and make sure .9 to 1.2 does not end up 1.05
 		}
 		else
 		{
-			pPlayer->SetCycle( Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle ) );
+			pEntity->SetCycle( Lerp( frac, record->m_masterCycle, prevRecord->m_masterCycle ) );
 		}
 	}
 	if( !interpolatedMasters )
 	{
-		pPlayer->SetSequence(record->m_masterSequence);
-		pPlayer->SetCycle(record->m_masterCycle);
+		pEntity->SetSequence(record->m_masterSequence);
+		pEntity->SetCycle(record->m_masterCycle);
 	}
 
 	////////////////////////
 	// Now do all the layers
-	int layerCount = pPlayer->GetNumAnimOverlays();
+	int layerCount = pEntity->GetNumAnimOverlays();
 	for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
 	{
-		CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
+		CAnimationLayer *currentLayer = pEntity->GetAnimOverlay(layerIndex);
 		if( currentLayer )
 		{
 			restore->m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
@@ -705,25 +1126,20 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	}
 	
 	if ( !flags )
-		return; // we didn't change anything
+		return 0; // we didn't change anything
 
 	if ( sv_lagflushbonecache.GetBool() )
-		pPlayer->InvalidateBoneCache();
+		pEntity->InvalidateBoneCache();
 
-	/*char text[256]; Q_snprintf( text, sizeof(text), "time %.2f", flTargetTime );
-	pPlayer->DrawServerHitboxes( 10 );
-	NDebugOverlay::Text( org, text, false, 10 );
-	NDebugOverlay::EntityBounds( pPlayer, 255, 0, 0, 32, 10 ); */
-
-	m_RestorePlayer.Set( pl_index ); //remember that we changed this player
-	m_bNeedToRestore = true;  // we changed at least one player
 	restore->m_fFlags = flags; // we need to restore these flags
 	change->m_fFlags = flags; // we have changed these flags
 
 	if( sv_showlagcompensation.GetInt() == 1 )
 	{
-		pPlayer->DrawServerHitboxes(4, true);
+		pEntity->DrawServerHitboxes(4, true);
 	}
+
+	return flags;
 }
 
 
@@ -753,80 +1169,109 @@ void CLagCompensationManager::FinishLagCompensation( CBasePlayer *player )
 			continue;
 		}
 
-		LagRecord *restore = &m_RestoreData[ pl_index ];
-		LagRecord *change  = &m_ChangeData[ pl_index ];
+		RestoreEntity( pPlayer, &m_RestoreData[ pl_index ], &m_ChangeData[ pl_index ], true );
+	}
 
-		bool restoreSimulationTime = false;
+	for ( int i = 0; i < m_RestoreNPCs.Count(); i++ )
+	{
+		NPCLagTrack_t &npcTrack = m_NPCTracks[ m_RestoreNPCs[i] ];
 
-		if ( restore->m_fFlags & LC_SIZE_CHANGED )
+		CAI_BaseNPC *pNPC = assert_cast< CAI_BaseNPC * >( npcTrack.m_hNPC.Get() );
+		if ( !pNPC )
 		{
-			restoreSimulationTime = true;
-	
-			// see if simulation made any changes, if no, then do the restore, otherwise,
-			//  leave new values in
-			if ( pPlayer->CollisionProp()->OBBMinsPreScaled() == change->m_vecMinsPreScaled &&
-				pPlayer->CollisionProp()->OBBMaxsPreScaled() == change->m_vecMaxsPreScaled )
-			{
-				// Restore it
-				pPlayer->SetSize( restore->m_vecMinsPreScaled, restore->m_vecMaxsPreScaled );
-			}
-#ifdef STAGING_ONLY
-			else
-			{
-				Warning( "Should we really not restore the size?\n" );
-			}
-#endif
+			continue;
 		}
 
-		if ( restore->m_fFlags & LC_ANGLES_CHANGED )
-		{		   
-			restoreSimulationTime = true;
+		RestoreEntity( pNPC, &npcTrack.m_RestoreData, &npcTrack.m_ChangeData, false );
+	}
 
-			if ( pPlayer->GetLocalAngles() == change->m_vecAngles )
-			{
-				pPlayer->SetLocalAngles( restore->m_vecAngles );
-			}
+	m_RestoreNPCs.RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Puts back whatever ApplyBacktrack changed, unless the simulation
+//			since has changed it again
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::RestoreEntity( CBaseAnimatingOverlay *pEntity, LagRecord *restore, LagRecord *change, bool bPlayer )
+{
+	bool restoreSimulationTime = false;
+
+	if ( restore->m_fFlags & LC_SIZE_CHANGED )
+	{
+		restoreSimulationTime = true;
+
+		// see if simulation made any changes, if no, then do the restore, otherwise,
+		//  leave new values in
+		if ( pEntity->CollisionProp()->OBBMinsPreScaled() == change->m_vecMinsPreScaled &&
+			pEntity->CollisionProp()->OBBMaxsPreScaled() == change->m_vecMaxsPreScaled )
+		{
+			// Restore it
+			pEntity->SetSize( restore->m_vecMinsPreScaled, restore->m_vecMaxsPreScaled );
 		}
+#ifdef STAGING_ONLY
+		else
+		{
+			Warning( "Should we really not restore the size?\n" );
+		}
+#endif
+	}
+
+	if ( restore->m_fFlags & LC_ANGLES_CHANGED )
+	{		   
+		restoreSimulationTime = true;
 
-		if ( restore->m_fFlags & LC_ORIGIN_CHANGED )
+		if ( pEntity->GetLocalAngles() == change->m_vecAngles )
 		{
-			restoreSimulationTime = true;
+			pEntity->SetLocalAngles( restore->m_vecAngles );
+		}
+	}
+
+	if ( restore->m_fFlags & LC_ORIGIN_CHANGED )
+	{
+		restoreSimulationTime = true;
 
-			// Okay, let's see if we can do something reasonable with the change
-			Vector delta = pPlayer->GetLocalOrigin() - change->m_vecOrigin;
-			
-			// If it moved really far, just leave the player in the new spot!!!
-			if ( delta.Length2DSqr() < m_flTeleportDistanceSqr )
+		// Okay, let's see if we can do something reasonable with the change
+		Vector delta = pEntity->GetLocalOrigin() - change->m_vecOrigin;
+		
+		// If it moved really far, just leave the entity in the new spot!!!
+		if ( delta.Length2DSqr() < m_flTeleportDistanceSqr )
+		{
+			if ( bPlayer )
 			{
-				RestorePlayerTo( pPlayer, restore->m_vecOrigin + delta );
+				RestorePlayerTo( static_cast< CBasePlayer * >( pEntity ), restore->m_vecOrigin + delta );
+			}
+			else
+			{
+				// NPCs aren't moved by the shooter's usercmd, so there's nothing in the way to trace for
+				pEntity->SetLocalOrigin( restore->m_vecOrigin + delta );
 			}
 		}
+	}
 
-		if( restore->m_fFlags & LC_ANIMATION_CHANGED )
-		{
-			restoreSimulationTime = true;
+	if( restore->m_fFlags & LC_ANIMATION_CHANGED )
+	{
+		restoreSimulationTime = true;
 
-			pPlayer->SetSequence(restore->m_masterSequence);
-			pPlayer->SetCycle(restore->m_masterCycle);
+		pEntity->SetSequence(restore->m_masterSequence);
+		pEntity->SetCycle(restore->m_masterCycle);
 
-			int layerCount = pPlayer->GetNumAnimOverlays();
-			for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
+		int layerCount = pEntity->GetNumAnimOverlays();
+		for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
+		{
+			CAnimationLayer *currentLayer = pEntity->GetAnimOverlay(layerIndex);
+			if( currentLayer )
 			{
-				CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
-				if( currentLayer )
-				{
-					currentLayer->m_flCycle = restore->m_layerRecords[layerIndex].m_cycle;
-					currentLayer->m_nOrder = restore->m_layerRecords[layerIndex].m_order;
-					currentLayer->m_nSequence = restore->m_layerRecords[layerIndex].m_sequence;
-					currentLayer->m_flWeight = restore->m_layerRecords[layerIndex].m_weight;
-				}
+				currentLayer->m_flCycle = restore->m_layerRecords[layerIndex].m_cycle;
+				currentLayer->m_nOrder = restore->m_layerRecords[layerIndex].m_order;
+				currentLayer->m_nSequence = restore->m_layerRecords[layerIndex].m_sequence;
+				currentLayer->m_flWeight = restore->m_layerRecords[layerIndex].m_weight;
 			}
 		}
+	}
 
-		if ( restoreSimulationTime )
-		{
-			pPlayer->SetSimulationTime( restore->m_flSimulationTime );
-		}
+	if ( restoreSimulationTime )
+	{
+		pEntity->SetSimulationTime( restore->m_flSimulationTime );
 	}
 }
 
@@ -9,6 +9,7 @@
 #include "soundent.h"
 #include "game.h"
 #include "world.h"
+#include "isaverestore.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -21,6 +22,13 @@
 #define SOUNDLISTTYPE_FREE		1
 #define SOUNDLISTTYPE_ACTIVE	2
 
+// Sound spatial index. A sound whose audible radius spans more cells than
+// SOUND_GRID_MAX_CELLS goes on the unbounded list instead.
+#define SOUND_GRID_CELL_SIZE	1024.0f
+#define SOUND_GRID_MAX_CELLS	36
+
+ConVar ai_sound_pool_size( "ai_sound_pool_size", "256", 0, "Number of AI sounds the world can track at once (takes effect on map load)", true, MAX_WORLD_SOUNDS_SP, true, MAX_WORLD_SOUNDS );
+ConVar ai_sound_spatial_index( "ai_sound_spatial_index", "1", 0, "Use a spatial index of active AI sounds when NPCs listen (0 = test every active sound)" );
 
 
 LINK_ENTITY_TO_CLASS( soundent, CSoundEnt );
@@ -188,7 +196,14 @@ BEGIN_DATADESC( CSoundEnt )
 	DEFINE_FIELD( m_iFreeSound,			FIELD_INTEGER ),
 	DEFINE_FIELD( m_iActiveSound,		FIELD_INTEGER ),
 	DEFINE_FIELD( m_cLastActiveSounds,	FIELD_INTEGER ),
-	DEFINE_EMBEDDED_ARRAY( m_SoundPool, MAX_WORLD_SOUNDS_SP ),
+	DEFINE_FIELD( m_nSoundPoolSize,		FIELD_INTEGER ),
+	DEFINE_EMBEDDED_ARRAY( m_SoundPool, MAX_WORLD_SOUNDS_SP ),	// Entries past MAX_WORLD_SOUNDS_SP are written by Save()
+	//								m_bSoundGridDirty	(not saved, rebuilt)
+	//								m_iSoundGridTick
+	//								m_SoundGridStart
+	//								m_SoundGridEntries
+	//								m_SoundGridUnbounded
+	//								m_SoundRank
 
 END_DATADESC()
 
@@ -224,6 +239,9 @@ void CSoundEnt::ShutdownSoundEnt()
 //-----------------------------------------------------------------------------
 CSoundEnt::CSoundEnt()
 {
+	m_nSoundPoolSize = MAX_WORLD_SOUNDS_SP;
+	m_bSoundGridDirty = true;
+	m_iSoundGridTick = -1;
 }
 
 CSoundEnt::~CSoundEnt()
@@ -242,6 +260,45 @@ void CSoundEnt::Spawn( void )
 	SetNextThink( gpGlobals->curtime + 1 );
 }
 
+//-----------------------------------------------------------------------------
+// The datadesc only covers the first MAX_WORLD_SOUNDS_SP entries of the pool so
+// older save games still load; any entries past that follow the entity data.
+//-----------------------------------------------------------------------------
+int CSoundEnt::Save( ISave &save )
+{
+	if ( !BaseClass::Save( save ) )
+		return 0;
+
+	for ( int i = MAX_WORLD_SOUNDS_SP; i < m_nSoundPoolSize; i++ )
+	{
+		save.WriteAll( &m_SoundPool[ i ], &CSound::m_DataMap );
+	}
+
+	return 1;
+}
+
+int CSoundEnt::Restore( IRestore &restore )
+{
+	// Save games from before the pool was resizable don't have a pool size
+	m_nSoundPoolSize = 0;
+
+	if ( !BaseClass::Restore( restore ) )
+		return 0;
+
+	if ( m_nSoundPoolSize < MAX_WORLD_SOUNDS_SP )
+		m_nSoundPoolSize = MAX_WORLD_SOUNDS_SP;
+	else if ( m_nSoundPoolSize > MAX_WORLD_SOUNDS )
+		m_nSoundPoolSize = MAX_WORLD_SOUNDS;
+
+	for ( int i = MAX_WORLD_SOUNDS_SP; i < m_nSoundPoolSize; i++ )
+	{
+		restore.ReadAll( &m_SoundPool[ i ], &CSound::m_DataMap );
+	}
+
+	MarkSoundGridDirty();
+	return 1;
+}
+
 void CSoundEnt::OnRestore()
 {
 	BaseClass::OnRestore();
@@ -385,6 +442,8 @@ void CSoundEnt::FreeSound ( int iSound, int iPrevious )
 	// make iSound the head of the Free list.
 	g_pSoundEnt->m_SoundPool[ iSound ].m_iNext = g_pSoundEnt->m_iFreeSound;
 	g_pSoundEnt->m_iFreeSound = iSound;
+
+	g_pSoundEnt->MarkSoundGridDirty();
 }
 
 //=========================================================
@@ -415,6 +474,8 @@ int CSoundEnt::IAllocSound( void )
 
 	m_iActiveSound = iNewSound;// now make the new sound the top of the active list. You're done.
 
+	MarkSoundGridDirty();
+
 #ifdef DEBUG
 	m_SoundPool[ iNewSound ].m_iMyIndex = iNewSound;
 #endif // DEBUG
@@ -465,6 +526,9 @@ void CSoundEnt::InsertSound ( int iType, const Vector &vecOrigin, int iVolume, f
 	pSound->m_hTarget.Set( pSoundTarget );
 	pSound->m_ownerChannelIndex = soundChannelIndex;
 
+	// Origin and volume may have changed for a reused channel
+	g_pSoundEnt->MarkSoundGridDirty();
+
 	// Keep track of whether this sound had an owner when it was made. If the sound has a long duration,
 	// the owner could disappear by the time someone hears this sound, so we have to look at this boolean
 	// and throw out sounds who have a NULL owner but this field set to true. (sjb) 12/2/2005
@@ -521,11 +585,13 @@ void CSoundEnt::Initialize ( void )
 	m_iFreeSound = 0;
 	m_iActiveSound = SOUNDLIST_EMPTY;
 
-	// In SP, we should only use the first 64 slots so save/load works right.
-	// In MP, have one for each player and 32 extras.
-	int nTotalSoundsInPool = MAX_WORLD_SOUNDS_SP;
+	// In MP, have at least one for each player and 32 extras.
+	int nTotalSoundsInPool = clamp( ai_sound_pool_size.GetInt(), (int)MAX_WORLD_SOUNDS_SP, (int)MAX_WORLD_SOUNDS );
 	if ( gpGlobals->maxClients > 1 )
-		nTotalSoundsInPool = MIN( MAX_WORLD_SOUNDS_MP, gpGlobals->maxClients + 32 );
+		nTotalSoundsInPool = MIN( MAX_WORLD_SOUNDS, MAX( nTotalSoundsInPool, gpGlobals->maxClients + 32 ) );
+
+	m_nSoundPoolSize = nTotalSoundsInPool;
+	MarkSoundGridDirty();
 
 	if ( gpGlobals->maxClients+16 > nTotalSoundsInPool )
 	{
@@ -633,7 +699,7 @@ CSound*	CSoundEnt::SoundPointerForIndex( int iIndex )
 		return NULL;
 	}
 
-	if ( iIndex > ( MAX_WORLD_SOUNDS_MP - 1 ) )
+	if ( iIndex > ( MAX_WORLD_SOUNDS - 1 ) )
 	{
 		Msg( "SoundPointerForIndex() - Index too large!\n" );
 		return NULL;
@@ -681,10 +747,12 @@ CSound*	CSoundEnt::GetLoudestSoundOfType( int iType, const Vector &vecEarPositio
 	float flDist;
 	CSound *pSound;
 
-	iThisSound = ActiveList();
+	SoundCandidateList_t candidates;
+	GetAudibleSoundCandidates( vecEarPosition, 1.0f, &candidates );
 
-	while ( iThisSound != SOUNDLIST_EMPTY )
+	for ( int i = 0; i < candidates.Count(); i++ )
 	{
+		iThisSound = candidates[i];
 		pSound = SoundPointerForIndex( iThisSound );
 
 		if ( pSound && pSound->m_iType == iType && pSound->ValidateOwner() )
@@ -702,13 +770,144 @@ CSound*	CSoundEnt::GetLoudestSoundOfType( int iType, const Vector &vecEarPositio
 				flBestDist = flDist;
 			}
 		}
-
-		iThisSound = pSound->m_iNext;
 	}
 
 	return pLoudestSound;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Rebuild the spatial index of the active sound list
+//-----------------------------------------------------------------------------
+struct SoundGridPair_t
+{
+	short iBucket;
+	short iSound;
+};
+
+static inline int SoundGridCellCoord( float f )
+{
+	return (int)floor( f / SOUND_GRID_CELL_SIZE );
+}
+
+static inline int SoundGridBucket( int x, int y )
+{
+	return ( ( x * 73856093 ) ^ ( y * 19349663 ) );
+}
+
+void CSoundEnt::UpdateSoundGrid( void )
+{
+	if ( !m_bSoundGridDirty && m_iSoundGridTick == gpGlobals->tickcount )
+		return;
+
+	m_bSoundGridDirty = false;
+	m_iSoundGridTick = gpGlobals->tickcount;
+
+	m_SoundGridEntries.RemoveAll();
+	m_SoundGridUnbounded.RemoveAll();
+	memset( m_SoundGridStart, 0, sizeof( m_SoundGridStart ) );
+
+	// (bucket, sound) pairs in active list order
+	CUtlVectorFixedGrowable<SoundGridPair_t, 256> pairs;
+
+	bool bucketUsed[ SOUND_GRID_BUCKETS ];
+
+	int iRank = 0;
+	for ( int iSound = m_iActiveSound; iSound != SOUNDLIST_EMPTY; iSound = m_SoundPool[ iSound ].m_iNext )
+	{
+		CSound *pSound = &m_SoundPool[ iSound ];
+		m_SoundRank[ iSound ] = iRank++;
+
+		const Vector &vecOrigin = pSound->GetSoundOrigin();
+		float flRadius = MAX( pSound->Volume(), 0 );
+
+		int xMin = SoundGridCellCoord( vecOrigin.x - flRadius );
+		int xMax = SoundGridCellCoord( vecOrigin.x + flRadius );
+		int yMin = SoundGridCellCoord( vecOrigin.y - flRadius );
+		int yMax = SoundGridCellCoord( vecOrigin.y + flRadius );
+
+		if ( ( xMax - xMin + 1 ) * ( yMax - yMin + 1 ) > SOUND_GRID_MAX_CELLS )
+		{
+			m_SoundGridUnbounded.AddToTail( iSound );
+			continue;
+		}
+
+		// Cells can share a bucket, only add the sound once per bucket
+		memset( bucketUsed, 0, sizeof( bucketUsed ) );
+		for ( int x = xMin; x <= xMax; x++ )
+		{
+			for ( int y = yMin; y <= yMax; y++ )
+			{
+				int iBucket = SoundGridBucket( x, y ) & ( SOUND_GRID_BUCKETS - 1 );
+				if ( bucketUsed[ iBucket ] )
+					continue;
+				bucketUsed[ iBucket ] = true;
+
+				SoundGridPair_t pair = { (short)iBucket, (short)iSound };
+				pairs.AddToTail( pair );
+				m_SoundGridStart[ iBucket + 1 ]++;
+			}
+		}
+	}
+
+	// Stable counting sort keeps each bucket in active list order
+	int i;
+	for ( i = 0; i < SOUND_GRID_BUCKETS; i++ )
+		m_SoundGridStart[ i + 1 ] += m_SoundGridStart[ i ];
+
+	int next[ SOUND_GRID_BUCKETS ];
+	memcpy( next, m_SoundGridStart, sizeof( next ) );
+
+	m_SoundGridEntries.SetCount( pairs.Count() );
+	for ( i = 0; i < pairs.Count(); i++ )
+		m_SoundGridEntries[ next[ pairs[i].iBucket ]++ ] = pairs[i].iSound;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Return the active sounds that may be audible at vecEarPosition
+//			(those whose volume * flHearingSensitivity can reach it), in
+//			active list order so callers see them in the same order as a
+//			walk of ActiveList().
+//-----------------------------------------------------------------------------
+void CSoundEnt::GetAudibleSoundCandidates( const Vector &vecEarPosition, float flHearingSensitivity, SoundCandidateList_t *pResult )
+{
+	if ( !g_pSoundEnt )
+		return;
+
+	// The grid is built for a sensitivity of 1, more sensitive ears hear past it
+	if ( !ai_sound_spatial_index.GetBool() || flHearingSensitivity > 1.0f )
+	{
+		for ( int iSound = g_pSoundEnt->m_iActiveSound; iSound != SOUNDLIST_EMPTY; iSound = g_pSoundEnt->m_SoundPool[ iSound ].m_iNext )
+		{
+			pResult->AddToTail( iSound );
+		}
+		return;
+	}
+
+	g_pSoundEnt->UpdateSoundGrid();
+
+	int iBucket = SoundGridBucket( SoundGridCellCoord( vecEarPosition.x ), SoundGridCellCoord( vecEarPosition.y ) ) & ( SOUND_GRID_BUCKETS - 1 );
+
+	const short *pBucket = g_pSoundEnt->m_SoundGridEntries.Base() + g_pSoundEnt->m_SoundGridStart[ iBucket ];
+	int nBucket = g_pSoundEnt->m_SoundGridStart[ iBucket + 1 ] - g_pSoundEnt->m_SoundGridStart[ iBucket ];
+	const short *pUnbounded = g_pSoundEnt->m_SoundGridUnbounded.Base();
+	int nUnbounded = g_pSoundEnt->m_SoundGridUnbounded.Count();
+	const short *pRank = g_pSoundEnt->m_SoundRank;
+
+	// Merge the two lists, both are already in active list order
+	int i = 0, j = 0;
+	while ( i < nBucket || j < nUnbounded )
+	{
+		if ( j >= nUnbounded || ( i < nBucket && pRank[ pBucket[i] ] < pRank[ pUnbounded[j] ] ) )
+		{
+			pResult->AddToTail( pBucket[i++] );
+		}
+		else
+		{
+			pResult->AddToTail( pUnbounded[j++] );
+		}
+	}
+}
+
 
 //-----------------------------------------------------------------------------
 // Purpose: Inserts an AI sound into the world sound list.
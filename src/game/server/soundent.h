@@ -21,7 +21,9 @@ enum
 	MAX_WORLD_SOUNDS_SP	= 64,	// Maximum number of sounds handled by the world at one time in single player.
 	// This is also the number of entries saved in a savegame file (for b/w compatibility).
 
-	MAX_WORLD_SOUNDS_MP	= 128	// The sound array size is set this large but we'll only use gpGlobals->maxPlayers+32 entries in mp.
+	MAX_WORLD_SOUNDS_MP	= 128,	// In mp we'll use at least gpGlobals->maxPlayers+32 entries.
+
+	MAX_WORLD_SOUNDS	= 512	// The sound array size is set this large; ai_sound_pool_size picks how many entries are used.
 };
 
 enum
@@ -205,6 +207,9 @@ inline bool CSound::ValidateOwner( void ) const
 	return ( !m_bHasOwner || (m_hOwner.Get() != NULL) );
 }
 
+// GetAudibleSoundCandidates() results live on the caller's stack unless there are a lot of them
+typedef CUtlVectorFixedGrowable<int, 64> SoundCandidateList_t;
+
 //=========================================================
 // CSoundEnt - a single instance of this entity spawns when
 // the world spawns. The SoundEnt's job is to update the 
@@ -231,12 +236,16 @@ public:
 	void Initialize ( void );
 	int ObjectCaps( void ) { return BaseClass::ObjectCaps() & ~FCAP_ACROSS_TRANSITION; }
 
+	virtual int	Save( ISave &save );
+	virtual int	Restore( IRestore &restore );
+
 	static void		InsertSound ( int iType, const Vector &vecOrigin, int iVolume, float flDuration, CBaseEntity *pOwner = NULL, int soundChannelIndex = SOUNDENT_CHANNEL_UNSPECIFIED, CBaseEntity *pSoundTarget = NULL );
 	static void		FreeSound ( int iSound, int iPrevious );
 	static int		ActiveList( void );// return the head of the active list
 	static int		FreeList( void );// return the head of the free list
 	static CSound*	SoundPointerForIndex( int iIndex );// return a pointer for this index in the sound list
 	static CSound*	GetLoudestSoundOfType( int iType, const Vector &vecEarPosition );
+	static void		GetAudibleSoundCandidates( const Vector &vecEarPosition, float flHearingSensitivity, SoundCandidateList_t *pResult );// active sounds that may reach this ear, in active list order
 	static int		ClientSoundIndex ( edict_t *pClient );
 
 	bool	IsEmpty( void );
@@ -248,7 +257,27 @@ private:
 	int		m_iFreeSound;	// index of the first sound in the free sound list
 	int		m_iActiveSound; // indes of the first sound in the active sound list
 	int		m_cLastActiveSounds; // keeps track of the number of active sounds at the last update. (for diagnostic work)
-	CSound	m_SoundPool[ MAX_WORLD_SOUNDS_MP ];
+	int		m_nSoundPoolSize;	// number of entries of m_SoundPool in use
+	CSound	m_SoundPool[ MAX_WORLD_SOUNDS ];
+
+	// Spatial index of the active list. Each sound is bucketed into every grid cell
+	// its audible radius reaches, so a listener only tests the sounds in its own cell.
+	// Rebuilt on demand when the active list changes, and once per tick since owners
+	// move their reserved sounds around directly.
+	enum
+	{
+		SOUND_GRID_BUCKETS = 256,	// must be power of 2
+	};
+
+	void	MarkSoundGridDirty() { m_bSoundGridDirty = true; }
+	void	UpdateSoundGrid( void );
+
+	bool	m_bSoundGridDirty;
+	int		m_iSoundGridTick;
+	int		m_SoundGridStart[ SOUND_GRID_BUCKETS + 1 ];
+	CUtlVector<short> m_SoundGridEntries;		// sound indices, sorted by bucket then active list order
+	CUtlVector<short> m_SoundGridUnbounded;		// sounds too loud to bucket, heard everywhere
+	short	m_SoundRank[ MAX_WORLD_SOUNDS ];	// position of each sound in the active list
 };
 
 
@@ -17,8 +17,17 @@
 #include "tier0/memdbgon.h"
 
 //-----------------------------------------------------------------------------
-// Purpose: The actual storage for pooled per-level strings
+// Purpose: The actual storage for pooled per-level strings.
+//			Strings live in an arena of large blocks that is freed in one go at
+//			level shutdown, and are found through an open-addressed table of
+//			(hash, string) slots with linear probing. The hash ignores case so
+//			all spellings of a name share a probe chain, but pooling is still
+//			case-sensitive since string_t identity depends on the exact text.
 //-----------------------------------------------------------------------------
+#define GAMESTRINGPOOL_BLOCK_SIZE	( 64 * 1024 )
+#define GAMESTRINGPOOL_LARGE_STRING	( GAMESTRINGPOOL_BLOCK_SIZE / 16 )
+#define GAMESTRINGPOOL_MIN_SLOTS	4096
+
 #ifdef GC
 class CGameStringPool
 #else
@@ -27,32 +36,128 @@ class CGameStringPool : public CBaseGameSystem
 {
 	virtual char const *Name() { return "CGameStringPool"; }
 	virtual void LevelShutdownPostEntity() { FreeAll(); }
+#ifndef GC
+	virtual void LevelInitPostEntity() { Report(); }
+#endif
+
+	struct Slot_t
+	{
+		unsigned int	m_nHash;
+		const char		*m_pString;		// NULL if the slot is empty
+	};
 
 	void FreeAll()
 	{
-#if 0 && _DEBUG
-		m_Strings.DbgCheckIntegrity();
-		m_KeyLookupCache.DbgCheckIntegrity();
-#endif
-		m_Strings.Purge();
+		m_Slots.Purge();
+		m_nCount = 0;
+
+		for ( int i = 0; i < m_Blocks.Count(); i++ )
+		{
+			delete[] m_Blocks[i];
+		}
+		m_Blocks.Purge();
+		m_pBlockCur = m_pBlockEnd = NULL;
+		m_nArenaUsed = m_nArenaReserved = 0;
+
 		m_KeyLookupCache.Purge();
 	}
 
-	CUtlHashtable<CUtlConstString> m_Strings;
+	static unsigned int HashString( const char *string )
+	{
+		return CaselessStringHashFunctor()( string );
+	}
+
+	// Returns the slot holding the string, or the empty slot where it belongs
+	int FindSlot( const char *string, unsigned int nHash ) const
+	{
+		int nMask = m_Slots.Count() - 1;
+		for ( int i = nHash & nMask; ; i = ( i + 1 ) & nMask )
+		{
+			const Slot_t &slot = m_Slots[i];
+			if ( !slot.m_pString || ( slot.m_nHash == nHash && !V_strcmp( slot.m_pString, string ) ) )
+				return i;
+		}
+	}
+
+	void Grow()
+	{
+		CUtlVector< Slot_t > oldSlots;
+		oldSlots.Swap( m_Slots );
+
+		int nSlots = Max( GAMESTRINGPOOL_MIN_SLOTS, oldSlots.Count() * 2 );
+		m_Slots.SetCount( nSlots );
+		memset( m_Slots.Base(), 0, nSlots * sizeof( Slot_t ) );
+
+		for ( int i = 0; i < oldSlots.Count(); i++ )
+		{
+			if ( oldSlots[i].m_pString )
+			{
+				m_Slots[ FindSlot( oldSlots[i].m_pString, oldSlots[i].m_nHash ) ] = oldSlots[i];
+			}
+		}
+	}
+
+	const char *CopyToArena( const char *string )
+	{
+		int nLen = V_strlen( string ) + 1;
+		if ( nLen > GAMESTRINGPOOL_LARGE_STRING )
+		{
+			// Large strings get an allocation of their own so the current
+			// block keeps filling instead of having its tail thrown away
+			char *pCopy = new char[ nLen ];
+			memcpy( pCopy, string, nLen );
+			m_Blocks.AddToTail( pCopy );
+			m_nArenaReserved += nLen;
+			m_nArenaUsed += nLen;
+			return pCopy;
+		}
+
+		if ( m_pBlockCur + nLen > m_pBlockEnd )
+		{
+			m_pBlockCur = new char[ GAMESTRINGPOOL_BLOCK_SIZE ];
+			m_pBlockEnd = m_pBlockCur + GAMESTRINGPOOL_BLOCK_SIZE;
+			m_Blocks.AddToTail( m_pBlockCur );
+			m_nArenaReserved += GAMESTRINGPOOL_BLOCK_SIZE;
+		}
+
+		char *pCopy = m_pBlockCur;
+		memcpy( pCopy, string, nLen );
+		m_pBlockCur += nLen;
+		m_nArenaUsed += nLen;
+		return pCopy;
+	}
+
+	CUtlVector< Slot_t > m_Slots;		// power of two, kept under 3/4 full
+	int m_nCount;
+
+	CUtlVector< char * > m_Blocks;
+	char *m_pBlockCur;
+	char *m_pBlockEnd;
+	int m_nArenaUsed;
+	int m_nArenaReserved;
+
 	CUtlHashtable<const void*, const char*> m_KeyLookupCache;
 
 public:
 
-	CGameStringPool() : m_Strings(256) { }
+	CGameStringPool()
+	{
+		m_nCount = 0;
+		m_pBlockCur = m_pBlockEnd = NULL;
+		m_nArenaUsed = m_nArenaReserved = 0;
+	}
 
 	~CGameStringPool() { FreeAll(); }
 
 	void Dump( void )
 	{
-		CUtlVector<const char*> strings( 0, m_Strings.Count() );
-		for (UtlHashHandle_t i = m_Strings.FirstHandle(); i != m_Strings.InvalidHandle(); i = m_Strings.NextHandle(i))
+		CUtlVector<const char*> strings( 0, m_nCount );
+		for ( int i = 0; i < m_Slots.Count(); i++ )
 		{
-			strings.AddToTail( strings[i] );
+			if ( m_Slots[i].m_pString )
+			{
+				strings.AddToTail( m_Slots[i].m_pString );
+			}
 		}
 		struct _Local {
 			static int __cdecl F(const char * const *a, const char * const *b) { return strcmp(*a, *b); }
@@ -65,17 +170,54 @@ public:
 		}
 		DevMsg( "\n" );
 		DevMsg( "Size:  %d items\n", strings.Count() );
+		Report();
+	}
+
+	void Report( void )
+	{
+		int nTotalProbes = 0;
+		int nMaxProbes = 0;
+		int nMask = m_Slots.Count() - 1;
+		for ( int i = 0; i < m_Slots.Count(); i++ )
+		{
+			if ( !m_Slots[i].m_pString )
+				continue;
+
+			int nProbes = ( ( i - (int)( m_Slots[i].m_nHash & nMask ) ) & nMask ) + 1;
+			nTotalProbes += nProbes;
+			nMaxProbes = Max( nMaxProbes, nProbes );
+		}
+
+		DevMsg( "Game string pool: %d strings in %d slots (%.0f%% full), probe length avg %.2f max %d, %d/%d bytes of string arena in %d blocks\n",
+			m_nCount, m_Slots.Count(), m_Slots.Count() ? 100.0f * m_nCount / m_Slots.Count() : 0.0f,
+			m_nCount ? (float)nTotalProbes / m_nCount : 0.0f, nMaxProbes,
+			m_nArenaUsed, m_nArenaReserved, m_Blocks.Count() );
 	}
 
 	const char *Find(const char *string)
 	{
-		UtlHashHandle_t i = m_Strings.Find( string );
-		return i == m_Strings.InvalidHandle() ? NULL : m_Strings[ i ].Get();
+		if ( !m_nCount )
+			return NULL;
+
+		return m_Slots[ FindSlot( string, HashString( string ) ) ].m_pString;
 	}
 
 	const char *Allocate(const char *string)
 	{
-		return m_Strings[ m_Strings.Insert( string ) ].Get();
+		if ( ( m_nCount + 1 ) * 4 > m_Slots.Count() * 3 )
+		{
+			Grow();
+		}
+
+		unsigned int nHash = HashString( string );
+		Slot_t &slot = m_Slots[ FindSlot( string, nHash ) ];
+		if ( !slot.m_pString )
+		{
+			slot.m_nHash = nHash;
+			slot.m_pString = CopyToArena( string );
+			m_nCount++;
+		}
+		return slot.m_pString;
 	}
 
 	const char *AllocateWithKey(const char *string, const void* key)
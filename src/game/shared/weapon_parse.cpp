@@ -205,8 +205,9 @@ KeyValues* ReadEncryptedKVFile( IFileSystem *filesystem, const char *szFilenameW
 		pSearchPath = "GAME";
 	}
 
-	// Open the weapon data file, and abort if we can't
-	KeyValues *pKV = new KeyValues( "WeaponDatafile" );
+	// Open the weapon data file, and abort if we can't. Every caller reads the
+	// tree and deletes it right away, so it can live in an arena
+	KeyValues *pKV = KeyValues::CreateArenaRoot( "WeaponDatafile" );
 
 	Q_snprintf(szFullName,sizeof(szFullName), "%s.txt", szFilenameWithoutExtension);
 
@@ -212,30 +212,27 @@ short *CBoneCache::CachedToStudio()
 	return (short *)( (char *)(this+1) + m_cachedToStudioOffset );
 }
 
-// Construct a singleton
-static CDataManager<CBoneCache, bonecacheparams_t, CBoneCache *, CThreadFastMutex> g_StudioBoneCache( 128 * 1024L );
+// Construct a singleton. Sharded so threaded bone setup isn't serialized on one lock and LRU.
+static CShardedDataManager<CBoneCache, bonecacheparams_t, CBoneCache *, CThreadFastMutex> g_StudioBoneCache( 128 * 1024L );
 
 CBoneCache *Studio_GetBoneCache( memhandle_t cacheHandle )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
 	return g_StudioBoneCache.GetResource_NoLock( cacheHandle );
 }
 
 memhandle_t Studio_CreateBoneCache( bonecacheparams_t &params )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
 	return g_StudioBoneCache.CreateResource( params );
 }
 
 void Studio_DestroyBoneCache( memhandle_t cacheHandle )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
 	g_StudioBoneCache.DestroyResource( cacheHandle );
 }
 
 void Studio_InvalidateBoneCache( memhandle_t cacheHandle )
 {
-	AUTO_LOCK( g_StudioBoneCache.AccessMutex() );
+	AUTO_LOCK( g_StudioBoneCache.AccessMutex( cacheHandle ) );
 	CBoneCache *pCache = g_StudioBoneCache.GetResource_NoLock( cacheHandle );
 	if ( pCache )
 	{
@@ -243,6 +240,27 @@ void Studio_InvalidateBoneCache( memhandle_t cacheHandle )
 	}
 }
 
+#ifdef CLIENT_DLL
+CON_COMMAND( cl_bonecache_stats, "Prints bone cache memory use and lock contention since the last call." )
+#else
+bool UTIL_IsCommandIssuedByServerAdmin( void );
+
+CON_COMMAND( sv_bonecache_stats, "Prints bone cache memory use and lock contention since the last call." )
+#endif
+{
+#ifndef CLIENT_DLL
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+#endif
+
+	int nLocks, nContended;
+	g_StudioBoneCache.GetLockStats( nLocks, nContended );
+	g_StudioBoneCache.ResetLockStats();
+
+	Msg( "bone cache: %u / %u bytes, %d shards\n", g_StudioBoneCache.UsedSize(), g_StudioBoneCache.TargetSize(), (int)g_StudioBoneCache.NUM_SHARDS );
+	Msg( "  %d lock acquisitions, %d contended (%.1f%%)\n", nLocks, nContended, nLocks ? 100.0f * nContended / nLocks : 0.0f );
+}
+
 //-----------------------------------------------------------------------------
 // Purpose:
 //-----------------------------------------------------------------------------
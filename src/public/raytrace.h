@@ -41,6 +41,17 @@ public:
 
 };
 
+// 8 rays, traced as one AVX packet by Trace8Rays when the cpu supports it. Rays 0-3 are half[0]
+// and 4-7 are half[1], so a packet can be assembled from (and traced as) two FourRays.
+class EightRays
+{
+public:
+	FourRays half[2];
+
+	// returns direction sign mask for all 8 rays, or -1 if they can not be traced as a bundle.
+	int CalculateDirectionSignMask(void) const;
+};
+
 /// The format a triangle is stored in for intersections. size of this structure is important.
 /// This structure can be in one of two forms. Before the ray tracing environment is set up, the
 /// ProjectedEdgeEquations hold the coordinates of the 3 vertices, for facilitating bounding box
@@ -208,6 +219,11 @@ struct RayTracingResult
 	fltx4 HitDistance;										// distance to intersection
 };
 
+struct EightRayTracingResult
+{
+	RayTracingResult half[2];								// results for EightRays::half[]
+};
+
 
 class RayTraceLight
 {
@@ -220,6 +236,8 @@ public:
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
+#define RTE_FLAGS_EXHAUSTIVE_TREE_GENERATION 8				// build the tree with RefineNode instead
+															// of the binned builder. slow.
 
 enum RayTraceLightingMode_t {
 	DIRECT_LIGHTING,										// just dot product lighting
@@ -264,6 +282,7 @@ public:
 	CUtlVector<CacheOptimizedKDNode> OptimizedKDTree;		//< the packed kdtree. root is 0
 	CUtlBlockVector<CacheOptimizedTriangle> OptimizedTriangleList; //< the packed triangles
 	CUtlVector<int32> TriangleIndexList;					//< the list of triangle indices.
+	CUtlVector<TriIntersectData_t const *> m_IntersectDataList;	//< by triangle index, for trace8.cpp
 	CUtlVector<LightDesc_t> LightList;						//< the list of lights
 	CUtlVector<Vector> TriangleColors;						//< color of tries
 	CUtlVector<int32> TriangleMaterials;					//< material index of tries
@@ -310,6 +329,15 @@ public:
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// trace 8 rays, with per-ray extents. Traces all 8 at once if the cpu supports AVX and the
+	// rays share direction signs, otherwise traces each half with Trace4Rays. There's no
+	// transparent triangle callback; use Trace4Rays when one is needed.
+	void Trace8Rays(const EightRays &rays, const fltx4 TMin[2], const fltx4 TMax[2],
+					EightRayTracingResult *rslt_out, int32 skip_id=-1);
+
+	// true if Trace8Rays can trace all 8 rays at once on this machine
+	static bool CanTrace8Wide(void);
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources(void);
 
@@ -344,6 +372,10 @@ public:
 
 	int MakeLeafNode(int first_tri, int last_tri);
 
+	// AVX implementation of Trace8Rays, in trace8.cpp. rays must share DirectionSignMask.
+	void Trace8RaysAVX(const EightRays &rays, const fltx4 TMin[2], const fltx4 TMax[2],
+					   int DirectionSignMask, EightRayTracingResult *rslt_out, int32 skip_id);
+
 
 	float CalculateCostsOfSplit(
 		int split_plane,int32 const *tri_list,int ntris,
@@ -352,6 +384,9 @@ public:
 		
 	void RefineNode(int node_number,int32 const *tri_list,int ntris,
 						 Vector MinBound,Vector MaxBound, int depth);
+
+	// binned SAH build of the whole tree, with the lower levels built on all threads
+	void BuildBinnedTree(int32 const *tri_list,int ntris);
 	
 	void CalculateTriangleListBounds(int32 const *tris,int ntris,
 									 Vector &minout, Vector &maxout);
@@ -40,6 +40,9 @@ class Color;
 typedef void * FileHandle_t;
 class CKeyValuesGrowableStringTable;
 
+// Compiled sidecar next to a text file; see KeyValues::LoadFromBinaryCache()
+#define KEYVALUES_BINARY_CACHE_EXT	".kvc"
+
 //-----------------------------------------------------------------------------
 // Purpose: Simple recursive data access class
 //			Used in vgui for message parameters and resource files
@@ -129,6 +132,21 @@ public:
 	// Read from a utlbuffer...
 	bool LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBaseFileSystem* pFileSystem = NULL, const char *pPathID = NULL );
 
+	// Creates an empty key whose LoadFromBuffer()/LoadFromFile() places every parsed key and
+	// string in a block arena owned by the root, so the whole tree is released by one deleteThis().
+	// Parents with many children also get a symbol index so FindKey() doesn't walk the list.
+	// Arena trees must not be handed to other modules (their tier1 frees keys one at a time)
+	// and subkeys detached from one must not outlive its root.
+	static KeyValues *CreateArenaRoot( const char *setName, int nSizeHint = 0 );
+	bool IsArenaAllocated() const { return ( m_nArenaFlags & ARENA_NODE ) != 0; }
+
+	// Compiled sidecars. LoadFromFile() reads "<resourceName>" KEYVALUES_BINARY_CACHE_EXT instead of
+	// tokenising the text when it was written from the same text (matching file time, else CRC) with
+	// the same escape sequence setting. -nokvcache on the command line turns the lookup off.
+	static bool CanCompileBinaryCache( const char *pText, int nTextSize );
+	bool WriteBinaryCache( CUtlBuffer &buf, const void *pText, int nTextSize, long nTextFileTime );
+	bool LoadFromBinaryCache( CUtlBuffer &buf, long nTextFileTime, const void *pText = NULL, int nTextSize = 0 );
+
 	// Find a keyValue, create it if it is not found.
 	// Set bCreate to true to create the key if it doesn't already exist (which ensures a valid pointer will be returned)
 	KeyValues *FindKey(const char *keyName, bool bCreate = false);
@@ -302,6 +320,24 @@ private:
 	void FreeAllocatedValue();
 	void AllocateValueBlock(int size);
 
+	// Arena support; see CreateArenaRoot()
+	enum
+	{
+		ARENA_NODE = 0x01,		// this key was placement-constructed in a CKeyValuesArena
+		ARENA_VALUE = 0x02,		// m_sValue points into the arena and must not be deleted
+	};
+
+	void *operator new( size_t iAllocSize, void *pMem ) { return pMem; }
+	void operator delete( void *pMem, void *pPlace ) {}
+
+	KeyValues *CreateKeyInArena( const char *keyName, KeyValues *pParent );	// plain new unless we're an arena key
+	char *AllocValueString( int len );
+	void FreeValueString();
+	void InvalidateChildIndex();
+	void InvalidateParentIndex();
+	void BuildChildIndices();
+	bool FindIndexedKey( int keySymbol, KeyValues **ppKey ) const;	// false if there's no index to consult
+
 	int m_iKeyName;	// keyname is a symbol defined in KeyValuesSystem
 
 	// These are needed out of the union because the API returns string pointers
@@ -320,7 +356,7 @@ private:
 	char	   m_iDataType;
 	char	   m_bHasEscapeSequences; // true, if while parsing this KeyValue, Escape Sequences are used (default false)
 	char	   m_bEvaluateConditionals; // true, if while parsing this KeyValue, conditionals blocks are evaluated (default true)
-	char	   unused[1];
+	char	   m_nArenaFlags; // ARENA_* bits, formerly unused padding
 
 	KeyValues *m_pPeer;	// pointer to next key in list
 	KeyValues *m_pSub;	// pointer to Start of a new sub key list
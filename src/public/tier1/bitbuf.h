@@ -217,6 +217,13 @@ public:
 	void			WriteBitVec3Normal( const Vector& fa );
 	void			WriteBitAngles( const QAngle& fa );
 
+	// Batched versions of the above. When the whole batch is sure to fit they
+	// encode through a 64-bit accumulator with a single overflow check; the
+	// bits written are identical to calling the single-field versions in a loop.
+	void			WriteUBitLongs( const unsigned int *pData, int nCount, int numbits );
+	void			WriteBitCoords( const float *pValues, int nCount );
+	void			WriteBitVec3Coords( const Vector *pVecs, int nCount );
+
 
 // Byte functions.
 public:
@@ -592,6 +599,11 @@ public:
 	void			ReadBitVec3Normal( Vector& fa );
 	void			ReadBitAngles( QAngle& fa );
 
+	// Batched readers matching bf_write::WriteUBitLongs etc.
+	void			ReadUBitLongs( unsigned int *pOut, int nCount, int numbits );
+	void			ReadBitCoords( float *pOut, int nCount );
+	void			ReadBitVec3Coords( Vector *pOut, int nCount );
+
 	// Faster for comparisons but do not fully decode float values
 	unsigned int	ReadBitCoordBits();
 	unsigned int	ReadBitCoordMPBits( bool bIntegral, bool bLowPrecision );
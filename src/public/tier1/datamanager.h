@@ -247,6 +247,260 @@ private:
 	MUTEX_TYPE m_mutex;
 };
 
+//-----------------------------------------------------------------------------
+// A CDataManager split into shards that each have their own lock and LRU, so
+// threads working on different resources rarely wait on each other. The
+// shards share one memory budget, evicted from each shard's LRU in turn.
+// Every call locks the one shard it needs; there's no global lock to take.
+// Handles carry the shard in the low bits of the index half, which limits
+// each shard to MAX_SHARD_RESOURCES live resources.
+//-----------------------------------------------------------------------------
+template< class STORAGE_TYPE, class CREATE_PARAMS, class LOCK_TYPE = STORAGE_TYPE *, class MUTEX_TYPE = CThreadFastMutex, int SHARD_BITS = 3 >
+class CShardedDataManager
+{
+public:
+	enum
+	{
+		NUM_SHARDS = 1 << SHARD_BITS,
+		// the top index in the last shard would make an index half of 0xFFFF, which with a
+		// serial of 0xFFFF is INVALID_MEMHANDLE, so every shard gives up its top index
+		MAX_SHARD_RESOURCES = ( 0x10000 >> SHARD_BITS ) - 2,
+	};
+
+	typedef CDataManager< STORAGE_TYPE, CREATE_PARAMS, LOCK_TYPE, MUTEX_TYPE > Shard_t;
+
+	CShardedDataManager( unsigned int size = (unsigned)-1 ) : m_nNextShard( 0 ), m_nNextPurgeShard( 0 )
+	{
+		SetTargetSize( size );
+	}
+
+	memhandle_t CreateResource( const CREATE_PARAMS &createParams, bool bCreateLocked = false )
+	{
+		// make room in the shared budget first, so the new resource can't be the one evicted
+		EnsureCapacity( STORAGE_TYPE::EstimatedSize( createParams ) );
+
+		int iShard = (unsigned)( ++m_nNextShard ) & ( NUM_SHARDS - 1 );
+		memhandle_t hShard;
+		{
+			CShardLock lock( m_Shards[iShard] );
+			hShard = m_Shards[iShard].m_Manager.CreateResource( createParams, bCreateLocked );
+		}
+
+		if ( ( (unsigned int)hShard & 0xFFFF ) > MAX_SHARD_RESOURCES )
+		{
+			AssertMsg( false, "CShardedDataManager: shard is full\n" );
+			CShardLock lock( m_Shards[iShard] );
+			m_Shards[iShard].m_Manager.DestroyResource( hShard );
+			return INVALID_MEMHANDLE;
+		}
+
+		return ToShardedHandle( hShard, iShard );
+	}
+
+	void DestroyResource( memhandle_t handle )
+	{
+		memhandle_t hShard;
+		Shard_t *pShard = GetShard( handle, hShard );
+		if ( pShard )
+		{
+			CShardLock lock( ShardFor( handle ) );
+			pShard->DestroyResource( hShard );
+		}
+	}
+
+	LOCK_TYPE LockResource( memhandle_t handle )
+	{
+		memhandle_t hShard;
+		Shard_t *pShard = GetShard( handle, hShard );
+		if ( !pShard )
+			return NULL;
+
+		CShardLock lock( ShardFor( handle ) );
+		return pShard->LockResource( hShard );
+	}
+
+	int UnlockResource( memhandle_t handle )
+	{
+		memhandle_t hShard;
+		Shard_t *pShard = GetShard( handle, hShard );
+		if ( !pShard )
+			return 0;
+
+		CShardLock lock( ShardFor( handle ) );
+		return pShard->UnlockResource( hShard );
+	}
+
+	void TouchResource( memhandle_t handle )
+	{
+		memhandle_t hShard;
+		Shard_t *pShard = GetShard( handle, hShard );
+		if ( pShard )
+		{
+			CShardLock lock( ShardFor( handle ) );
+			pShard->TouchResource( hShard );
+		}
+	}
+
+	LOCK_TYPE GetResource_NoLock( memhandle_t handle )
+	{
+		memhandle_t hShard;
+		Shard_t *pShard = GetShard( handle, hShard );
+		if ( !pShard )
+			return NULL;
+
+		CShardLock lock( ShardFor( handle ) );
+		return pShard->GetResource_NoLock( hShard );
+	}
+
+	// The lock guarding one resource, for callers that touch its data in place
+	MUTEX_TYPE &AccessMutex( memhandle_t handle )	{ return m_Shards[ (unsigned int)handle & ( NUM_SHARDS - 1 ) ].m_Manager.AccessMutex(); }
+
+	unsigned int TargetSize()	{ return m_targetMemorySize; }
+
+	unsigned int UsedSize()
+	{
+		// unlocked reads; only ever used as an estimate
+		unsigned int nUsed = 0;
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			nUsed += m_Shards[i].m_Manager.UsedSize();
+		}
+		return nUsed;
+	}
+
+	void SetTargetSize( unsigned int targetSize )
+	{
+		m_targetMemorySize = targetSize;
+
+		// a shard only evicts by itself if it alone outgrows the whole budget
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			m_Shards[i].m_Manager.SetTargetSize( targetSize );
+		}
+	}
+
+	// Frees least recently used resources, a shard at a time, until size more bytes fit
+	unsigned int EnsureCapacity( unsigned int size )
+	{
+		unsigned int nFreed = 0;
+		for ( int nTries = 0; nTries < NUM_SHARDS; nTries++ )
+		{
+			unsigned int nUsed = UsedSize();
+			if ( nUsed + size <= m_targetMemorySize || nUsed + size < nUsed )
+				break;
+
+			int iShard = (unsigned)( ++m_nNextPurgeShard ) & ( NUM_SHARDS - 1 );
+			CShardLock lock( m_Shards[iShard] );
+			nFreed += m_Shards[iShard].m_Manager.Purge( nUsed + size - m_targetMemorySize );
+		}
+		return nFreed;
+	}
+
+	unsigned int FlushToTargetSize()	{ return EnsureCapacity( 0 ); }
+
+	unsigned int FlushAllUnlocked()
+	{
+		unsigned int nFreed = 0;
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			CShardLock lock( m_Shards[i] );
+			nFreed += m_Shards[i].m_Manager.FlushAllUnlocked();
+		}
+		return nFreed;
+	}
+
+	unsigned int FlushAll()
+	{
+		unsigned int nFreed = 0;
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			CShardLock lock( m_Shards[i] );
+			nFreed += m_Shards[i].m_Manager.FlushAll();
+		}
+		return nFreed;
+	}
+
+	// Contention counters: how often a shard lock was taken, and how often it was already held
+	void GetLockStats( int &nLocks, int &nContended )
+	{
+		nLocks = nContended = 0;
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			nLocks += m_Shards[i].m_nLocks;
+			nContended += m_Shards[i].m_nContended;
+		}
+	}
+
+	void ResetLockStats()
+	{
+		for ( int i = 0; i < NUM_SHARDS; i++ )
+		{
+			m_Shards[i].m_nLocks = 0;
+			m_Shards[i].m_nContended = 0;
+		}
+	}
+
+private:
+	struct Shard_s
+	{
+		Shard_s() : m_nLocks( 0 ), m_nContended( 0 ) {}
+
+		Shard_t m_Manager;
+		int m_nLocks;		// updated under the shard lock
+		int m_nContended;
+	};
+
+	class CShardLock
+	{
+	public:
+		CShardLock( Shard_s &shard ) : m_Shard( shard )
+		{
+			bool bContended = !m_Shard.m_Manager.TryLock();
+			if ( bContended )
+			{
+				m_Shard.m_Manager.Lock();
+			}
+			m_Shard.m_nLocks++;
+			m_Shard.m_nContended += bContended;
+		}
+
+		~CShardLock()
+		{
+			m_Shard.m_Manager.Unlock();
+		}
+
+	private:
+		Shard_s &m_Shard;
+	};
+
+	Shard_s &ShardFor( memhandle_t handle )
+	{
+		return m_Shards[ (unsigned int)handle & ( NUM_SHARDS - 1 ) ];
+	}
+
+	// Splits a handle into its shard and that shard's own handle
+	Shard_t *GetShard( memhandle_t handle, memhandle_t &hShard )
+	{
+		if ( handle == INVALID_MEMHANDLE )
+			return NULL;
+
+		unsigned int fullWord = (unsigned int)handle;
+		hShard = (memhandle_t)( ( fullWord & 0xFFFF0000 ) | ( ( fullWord & 0xFFFF ) >> SHARD_BITS ) );
+		return &ShardFor( handle ).m_Manager;
+	}
+
+	static memhandle_t ToShardedHandle( memhandle_t hShard, int iShard )
+	{
+		unsigned int fullWord = (unsigned int)hShard;
+		return (memhandle_t)( ( fullWord & 0xFFFF0000 ) | ( ( fullWord & 0xFFFF ) << SHARD_BITS ) | iShard );
+	}
+
+	Shard_s m_Shards[NUM_SHARDS];
+	unsigned int m_targetMemorySize;
+	CInterlockedInt m_nNextShard;
+	CInterlockedInt m_nNextPurgeShard;
+};
+
 //-----------------------------------------------------------------------------
 
 inline unsigned short CDataManagerBase::FromHandle( memhandle_t handle )
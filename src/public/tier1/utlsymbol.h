@@ -202,6 +202,14 @@ public:
 		m_lock.UnlockRead();
 		return pszResult;
 	}
+
+	int GetNumStrings( void ) const
+	{
+		m_lock.LockForRead();
+		int nStrings = CUtlSymbolTable::GetNumStrings();
+		m_lock.UnlockRead();
+		return nStrings;
+	}
 	
 private:
 #if defined(WIN32) || defined(_WIN32)
@@ -212,6 +220,79 @@ private:
 };
 
 
+//-----------------------------------------------------------------------------
+// CUtlConcurrentSymbolTable:
+//    A replacement for CUtlSymbolTableMT for tables that many threads intern
+//    into at once. It has no growSize/initSize, since its buckets are fixed. Symbols hash into a fixed set of buckets whose chains
+//    are only ever prepended to, so looking up an existing symbol and turning a
+//    symbol back into a string take no locks. Inserts lock one of a few dozen
+//    stripes of buckets, each with its own string storage.
+//    RemoveAll must not run concurrently with anything else.
+//-----------------------------------------------------------------------------
+class CUtlConcurrentSymbolTable
+{
+public:
+	CUtlConcurrentSymbolTable( bool caseInsensitive = false );
+	~CUtlConcurrentSymbolTable();
+
+	// Finds and/or creates a symbol based on the string
+	CUtlSymbol AddString( const char* pString );
+
+	// Finds the symbol for pString
+	CUtlSymbol Find( const char* pString ) const;
+
+	// Look up the string associated with a particular symbol
+	const char* String( CUtlSymbol id ) const;
+
+	// Remove all symbols in the table.
+	void RemoveAll();
+
+	// Only counts symbols that Find() and String() can already see
+	int GetNumStrings( void ) const
+	{
+		return m_nPublished;
+	}
+
+private:
+	enum
+	{
+		BUCKET_COUNT = 4096,
+		STRIPE_COUNT = 32,
+		SYMBOLS_PER_PAGE = 256,
+		PAGE_COUNT = ( UTL_INVAL_SYMBOL + SYMBOLS_PER_PAGE ) / SYMBOLS_PER_PAGE,
+	};
+
+	struct Node_t
+	{
+		Node_t * volatile m_pNext;
+		unsigned int m_nHash;
+		UtlSymId_t m_Id;
+		char m_String[1];
+	};
+
+	struct Stripe_t
+	{
+		CThreadFastMutex m_Mutex;
+		char *m_pBlockCur;
+		char *m_pBlockEnd;
+		CUtlVector< char * > m_Blocks;
+	};
+
+	unsigned int HashString( const char *pString ) const;
+	Node_t *FindNode( const char *pString, unsigned int nHash ) const;
+
+	Node_t * volatile m_pBuckets[ BUCKET_COUNT ];
+	Stripe_t m_Stripes[ STRIPE_COUNT ];
+
+	// Symbol -> string, paged so pages never move once published
+	const char ** volatile m_pPages[ PAGE_COUNT ];
+	volatile long m_nSymbols;		// ids handed out
+	volatile long m_nPublished;		// symbols linked into their bucket
+
+	bool m_bInsensitive;
+};
+
+
 
 //-----------------------------------------------------------------------------
 // CUtlFilenameSymbolTable:
@@ -4,7 +4,12 @@
 #include "raytrace.h"
 #include <filesystem_tools.h>
 #include <cmdlib.h>
+#include <threads.h>
 #include <stdio.h>
+#if defined( _WIN32 ) && !defined( _X360 )
+#include <intrin.h>
+#include <immintrin.h>
+#endif
 
 static bool SameSign(float a, float b)
 {
@@ -344,6 +349,56 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 }
 
 
+int EightRays::CalculateDirectionSignMask(void) const
+{
+	int msk=half[0].CalculateDirectionSignMask();
+	if (msk!=half[1].CalculateDirectionSignMask())
+		return -1;
+	return msk;
+}
+
+static bool CPUSupportsAVX(void)
+{
+#if defined( _WIN32 ) && !defined( _X360 )
+	// the cpu has to have AVX, and the OS has to save the ymm registers (OSXSAVE and XCR0 bits 1-2)
+	int regs[4];
+	__cpuid( regs, 1 );
+	const int nAVXBits = ( 1 << 27 ) | ( 1 << 28 );
+	if ( ( regs[2] & nAVXBits ) != nAVXBits )
+		return false;
+	return ( _xgetbv( 0 ) & 6 ) == 6;
+#elif defined( __GNUC__ ) && ( defined( __i386__ ) || defined( __x86_64__ ) )
+	return __builtin_cpu_supports( "avx" ) != 0;
+#else
+	return false;
+#endif
+}
+
+static bool s_bCanTrace8Wide = CPUSupportsAVX();
+
+bool RayTracingEnvironment::CanTrace8Wide(void)
+{
+	return s_bCanTrace8Wide;
+}
+
+void RayTracingEnvironment::Trace8Rays(const EightRays &rays, const fltx4 TMin[2], const fltx4 TMax[2],
+									   EightRayTracingResult *rslt_out, int32 skip_id)
+{
+	int msk=rays.CalculateDirectionSignMask();
+	if ( s_bCanTrace8Wide && (msk!=-1) )
+	{
+		Trace8RaysAVX(rays,TMin,TMax,msk,rslt_out,skip_id);
+	}
+	else
+	{
+		// no AVX, or the halves go different ways. Trace4Rays sorts out any mixed signs
+		// within each half.
+		Trace4Rays(rays.half[0],TMin[0],TMax[0],&rslt_out->half[0],skip_id);
+		Trace4Rays(rays.half[1],TMin[1],TMax[1],&rslt_out->half[1],skip_id);
+	}
+}
+
+
 void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
 									   int DirectionSignMask, RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
@@ -872,6 +927,376 @@ void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int
 }
 
 
+//-----------------------------------------------------------------------------
+// Binned kd-tree build
+//
+// Rather than costing a sample of triangle vertices as split planes, each node drops the
+// triangle extents into KDTREE_BINS bins per axis and costs every bin boundary, plus the planes
+// that cut the empty space off either side, in one pass over its triangles. The cost model and
+// the leaf criteria are RefineNode's. The triangles' bounds are computed once up front and the
+// triangles themselves are never written, so subtrees can be built on any thread.
+//
+// The top of the tree is built on the main thread. Nodes small enough to be one of about
+// KDTREE_JOBS_PER_THREAD jobs per thread are deferred, built on all threads into their own
+// node and index lists, and then appended to the tree in the order they were deferred. A job
+// builds exactly the subtree the main thread would have, so the thread count only changes the
+// order of the nodes in OptimizedKDTree, not the tree.
+//-----------------------------------------------------------------------------
+#define KDTREE_BINS 64
+#define KDTREE_JOBS_PER_THREAD 8
+#define KDTREE_MIN_JOB_TRIS 1024							// don't bother threading below this
+
+struct KDTriBounds_t
+{
+	Vector m_Mins;
+	Vector m_Maxs;
+};
+
+struct KDBuildJob_t
+{
+	int m_nNode;											// placeholder node for the subtree root
+	int m_nDepth;
+	Vector m_Mins;
+	Vector m_Maxs;
+	CUtlVector<int32> m_Tris;
+	CUtlVector<CacheOptimizedKDNode> m_Nodes;				// subtree, root first
+	CUtlVector<int32> m_TriIndices;							// leaf triangle lists of the subtree
+};
+
+class CKDTreeBinnedBuilder
+{
+public:
+	CKDTreeBinnedBuilder( const KDTriBounds_t *pBounds, CUtlVector<CacheOptimizedKDNode> &nodes,
+						  CUtlVector<int32> &triIndices, CUtlVector<KDBuildJob_t *> *pJobs, int nMaxJobTris ) :
+		m_pBounds( pBounds ), m_Nodes( nodes ), m_TriIndices( triIndices ), m_pJobs( pJobs ), m_nMaxJobTris( nMaxJobTris )
+	{
+	}
+
+	void Build_r( int nNode, const int32 *pTris, int nTris, const Vector &mins, const Vector &maxs, int nDepth );
+
+private:
+	bool FindBestSplit( const int32 *pTris, int nTris, const Vector &mins, const Vector &maxs,
+						int &nBestAxis, float &flBestSplit, float &flBestCost ) const;
+	void MakeLeaf( int nNode, const int32 *pTris, int nTris, const Vector &mins, const Vector &maxs );
+	void AddJob( int nNode, const int32 *pTris, int nTris, const Vector &mins, const Vector &maxs, int nDepth );
+
+	const KDTriBounds_t *m_pBounds;
+	CUtlVector<CacheOptimizedKDNode> &m_Nodes;
+	CUtlVector<int32> &m_TriIndices;
+	CUtlVector<KDBuildJob_t *> *m_pJobs;					// NULL when building a job
+	int m_nMaxJobTris;
+};
+
+static inline int KDTreeBin( float flBin, int nMaxBin )
+{
+	// clamp before converting so triangles far outside the node can't overflow the int
+	if ( flBin <= 0.0f )
+		return 0;
+	if ( flBin >= nMaxBin )
+		return nMaxBin;
+	return (int)flBin;
+}
+
+static inline float KDTreeSplitCost( int nAxis, float flSplit, const Vector &mins, const Vector &maxs,
+									 float flInvSA, int nLeft, int nRight, int nBoth )
+{
+	Vector LeftMaxes = maxs;
+	Vector RightMins = mins;
+	LeftMaxes[nAxis] = flSplit;
+	RightMins[nAxis] = flSplit;
+	return COST_OF_TRAVERSAL + COST_OF_INTERSECTION * ( nBoth +
+		BoxSurfaceArea( mins, LeftMaxes ) * flInvSA * nLeft + BoxSurfaceArea( RightMins, maxs ) * flInvSA * nRight );
+}
+
+static inline int KDTreeClassify( const KDTriBounds_t &bounds, int nAxis, float flSplit )
+{
+	// same answer as CacheOptimizedTriangle::ClassifyAgainstAxisSplit
+	if ( bounds.m_Mins[nAxis] >= flSplit )
+		return PLANECHECK_POSITIVE;
+	if ( bounds.m_Maxs[nAxis] <= flSplit )
+		return PLANECHECK_NEGATIVE;
+	return PLANECHECK_STRADDLING;
+}
+
+bool CKDTreeBinnedBuilder::FindBestSplit( const int32 *pTris, int nTris, const Vector &mins, const Vector &maxs,
+										  int &nBestAxis, float &flBestSplit, float &flBestCost ) const
+{
+	nBestAxis = -1;
+	flBestCost = 1.0e23;
+	float flInvSA = 1.0 / BoxSurfaceArea( mins, maxs );
+
+	for ( int nAxis = 0; nAxis < 3; nAxis++ )
+	{
+		float flLo = mins[nAxis];
+		float flHi = maxs[nAxis];
+		if ( flHi <= flLo )
+			continue;
+
+		// nStarts[b] counts the triangles whose min falls in bin b, nEnds[b] the triangles whose
+		// max is at or below boundary b
+		int nStarts[KDTREE_BINS];
+		int nEnds[KDTREE_BINS + 1];
+		memset( nStarts, 0, sizeof( nStarts ) );
+		memset( nEnds, 0, sizeof( nEnds ) );
+
+		float flScale = KDTREE_BINS / ( flHi - flLo );
+		float flTriMin = 1.0e23;
+		float flTriMax = -1.0e23;
+		for ( int t = 0; t < nTris; t++ )
+		{
+			const KDTriBounds_t &bounds = m_pBounds[pTris[t]];
+			float flMin = bounds.m_Mins[nAxis];
+			float flMax = bounds.m_Maxs[nAxis];
+			flTriMin = min( flTriMin, flMin );
+			flTriMax = max( flTriMax, flMax );
+			nStarts[KDTreeBin( ( flMin - flLo ) * flScale, KDTREE_BINS - 1 )]++;
+			nEnds[KDTreeBin( ceil( ( flMax - flLo ) * flScale ), KDTREE_BINS )]++;
+		}
+
+		// sweep the boundaries between the bins
+		int nLeft = nEnds[0];
+		int nStarted = 0;
+		for ( int b = 1; b < KDTREE_BINS; b++ )
+		{
+			nLeft += nEnds[b];
+			nStarted += nStarts[b - 1];
+			int nRight = nTris - nStarted;
+			int nBoth = nTris - nLeft - nRight;
+			int nLeftOnly = nLeft;
+			if ( nBoth < 0 )
+			{
+				// flat triangles sitting exactly on the boundary count on both sides
+				nLeftOnly += nBoth;
+				nBoth = 0;
+			}
+
+			float flSplit = flLo + ( flHi - flLo ) * b / KDTREE_BINS;
+			float flCost = KDTreeSplitCost( nAxis, flSplit, mins, maxs, flInvSA, nLeftOnly, nRight, nBoth );
+			if ( flCost < flBestCost )
+			{
+				nBestAxis = nAxis;
+				flBestSplit = flSplit;
+				flBestCost = flCost;
+			}
+		}
+
+		// "grow" empty space off either side, like CalculateCostsOfSplit does
+		if ( ( flTriMin > flLo ) && ( flTriMin < flHi ) )
+		{
+			float flCost = KDTreeSplitCost( nAxis, flTriMin, mins, maxs, flInvSA, 0, nTris, 0 );
+			if ( flCost < flBestCost )
+			{
+				nBestAxis = nAxis;
+				flBestSplit = flTriMin;
+				flBestCost = flCost;
+			}
+		}
+		if ( ( flTriMax < flHi ) && ( flTriMax > flLo ) )
+		{
+			float flCost = KDTreeSplitCost( nAxis, flTriMax, mins, maxs, flInvSA, nTris, 0, 0 );
+			if ( flCost < flBestCost )
+			{
+				nBestAxis = nAxis;
+				flBestSplit = flTriMax;
+				flBestCost = flCost;
+			}
+		}
+	}
+
+	return nBestAxis >= 0;
+}
+
+void CKDTreeBinnedBuilder::MakeLeaf( int nNode, const int32 *pTris, int nTris, const Vector &mins, const Vector &maxs )
+{
+	CacheOptimizedKDNode &node = m_Nodes[nNode];
+	node.Children = KDNODE_STATE_LEAF + ( m_TriIndices.Count() << 2 );
+	node.SetNumberOfTrianglesInLeafNode( nTris );
+#ifdef DEBUG_RAYTRACE
+	node.vecMins = mins;
+	node.vecMaxs = maxs;
+#endif
+	m_TriIndices.AddMultipleToTail( nTris, pTris );
+}
+
+void CKDTreeBinnedBuilder::AddJob( int nNode, const int32 *pTris, int nTris, const Vector &mins, const Vector &maxs, int nDepth )
+{
+	KDBuildJob_t *pJob = new KDBuildJob_t;
+	pJob->m_nNode = nNode;
+	pJob->m_nDepth = nDepth;
+	pJob->m_Mins = mins;
+	pJob->m_Maxs = maxs;
+	pJob->m_Tris.CopyArray( pTris, nTris );
+	m_pJobs->AddToTail( pJob );
+}
+
+void CKDTreeBinnedBuilder::Build_r( int nNode, const int32 *pTris, int nTris, const Vector &mins, const Vector &maxs, int nDepth )
+{
+	if ( nTris < 3 )										// never split empty lists
+	{
+		MakeLeaf( nNode, pTris, nTris, mins, maxs );
+		return;
+	}
+
+	if ( m_pJobs && ( nTris <= m_nMaxJobTris ) )
+	{
+		AddJob( nNode, pTris, nTris, mins, maxs, nDepth );
+		return;
+	}
+
+	int nAxis;
+	float flSplit, flCost;
+	if ( !FindBestSplit( pTris, nTris, mins, maxs, nAxis, flSplit, flCost ) ||
+		 ( COST_OF_INTERSECTION * nTris <= flCost ) || ( nDepth > MAX_TREE_DEPTH ) )
+	{
+		MakeLeaf( nNode, pTris, nTris, mins, maxs );
+		return;
+	}
+
+	// the bins only estimate the counts; classify exactly and lay the list out as
+	// [left | both | right] so each child's triangles are contiguous
+	int nLeft = 0, nRight = 0, nBoth = 0;
+	for ( int t = 0; t < nTris; t++ )
+	{
+		switch ( KDTreeClassify( m_pBounds[pTris[t]], nAxis, flSplit ) )
+		{
+			case PLANECHECK_NEGATIVE:	nLeft++; break;
+			case PLANECHECK_POSITIVE:	nRight++; break;
+			default:					nBoth++; break;
+		}
+	}
+	if ( nBoth == nTris )
+	{
+		// splitting wouldn't separate anything
+		MakeLeaf( nNode, pTris, nTris, mins, maxs );
+		return;
+	}
+
+	int32 *pNewTris = new int32[nTris];
+	int nLeftOut = 0, nBothOut = nLeft, nRightOut = nLeft + nBoth;
+	for ( int t = 0; t < nTris; t++ )
+	{
+		switch ( KDTreeClassify( m_pBounds[pTris[t]], nAxis, flSplit ) )
+		{
+			case PLANECHECK_NEGATIVE:	pNewTris[nLeftOut++] = pTris[t]; break;
+			case PLANECHECK_POSITIVE:	pNewTris[nRightOut++] = pTris[t]; break;
+			default:					pNewTris[nBothOut++] = pTris[t]; break;
+		}
+	}
+
+	Vector LeftMaxes = maxs;
+	Vector RightMins = mins;
+	LeftMaxes[nAxis] = flSplit;
+	RightMins[nAxis] = flSplit;
+
+	int nLeftChild = m_Nodes.Count();
+	m_Nodes[nNode].Children = nAxis + ( nLeftChild << 2 );
+	m_Nodes[nNode].SplittingPlaneValue = flSplit;
+#ifdef DEBUG_RAYTRACE
+	m_Nodes[nNode].vecMins = mins;
+	m_Nodes[nNode].vecMaxs = maxs;
+#endif
+	m_Nodes.AddToTail();
+	m_Nodes.AddToTail();
+
+	if ( ( nTris < 20 ) && ( ( nLeft == 0 ) || ( nRight == 0 ) ) )
+		nDepth += 100;
+	Build_r( nLeftChild, pNewTris, nLeft + nBoth, mins, LeftMaxes, nDepth + 1 );
+	Build_r( nLeftChild + 1, pNewTris + nLeft, nBoth + nRight, RightMins, maxs, nDepth + 1 );
+	delete[] pNewTris;
+}
+
+static const KDTriBounds_t *s_pKDTriBounds;
+static CUtlVector<KDBuildJob_t *> *s_pKDBuildJobs;
+
+static int __cdecl CompareKDBuildJobSize( const int *pA, const int *pB )
+{
+	// biggest first, so the stragglers at the end are small
+	int nA = (*s_pKDBuildJobs)[*pA]->m_Tris.Count();
+	int nB = (*s_pKDBuildJobs)[*pB]->m_Tris.Count();
+	if ( nA != nB )
+		return nB - nA;
+	return *pA - *pB;
+}
+
+static CUtlVector<int> s_KDBuildJobOrder;
+
+static void BuildKDTreeJob( int iThread, int iJob )
+{
+	KDBuildJob_t *pJob = (*s_pKDBuildJobs)[s_KDBuildJobOrder[iJob]];
+	pJob->m_Nodes.AddToTail();
+	CKDTreeBinnedBuilder builder( s_pKDTriBounds, pJob->m_Nodes, pJob->m_TriIndices, NULL, 0 );
+	builder.Build_r( 0, pJob->m_Tris.Base(), pJob->m_Tris.Count(), pJob->m_Mins, pJob->m_Maxs, pJob->m_nDepth );
+	pJob->m_Tris.Purge();
+}
+
+void RayTracingEnvironment::BuildBinnedTree(int32 const *tri_list,int ntris)
+{
+	KDTriBounds_t *pBounds = new KDTriBounds_t[OptimizedTriangleList.Count()];
+	for ( int t = 0; t < ntris; t++ )
+	{
+		CalculateTriangleListBounds( tri_list + t, 1, pBounds[tri_list[t]].m_Mins, pBounds[tri_list[t]].m_Maxs );
+	}
+
+	int nThreads = max( numthreads, 1 );
+	int nMaxJobTris = max( KDTREE_MIN_JOB_TRIS, ntris / ( nThreads * KDTREE_JOBS_PER_THREAD ) );
+
+	CUtlVector<KDBuildJob_t *> jobs;
+	CKDTreeBinnedBuilder builder( pBounds, OptimizedKDTree, TriangleIndexList, &jobs, nMaxJobTris );
+	builder.Build_r( 0, tri_list, ntris, m_MinBound, m_MaxBound, 0 );
+
+	if ( jobs.Count() )
+	{
+		s_pKDTriBounds = pBounds;
+		s_pKDBuildJobs = &jobs;
+		s_KDBuildJobOrder.SetCount( jobs.Count() );
+		for ( int i = 0; i < jobs.Count(); i++ )
+			s_KDBuildJobOrder[i] = i;
+		s_KDBuildJobOrder.Sort( CompareKDBuildJobSize );
+
+		RunThreadsOnIndividual( jobs.Count(), false, BuildKDTreeJob );
+
+		// append the subtrees. the job's root goes into its placeholder, and its node i>0 lands at
+		// nNodeBase+i, so child indices shift by nNodeBase and leaf triangle starts by nTriBase.
+		int nTotalNodes = OptimizedKDTree.Count();
+		int nTotalTris = TriangleIndexList.Count();
+		for ( int i = 0; i < jobs.Count(); i++ )
+		{
+			nTotalNodes += jobs[i]->m_Nodes.Count() - 1;
+			nTotalTris += jobs[i]->m_TriIndices.Count();
+		}
+		OptimizedKDTree.EnsureCapacity( nTotalNodes );
+		TriangleIndexList.EnsureCapacity( nTotalTris );
+
+		for ( int i = 0; i < jobs.Count(); i++ )
+		{
+			KDBuildJob_t *pJob = jobs[i];
+			int nNodeBase = OptimizedKDTree.Count() - 1;
+			int nTriBase = TriangleIndexList.Count();
+			for ( int n = 0; n < pJob->m_Nodes.Count(); n++ )
+			{
+				CacheOptimizedKDNode node = pJob->m_Nodes[n];
+				if ( node.NodeType() == KDNODE_STATE_LEAF )
+					node.Children += nTriBase << 2;
+				else
+					node.Children += nNodeBase << 2;
+
+				if ( n == 0 )
+					OptimizedKDTree[pJob->m_nNode] = node;
+				else
+					OptimizedKDTree.AddToTail( node );
+			}
+			TriangleIndexList.AddMultipleToTail( pJob->m_TriIndices.Count(), pJob->m_TriIndices.Base() );
+			delete pJob;
+		}
+		s_KDBuildJobOrder.Purge();
+		s_pKDBuildJobs = NULL;
+		s_pKDTriBounds = NULL;
+	}
+
+	delete[] pBounds;
+}
+
+
 void RayTracingEnvironment::SetupAccelerationStructure(void)
 {
 	CacheOptimizedKDNode root;
@@ -881,12 +1306,20 @@ void RayTracingEnvironment::SetupAccelerationStructure(void)
 		root_triangle_list[t]=t;
 	CalculateTriangleListBounds(root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,
 								m_MaxBound);
-	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
+	if (Flags & RTE_FLAGS_EXHAUSTIVE_TREE_GENERATION)
+		RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
+	else
+		BuildBinnedTree(root_triangle_list,OptimizedTriangleList.Count());
 	delete[] root_triangle_list;
 
 	// now, convert all triangles to "intersection format"
 	for(int i=0;i<OptimizedTriangleList.Count();i++)
 		OptimizedTriangleList[i].ChangeIntoIntersectionFormat();
+
+	// the triangles aren't contiguous, so the AVX code gets a flat table of them
+	m_IntersectDataList.SetCount(OptimizedTriangleList.Count());
+	for(int i=0;i<OptimizedTriangleList.Count();i++)
+		m_IntersectDataList[i]=&(OptimizedTriangleList[i].m_Data.m_IntersectData);
 }
 
 
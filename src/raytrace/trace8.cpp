@@ -0,0 +1,333 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+
+// 8-wide AVX version of Trace4Rays. Only Trace8Kernel and the helpers it uses are compiled
+// for AVX, and they see nothing but plain data, so no inline from a header can be
+// instantiated here with AVX instructions in it. Nothing in this file may be called unless
+// RayTracingEnvironment::CanTrace8Wide() says the cpu supports it; Trace8Rays in raytrace.cpp
+// does the checking.
+
+#include "raytrace.h"
+#include <immintrin.h>
+
+// msvc takes the _mm256 intrinsics without /arch:AVX
+#if defined( __GNUC__ )
+#define AVX_TARGET __attribute__(( target( "avx" ) ))
+#else
+#define AVX_TARGET
+#endif
+
+// these match raytrace.cpp
+#define MAILBOX_HASH_SIZE 256
+#define MAX_TREE_DEPTH 21
+#define MAX_NODE_STACK_LEN (40*MAX_TREE_DEPTH)
+
+extern int n_intersection_calculations;
+
+typedef __m256 fltx8;
+
+// everything the kernel reads and writes, laid out as 8 floats per ray coordinate
+struct Trace8Data_t
+{
+	float m_Origin[3][8];
+	float m_Direction[3][8];
+	float m_OneOverRayDir[3][8];
+	float m_TMin[8];
+	float m_TMax[8];
+	float m_MinBound[3];
+	float m_MaxBound[3];
+	CacheOptimizedKDNode const *m_pNodes;
+	int32 const *m_pTriangleIndices;
+	TriIntersectData_t const * const *m_ppTriangles;
+	int m_DirectionSignMask;
+	int32 m_nSkipID;
+
+	int32 m_HitIds[8];
+	float m_HitDistance[8];
+	float m_SurfaceNormal[3][8];
+};
+
+struct NodeToVisit8 {
+	CacheOptimizedKDNode const *node;
+	fltx8 TMin;
+	fltx8 TMax;
+};
+
+struct EightVectors
+{
+	fltx8 x, y, z;
+
+	AVX_TARGET FORCEINLINE fltx8 operator[](int c) const
+	{
+		return ( c == 0 ) ? x : ( ( c == 1 ) ? y : z );
+	}
+};
+
+static AVX_TARGET FORCEINLINE void Load8( const float v[3][8], EightVectors &out )
+{
+	out.x = _mm256_loadu_ps( v[0] );
+	out.y = _mm256_loadu_ps( v[1] );
+	out.z = _mm256_loadu_ps( v[2] );
+}
+
+static AVX_TARGET FORCEINLINE fltx8 Replicate8( float f )
+{
+	return _mm256_set1_ps( f );
+}
+
+static AVX_TARGET FORCEINLINE bool IsAnyNegative8( const fltx8 &v )
+{
+	return _mm256_movemask_ps( v ) != 0;
+}
+
+static AVX_TARGET FORCEINLINE fltx8 Dot8( const EightVectors &a, const EightVectors &b )
+{
+	// same order of operations as FourVectors::operator*
+	return _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( a.x, b.x ), _mm256_mul_ps( a.y, b.y ) ),
+						  _mm256_mul_ps( a.z, b.z ) );
+}
+
+// select a where mask is set, else b
+static AVX_TARGET FORCEINLINE fltx8 Select8( const fltx8 &mask, const fltx8 &a, const fltx8 &b )
+{
+	return _mm256_or_ps( _mm256_and_ps( a, mask ), _mm256_andnot_ps( mask, b ) );
+}
+
+// the nodes and triangles are read straight from their fields rather than through the
+// CacheOptimizedKDNode accessors, see the comment at the top
+static AVX_TARGET void Trace8Kernel( Trace8Data_t &data )
+{
+	EightVectors origin, direction, OneOverRayDir;
+	Load8( data.m_Origin, origin );
+	Load8( data.m_Direction, direction );
+	Load8( data.m_OneOverRayDir, OneOverRayDir );
+
+	fltx8 TMin = _mm256_loadu_ps( data.m_TMin );
+	fltx8 TMax = _mm256_loadu_ps( data.m_TMax );
+
+	fltx8 HitIds = _mm256_castsi256_ps( _mm256_set1_epi32( -1 ) );
+	fltx8 HitDistance = Replicate8( 1.0e23 );
+	EightVectors SurfaceNormal;
+	SurfaceNormal.x = SurfaceNormal.y = SurfaceNormal.z = _mm256_setzero_ps();
+
+	const fltx8 Epsilons = Replicate8( 1.0e-10 );
+	const fltx8 NegativeEpsilons = Replicate8( -1.0e-10 );
+	const fltx8 Ones = Replicate8( 1.0 );
+
+	// now, clip rays against bounding box
+	for(int c=0;c<3;c++)
+	{
+		fltx8 isect_min_t=
+			_mm256_mul_ps(_mm256_sub_ps(Replicate8(data.m_MinBound[c]),origin[c]),OneOverRayDir[c]);
+		fltx8 isect_max_t=
+			_mm256_mul_ps(_mm256_sub_ps(Replicate8(data.m_MaxBound[c]),origin[c]),OneOverRayDir[c]);
+		TMin=_mm256_max_ps(TMin,_mm256_min_ps(isect_min_t,isect_max_t));
+		TMax=_mm256_min_ps(TMax,_mm256_max_ps(isect_min_t,isect_max_t));
+	}
+
+	fltx8 active=_mm256_cmp_ps(TMin,TMax,_CMP_LE_OQ);		// mask of which rays are active
+	if ( IsAnyNegative8(active) )
+	{
+		int32 mailboxids[MAILBOX_HASH_SIZE];				// used to avoid redundant triangle tests
+		memset(mailboxids,0xff,sizeof(mailboxids));
+
+		int front_idx[3],back_idx[3];						// based on ray direction, whether to
+															// visit left or right node first
+		for(int c=0;c<3;c++)
+		{
+			back_idx[c]=(data.m_DirectionSignMask & (1<<c)) ? 0 : 1;
+			front_idx[c]=1-back_idx[c];
+		}
+
+		NodeToVisit8 NodeQueue[MAX_NODE_STACK_LEN];
+		CacheOptimizedKDNode const *CurNode=data.m_pNodes;
+		NodeToVisit8 *stack_ptr=&NodeQueue[MAX_NODE_STACK_LEN];
+		while(1)
+		{
+			while ((CurNode->Children & 3) != KDNODE_STATE_LEAF)	// traverse until next leaf
+			{
+				int split_plane_number=CurNode->Children & 3;
+				CacheOptimizedKDNode const *FrontChild=data.m_pNodes+(CurNode->Children>>2);
+
+				fltx8 dist_to_sep_plane=					// dist=(split-org)/dir
+					_mm256_mul_ps(
+						_mm256_sub_ps(Replicate8(CurNode->SplittingPlaneValue),
+									  origin[split_plane_number]),OneOverRayDir[split_plane_number]);
+				fltx8 active=_mm256_cmp_ps(TMin,TMax,_CMP_LE_OQ);
+
+				// now, decide how to traverse children. can either do front,back, or do front
+				// and push back.
+				fltx8 hits_front=_mm256_and_ps(active,_mm256_cmp_ps(dist_to_sep_plane,TMin,_CMP_GE_OQ));
+				if (! IsAnyNegative8(hits_front))
+				{
+					// missed the front. only traverse back
+					CurNode=FrontChild+back_idx[split_plane_number];
+					TMin=_mm256_max_ps(TMin, dist_to_sep_plane);
+				}
+				else
+				{
+					fltx8 hits_back=_mm256_and_ps(active,_mm256_cmp_ps(dist_to_sep_plane,TMax,_CMP_LE_OQ));
+					if (! IsAnyNegative8(hits_back) )
+					{
+						// missed the back - only need to traverse front node
+						CurNode=FrontChild+front_idx[split_plane_number];
+						TMax=_mm256_min_ps(TMax, dist_to_sep_plane);
+					}
+					else
+					{
+						// at least some rays hit both nodes.
+						// must push far, traverse near
+						assert(stack_ptr>NodeQueue);
+						--stack_ptr;
+						stack_ptr->node=FrontChild+back_idx[split_plane_number];
+						stack_ptr->TMin=_mm256_max_ps(TMin,dist_to_sep_plane);
+						stack_ptr->TMax=TMax;
+						CurNode=FrontChild+front_idx[split_plane_number];
+						TMax=_mm256_min_ps(TMax,dist_to_sep_plane);
+					}
+				}
+			}
+			// hit a leaf! must do intersection check
+			int ntris=*((int32 const *) &CurNode->SplittingPlaneValue);
+			if (ntris)
+			{
+				int32 const *tlist=data.m_pTriangleIndices+(CurNode->Children>>2);
+				do
+				{
+					int tnum=*(tlist++);
+					// check mailbox
+					int mbox_slot=tnum & (MAILBOX_HASH_SIZE-1);
+					TriIntersectData_t const *tri = data.m_ppTriangles[tnum];
+					if ( ( mailboxids[mbox_slot] == tnum ) || ( tri->m_nTriangleID == data.m_nSkipID ) )
+						continue;
+
+					n_intersection_calculations++;
+					mailboxids[mbox_slot] = tnum;
+
+					// compute plane intersection
+					EightVectors N;
+					N.x = Replicate8( tri->m_flNx );
+					N.y = Replicate8( tri->m_flNy );
+					N.z = Replicate8( tri->m_flNz );
+
+					fltx8 DDotN = Dot8( direction, N );
+					// mask off zero or near zero (ray parallel to surface)
+					fltx8 did_hit = _mm256_or_ps( _mm256_cmp_ps( DDotN, Epsilons, _CMP_GT_OQ ),
+												  _mm256_cmp_ps( DDotN, NegativeEpsilons, _CMP_LT_OQ ) );
+
+					fltx8 numerator = _mm256_sub_ps( Replicate8( tri->m_flD ), Dot8( origin, N ) );
+
+					fltx8 isect_t = _mm256_div_ps( numerator, DDotN );
+					// now, we have the distance to the plane. lets update our mask
+					did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, Epsilons, _CMP_GT_OQ ) );
+					did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( isect_t, HitDistance, _CMP_LT_OQ ) );
+
+					if ( ! IsAnyNegative8( did_hit ) )
+						continue;
+
+					// now, check 3 edges
+					fltx8 hitc1 = _mm256_add_ps( origin[tri->m_nCoordSelect0],
+												 _mm256_mul_ps( isect_t, direction[tri->m_nCoordSelect0] ) );
+					fltx8 hitc2 = _mm256_add_ps( origin[tri->m_nCoordSelect1],
+												 _mm256_mul_ps( isect_t, direction[tri->m_nCoordSelect1] ) );
+
+					// do barycentric coordinate check
+					fltx8 B0 = _mm256_mul_ps( Replicate8( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+					B0 = _mm256_add_ps( B0, _mm256_mul_ps( Replicate8( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
+					B0 = _mm256_add_ps( B0, Replicate8( tri->m_ProjectedEdgeEquations[2] ) );
+
+					did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B0, Epsilons, _CMP_GE_OQ ) );
+
+					fltx8 B1 = _mm256_mul_ps( Replicate8( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
+					B1 = _mm256_add_ps( B1, _mm256_mul_ps( Replicate8( tri->m_ProjectedEdgeEquations[4] ), hitc2 ) );
+					B1 = _mm256_add_ps( B1, Replicate8( tri->m_ProjectedEdgeEquations[5] ) );
+
+					did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B1, Epsilons, _CMP_GE_OQ ) );
+
+					fltx8 B2 = _mm256_add_ps( B1, B0 );
+					did_hit = _mm256_and_ps( did_hit, _mm256_cmp_ps( B2, Ones, _CMP_LE_OQ ) );
+
+					if ( ! IsAnyNegative8( did_hit ) )
+						continue;
+
+					// now, set the hit_id and closest_hit fields for any enabled rays
+					HitIds = Select8( did_hit, _mm256_castsi256_ps( _mm256_set1_epi32( tnum ) ), HitIds );
+					HitDistance = Select8( did_hit, isect_t, HitDistance );
+					SurfaceNormal.x = Select8( did_hit, N.x, SurfaceNormal.x );
+					SurfaceNormal.y = Select8( did_hit, N.y, SurfaceNormal.y );
+					SurfaceNormal.z = Select8( did_hit, N.z, SurfaceNormal.z );
+				} while (--ntris);
+
+				// now, check if all rays have terminated
+				fltx8 raydone=_mm256_cmp_ps(TMax,HitDistance,_CMP_LE_OQ);
+				if (! IsAnyNegative8(raydone))
+					break;
+			}
+
+			if (stack_ptr==&NodeQueue[MAX_NODE_STACK_LEN])
+				break;
+
+			// pop stack!
+			CurNode=stack_ptr->node;
+			TMin=stack_ptr->TMin;
+			TMax=stack_ptr->TMax;
+			stack_ptr++;
+		}
+	}
+
+	_mm256_storeu_ps( (float *)data.m_HitIds, HitIds );
+	_mm256_storeu_ps( data.m_HitDistance, HitDistance );
+	_mm256_storeu_ps( data.m_SurfaceNormal[0], SurfaceNormal.x );
+	_mm256_storeu_ps( data.m_SurfaceNormal[1], SurfaceNormal.y );
+	_mm256_storeu_ps( data.m_SurfaceNormal[2], SurfaceNormal.z );
+
+	// don't leave the upper halves of the ymm registers dirty for the sse code that follows
+	_mm256_zeroupper();
+}
+
+void RayTracingEnvironment::Trace8RaysAVX(const EightRays &rays, const fltx4 TMin4[2], const fltx4 TMax4[2],
+										  int DirectionSignMask, EightRayTracingResult *rslt_out,
+										  int32 skip_id)
+{
+	Trace8Data_t data;
+	for ( int h = 0; h < 2; h++ )
+	{
+		const FourRays &half = rays.half[h];
+		half.Check();
+
+		// reciprocal the same way Trace4Rays does, so both find the same hits
+		FourVectors OneOverRayDir = half.direction;
+		OneOverRayDir.MakeReciprocalSaturate();
+
+		for ( int c = 0; c < 3; c++ )
+		{
+			StoreUnalignedSIMD( data.m_Origin[c] + 4 * h, half.origin[c] );
+			StoreUnalignedSIMD( data.m_Direction[c] + 4 * h, half.direction[c] );
+			StoreUnalignedSIMD( data.m_OneOverRayDir[c] + 4 * h, OneOverRayDir[c] );
+		}
+		StoreUnalignedSIMD( data.m_TMin + 4 * h, TMin4[h] );
+		StoreUnalignedSIMD( data.m_TMax + 4 * h, TMax4[h] );
+	}
+	for ( int c = 0; c < 3; c++ )
+	{
+		data.m_MinBound[c] = m_MinBound[c];
+		data.m_MaxBound[c] = m_MaxBound[c];
+	}
+	data.m_pNodes = OptimizedKDTree.Base();
+	data.m_pTriangleIndices = TriangleIndexList.Base();
+	data.m_ppTriangles = m_IntersectDataList.Base();
+	data.m_DirectionSignMask = DirectionSignMask;
+	data.m_nSkipID = skip_id;
+
+	Trace8Kernel( data );
+
+	for ( int h = 0; h < 2; h++ )
+	{
+		RayTracingResult &rslt = rslt_out->half[h];
+		memcpy( rslt.HitIds, data.m_HitIds + 4 * h, sizeof( rslt.HitIds ) );
+		rslt.HitDistance = LoadUnalignedSIMD( data.m_HitDistance + 4 * h );
+		rslt.surface_normal.x = LoadUnalignedSIMD( data.m_SurfaceNormal[0] + 4 * h );
+		rslt.surface_normal.y = LoadUnalignedSIMD( data.m_SurfaceNormal[1] + 4 * h );
+		rslt.surface_normal.z = LoadUnalignedSIMD( data.m_SurfaceNormal[2] + 4 * h );
+	}
+}
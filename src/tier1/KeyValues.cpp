@@ -28,6 +28,8 @@
 #include "utlhash.h"
 #include "UtlSortVector.h"
 #include "convar.h"
+#include "checksum_crc.h"
+#include "tier0/icommandline.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include <tier0/memdbgon.h>
@@ -46,6 +48,126 @@ static char s_pTokenBuf[KEYVALUES_TOKEN_SIZE];
 #define INTERNALWRITE( pData, len ) InternalWrite( filesystem, f, pBuf, pData, len )
 
 
+//-----------------------------------------------------------------------------
+// Arena backing for KeyValues::CreateArenaRoot() trees. Keys and their string
+// values are carved out of a few large blocks that are released together when
+// the root is deleted; each key is preceded by a KeyValuesArenaHeader_t.
+//-----------------------------------------------------------------------------
+#define KEYVALUES_ARENA_MIN_BLOCK		( 16 * 1024 )
+#define KEYVALUES_ARENA_MAX_BLOCK		( 1024 * 1024 )
+#define KEYVALUES_INDEX_MIN_CHILDREN	16		// parents with fewer children just walk the list
+
+class CKeyValuesArena
+{
+public:
+	CKeyValuesArena( int nSizeHint ) : m_pBlocks( NULL ), m_pRoot( NULL )
+	{
+		m_nNextBlockSize = MIN( MAX( nSizeHint, KEYVALUES_ARENA_MIN_BLOCK ), KEYVALUES_ARENA_MAX_BLOCK );
+	}
+
+	~CKeyValuesArena()
+	{
+		while ( m_pBlocks )
+		{
+			Block_t *pNext = m_pBlocks->m_pNext;
+			free( m_pBlocks );
+			m_pBlocks = pNext;
+		}
+	}
+
+	// Makes sure the next block is large enough for nBytes more data, up to the largest block size
+	void Reserve( int nBytes )
+	{
+		nBytes = MIN( nBytes, KEYVALUES_ARENA_MAX_BLOCK );
+		if ( !m_pBlocks || m_pBlocks->m_nSize - m_pBlocks->m_nUsed < nBytes )
+		{
+			m_nNextBlockSize = MAX( m_nNextBlockSize, nBytes );
+		}
+	}
+
+	void *Alloc( int nBytes )
+	{
+		nBytes = AlignValue( nBytes, 8 );
+		if ( !m_pBlocks || m_pBlocks->m_nSize - m_pBlocks->m_nUsed < nBytes )
+		{
+			int nSize = MAX( m_nNextBlockSize, nBytes );
+			Block_t *pBlock = (Block_t *)malloc( BLOCK_HEADER_SIZE + nSize );
+			pBlock->m_pNext = m_pBlocks;
+			pBlock->m_nSize = nSize;
+			pBlock->m_nUsed = 0;
+			m_pBlocks = pBlock;
+			m_nNextBlockSize = MIN( nSize * 2, KEYVALUES_ARENA_MAX_BLOCK );
+		}
+
+		void *pMem = (char *)m_pBlocks + BLOCK_HEADER_SIZE + m_pBlocks->m_nUsed;
+		m_pBlocks->m_nUsed += nBytes;
+		return pMem;
+	}
+
+	KeyValues *GetRoot() const { return m_pRoot; }
+	void SetRoot( KeyValues *pRoot ) { m_pRoot = pRoot; }
+
+private:
+	struct Block_t
+	{
+		Block_t *m_pNext;
+		int m_nSize;
+		int m_nUsed;
+	};
+	enum { BLOCK_HEADER_SIZE = ( sizeof( Block_t ) + 7 ) & ~7 };
+
+	Block_t *m_pBlocks;
+	int m_nNextBlockSize;
+	KeyValues *m_pRoot;
+};
+
+// Open-addressed symbol -> first child with that name
+struct KeyValuesChildIndex_t
+{
+	int m_nMask;
+	KeyValues *m_pSlots[1];
+};
+
+struct KeyValuesArenaHeader_t
+{
+	CKeyValuesArena *m_pArena;
+	KeyValues *m_pParent;		// NULL for the root and its top level peers
+	KeyValuesChildIndex_t *m_pChildIndex;
+	void *m_pPad;				// keeps the key 8-byte aligned on 32 bit
+};
+
+static inline KeyValuesArenaHeader_t *ArenaHeader( const KeyValues *pKey )
+{
+	Assert( pKey->IsArenaAllocated() );
+	return (KeyValuesArenaHeader_t *)pKey - 1;
+}
+
+static inline unsigned int HashKeySymbol( int keySymbol )
+{
+	unsigned int nHash = (unsigned int)keySymbol * 0x9E3779B1;
+	return nHash ^ ( nHash >> 16 );
+}
+
+//-----------------------------------------------------------------------------
+// Compiled binary sidecars. The header ties the WriteAsBinary() body to the
+// text it was parsed from so a stale sidecar is never used.
+//-----------------------------------------------------------------------------
+#define KEYVALUES_BINARY_CACHE_ID		( ( 'C' << 24 ) + ( 'B' << 16 ) + ( 'V' << 8 ) + 'K' )
+#define KEYVALUES_BINARY_CACHE_VERSION	1
+
+#define KEYVALUES_BINARY_CACHE_ESCAPES	0x01
+
+static bool UseBinaryCache()
+{
+	static int s_nUseBinaryCache = -1;
+	if ( s_nUseBinaryCache < 0 )
+	{
+		s_nUseBinaryCache = CommandLine()->CheckParm( "-nokvcache" ) ? 0 : 1;
+	}
+	return s_nUseBinaryCache != 0;
+}
+
+
 // a simple class to keep track of a stack of valid parsed symbols
 const int MAX_ERROR_STACK = 64;
 class CKeyValuesErrorStack
@@ -449,8 +571,7 @@ void KeyValues::Init()
 	m_bHasEscapeSequences = false;
 	m_bEvaluateConditionals = true;
 
-	// for future proof
-	memset( unused, 0, sizeof(unused) );
+	m_nArenaFlags = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -468,24 +589,25 @@ KeyValues::~KeyValues()
 //-----------------------------------------------------------------------------
 void KeyValues::RemoveEverything()
 {
+	InvalidateChildIndex();
+
 	KeyValues *dat;
 	KeyValues *datNext = NULL;
 	for ( dat = m_pSub; dat != NULL; dat = datNext )
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		dat->deleteThis();
 	}
 
 	for ( dat = m_pPeer; dat && dat != this; dat = datNext )
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		dat->deleteThis();
 	}
 
-	delete [] m_sValue;
-	m_sValue = NULL;
+	FreeValueString();
 	delete [] m_wsValue;
 	m_wsValue = NULL;
 }
@@ -636,6 +758,25 @@ bool KeyValues::LoadFromFile( IBaseFileSystem *filesystem, const char *resourceN
 #ifdef WIN32
 	Assert( IsX360() || ( IsPC() && _heapchk() == _HEAPOK ) );
 #endif
+	// A compiled sidecar with the text's file time saves even reading the text.
+	// Only used for a fresh load, since a text load appends to what's there.
+	CUtlBuffer cacheBuf;
+	long nTextFileTime = 0;
+	bool bHaveCache = false;
+	if ( UseBinaryCache() && !m_pSub && !m_pPeer )
+	{
+		char szCacheName[MAX_PATH];
+		Q_snprintf( szCacheName, sizeof( szCacheName ), "%s" KEYVALUES_BINARY_CACHE_EXT, resourceName );
+		// a failed read just means there's no sidecar, so don't pay for a FileExists() lookup first
+		if ( filesystem->ReadFile( szCacheName, pathID, cacheBuf ) )
+		{
+			bHaveCache = true;
+			nTextFileTime = filesystem->GetFileTime( resourceName, pathID );
+			if ( LoadFromBinaryCache( cacheBuf, nTextFileTime ) )
+				return true;
+		}
+	}
+
 	FileHandle_t f = filesystem->Open(resourceName, "rb", pathID);
 	if ( !f )
 		return false;
@@ -658,7 +799,12 @@ bool KeyValues::LoadFromFile( IBaseFileSystem *filesystem, const char *resourceN
 	{
 		buffer[fileSize] = 0; // null terminate file as EOF
 		buffer[fileSize+1] = 0; // double NULL terminating in case this is a unicode file
-		bRetOK = LoadFromBuffer( resourceName, buffer, filesystem );
+
+		cacheBuf.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+		if ( !bHaveCache || !LoadFromBinaryCache( cacheBuf, nTextFileTime, buffer, fileSize ) )
+		{
+			bRetOK = LoadFromBuffer( resourceName, buffer, filesystem );
+		}
 	}
 
 	((IFileSystem *)filesystem)->FreeOptimalReadBuffer( buffer );
@@ -896,6 +1042,10 @@ void KeyValues::SaveKeyToFile( KeyValues *dat, IBaseFileSystem *filesystem, File
 //-----------------------------------------------------------------------------
 KeyValues *KeyValues::FindKey(int keySymbol) const
 {
+	KeyValues *pIndexed;
+	if ( FindIndexedKey( keySymbol, &pIndexed ) )
+		return pIndexed;
+
 	for (KeyValues *dat = m_pSub; dat != NULL; dat = dat->m_pPeer)
 	{
 		if (dat->m_iKeyName == keySymbol)
@@ -941,15 +1091,26 @@ KeyValues *KeyValues::FindKey(const char *keyName, bool bCreate)
 
 	KeyValues *lastItem = NULL;
 	KeyValues *dat;
-	// find the searchStr in the current peer list
-	for (dat = m_pSub; dat != NULL; dat = dat->m_pPeer)
+	if ( FindIndexedKey( iSearchStr, &dat ) )
 	{
-		lastItem = dat;	// record the last item looked at (for if we need to append to the end of the list)
-
-		// symbol compare
-		if (dat->m_iKeyName == iSearchStr)
+		// the index is authoritative, only walk to the tail if we're going to append
+		if ( !dat && bCreate )
 		{
-			break;
+			lastItem = FindLastSubKey();
+		}
+	}
+	else
+	{
+		// find the searchStr in the current peer list
+		for (dat = m_pSub; dat != NULL; dat = dat->m_pPeer)
+		{
+			lastItem = dat;	// record the last item looked at (for if we need to append to the end of the list)
+
+			// symbol compare
+			if (dat->m_iKeyName == iSearchStr)
+			{
+				break;
+			}
 		}
 	}
 
@@ -964,7 +1125,8 @@ KeyValues *KeyValues::FindKey(const char *keyName, bool bCreate)
 		if (bCreate)
 		{
 			// we need to create a new key
-			dat = new KeyValues( searchStr );
+			dat = CreateKeyInArena( searchStr, this );
+			InvalidateChildIndex();
 //			Assert(dat != NULL);
 
 			dat->UsesEscapeSequences( m_bHasEscapeSequences != 0 );	// use same format as parent
@@ -1044,7 +1206,7 @@ KeyValues* KeyValues::CreateKey( const char *keyName )
 KeyValues* KeyValues::CreateKeyUsingKnownLastChild( const char *keyName, KeyValues *pLastChild )
 {
 	// Create a new key
-	KeyValues* dat = new KeyValues( keyName );
+	KeyValues* dat = CreateKeyInArena( keyName, this );
 
 	dat->UsesEscapeSequences( m_bHasEscapeSequences != 0 ); // use same format as parent does
 	dat->UsesConditionals( m_bEvaluateConditionals != 0 );
@@ -1062,6 +1224,12 @@ void KeyValues::AddSubkeyUsingKnownLastChild( KeyValues *pSubkey, KeyValues *pLa
 	Assert( pSubkey != NULL );
 	Assert( pSubkey->m_pPeer == NULL );
 
+	InvalidateChildIndex();
+	if ( pSubkey->IsArenaAllocated() )
+	{
+		ArenaHeader( pSubkey )->m_pParent = this;
+	}
+
 	// Empty child list?
 	if ( pLastChild == NULL )
 	{
@@ -1097,6 +1265,12 @@ void KeyValues::AddSubKey( KeyValues *pSubkey )
 	Assert( pSubkey != NULL );
 	Assert( pSubkey->m_pPeer == NULL );
 
+	InvalidateChildIndex();
+	if ( pSubkey->IsArenaAllocated() )
+	{
+		ArenaHeader( pSubkey )->m_pParent = this;
+	}
+
 	// add into subkey list
 	if ( m_pSub == NULL )
 	{
@@ -1124,6 +1298,12 @@ void KeyValues::RemoveSubKey(KeyValues *subKey)
 	if (!subKey)
 		return;
 
+	InvalidateChildIndex();
+	if ( subKey->IsArenaAllocated() )
+	{
+		ArenaHeader( subKey )->m_pParent = NULL;
+	}
+
 	// check the list pointer
 	if (m_pSub == subKey)
 	{
@@ -1172,6 +1352,8 @@ KeyValues *KeyValues::FindLastSubKey()
 //-----------------------------------------------------------------------------
 void KeyValues::SetNextKey( KeyValues *pDat )
 {
+	// relinking behind our parent's back changes its child list
+	InvalidateParentIndex();
 	m_pPeer = pDat;
 }
 
@@ -1507,7 +1689,7 @@ void KeyValues::SetColor( const char *keyName, Color value)
 void KeyValues::SetStringValue( char const *strValue )
 {
 	// delete the old value
-	delete [] m_sValue;
+	FreeValueString();
 	// make sure we're not storing the WSTRING  - as we're converting over to STRING
 	delete [] m_wsValue;
 	m_wsValue = NULL;
@@ -1541,7 +1723,7 @@ void KeyValues::SetString( const char *keyName, const char *value )
 		}
 
 		// delete the old value
-		delete [] dat->m_sValue;
+		dat->FreeValueString();
 		// make sure we're not storing the WSTRING  - as we're converting over to STRING
 		delete [] dat->m_wsValue;
 		dat->m_wsValue = NULL;
@@ -1572,8 +1754,7 @@ void KeyValues::SetWString( const char *keyName, const wchar_t *value )
 		// delete the old value
 		delete [] dat->m_wsValue;
 		// make sure we're not storing the STRING  - as we're converting over to WSTRING
-		delete [] dat->m_sValue;
-		dat->m_sValue = NULL;
+		dat->FreeValueString();
 
 		if (!value)
 		{
@@ -1614,7 +1795,7 @@ void KeyValues::SetUint64( const char *keyName, uint64 value )
 	if ( dat )
 	{
 		// delete the old value
-		delete [] dat->m_sValue;
+		dat->FreeValueString();
 		// make sure we're not storing the WSTRING  - as we're converting over to STRING
 		delete [] dat->m_wsValue;
 		dat->m_wsValue = NULL;
@@ -1641,6 +1822,7 @@ void KeyValues::SetFloat( const char *keyName, float value )
 
 void KeyValues::SetName( const char * setName )
 {
+	InvalidateParentIndex();
 	m_iKeyName = s_pfGetSymbolForString( setName, true );
 }
 
@@ -1764,8 +1946,10 @@ void KeyValues::RecursiveCopyKeyValues( KeyValues& src )
 
 KeyValues& KeyValues::operator=( KeyValues& src )
 {
+	char nArenaFlags = m_nArenaFlags & ARENA_NODE;
 	RemoveEverything();
 	Init();	// reset all values
+	m_nArenaFlags = nArenaFlags;
 	RecursiveCopyKeyValues( src );
 	return *this;
 }
@@ -1779,6 +1963,7 @@ void KeyValues::CopySubkeys( KeyValues *pParent ) const
 	// recursively copy subkeys
 	// Also maintain ordering....
 	KeyValues *pPrev = NULL;
+	pParent->InvalidateChildIndex();
 	for ( KeyValues *sub = m_pSub; sub != NULL; sub = sub->m_pPeer )
 	{
 		// take a copy of the subkey
@@ -1886,7 +2071,11 @@ bool KeyValues::IsEmpty(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::Clear( void )
 {
-	delete m_pSub;
+	InvalidateChildIndex();
+	if ( m_pSub )
+	{
+		m_pSub->deleteThis();
+	}
 	m_pSub = NULL;
 	m_iDataType = TYPE_NONE;
 }
@@ -1908,6 +2097,18 @@ KeyValues::types_t KeyValues::GetDataType(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::deleteThis()
 {
+	if ( m_nArenaFlags & ARENA_NODE )
+	{
+		// arena keys only run their destructor; the root takes the arena down with it
+		CKeyValuesArena *pArena = ArenaHeader( this )->m_pArena;
+		this->~KeyValues();
+		if ( pArena->GetRoot() == this )
+		{
+			delete pArena;
+		}
+		return;
+	}
+
 	delete this;
 }
 
@@ -2091,6 +2292,12 @@ bool EvaluateConditional( const char *str )
 //-----------------------------------------------------------------------------
 bool KeyValues::LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBaseFileSystem* pFileSystem, const char *pPathID )
 {
+	if ( m_nArenaFlags & ARENA_NODE )
+	{
+		// parsed trees run to a few times the size of their text
+		ArenaHeader( this )->m_pArena->Reserve( MIN( buf.TellMaxPut(), KEYVALUES_ARENA_MAX_BLOCK / 4 ) * 4 );
+	}
+
 	KeyValues *pPreviousKey = NULL;
 	KeyValues *pCurrentKey = this;
 	CUtlVector< KeyValues * > includedKeys;
@@ -2142,7 +2349,7 @@ bool KeyValues::LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBase
 
 		if ( !pCurrentKey )
 		{
-			pCurrentKey = new KeyValues( s );
+			pCurrentKey = CreateKeyInArena( s, NULL );
 			Assert( pCurrentKey );
 
 			pCurrentKey->UsesEscapeSequences( m_bHasEscapeSequences != 0 ); // same format has parent use
@@ -2216,6 +2423,14 @@ bool KeyValues::LoadFromBuffer( char const *resourceName, CUtlBuffer &buf, IBase
 		}
 	}
 
+	if ( m_nArenaFlags & ARENA_NODE )
+	{
+		for ( KeyValues *pKey = this; pKey != NULL; pKey = pKey->m_pPeer )
+		{
+			pKey->BuildChildIndices();
+		}
+	}
+
 	g_KeyValuesErrorStack.SetFilename( "" );	
 
 	return true;
@@ -2328,11 +2543,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 				break;
 			}
 			
-			if (dat->m_sValue)
-			{
-				delete[] dat->m_sValue;
-				dat->m_sValue = NULL;
-			}
+			dat->FreeValueString();
 
 			int len = Q_strlen( value );
 
@@ -2372,7 +2583,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 							digit -= 'A' - ( '9' + 1 );
 					retVal = ( retVal * 16 ) + ( digit - '0' );
 				}
-				dat->m_sValue = new char[sizeof(uint64)];
+				dat->m_sValue = dat->AllocValueString( sizeof(uint64) );
 				*((uint64 *)dat->m_sValue) = retVal;
 				dat->m_iDataType = TYPE_UINT64;
 			}
@@ -2394,7 +2605,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 			if (dat->m_iDataType == TYPE_STRING)
 			{
 				// copy in the string information
-				dat->m_sValue = new char[len+1];
+				dat->m_sValue = dat->AllocValueString( len+1 );
 				Q_memcpy( dat->m_sValue, value, len+1 );
 			}
 
@@ -2535,8 +2746,15 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 	if ( !buffer.IsValid() ) // must be valid, no overflows etc
 		return false;
 
+	// keep the parse settings and arena placement, like a text load would
+	char nArenaFlags = m_nArenaFlags & ARENA_NODE;
+	char bHasEscapeSequences = m_bHasEscapeSequences;
+	char bEvaluateConditionals = m_bEvaluateConditionals;
 	RemoveEverything(); // remove current content
 	Init();	// reset
+	m_nArenaFlags = nArenaFlags;
+	m_bHasEscapeSequences = bHasEscapeSequences;
+	m_bEvaluateConditionals = bEvaluateConditionals;
 	
 	if ( nStackDepth > 100 )
 	{
@@ -2566,7 +2784,15 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 		{
 		case TYPE_NONE:
 			{
-				dat->m_pSub = new KeyValues("");
+				// an empty section is written as just the end of peers marker
+				int nSubStart = buffer.TellGet();
+				if ( buffer.GetUnsignedChar() == TYPE_NUMTYPES )
+					break;
+				buffer.SeekGet( CUtlBuffer::SEEK_HEAD, nSubStart );
+
+				dat->m_pSub = dat->CreateKeyInArena( "", dat );
+				dat->m_pSub->UsesEscapeSequences( m_bHasEscapeSequences != 0 );
+				dat->m_pSub->UsesConditionals( m_bEvaluateConditionals != 0 );
 				dat->m_pSub->ReadAsBinary( buffer, nStackDepth + 1 );
 				break;
 			}
@@ -2577,7 +2803,7 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 				token[KEYVALUES_TOKEN_SIZE-1] = 0;
 
 				int len = Q_strlen( token );
-				dat->m_sValue = new char[len + 1];
+				dat->m_sValue = dat->AllocValueString( len + 1 );
 				Q_memcpy( dat->m_sValue, token, len+1 );
 								
 				break;
@@ -2596,7 +2822,7 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 
 		case TYPE_UINT64:
 			{
-				dat->m_sValue = new char[sizeof(uint64)];
+				dat->m_sValue = dat->AllocValueString( sizeof(uint64) );
 				*((uint64 *)dat->m_sValue) = buffer.GetInt64();
 				break;
 			}
@@ -2632,13 +2858,116 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer, int nStackDepth )
 			break;
 
 		// new peer follows
-		dat->m_pPeer = new KeyValues("");
+		KeyValues *pParent = IsArenaAllocated() ? ArenaHeader( this )->m_pParent : NULL;
+		dat->m_pPeer = CreateKeyInArena( "", pParent );
 		dat = dat->m_pPeer;
+		dat->UsesEscapeSequences( m_bHasEscapeSequences != 0 );
+		dat->UsesConditionals( m_bEvaluateConditionals != 0 );
 	}
 
 	return buffer.IsValid();
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: The sidecar only captures the file itself, so anything that pulls
+//			in other files or depends on the platform stays text
+//-----------------------------------------------------------------------------
+bool KeyValues::CanCompileBinaryCache( const char *pText, int nTextSize )
+{
+	// Unicode files are converted on load; not worth caching
+	if ( nTextSize >= 2 && (uint8)pText[0] == 0xFF && (uint8)pText[1] == 0xFE )
+		return false;
+
+	for ( int i = 0; i < nTextSize; i++ )
+	{
+		if ( pText[i] == '#' )
+		{
+			if ( !Q_strnicmp( pText + i, "#include", 8 ) || !Q_strnicmp( pText + i, "#base", 5 ) )
+				return false;
+		}
+		else if ( pText[i] == '[' )
+		{
+			// [$WIN32], [!$X360] and friends
+			if ( i + 1 < nTextSize && ( pText[i + 1] == '$' || pText[i + 1] == '!' ) )
+				return false;
+		}
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Writes the sidecar for a tree that was just parsed from pText
+//-----------------------------------------------------------------------------
+bool KeyValues::WriteBinaryCache( CUtlBuffer &buf, const void *pText, int nTextSize, long nTextFileTime )
+{
+	if ( buf.IsText() )
+		return false;
+
+	buf.PutInt( KEYVALUES_BINARY_CACHE_ID );
+	buf.PutInt( KEYVALUES_BINARY_CACHE_VERSION );
+	buf.PutInt( m_bHasEscapeSequences ? KEYVALUES_BINARY_CACHE_ESCAPES : 0 );
+	buf.PutInt( nTextSize );
+	buf.PutUnsignedInt( CRC32_ProcessSingleBuffer( pText, nTextSize ) );
+	buf.PutInt64( nTextFileTime );
+
+	return WriteAsBinary( buf );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Loads a sidecar if it matches the text by file time or, when the
+//			text is supplied, by CRC. Returns false and leaves us untouched
+//			when the sidecar is stale or damaged.
+//-----------------------------------------------------------------------------
+bool KeyValues::LoadFromBinaryCache( CUtlBuffer &buf, long nTextFileTime, const void *pText, int nTextSize )
+{
+	if ( buf.IsText() || buf.TellMaxPut() - buf.TellGet() < 6 * (int)sizeof( int ) )
+		return false;
+
+	if ( buf.GetInt() != KEYVALUES_BINARY_CACHE_ID || buf.GetInt() != KEYVALUES_BINARY_CACHE_VERSION )
+		return false;
+
+	int nFlags = buf.GetInt();
+	int nCachedTextSize = buf.GetInt();
+	CRC32_t nCachedTextCRC = buf.GetUnsignedInt();
+	int64 nCachedTextFileTime = buf.GetInt64();
+
+	if ( nFlags != ( m_bHasEscapeSequences ? KEYVALUES_BINARY_CACHE_ESCAPES : 0 ) )
+		return false;
+
+	if ( nTextFileTime == 0 || nCachedTextFileTime != nTextFileTime )
+	{
+		// file times don't survive copies and packing, fall back to the contents
+		if ( !pText || nTextSize != nCachedTextSize || CRC32_ProcessSingleBuffer( pText, nTextSize ) != nCachedTextCRC )
+			return false;
+	}
+
+	KeyValues *pChain = m_pChain;
+	bool bOK = ReadAsBinary( buf ) && buf.TellGet() == buf.TellMaxPut();
+	if ( !bOK )
+	{
+		char nArenaFlags = m_nArenaFlags & ARENA_NODE;
+		char bHasEscapeSequences = m_bHasEscapeSequences;
+		char bEvaluateConditionals = m_bEvaluateConditionals;
+		RemoveEverything();
+		Init();
+		m_nArenaFlags = nArenaFlags;
+		m_bHasEscapeSequences = bHasEscapeSequences;
+		m_bEvaluateConditionals = bEvaluateConditionals;
+	}
+	m_pChain = pChain;
+
+	if ( bOK && ( m_nArenaFlags & ARENA_NODE ) )
+	{
+		for ( KeyValues *pKey = this; pKey != NULL; pKey = pKey->m_pPeer )
+		{
+			pKey->BuildChildIndices();
+		}
+	}
+
+	return bOK;
+}
+
 #include "tier0/memdbgoff.h"
 
 //-----------------------------------------------------------------------------
@@ -2671,6 +3000,172 @@ void KeyValues::operator delete( void *pMem, int nBlockUse, const char *pFileNam
 	KeyValuesSystem()->FreeKeyValuesMemory(pMem);
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Creates an empty key that owns an arena for everything loaded into it
+//-----------------------------------------------------------------------------
+KeyValues *KeyValues::CreateArenaRoot( const char *setName, int nSizeHint )
+{
+	CKeyValuesArena *pArena = new CKeyValuesArena( nSizeHint );
+
+	KeyValuesArenaHeader_t *pHeader = (KeyValuesArenaHeader_t *)pArena->Alloc( sizeof( KeyValuesArenaHeader_t ) + sizeof( KeyValues ) );
+	pHeader->m_pArena = pArena;
+	pHeader->m_pParent = NULL;
+	pHeader->m_pChildIndex = NULL;
+
+	KeyValues *pRoot = new ( pHeader + 1 ) KeyValues( setName );
+	pRoot->m_nArenaFlags = ARENA_NODE;
+	pArena->SetRoot( pRoot );
+	return pRoot;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Creates a key in the same arena as this one, or on the heap
+//-----------------------------------------------------------------------------
+KeyValues *KeyValues::CreateKeyInArena( const char *keyName, KeyValues *pParent )
+{
+	if ( !( m_nArenaFlags & ARENA_NODE ) )
+		return new KeyValues( keyName );
+
+	CKeyValuesArena *pArena = ArenaHeader( this )->m_pArena;
+	KeyValuesArenaHeader_t *pHeader = (KeyValuesArenaHeader_t *)pArena->Alloc( sizeof( KeyValuesArenaHeader_t ) + sizeof( KeyValues ) );
+	pHeader->m_pArena = pArena;
+	pHeader->m_pParent = pParent;
+	pHeader->m_pChildIndex = NULL;
+
+	KeyValues *pKey = new ( pHeader + 1 ) KeyValues( keyName );
+	pKey->m_nArenaFlags = ARENA_NODE;
+	return pKey;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Storage for m_sValue; the caller must have freed the previous value
+//-----------------------------------------------------------------------------
+char *KeyValues::AllocValueString( int len )
+{
+	Assert( !m_sValue );
+	if ( m_nArenaFlags & ARENA_NODE )
+	{
+		m_nArenaFlags |= ARENA_VALUE;
+		return (char *)ArenaHeader( this )->m_pArena->Alloc( len );
+	}
+
+	return new char[len];
+}
+
+void KeyValues::FreeValueString()
+{
+	if ( m_nArenaFlags & ARENA_VALUE )
+	{
+		m_nArenaFlags &= ~ARENA_VALUE;
+	}
+	else
+	{
+		delete [] m_sValue;
+	}
+	m_sValue = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Child index maintenance. Anything that changes which keys hang off
+//			a parent, or what they're called, drops the parent's index; it is
+//			only rebuilt by the next LoadFromBuffer(). Renaming a key finds its
+//			parent through the arena header, so only parents whose children
+//			are all arena keys get an index.
+//-----------------------------------------------------------------------------
+void KeyValues::InvalidateChildIndex()
+{
+	if ( m_nArenaFlags & ARENA_NODE )
+	{
+		ArenaHeader( this )->m_pChildIndex = NULL;
+	}
+}
+
+void KeyValues::InvalidateParentIndex()
+{
+	if ( m_nArenaFlags & ARENA_NODE )
+	{
+		KeyValues *pParent = ArenaHeader( this )->m_pParent;
+		if ( pParent )
+		{
+			pParent->InvalidateChildIndex();
+		}
+	}
+}
+
+void KeyValues::BuildChildIndices()
+{
+	if ( !( m_nArenaFlags & ARENA_NODE ) )
+		return;
+
+	int nChildren = 0;
+	bool bAllArena = true;
+	for ( KeyValues *pSub = m_pSub; pSub != NULL; pSub = pSub->m_pPeer )
+	{
+		if ( pSub->m_nArenaFlags & ARENA_NODE )
+		{
+			ArenaHeader( pSub )->m_pParent = this;
+		}
+		else
+		{
+			// a heap key can't tell us when it's renamed
+			bAllArena = false;
+		}
+		pSub->BuildChildIndices();
+		++nChildren;
+	}
+
+	KeyValuesArenaHeader_t *pHeader = ArenaHeader( this );
+	pHeader->m_pChildIndex = NULL;
+	if ( nChildren < KEYVALUES_INDEX_MIN_CHILDREN || !bAllArena )
+		return;
+
+	// at most half full, so probe sequences stay short
+	int nSlots = KEYVALUES_INDEX_MIN_CHILDREN * 2;
+	while ( nSlots < nChildren * 2 )
+	{
+		nSlots <<= 1;
+	}
+	KeyValuesChildIndex_t *pIndex = (KeyValuesChildIndex_t *)pHeader->m_pArena->Alloc( sizeof( KeyValuesChildIndex_t ) + ( nSlots - 1 ) * sizeof( KeyValues * ) );
+	pIndex->m_nMask = nSlots - 1;
+	memset( pIndex->m_pSlots, 0, nSlots * sizeof( KeyValues * ) );
+
+	for ( KeyValues *pSub = m_pSub; pSub != NULL; pSub = pSub->m_pPeer )
+	{
+		// FindKey() returns the first match, so later duplicates stay out
+		unsigned int i = HashKeySymbol( pSub->m_iKeyName ) & pIndex->m_nMask;
+		while ( pIndex->m_pSlots[i] && pIndex->m_pSlots[i]->m_iKeyName != pSub->m_iKeyName )
+		{
+			i = ( i + 1 ) & pIndex->m_nMask;
+		}
+
+		if ( !pIndex->m_pSlots[i] )
+		{
+			pIndex->m_pSlots[i] = pSub;
+		}
+	}
+
+	pHeader->m_pChildIndex = pIndex;
+}
+
+bool KeyValues::FindIndexedKey( int keySymbol, KeyValues **ppKey ) const
+{
+	if ( !( m_nArenaFlags & ARENA_NODE ) )
+		return false;
+
+	const KeyValuesChildIndex_t *pIndex = ArenaHeader( this )->m_pChildIndex;
+	if ( !pIndex )
+		return false;
+
+	unsigned int i = HashKeySymbol( keySymbol ) & pIndex->m_nMask;
+	while ( pIndex->m_pSlots[i] && pIndex->m_pSlots[i]->m_iKeyName != keySymbol )
+	{
+		i = ( i + 1 ) & pIndex->m_nMask;
+	}
+
+	*ppKey = pIndex->m_pSlots[i];
+	return true;
+}
+
 void KeyValues::UnpackIntoStructure( KeyValuesUnpackStructure const *pUnpackTable, void *pDest, size_t DestSizeInBytes )
 {
 #ifdef DBGFLAG_ASSERT
@@ -119,6 +119,130 @@ public:
 static CBitWriteMasksInit g_BitWriteMasksInit;
 
 
+// ---------------------------------------------------------------------------------------- //
+// Accumulators for the batched readers and writers. Bits are gathered in a 64-bit
+// register and moved a dword at a time; the caller has already made sure every bit
+// it touches lies inside the buffer, so there are no per-field checks.
+// ---------------------------------------------------------------------------------------- //
+
+// Most bits a single WriteBitCoord / WriteBitVec3Coord can produce
+#define MAX_BITCOORD_BITS		( 3 + COORD_INTEGER_BITS + COORD_FRACTIONAL_BITS )
+#define MAX_BITVEC3COORD_BITS	( 3 + 3 * MAX_BITCOORD_BITS )
+
+class CBitWriteAccumulator
+{
+public:
+	CBitWriteAccumulator( unsigned long *pData, int iCurBit ) : m_pData( pData ), m_iDWord( iCurBit >> 5 ), m_nBits( iCurBit & 31 )
+	{
+		// keep what's already been written to the first dword
+		m_nAccum = m_nBits ? ( LoadLittleDWord( pData, m_iDWord ) & g_ExtraMasks[m_nBits] ) : 0;
+	}
+
+	FORCEINLINE void Write( unsigned int nData, int numbits )
+	{
+		m_nAccum |= (uint64)( nData & g_ExtraMasks[numbits] ) << m_nBits;
+		m_nBits += numbits;
+		if ( m_nBits >= 32 )
+		{
+			StoreLittleDWord( m_pData, m_iDWord++, (uint32)m_nAccum );
+			m_nAccum >>= 32;
+			m_nBits -= 32;
+		}
+	}
+
+	// Stores the partial last dword and returns the new bit position
+	int Finish()
+	{
+		if ( m_nBits )
+		{
+			// bits past the end are left alone, like WriteUBitLong does
+			unsigned long nMask = g_ExtraMasks[m_nBits];
+			unsigned long nOld = LoadLittleDWord( m_pData, m_iDWord );
+			StoreLittleDWord( m_pData, m_iDWord, ( nOld & ~nMask ) | ( (uint32)m_nAccum & nMask ) );
+		}
+		return ( m_iDWord << 5 ) + m_nBits;
+	}
+
+private:
+	unsigned long *m_pData;
+	uint64 m_nAccum;
+	int m_iDWord;
+	int m_nBits;
+};
+
+class CBitReadAccumulator
+{
+public:
+	CBitReadAccumulator( const unsigned char *pData, int iCurBit ) : m_pData( (const unsigned long *)pData ), m_nAccum( 0 ), m_iCurBit( iCurBit ), m_nAvail( 0 ) {}
+
+	FORCEINLINE unsigned int Read( int numbits )
+	{
+		// only dwords holding bits we actually read are loaded, same as ReadUBitLong
+		while ( m_nAvail < numbits )
+		{
+			int iLoadBit = m_iCurBit + m_nAvail;
+			uint64 nWord = (uint32)LoadLittleDWord( m_pData, iLoadBit >> 5 ) >> ( iLoadBit & 31 );
+			m_nAccum |= nWord << m_nAvail;
+			m_nAvail += 32 - ( iLoadBit & 31 );
+		}
+
+		unsigned int nResult = (uint32)m_nAccum & g_ExtraMasks[numbits];
+		m_nAccum >>= numbits;
+		m_nAvail -= numbits;
+		m_iCurBit += numbits;
+		return nResult;
+	}
+
+	int GetCurBit() const { return m_iCurBit; }
+
+private:
+	const unsigned long *m_pData;
+	uint64 m_nAccum;
+	int m_iCurBit;
+	int m_nAvail;
+};
+
+// Same encoding as bf_write::WriteBitCoord
+static FORCEINLINE void AccumulateBitCoord( CBitWriteAccumulator &accum, const float f )
+{
+	int		signbit = (f <= -COORD_RESOLUTION);
+	int		intval = (int)abs(f);
+	int		fractval = abs((int)(f*COORD_DENOMINATOR)) & (COORD_DENOMINATOR-1);
+
+	accum.Write( ( intval ? 1 : 0 ) | ( fractval ? 2 : 0 ), 2 );
+
+	if ( intval || fractval )
+	{
+		accum.Write( signbit, 1 );
+
+		if ( intval )
+		{
+			accum.Write( (unsigned int)( intval - 1 ), COORD_INTEGER_BITS );
+		}
+
+		if ( fractval )
+		{
+			accum.Write( (unsigned int)fractval, COORD_FRACTIONAL_BITS );
+		}
+	}
+}
+
+// Same decoding as bf_read::ReadBitCoord
+static FORCEINLINE float AccumulatedBitCoord( CBitReadAccumulator &accum )
+{
+	unsigned int flags = accum.Read( 2 );
+	if ( !flags )
+		return 0.0f;
+
+	int signbit = accum.Read( 1 );
+	int intval = ( flags & 1 ) ? accum.Read( COORD_INTEGER_BITS ) + 1 : 0;
+	int fractval = ( flags & 2 ) ? accum.Read( COORD_FRACTIONAL_BITS ) : 0;
+
+	float value = intval + ((float)fractval * COORD_RESOLUTION);
+	return signbit ? -value : value;
+}
+
+
 // ---------------------------------------------------------------------------------------- //
 // bf_write
 // ---------------------------------------------------------------------------------------- //
@@ -716,6 +840,92 @@ void bf_write::WriteBitAngles( const QAngle& fa )
 	WriteBitVec3Coord( tmp );
 }
 
+void bf_write::WriteUBitLongs( const unsigned int *pData, int nCount, int numbits )
+{
+	Assert( numbits > 0 && numbits <= 32 );
+	if ( nCount <= 0 )
+		return;
+
+	// Not sure to fit; the single-field path overflows at exactly the same place
+	if ( GetNumBitsLeft() / numbits < nCount )
+	{
+		for ( int i = 0; i < nCount; i++ )
+		{
+			WriteUBitLong( pData[i], numbits );
+		}
+		return;
+	}
+
+	CBitWriteAccumulator accum( m_pData, m_iCurBit );
+	for ( int i = 0; i < nCount; i++ )
+	{
+#ifdef _DEBUG
+		if ( numbits < 32 && pData[i] >= (unsigned long)(1 << numbits) )
+		{
+			CallErrorHandler( BITBUFERROR_VALUE_OUT_OF_RANGE, GetDebugName() );
+		}
+#endif
+		accum.Write( pData[i], numbits );
+	}
+	m_iCurBit = accum.Finish();
+}
+
+void bf_write::WriteBitCoords( const float *pValues, int nCount )
+{
+	if ( nCount <= 0 )
+		return;
+
+	if ( GetNumBitsLeft() / MAX_BITCOORD_BITS < nCount )
+	{
+		for ( int i = 0; i < nCount; i++ )
+		{
+			WriteBitCoord( pValues[i] );
+		}
+		return;
+	}
+
+	CBitWriteAccumulator accum( m_pData, m_iCurBit );
+	for ( int i = 0; i < nCount; i++ )
+	{
+		AccumulateBitCoord( accum, pValues[i] );
+	}
+	m_iCurBit = accum.Finish();
+}
+
+void bf_write::WriteBitVec3Coords( const Vector *pVecs, int nCount )
+{
+	if ( nCount <= 0 )
+		return;
+
+	if ( GetNumBitsLeft() / MAX_BITVEC3COORD_BITS < nCount )
+	{
+		for ( int i = 0; i < nCount; i++ )
+		{
+			WriteBitVec3Coord( pVecs[i] );
+		}
+		return;
+	}
+
+	CBitWriteAccumulator accum( m_pData, m_iCurBit );
+	for ( int i = 0; i < nCount; i++ )
+	{
+		const Vector &fa = pVecs[i];
+		int xflag = (fa[0] >= COORD_RESOLUTION) || (fa[0] <= -COORD_RESOLUTION);
+		int yflag = (fa[1] >= COORD_RESOLUTION) || (fa[1] <= -COORD_RESOLUTION);
+		int zflag = (fa[2] >= COORD_RESOLUTION) || (fa[2] <= -COORD_RESOLUTION);
+
+		accum.Write( xflag | ( yflag << 1 ) | ( zflag << 2 ), 3 );
+
+		if ( xflag )
+			AccumulateBitCoord( accum, fa[0] );
+		if ( yflag )
+			AccumulateBitCoord( accum, fa[1] );
+		if ( zflag )
+			AccumulateBitCoord( accum, fa[2] );
+	}
+	m_iCurBit = accum.Finish();
+}
+
 void bf_write::WriteChar(int val)
 {
 	WriteSBitLong(val, sizeof(char) << 3);
@@ -1341,6 +1551,78 @@ void bf_read::ReadBitAngles( QAngle& fa )
 	fa.Init( tmp.x, tmp.y, tmp.z );
 }
 
+void bf_read::ReadUBitLongs( unsigned int *pOut, int nCount, int numbits )
+{
+	Assert( numbits > 0 && numbits <= 32 );
+	if ( nCount <= 0 )
+		return;
+
+	if ( GetNumBitsLeft() / numbits < nCount )
+	{
+		for ( int i = 0; i < nCount; i++ )
+		{
+			pOut[i] = ReadUBitLong( numbits );
+		}
+		return;
+	}
+
+	CBitReadAccumulator accum( m_pData, m_iCurBit );
+	for ( int i = 0; i < nCount; i++ )
+	{
+		pOut[i] = accum.Read( numbits );
+	}
+	m_iCurBit = accum.GetCurBit();
+}
+
+void bf_read::ReadBitCoords( float *pOut, int nCount )
+{
+	if ( nCount <= 0 )
+		return;
+
+	// Coords are variable length, so this is only an upper bound
+	if ( GetNumBitsLeft() / MAX_BITCOORD_BITS < nCount )
+	{
+		for ( int i = 0; i < nCount; i++ )
+		{
+			pOut[i] = ReadBitCoord();
+		}
+		return;
+	}
+
+	CBitReadAccumulator accum( m_pData, m_iCurBit );
+	for ( int i = 0; i < nCount; i++ )
+	{
+		pOut[i] = AccumulatedBitCoord( accum );
+	}
+	m_iCurBit = accum.GetCurBit();
+}
+
+void bf_read::ReadBitVec3Coords( Vector *pOut, int nCount )
+{
+	if ( nCount <= 0 )
+		return;
+
+	if ( GetNumBitsLeft() / MAX_BITVEC3COORD_BITS < nCount )
+	{
+		for ( int i = 0; i < nCount; i++ )
+		{
+			ReadBitVec3Coord( pOut[i] );
+		}
+		return;
+	}
+
+	CBitReadAccumulator accum( m_pData, m_iCurBit );
+	for ( int i = 0; i < nCount; i++ )
+	{
+		unsigned int flags = accum.Read( 3 );
+		Vector &fa = pOut[i];
+		fa[0] = ( flags & 1 ) ? AccumulatedBitCoord( accum ) : 0.0f;
+		fa[1] = ( flags & 2 ) ? AccumulatedBitCoord( accum ) : 0.0f;
+		fa[2] = ( flags & 4 ) ? AccumulatedBitCoord( accum ) : 0.0f;
+	}
+	m_iCurBit = accum.GetCurBit();
+}
+
 int64 bf_read::ReadLongLong()
 {
 	int64 retval;
@@ -289,6 +289,161 @@ void CUtlSymbolTable::RemoveAll()
 
 
 
+//-----------------------------------------------------------------------------
+// Concurrent symbol table
+//-----------------------------------------------------------------------------
+CUtlConcurrentSymbolTable::CUtlConcurrentSymbolTable( bool caseInsensitive ) :
+	m_nSymbols( 0 ), m_nPublished( 0 ), m_bInsensitive( caseInsensitive )
+{
+	memset( (void *)m_pBuckets, 0, sizeof( m_pBuckets ) );
+	memset( (void *)m_pPages, 0, sizeof( m_pPages ) );
+
+	for ( int i = 0; i < STRIPE_COUNT; i++ )
+	{
+		m_Stripes[i].m_pBlockCur = m_Stripes[i].m_pBlockEnd = NULL;
+	}
+}
+
+CUtlConcurrentSymbolTable::~CUtlConcurrentSymbolTable()
+{
+	RemoveAll();
+}
+
+inline unsigned int CUtlConcurrentSymbolTable::HashString( const char *pString ) const
+{
+	return m_bInsensitive ? CaselessStringHashFunctor()( pString ) : StringHashFunctor()( pString );
+}
+
+//-----------------------------------------------------------------------------
+// Walks a bucket's chain without locking. Chains are only ever prepended to,
+// and a node is fully written before it's published, so a reader either sees
+// a node in full or not at all.
+//-----------------------------------------------------------------------------
+CUtlConcurrentSymbolTable::Node_t *CUtlConcurrentSymbolTable::FindNode( const char *pString, unsigned int nHash ) const
+{
+	for ( Node_t *pNode = m_pBuckets[ nHash & ( BUCKET_COUNT - 1 ) ]; pNode; pNode = pNode->m_pNext )
+	{
+		if ( pNode->m_nHash != nHash )
+			continue;
+
+		if ( m_bInsensitive ? !V_stricmp( pNode->m_String, pString ) : !V_strcmp( pNode->m_String, pString ) )
+			return pNode;
+	}
+
+	return NULL;
+}
+
+CUtlSymbol CUtlConcurrentSymbolTable::Find( const char* pString ) const
+{
+	if ( !pString )
+		return CUtlSymbol();
+
+	Node_t *pNode = FindNode( pString, HashString( pString ) );
+	return pNode ? CUtlSymbol( pNode->m_Id ) : CUtlSymbol();
+}
+
+CUtlSymbol CUtlConcurrentSymbolTable::AddString( const char* pString )
+{
+	if ( !pString )
+		return CUtlSymbol( UTL_INVAL_SYMBOL );
+
+	unsigned int nHash = HashString( pString );
+	Node_t *pNode = FindNode( pString, nHash );
+	if ( pNode )
+		return CUtlSymbol( pNode->m_Id );
+
+	int iBucket = nHash & ( BUCKET_COUNT - 1 );
+	Stripe_t &stripe = m_Stripes[ iBucket & ( STRIPE_COUNT - 1 ) ];
+	AUTO_LOCK( stripe.m_Mutex );
+
+	// Someone else may have added it while we waited for the lock
+	pNode = FindNode( pString, nHash );
+	if ( pNode )
+		return CUtlSymbol( pNode->m_Id );
+
+	long nId = ThreadInterlockedIncrement( &m_nSymbols ) - 1;
+	if ( nId >= UTL_INVAL_SYMBOL )
+	{
+		AssertMsg( 0, "CUtlConcurrentSymbolTable is out of symbols" );
+		ThreadInterlockedDecrement( &m_nSymbols );
+		return CUtlSymbol( UTL_INVAL_SYMBOL );
+	}
+
+	// Carve the node and its string out of this stripe's storage
+	int len = V_strlen( pString ) + 1;
+	int nNodeSize = AlignValue( (int)offsetof( Node_t, m_String ) + len, (int)sizeof( void * ) );
+	if ( stripe.m_pBlockCur + nNodeSize > stripe.m_pBlockEnd )
+	{
+		int nBlockSize = max( nNodeSize, MIN_STRING_POOL_SIZE );
+		stripe.m_pBlockCur = (char *)malloc( nBlockSize );
+		stripe.m_pBlockEnd = stripe.m_pBlockCur + nBlockSize;
+		stripe.m_Blocks.AddToTail( stripe.m_pBlockCur );
+	}
+
+	pNode = (Node_t *)stripe.m_pBlockCur;
+	stripe.m_pBlockCur += nNodeSize;
+
+	pNode->m_nHash = nHash;
+	pNode->m_Id = (UtlSymId_t)nId;
+	memcpy( pNode->m_String, pString, len );
+
+	// Publish the string for String() before the symbol can be found
+	int iPage = nId / SYMBOLS_PER_PAGE;
+	if ( !m_pPages[iPage] )
+	{
+		const char **pPage = (const char **)calloc( SYMBOLS_PER_PAGE, sizeof( const char * ) );
+		if ( ThreadInterlockedCompareExchangePointer( (void * volatile *)&m_pPages[iPage], pPage, NULL ) != NULL )
+		{
+			// Another stripe published this page first
+			free( pPage );
+		}
+	}
+	m_pPages[iPage][ nId % SYMBOLS_PER_PAGE ] = pNode->m_String;
+
+	pNode->m_pNext = m_pBuckets[iBucket];
+	ThreadMemoryBarrier();
+	m_pBuckets[iBucket] = pNode;
+	ThreadInterlockedIncrement( &m_nPublished );
+
+	return CUtlSymbol( pNode->m_Id );
+}
+
+const char* CUtlConcurrentSymbolTable::String( CUtlSymbol id ) const
+{
+	if ( !id.IsValid() )
+		return "";
+
+	UtlSymId_t nId = id;
+	Assert( nId < m_nSymbols && m_pPages[ nId / SYMBOLS_PER_PAGE ] );
+	return m_pPages[ nId / SYMBOLS_PER_PAGE ][ nId % SYMBOLS_PER_PAGE ];
+}
+
+void CUtlConcurrentSymbolTable::RemoveAll()
+{
+	memset( (void *)m_pBuckets, 0, sizeof( m_pBuckets ) );
+
+	for ( int i = 0; i < PAGE_COUNT; i++ )
+	{
+		free( (void *)m_pPages[i] );
+		m_pPages[i] = NULL;
+	}
+
+	for ( int i = 0; i < STRIPE_COUNT; i++ )
+	{
+		Stripe_t &stripe = m_Stripes[i];
+		for ( int j = 0; j < stripe.m_Blocks.Count(); j++ )
+		{
+			free( stripe.m_Blocks[j] );
+		}
+		stripe.m_Blocks.RemoveAll();
+		stripe.m_pBlockCur = stripe.m_pBlockEnd = NULL;
+	}
+
+	m_nSymbols = 0;
+	m_nPublished = 0;
+}
+
+
 class CUtlFilenameSymbolTable::HashTable : public CUtlStableHashtable<CUtlConstString>
 {
 };
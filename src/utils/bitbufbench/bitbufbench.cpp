@@ -0,0 +1,224 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Measures bf_write / bf_read throughput for the common field types,
+//			one field per call against the batched calls, and checks that both
+//			produce the same bits.
+//
+// $NoKeywords: $
+//
+//===========================================================================//
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "tier0/platform.h"
+#include "tier1/strtools.h"
+#include "tier1/bitbuf.h"
+#include "mathlib/vector.h"
+#include "coordsize.h"
+
+#define BENCH_FIELDS		4096
+#define BENCH_BUFFER_BYTES	( BENCH_FIELDS * 12 )	// room for a worst case vector per field
+
+static unsigned int g_UBits[ BENCH_FIELDS ];
+static float g_Coords[ BENCH_FIELDS ];
+static Vector g_Vecs[ BENCH_FIELDS ];
+
+static unsigned int g_UBitsOut[ BENCH_FIELDS ];
+static float g_CoordsOut[ BENCH_FIELDS ];
+static Vector g_VecsOut[ BENCH_FIELDS ];
+
+static ALIGN16 unsigned char g_SingleBuffer[ BENCH_BUFFER_BYTES ] ALIGN16_POST;
+static ALIGN16 unsigned char g_BatchBuffer[ BENCH_BUFFER_BYTES ] ALIGN16_POST;
+
+static int g_nRounds;
+static int g_nUBits;
+
+void Usage( void )
+{
+	printf( "Usage: bitbufbench [-rounds n] [-seed n]\n" );
+	printf( "  -rounds n : times each buffer of %d fields is encoded and decoded (default: 2000)\n", BENCH_FIELDS );
+	printf( "  -seed n   : random seed for the field values (default: 1)\n" );
+	exit( -1 );
+}
+
+//-----------------------------------------------------------------------------
+// One field type: encode/decode BENCH_FIELDS values one call at a time or in a batch
+//-----------------------------------------------------------------------------
+struct FieldBench_t
+{
+	const char *m_pName;
+	void (*m_pfnWriteSingle)( bf_write &buf );
+	void (*m_pfnWriteBatch)( bf_write &buf );
+	void (*m_pfnReadSingle)( bf_read &buf );
+	void (*m_pfnReadBatch)( bf_read &buf );
+	bool (*m_pfnCheckRead)();
+};
+
+static void WriteUBitSingle( bf_write &buf )	{ for ( int i = 0; i < BENCH_FIELDS; i++ ) buf.WriteUBitLong( g_UBits[i], g_nUBits ); }
+static void WriteUBitBatch( bf_write &buf )		{ buf.WriteUBitLongs( g_UBits, BENCH_FIELDS, g_nUBits ); }
+static void ReadUBitSingle( bf_read &buf )		{ for ( int i = 0; i < BENCH_FIELDS; i++ ) g_UBitsOut[i] = buf.ReadUBitLong( g_nUBits ); }
+static void ReadUBitBatch( bf_read &buf )		{ buf.ReadUBitLongs( g_UBitsOut, BENCH_FIELDS, g_nUBits ); }
+static bool CheckUBits()
+{
+	unsigned int nMask = ( g_nUBits == 32 ) ? ~0u : ( ( 1u << g_nUBits ) - 1 );
+	for ( int i = 0; i < BENCH_FIELDS; i++ )
+	{
+		if ( g_UBitsOut[i] != ( g_UBits[i] & nMask ) )
+			return false;
+	}
+	return true;
+}
+
+static void WriteCoordSingle( bf_write &buf )	{ for ( int i = 0; i < BENCH_FIELDS; i++ ) buf.WriteBitCoord( g_Coords[i] ); }
+static void WriteCoordBatch( bf_write &buf )	{ buf.WriteBitCoords( g_Coords, BENCH_FIELDS ); }
+static void ReadCoordSingle( bf_read &buf )		{ for ( int i = 0; i < BENCH_FIELDS; i++ ) g_CoordsOut[i] = buf.ReadBitCoord(); }
+static void ReadCoordBatch( bf_read &buf )		{ buf.ReadBitCoords( g_CoordsOut, BENCH_FIELDS ); }
+static bool CheckCoords()
+{
+	for ( int i = 0; i < BENCH_FIELDS; i++ )
+	{
+		if ( fabs( g_CoordsOut[i] - g_Coords[i] ) > COORD_RESOLUTION )
+			return false;
+	}
+	return true;
+}
+
+static void WriteVecSingle( bf_write &buf )		{ for ( int i = 0; i < BENCH_FIELDS; i++ ) buf.WriteBitVec3Coord( g_Vecs[i] ); }
+static void WriteVecBatch( bf_write &buf )		{ buf.WriteBitVec3Coords( g_Vecs, BENCH_FIELDS ); }
+static void ReadVecSingle( bf_read &buf )		{ for ( int i = 0; i < BENCH_FIELDS; i++ ) buf.ReadBitVec3Coord( g_VecsOut[i] ); }
+static void ReadVecBatch( bf_read &buf )		{ buf.ReadBitVec3Coords( g_VecsOut, BENCH_FIELDS ); }
+static bool CheckVecs()
+{
+	for ( int i = 0; i < BENCH_FIELDS; i++ )
+	{
+		for ( int j = 0; j < 3; j++ )
+		{
+			if ( fabs( g_VecsOut[i][j] - g_Vecs[i][j] ) > COORD_RESOLUTION )
+				return false;
+		}
+	}
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Returns MB/s of encoded data
+//-----------------------------------------------------------------------------
+static double TimeWrite( void (*pfnWrite)( bf_write &buf ), unsigned char *pBuffer, int *pnBits )
+{
+	double flStart = Plat_FloatTime();
+	for ( int nRound = 0; nRound < g_nRounds; nRound++ )
+	{
+		bf_write buf( pBuffer, BENCH_BUFFER_BYTES );
+		pfnWrite( buf );
+		*pnBits = buf.GetNumBitsWritten();
+	}
+	double flElapsed = Plat_FloatTime() - flStart;
+	return ( (double)*pnBits / 8.0 ) * g_nRounds / ( flElapsed * 1024.0 * 1024.0 );
+}
+
+static double TimeRead( void (*pfnRead)( bf_read &buf ), unsigned char *pBuffer, int nBits, bool *pbCorrect )
+{
+	bool bCorrect = true;
+	double flStart = Plat_FloatTime();
+	for ( int nRound = 0; nRound < g_nRounds; nRound++ )
+	{
+		bf_read buf( pBuffer, BENCH_BUFFER_BYTES );
+		pfnRead( buf );
+		bCorrect = bCorrect && !buf.IsOverflowed() && buf.GetNumBitsRead() == nBits;
+	}
+	double flElapsed = Plat_FloatTime() - flStart;
+	*pbCorrect = bCorrect;
+	return ( (double)nBits / 8.0 ) * g_nRounds / ( flElapsed * 1024.0 * 1024.0 );
+}
+
+static void RunBench( const FieldBench_t &bench )
+{
+	int nSingleBits, nBatchBits;
+	bool bSingleRead, bBatchRead;
+
+	double flWriteSingle = TimeWrite( bench.m_pfnWriteSingle, g_SingleBuffer, &nSingleBits );
+	double flWriteBatch = TimeWrite( bench.m_pfnWriteBatch, g_BatchBuffer, &nBatchBits );
+
+	// The batched writer has to produce exactly the same stream
+	bool bSameBits = ( nSingleBits == nBatchBits ) && !memcmp( g_SingleBuffer, g_BatchBuffer, BitByte( nSingleBits ) );
+
+	double flReadSingle = TimeRead( bench.m_pfnReadSingle, g_SingleBuffer, nSingleBits, &bSingleRead );
+	bSingleRead = bSingleRead && bench.m_pfnCheckRead();
+	double flReadBatch = TimeRead( bench.m_pfnReadBatch, g_SingleBuffer, nSingleBits, &bBatchRead );
+	bBatchRead = bBatchRead && bench.m_pfnCheckRead();
+
+	printf( "%-16s write %8.1f -> %8.1f MB/s (%.2fx)   read %8.1f -> %8.1f MB/s (%.2fx)%s\n", bench.m_pName,
+		flWriteSingle, flWriteBatch, flWriteBatch / flWriteSingle,
+		flReadSingle, flReadBatch, flReadBatch / flReadSingle,
+		( bSameBits && bSingleRead && bBatchRead ) ? "" : "  ** WRONG RESULTS **" );
+}
+
+static float RandomCoord()
+{
+	// mostly map-sized positions, with some zeros and pure integers/fractions mixed in
+	switch ( rand() % 8 )
+	{
+	case 0:		return 0.0f;
+	case 1:		return (float)( rand() % 4096 - 2048 );
+	case 2:		return ( rand() % ( COORD_DENOMINATOR - 1 ) + 1 ) * COORD_RESOLUTION;
+	default:	return ( (float)rand() / RAND_MAX * 2.0f - 1.0f ) * ( MAX_COORD_INTEGER - 1 );
+	}
+}
+
+int main( int argc, char **argv )
+{
+	int nSeed = 1;
+	g_nRounds = 2000;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( i + 1 >= argc )
+		{
+			Usage();
+		}
+
+		if ( !V_stricmp( argv[i], "-rounds" ) )
+		{
+			g_nRounds = MAX( atoi( argv[++i] ), 1 );
+		}
+		else if ( !V_stricmp( argv[i], "-seed" ) )
+		{
+			nSeed = atoi( argv[++i] );
+		}
+		else
+		{
+			Usage();
+		}
+	}
+
+	srand( nSeed );
+	for ( int i = 0; i < BENCH_FIELDS; i++ )
+	{
+		g_UBits[i] = ( (unsigned int)rand() << 16 ) ^ (unsigned int)rand();
+		g_Coords[i] = RandomCoord();
+		g_Vecs[i].Init( RandomCoord(), RandomCoord(), RandomCoord() );
+	}
+
+	printf( "%d fields x %d rounds\n", BENCH_FIELDS, g_nRounds );
+
+	static const FieldBench_t s_UBitBench = { NULL, WriteUBitSingle, WriteUBitBatch, ReadUBitSingle, ReadUBitBatch, CheckUBits };
+	static const int s_UBitSizes[] = { 1, 8, 17, 32 };
+	for ( int i = 0; i < ARRAYSIZE( s_UBitSizes ); i++ )
+	{
+		char szName[32];
+		V_snprintf( szName, sizeof( szName ), "ubitlong:%d", s_UBitSizes[i] );
+		g_nUBits = s_UBitSizes[i];
+
+		FieldBench_t bench = s_UBitBench;
+		bench.m_pName = szName;
+		RunBench( bench );
+	}
+
+	static const FieldBench_t s_CoordBench = { "bitcoord", WriteCoordSingle, WriteCoordBatch, ReadCoordSingle, ReadCoordBatch, CheckCoords };
+	RunBench( s_CoordBench );
+
+	static const FieldBench_t s_VecBench = { "bitvec3coord", WriteVecSingle, WriteVecBatch, ReadVecSingle, ReadVecBatch, CheckVecs };
+	RunBench( s_VecBench );
+
+	return 0;
+}
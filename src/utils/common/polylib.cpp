@@ -31,7 +31,18 @@ void pw(winding_t *w)
 		printf ("(%5.1f, %5.1f, %5.1f)\n",w->p[i][0], w->p[i][1],w->p[i][2]);
 }
 
-winding_t *winding_pool[MAX_POINTS_ON_WINDING+4];
+// Freed windings are kept on a list per thread and per size, so threads don't
+// contend for a lock on every allocation.  Worker threads only keep so many of
+// each size; the main thread keeps them all, the way the single pool used to.
+#define WINDING_POOL_MAX_FREE	256
+
+struct windingpool_t
+{
+	winding_t	*m_pFree[MAX_POINTS_ON_WINDING+4];
+	int			m_nFree[MAX_POINTS_ON_WINDING+4];
+};
+
+static windingpool_t g_WindingPools[MAX_TOOL_THREADS+1];
 
 /*
 =============
@@ -50,18 +61,26 @@ winding_t *AllocWinding (int points)
 		if (c_active_windings > c_peak_windings)
 			c_peak_windings = c_active_windings;
 	}
-	ThreadLock();
-	if (winding_pool[points])
+
+	// Threads we didn't start share the main thread's pool, under the lock.
+	int iThread = GetThreadIndex();
+	windingpool_t *pPool = &g_WindingPools[iThread];
+	if (iThread == THREADINDEX_MAIN)
+		ThreadLock();
+	w = pPool->m_pFree[points];
+	if (w)
 	{
-		w = winding_pool[points];
-		winding_pool[points] = w->next;
+		pPool->m_pFree[points] = w->next;
+		pPool->m_nFree[points]--;
 	}
-	else
+	if (iThread == THREADINDEX_MAIN)
+		ThreadUnlock();
+
+	if (!w)
 	{
 		w = (winding_t *)malloc(sizeof(*w));
 		w->p = (Vector *)calloc( points, sizeof(Vector) );
 	}
-	ThreadUnlock();
 	w->numpoints = 0; // None are occupied yet even though allocated.
 	w->maxpoints = points;
 	w->next = NULL;
@@ -72,12 +91,26 @@ void FreeWinding (winding_t *w)
 {
 	if (w->numpoints == 0xdeaddead)
 		Error ("FreeWinding: freed a freed winding");
-	
-	ThreadLock();
 	w->numpoints = 0xdeaddead; // flag as freed
-	w->next = winding_pool[w->maxpoints];
-	winding_pool[w->maxpoints] = w;
-	ThreadUnlock();
+
+	int iThread = GetThreadIndex();
+	windingpool_t *pPool = &g_WindingPools[iThread];
+	if (iThread == THREADINDEX_MAIN)
+	{
+		ThreadLock();
+	}
+	else if (pPool->m_nFree[w->maxpoints] >= WINDING_POOL_MAX_FREE)
+	{
+		free (w->p);
+		free (w);
+		return;
+	}
+
+	w->next = pPool->m_pFree[w->maxpoints];
+	pPool->m_pFree[w->maxpoints] = w;
+	pPool->m_nFree[w->maxpoints]++;
+	if (iThread == THREADINDEX_MAIN)
+		ThreadUnlock();
 }
 
 /*
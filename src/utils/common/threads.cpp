@@ -18,8 +18,9 @@
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
+#include "tier0/threadtools.h"
 
-#define	MAX_THREADS	16
+#define	MAX_THREADS	MAX_TOOL_THREADS
 
 
 class CRunThreadsData
@@ -33,7 +34,6 @@ public:
 CRunThreadsData g_RunThreadsData[MAX_THREADS];
 
 
-int		dispatch;
 int		workcount;
 qboolean		pacifier;
 
@@ -43,6 +43,165 @@ bool g_bLowPriorityThreads = false;
 HANDLE g_ThreadHandles[MAX_THREADS];
 
 
+/*
+===================================================================
+
+WORK STEALING
+
+The work items are cut into chunks and chunk c starts out queued on
+thread c % numthreads, so each thread's queue is the run of chunks
+base + k * stride for k in [head, tail).  A thread pops chunks off the
+head of its own queue, which keeps the overall order close to the order
+the caller sorted its items in (vvis relies on this), and when it runs
+dry it steals the back half of the fullest queue.  The queues live on
+their own cache lines and nothing is shared between threads until one
+of them has to steal.
+
+===================================================================
+*/
+
+// Aim for this many chunks per thread.  Smaller chunks even out long-tail
+// items better, bigger ones take the queue locks less often.
+#define CHUNKS_PER_THREAD	32
+#define MAX_CHUNK_SIZE		32
+
+struct DECL_ALIGN(64) CThreadWorkQueue
+{
+	CRITICAL_SECTION	m_Lock;
+	int		m_iBase;
+	int		m_iHead;
+	int		m_iTail;
+
+	// Chunk being worked on, only touched by the owning thread
+	int		m_iNextItem;
+	int		m_iEndItem;
+
+	// Stats for the current RunThreadsOn
+	int		m_nItems;
+	int		m_nSteals;
+	double	m_flFinishTime;
+};
+
+static CThreadWorkQueue g_WorkQueues[MAX_THREADS];
+static int g_nWorkQueues;
+static int g_nChunkSize;
+static int g_nChunkStride;
+static double g_flWorkStartTime;
+static volatile LONG g_nItemsDispatched;
+
+// iThread + 1 of the worker running on this thread, 0 if it's not one of ours
+static CThreadLocalInt<> g_iWorkQueue;
+
+static CRITICAL_SECTION g_PacifierCrit;
+
+
+class CWorkQueueInit
+{
+public:
+	CWorkQueueInit()
+	{
+		InitializeCriticalSection( &g_PacifierCrit );
+		for ( int i=0; i < MAX_THREADS; i++ )
+			InitializeCriticalSectionAndSpinCount( &g_WorkQueues[i].m_Lock, 1000 );
+	}
+} g_WorkQueueInit;
+
+
+static void ResetWorkQueues( int nQueues, int nWorkItems )
+{
+	g_nWorkQueues = Max( nQueues, 1 );
+	g_nChunkSize = Clamp( nWorkItems / ( g_nWorkQueues * CHUNKS_PER_THREAD ), 1, MAX_CHUNK_SIZE );
+	g_nChunkStride = g_nWorkQueues;
+	g_nItemsDispatched = 0;
+	g_flWorkStartTime = Plat_FloatTime();
+
+	int nChunks = ( nWorkItems + g_nChunkSize - 1 ) / g_nChunkSize;
+	for ( int i=0; i < g_nWorkQueues; i++ )
+	{
+		CThreadWorkQueue *pQueue = &g_WorkQueues[i];
+		pQueue->m_iBase = i;
+		pQueue->m_iHead = 0;
+		pQueue->m_iTail = ( nChunks > i ) ? ( nChunks - i + g_nWorkQueues - 1 ) / g_nWorkQueues : 0;
+		pQueue->m_iNextItem = pQueue->m_iEndItem = 0;
+		pQueue->m_nItems = 0;
+		pQueue->m_nSteals = 0;
+		pQueue->m_flFinishTime = 0;
+	}
+}
+
+
+// Moves the back half of the fullest other queue into pQueue, which must be empty.
+static bool StealWork( CThreadWorkQueue *pQueue )
+{
+	while ( 1 )
+	{
+		// Pick a victim without locking; the count is rechecked under its lock.
+		CThreadWorkQueue *pVictim = NULL;
+		int nMostChunks = 0;
+		for ( int i=0; i < g_nWorkQueues; i++ )
+		{
+			CThreadWorkQueue *pOther = &g_WorkQueues[i];
+			int nChunks = pOther->m_iTail - pOther->m_iHead;
+			if ( pOther != pQueue && nChunks > nMostChunks )
+			{
+				nMostChunks = nChunks;
+				pVictim = pOther;
+			}
+		}
+
+		if ( !pVictim )
+			return false;
+
+		EnterCriticalSection( &pVictim->m_Lock );
+		int nChunks = pVictim->m_iTail - pVictim->m_iHead;
+		if ( nChunks <= 0 )
+		{
+			// Someone beat us to it, look again.
+			LeaveCriticalSection( &pVictim->m_Lock );
+			continue;
+		}
+
+		int nSteal = ( nChunks + 1 ) / 2;
+		int iBase = pVictim->m_iBase;
+		int iTail = pVictim->m_iTail;
+		pVictim->m_iTail -= nSteal;
+		LeaveCriticalSection( &pVictim->m_Lock );
+
+		EnterCriticalSection( &pQueue->m_Lock );
+		pQueue->m_iBase = iBase;
+		pQueue->m_iHead = iTail - nSteal;
+		pQueue->m_iTail = iTail;
+		LeaveCriticalSection( &pQueue->m_Lock );
+
+		++pQueue->m_nSteals;
+		return true;
+	}
+}
+
+
+// Pops the next chunk off pQueue, stealing when it's empty.
+static bool GetWorkChunk( CThreadWorkQueue *pQueue )
+{
+	while ( 1 )
+	{
+		EnterCriticalSection( &pQueue->m_Lock );
+		if ( pQueue->m_iHead < pQueue->m_iTail )
+		{
+			int iChunk = pQueue->m_iBase + pQueue->m_iHead * g_nChunkStride;
+			pQueue->m_iHead++;
+			LeaveCriticalSection( &pQueue->m_Lock );
+
+			pQueue->m_iNextItem = iChunk * g_nChunkSize;
+			pQueue->m_iEndItem = Min( pQueue->m_iNextItem + g_nChunkSize, workcount );
+			return true;
+		}
+		LeaveCriticalSection( &pQueue->m_Lock );
+
+		if ( !StealWork( pQueue ) )
+			return false;
+	}
+}
+
 
 /*
 =============
@@ -52,23 +211,146 @@ GetThreadWork
 */
 int	GetThreadWork (void)
 {
-	int	r;
+	int iQueue = g_iWorkQueue - 1;
+	if ( iQueue < 0 || iQueue >= g_nWorkQueues )
+	{
+		// Called from outside RunThreadsOn, hand out the work from the first queue.
+		iQueue = 0;
+	}
+
+	CThreadWorkQueue *pQueue = &g_WorkQueues[iQueue];
+	if ( pQueue->m_iNextItem >= pQueue->m_iEndItem )
+	{
+		if ( !GetWorkChunk( pQueue ) )
+		{
+			if ( pQueue->m_flFinishTime == 0 )
+				pQueue->m_flFinishTime = Plat_FloatTime() - g_flWorkStartTime;
+			return -1;
+		}
+
+		// Only one thread draws the pacifier at a time, the rest don't wait for it.
+		LONG nDispatched = InterlockedExchangeAdd( &g_nItemsDispatched, pQueue->m_iEndItem - pQueue->m_iNextItem );
+		if ( TryEnterCriticalSection( &g_PacifierCrit ) )
+		{
+			UpdatePacifier( (float)nDispatched / workcount );
+			LeaveCriticalSection( &g_PacifierCrit );
+		}
+	}
+
+	pQueue->m_nItems++;
+	return pQueue->m_iNextItem++;
+}
+
+
+/*
+===================================================================
+
+PHASE STATS
+
+Each RunThreadsOn call is filed under the name of its worker function so
+the compile can print where the threaded time went and how much of it
+threads spent idle waiting for the slowest one to finish.
+
+===================================================================
+*/
+
+#define MAX_THREAD_PHASES	64
+
+struct CThreadPhaseStats
+{
+	const char	*m_pName;
+	int		m_nRuns;
+	int		m_nThreads;
+	int		m_nItems;
+	int		m_nSteals;
+	double	m_flWallTime;		// Sum of the wall time of each run
+	double	m_flIdleTime;		// Thread-seconds spent with nothing left to do
+	double	m_flWorstImbalance;	// Largest (slowest thread / average thread) of any run
+};
+
+static CThreadPhaseStats g_ThreadPhases[MAX_THREAD_PHASES];
+static int g_nThreadPhases;
+static const char *g_pThreadPhaseName = NULL;
+
+
+void SetThreadPhaseName( const char *pName )
+{
+	g_pThreadPhaseName = pName;
+}
+
+
+static void RecordThreadPhase( double flWallTime )
+{
+	const char *pName = g_pThreadPhaseName ? g_pThreadPhaseName : "(unnamed)";
+	g_pThreadPhaseName = NULL;
+
+	CThreadPhaseStats *pPhase = NULL;
+	for ( int i=0; i < g_nThreadPhases; i++ )
+	{
+		if ( !Q_stricmp( g_ThreadPhases[i].m_pName, pName ) )
+		{
+			pPhase = &g_ThreadPhases[i];
+			break;
+		}
+	}
+
+	if ( !pPhase )
+	{
+		if ( g_nThreadPhases >= MAX_THREAD_PHASES )
+			return;
+
+		pPhase = &g_ThreadPhases[g_nThreadPhases++];
+		memset( pPhase, 0, sizeof( *pPhase ) );
+		pPhase->m_pName = pName;
+	}
 
-	ThreadLock ();
+	double flTotal = 0, flSlowest = 0;
+	for ( int i=0; i < g_nWorkQueues; i++ )
+	{
+		CThreadWorkQueue *pQueue = &g_WorkQueues[i];
+
+		// Threads that never asked for work after the last item were busy to the end.
+		double flFinish = pQueue->m_flFinishTime ? pQueue->m_flFinishTime : flWallTime;
+		flFinish = Min( flFinish, flWallTime );
+
+		flTotal += flFinish;
+		flSlowest = Max( flSlowest, flFinish );
+		pPhase->m_nItems += pQueue->m_nItems;
+		pPhase->m_nSteals += pQueue->m_nSteals;
+	}
 
-	if (dispatch == workcount)
+	pPhase->m_nRuns++;
+	pPhase->m_nThreads = Max( pPhase->m_nThreads, g_nWorkQueues );
+	pPhase->m_flWallTime += flWallTime;
+	pPhase->m_flIdleTime += g_nWorkQueues * flWallTime - flTotal;
+	if ( flTotal > 0 )
 	{
-		ThreadUnlock ();
-		return -1;
+		pPhase->m_flWorstImbalance = Max( pPhase->m_flWorstImbalance, flSlowest * g_nWorkQueues / flTotal );
 	}
+}
 
-	UpdatePacifier( (float)dispatch / workcount );
 
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
+void PrintThreadPhaseStats()
+{
+	if ( g_nThreadPhases == 0 )
+		return;
 
-	return r;
+	Msg( "\nThreaded phases:\n" );
+	Msg( "%-24s %5s %8s %10s %8s %10s %7s %10s\n", "phase", "runs", "threads", "items", "steals", "wall (s)", "idle", "imbalance" );
+	for ( int i=0; i < g_nThreadPhases; i++ )
+	{
+		CThreadPhaseStats *pPhase = &g_ThreadPhases[i];
+		double flThreadTime = pPhase->m_flWallTime * pPhase->m_nThreads;
+		Msg( "%-24s %5d %8d %10d %8d %10.2f %6.1f%% %9.2fx\n",
+			pPhase->m_pName,
+			pPhase->m_nRuns,
+			pPhase->m_nThreads,
+			pPhase->m_nItems,
+			pPhase->m_nSteals,
+			pPhase->m_flWallTime,
+			flThreadTime > 0 ? 100.0 * pPhase->m_flIdleTime / flThreadTime : 0.0,
+			pPhase->m_flWorstImbalance );
+	}
 }
 
 
@@ -128,22 +410,86 @@ void SetLowPriority()
 }
 
 
-void ThreadSetDefault (void)
+// GetActiveProcessorCount and friends only exist on Windows 7 and later.
+typedef DWORD (WINAPI *GetActiveProcessorCountFn)( WORD GroupNumber );
+typedef WORD (WINAPI *GetActiveProcessorGroupCountFn)( void );
+typedef BOOL (WINAPI *SetThreadGroupAffinityFn)( HANDLE hThread, const GROUP_AFFINITY *GroupAffinity, PGROUP_AFFINITY PreviousGroupAffinity );
+
+#ifndef ALL_PROCESSOR_GROUPS
+#define ALL_PROCESSOR_GROUPS	0xffff
+#endif
+
+static GetActiveProcessorCountFn GetActiveProcessorCountPtr()
 {
-	SYSTEM_INFO info;
+	return (GetActiveProcessorCountFn)GetProcAddress( GetModuleHandle( "kernel32.dll" ), "GetActiveProcessorCount" );
+}
+
 
+void ThreadSetDefault (void)
+{
 	if (numthreads == -1)	// not set manually
 	{
-		GetSystemInfo (&info);
-		numthreads = info.dwNumberOfProcessors;
-		if (numthreads < 1 || numthreads > 32)
+		// GetSystemInfo only reports the processors in our own processor group.
+		GetActiveProcessorCountFn pfnGetActiveProcessorCount = GetActiveProcessorCountPtr();
+		if ( pfnGetActiveProcessorCount )
+		{
+			numthreads = pfnGetActiveProcessorCount( ALL_PROCESSOR_GROUPS );
+		}
+		else
+		{
+			SYSTEM_INFO info;
+			GetSystemInfo (&info);
+			numthreads = info.dwNumberOfProcessors;
+		}
+
+		if (numthreads < 1)
 			numthreads = 1;
 	}
 
+	if ( numthreads > MAX_TOOL_THREADS )
+	{
+		Warning( "Clamping %i threads to %i\n", numthreads, MAX_TOOL_THREADS );
+		numthreads = MAX_TOOL_THREADS;
+	}
+
 	Msg ("%i threads\n", numthreads);
 }
 
 
+// Windows starts every thread in the process' processor group, so on machines
+// with more than 64 logical processors the threads have to be spread out by hand.
+static void SetThreadProcessorGroup( HANDLE hThread, int iThread )
+{
+	HMODULE hKernel = GetModuleHandle( "kernel32.dll" );
+	GetActiveProcessorGroupCountFn pfnGetGroupCount = (GetActiveProcessorGroupCountFn)GetProcAddress( hKernel, "GetActiveProcessorGroupCount" );
+	GetActiveProcessorCountFn pfnGetProcessorCount = GetActiveProcessorCountPtr();
+	SetThreadGroupAffinityFn pfnSetGroupAffinity = (SetThreadGroupAffinityFn)GetProcAddress( hKernel, "SetThreadGroupAffinity" );
+	if ( !pfnGetGroupCount || !pfnGetProcessorCount || !pfnSetGroupAffinity )
+		return;
+
+	WORD nGroups = pfnGetGroupCount();
+	if ( nGroups <= 1 )
+		return;
+
+	// Fill the groups in order so neighbouring threads share a group (and usually a NUMA node).
+	int iProcessor = iThread % pfnGetProcessorCount( ALL_PROCESSOR_GROUPS );
+	for ( WORD iGroup=0; iGroup < nGroups; iGroup++ )
+	{
+		int nInGroup = pfnGetProcessorCount( iGroup );
+		if ( iProcessor < nInGroup )
+		{
+			GROUP_AFFINITY affinity;
+			memset( &affinity, 0, sizeof( affinity ) );
+			affinity.Group = iGroup;
+			affinity.Mask = ( nInGroup >= (int)( sizeof( KAFFINITY ) * 8 ) ) ? ~(KAFFINITY)0 : ( ( (KAFFINITY)1 << nInGroup ) - 1 );
+			pfnSetGroupAffinity( hThread, &affinity, NULL );
+			return;
+		}
+		iProcessor -= nInGroup;
+	}
+}
+
+
 void ThreadLock (void)
 {
 	if (!threaded)
@@ -165,11 +511,20 @@ void ThreadUnlock (void)
 }
 
 
+int GetThreadIndex (void)
+{
+	int iThread = g_iWorkQueue - 1;
+	return ( iThread >= 0 ) ? iThread : THREADINDEX_MAIN;
+}
+
+
 // This runs in the thread and dispatches a RunThreadsFn call.
 DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+	g_iWorkQueue = pData->m_iThread + 1;
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
+	g_iWorkQueue = 0;
 	return 0;
 }
 
@@ -197,6 +552,8 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 		   0,			// DWORD fdwCreate,
 		   &dwDummy );
 
+		SetThreadProcessorGroup( g_ThreadHandles[i], i );
+
 		if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
 		{
 			if( g_bLowPriorityThreads )
@@ -212,7 +569,11 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 
 void RunThreads_End()
 {
-	WaitForMultipleObjects( numthreads, g_ThreadHandles, TRUE, INFINITE );
+	// WaitForMultipleObjects can only take MAXIMUM_WAIT_OBJECTS handles at once.
+	for ( int iFirst=0; iFirst < numthreads; iFirst += MAXIMUM_WAIT_OBJECTS )
+	{
+		WaitForMultipleObjects( Min( numthreads - iFirst, MAXIMUM_WAIT_OBJECTS ), &g_ThreadHandles[iFirst], TRUE, INFINITE );
+	}
 	for ( int i=0; i < numthreads; i++ )
 		CloseHandle( g_ThreadHandles[i] );
 
@@ -230,11 +591,14 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	int		start, end;
 
 	start = Plat_FloatTime();
-	dispatch = 0;
 	workcount = workcnt;
 	StartPacifier("");
 	pacifier = showpacifier;
 
+	if ( numthreads > MAX_TOOL_THREADS )
+		numthreads = MAX_TOOL_THREADS;
+	ResetWorkQueues( numthreads, workcnt );
+
 #ifdef _PROFILE
 	threaded = false;
 	(*func)( 0 );
@@ -245,6 +609,7 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	RunThreads_Start( fn, pUserData );
 	RunThreads_End();
 
+	RecordThreadPhase( Plat_FloatTime() - g_flWorkStartTime );
 
 	end = Plat_FloatTime();
 	if (pacifier)
@@ -18,7 +18,7 @@
 
 // Arrays that are indexed by thread should always be MAX_TOOL_THREADS+1
 // large so THREADINDEX_MAIN can be used from the main thread.
-#define MAX_TOOL_THREADS	16
+#define MAX_TOOL_THREADS	128
 #define THREADINDEX_MAIN	(MAX_TOOL_THREADS)
 
 
@@ -56,10 +56,19 @@ void RunThreads_End();
 void ThreadLock (void);
 void ThreadUnlock (void);
 
+// Index of the RunThreadsOn/RunThreads_Start thread that's calling, or THREADINDEX_MAIN
+// from any other thread.  Use it to pick the caller's slot in per-thread arrays.
+int GetThreadIndex (void);
+
+// RunThreadsOn calls are timed under the name set here (the worker function's name
+// when called through the macros below).  Print the totals at the end of a compile.
+void SetThreadPhaseName( const char *pName );
+void PrintThreadPhaseStats();
+
 
 #ifndef NO_THREAD_NAMES
-#define RunThreadsOn(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOn(n,p,f); }
-#define RunThreadsOnIndividual(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOnIndividual(n,p,f); }
+#define RunThreadsOn(n,p,f) { if (p) printf("%-20s ", #f ":"); SetThreadPhaseName(#f); RunThreadsOn(n,p,f); }
+#define RunThreadsOnIndividual(n,p,f) { if (p) printf("%-20s ", #f ":"); SetThreadPhaseName(#f); RunThreadsOnIndividual(n,p,f); }
 #endif
 
 #endif // THREADS_H
@@ -0,0 +1,258 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compiles KeyValues text scripts under a directory into the binary
+//			sidecars KeyValues::LoadFromFile() picks up, and optionally times
+//			loading each script from text against loading its sidecar.
+//
+// $NoKeywords: $
+//
+//===========================================================================//
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <windows.h>
+#include "tier0/platform.h"
+#include "tier1/strtools.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/KeyValues.h"
+
+static bool g_bEscapeSequences = false;
+static bool g_bClean = false;
+static bool g_bVerbose = false;
+static const char *g_pExtension = "txt";
+static int g_nBenchIterations = 0;
+
+static int g_nCompiled = 0;
+static int g_nSkipped = 0;
+static int g_nFailed = 0;
+static int g_nRemoved = 0;
+static double g_flTextTime = 0.0;
+static double g_flBinaryTime = 0.0;
+
+void Usage( void )
+{
+	printf( "Usage: kvcompile [-escape] [-ext name] [-bench n] [-clean] [-v] directory\n" );
+	printf( "  -escape   : scripts use escape sequences (must match how the game loads them)\n" );
+	printf( "  -ext name : extension of the scripts to compile (default: txt)\n" );
+	printf( "  -bench n  : load every script n times from text and from its sidecar, and report both\n" );
+	printf( "  -clean    : delete existing " KEYVALUES_BINARY_CACHE_EXT " sidecars instead of writing them\n" );
+	printf( "  -v        : list every file\n" );
+	exit( -1 );
+}
+
+static bool ReadWholeFile( const char *pFileName, CUtlBuffer &buf )
+{
+	FILE *fp = fopen( pFileName, "rb" );
+	if ( !fp )
+		return false;
+
+	fseek( fp, 0, SEEK_END );
+	int nSize = ftell( fp );
+	fseek( fp, 0, SEEK_SET );
+
+	// null terminated, twice in case it's unicode, the way LoadFromFile() reads it
+	buf.EnsureCapacity( nSize + 2 );
+	int nRead = fread( buf.Base(), 1, nSize, fp );
+	fclose( fp );
+	if ( nRead != nSize )
+		return false;
+
+	( (char *)buf.Base() )[nSize] = 0;
+	( (char *)buf.Base() )[nSize + 1] = 0;
+	buf.SeekPut( CUtlBuffer::SEEK_HEAD, nSize );
+	return true;
+}
+
+static KeyValues *CreateScriptKeyValues()
+{
+	KeyValues *pKV = new KeyValues( "" );
+	pKV->UsesEscapeSequences( g_bEscapeSequences );
+	return pKV;
+}
+
+static void BenchFile( const char *pFileName, const char *pText, CUtlBuffer &cache, long nFileTime )
+{
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < g_nBenchIterations; i++ )
+	{
+		KeyValues *pKV = CreateScriptKeyValues();
+		pKV->LoadFromBuffer( pFileName, pText );
+		pKV->deleteThis();
+	}
+	double flText = Plat_FloatTime() - flStart;
+
+	flStart = Plat_FloatTime();
+	for ( int i = 0; i < g_nBenchIterations; i++ )
+	{
+		KeyValues *pKV = CreateScriptKeyValues();
+		cache.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+		pKV->LoadFromBinaryCache( cache, nFileTime );
+		pKV->deleteThis();
+	}
+	double flBinary = Plat_FloatTime() - flStart;
+
+	g_flTextTime += flText;
+	g_flBinaryTime += flBinary;
+	if ( g_bVerbose )
+	{
+		printf( "  %8.3f ms text  %8.3f ms binary  %s\n", flText * 1000.0 / g_nBenchIterations, flBinary * 1000.0 / g_nBenchIterations, pFileName );
+	}
+}
+
+static void CompileFile( const char *pFileName )
+{
+	char szCacheName[MAX_PATH];
+	V_snprintf( szCacheName, sizeof( szCacheName ), "%s" KEYVALUES_BINARY_CACHE_EXT, pFileName );
+
+	if ( g_bClean )
+	{
+		if ( !remove( szCacheName ) )
+		{
+			g_nRemoved++;
+		}
+		return;
+	}
+
+	struct _stat st;
+	CUtlBuffer text;
+	if ( _stat( pFileName, &st ) || !ReadWholeFile( pFileName, text ) )
+	{
+		printf( "can't read %s\n", pFileName );
+		g_nFailed++;
+		return;
+	}
+
+	const char *pText = (const char *)text.Base();
+	int nTextSize = text.TellMaxPut();
+	if ( !KeyValues::CanCompileBinaryCache( pText, nTextSize ) )
+	{
+		// a sidecar left over from an earlier version of the file would only be ignored
+		remove( szCacheName );
+		if ( g_bVerbose )
+		{
+			printf( "skipped   %s (#include, #base or conditionals)\n", pFileName );
+		}
+		g_nSkipped++;
+		return;
+	}
+
+	KeyValues *pKV = CreateScriptKeyValues();
+	CUtlBuffer cache;
+	bool bOK = pKV->LoadFromBuffer( pFileName, pText ) && pKV->WriteBinaryCache( cache, pText, nTextSize, (long)st.st_mtime );
+	pKV->deleteThis();
+
+	FILE *fp = bOK ? fopen( szCacheName, "wb" ) : NULL;
+	if ( !fp || fwrite( cache.Base(), 1, cache.TellMaxPut(), fp ) != (size_t)cache.TellMaxPut() )
+	{
+		printf( "failed    %s\n", pFileName );
+		g_nFailed++;
+	}
+	else
+	{
+		if ( g_bVerbose )
+		{
+			printf( "compiled  %s (%d -> %d bytes)\n", pFileName, nTextSize, cache.TellMaxPut() );
+		}
+		g_nCompiled++;
+	}
+
+	if ( fp )
+	{
+		fclose( fp );
+	}
+
+	if ( bOK && g_nBenchIterations > 0 )
+	{
+		BenchFile( pFileName, pText, cache, (long)st.st_mtime );
+	}
+}
+
+static void CompileDirectory( const char *pDir )
+{
+	char szSearch[MAX_PATH];
+	V_ComposeFileName( pDir, "*", szSearch, sizeof( szSearch ) );
+
+	WIN32_FIND_DATA wfd;
+	HANDLE hFind = FindFirstFile( szSearch, &wfd );
+	if ( hFind == INVALID_HANDLE_VALUE )
+		return;
+
+	do
+	{
+		if ( wfd.cFileName[0] == '.' )
+			continue;
+
+		char szPath[MAX_PATH];
+		V_ComposeFileName( pDir, wfd.cFileName, szPath, sizeof( szPath ) );
+
+		if ( wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+		{
+			CompileDirectory( szPath );
+		}
+		else if ( !V_stricmp( V_GetFileExtension( wfd.cFileName ) ? V_GetFileExtension( wfd.cFileName ) : "", g_pExtension ) )
+		{
+			CompileFile( szPath );
+		}
+	} while ( FindNextFile( hFind, &wfd ) );
+
+	FindClose( hFind );
+}
+
+int main( int argc, char **argv )
+{
+	const char *pDir = NULL;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( !V_stricmp( argv[i], "-escape" ) )
+		{
+			g_bEscapeSequences = true;
+		}
+		else if ( !V_stricmp( argv[i], "-clean" ) )
+		{
+			g_bClean = true;
+		}
+		else if ( !V_stricmp( argv[i], "-v" ) )
+		{
+			g_bVerbose = true;
+		}
+		else if ( !V_stricmp( argv[i], "-ext" ) && i + 1 < argc )
+		{
+			g_pExtension = argv[++i];
+		}
+		else if ( !V_stricmp( argv[i], "-bench" ) && i + 1 < argc )
+		{
+			g_nBenchIterations = MAX( atoi( argv[++i] ), 1 );
+		}
+		else if ( argv[i][0] != '-' && !pDir )
+		{
+			pDir = argv[i];
+		}
+		else
+		{
+			Usage();
+		}
+	}
+
+	if ( !pDir )
+	{
+		Usage();
+	}
+
+	CompileDirectory( pDir );
+
+	if ( g_bClean )
+	{
+		printf( "removed %d sidecars\n", g_nRemoved );
+		return 0;
+	}
+
+	printf( "compiled %d, skipped %d, failed %d\n", g_nCompiled, g_nSkipped, g_nFailed );
+	if ( g_nBenchIterations > 0 && g_flBinaryTime > 0.0 )
+	{
+		printf( "text: %.2f ms  binary: %.2f ms  per pass over all scripts, speedup %.2fx\n",
+			g_flTextTime * 1000.0 / g_nBenchIterations, g_flBinaryTime * 1000.0 / g_nBenchIterations, g_flTextTime / g_flBinaryTime );
+	}
+
+	return g_nFailed ? 1 : 0;
+}
@@ -0,0 +1,164 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Times CUtlSymbolTableMT against CUtlConcurrentSymbolTable with
+//			several threads interning the same set of names at once, the way
+//			async loading interns material, sound and model names.
+//
+// $NoKeywords: $
+//
+//===========================================================================//
+#include <stdlib.h>
+#include <stdio.h>
+#include "tier0/platform.h"
+#include "tier0/threadtools.h"
+#include "tier1/strtools.h"
+#include "tier1/utlsymbol.h"
+#include "tier1/utlvector.h"
+
+#define MAX_BENCH_THREADS	64
+
+static CUtlVector< char * > g_Names;
+static int g_nRounds;
+
+void Usage( void )
+{
+	printf( "Usage: symboltablebench [-threads n] [-names n] [-rounds n]\n" );
+	printf( "  -threads n : number of threads interning at once (default: one per logical processor)\n" );
+	printf( "  -names n   : number of distinct names, at most 65000 (default: 20000)\n" );
+	printf( "  -rounds n  : passes each thread makes over the names (default: 20)\n" );
+	exit( -1 );
+}
+
+//-----------------------------------------------------------------------------
+// Each thread starts at a different place in the name list, so the first pass
+// races to insert and the later ones are almost all lookups of existing names
+//-----------------------------------------------------------------------------
+template < class TABLE >
+struct BenchThread_t
+{
+	TABLE *m_pTable;
+	int m_nThread;
+	int m_nThreads;
+	int m_nMismatches;
+
+	static unsigned Run( void *pParam )
+	{
+		BenchThread_t *pThread = (BenchThread_t *)pParam;
+		int nNames = g_Names.Count();
+		int nStart = ( nNames / pThread->m_nThreads ) * pThread->m_nThread;
+
+		for ( int nRound = 0; nRound < g_nRounds; nRound++ )
+		{
+			for ( int i = 0; i < nNames; i++ )
+			{
+				const char *pName = g_Names[ ( nStart + i ) % nNames ];
+				CUtlSymbol sym = pThread->m_pTable->AddString( pName );
+				if ( V_strcmp( pThread->m_pTable->String( sym ), pName ) )
+				{
+					pThread->m_nMismatches++;
+				}
+			}
+		}
+		return 0;
+	}
+};
+
+template < class TABLE >
+static double RunBench( const char *pTableName, int nThreads )
+{
+	TABLE table;
+	BenchThread_t< TABLE > threads[ MAX_BENCH_THREADS ];
+	ThreadHandle_t handles[ MAX_BENCH_THREADS ];
+
+	double flStart = Plat_FloatTime();
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		threads[i].m_pTable = &table;
+		threads[i].m_nThread = i;
+		threads[i].m_nThreads = nThreads;
+		threads[i].m_nMismatches = 0;
+		handles[i] = CreateSimpleThread( BenchThread_t< TABLE >::Run, &threads[i] );
+	}
+
+	int nMismatches = 0;
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		ThreadJoin( handles[i] );
+		ReleaseThreadHandle( handles[i] );
+		nMismatches += threads[i].m_nMismatches;
+	}
+	double flElapsed = Plat_FloatTime() - flStart;
+
+	// Every name must be in the table exactly once
+	int nMissing = 0;
+	for ( int i = 0; i < g_Names.Count(); i++ )
+	{
+		if ( !table.Find( g_Names[i] ).IsValid() )
+		{
+			nMissing++;
+		}
+	}
+
+	int nOps = nThreads * g_nRounds * g_Names.Count();
+	printf( "%-28s %8.2f ms  %8.1f ns/op  %d symbols%s\n", pTableName, flElapsed * 1000.0, flElapsed * 1.0e9 / nOps,
+		table.GetNumStrings(), ( nMismatches || nMissing || table.GetNumStrings() != g_Names.Count() ) ? "  ** WRONG RESULTS **" : "" );
+
+	return flElapsed;
+}
+
+int main( int argc, char **argv )
+{
+	int nThreads = GetCPUInformation()->m_nLogicalProcessors;
+	int nNames = 20000;
+	g_nRounds = 20;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( i + 1 >= argc )
+		{
+			Usage();
+		}
+
+		if ( !V_stricmp( argv[i], "-threads" ) )
+		{
+			nThreads = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-names" ) )
+		{
+			nNames = atoi( argv[++i] );
+		}
+		else if ( !V_stricmp( argv[i], "-rounds" ) )
+		{
+			g_nRounds = atoi( argv[++i] );
+		}
+		else
+		{
+			Usage();
+		}
+	}
+
+	nThreads = clamp( nThreads, 1, MAX_BENCH_THREADS );
+	nNames = clamp( nNames, 1, 65000 );
+	g_nRounds = MAX( g_nRounds, 1 );
+
+	// Names shaped like the asset paths that get interned during loading
+	for ( int i = 0; i < nNames; i++ )
+	{
+		char szName[ MAX_PATH ];
+		V_snprintf( szName, sizeof( szName ), "materials/models/props_set%02d/prop_%05d_%s.vmt", i % 37, i, ( i & 1 ) ? "skin" : "base" );
+		g_Names.AddToTail( strdup( szName ) );
+	}
+
+	printf( "%d threads, %d names, %d rounds\n", nThreads, nNames, g_nRounds );
+
+	double flLocked = RunBench< CUtlSymbolTableMT >( "CUtlSymbolTableMT", nThreads );
+	double flConcurrent = RunBench< CUtlConcurrentSymbolTable >( "CUtlConcurrentSymbolTable", nThreads );
+
+	printf( "speedup: %.2fx\n", flConcurrent > 0.0 ? flLocked / flConcurrent : 0.0 );
+
+	for ( int i = 0; i < g_Names.Count(); i++ )
+	{
+		free( g_Names[i] );
+	}
+	return 0;
+}
@@ -7,11 +7,46 @@
 //=============================================================================//
 
 #include "vbsp.h"
+#include "tier0/threadtools.h"
+#include "tier1/utlvector.h"
 
 
-int		c_nodes;
-int		c_nonvis;
-int		c_active_brushes;
+// Subtrees with at least this many brushes are handed to the task queue
+// instead of being built by the thread that split them off.
+#define BUILDTREE_TASK_BRUSHES	128
+
+// Freed brushes are kept on a list per thread and per side count so the
+// threads building subtrees don't contend for the heap.
+#define BRUSH_POOL_MAX_FREE		256
+
+struct brushpool_t
+{
+	bspbrush_t	*m_pFree[MAX_BRUSH_SIDES+2];
+	int			m_nFree[MAX_BRUSH_SIDES+2];
+};
+
+static brushpool_t g_BrushPools[MAX_TOOL_THREADS+1];
+
+// State shared by every task building part of one BrushBSP tree
+struct buildtree_t
+{
+	CInterlockedInt	m_nNodes;
+	CInterlockedInt	m_nNonVis;
+	CInterlockedInt	m_nTasks;		// subtrees queued or being built
+};
+
+struct buildtreetask_t
+{
+	node_t		*m_pNode;
+	bspbrush_t	*m_pBrushes;
+	buildtree_t	*m_pBuild;
+};
+
+static CUtlVector<buildtreetask_t> g_BuildTreeTasks;
+static CThreadFastMutex g_BuildTreeTaskMutex;
+static bool g_bBuildTreeTasks = false;
+static CInterlockedInt g_nNodeId;
+static CInterlockedInt g_nBrushId;
 
 // if a brush just barely pokes onto the other side,
 // let it slide by without chopping
@@ -310,17 +345,13 @@ AllocNode
 */
 node_t *AllocNode (void)
 {
-	static int s_NodeCount = 0;
-
 	node_t	*node;
 
 	node = (node_t*)malloc(sizeof(*node));
 	memset (node, 0, sizeof(*node));
-	node->id = s_NodeCount;
+	node->id = g_nNodeId++;
 	node->diskId = -1;
 
-	s_NodeCount++;
-
 	return node;
 }
 
@@ -332,17 +363,33 @@ AllocBrush
 */
 bspbrush_t *AllocBrush (int numsides)
 {
-	static int s_BrushId = 0;
-
-	bspbrush_t	*bb;
+	bspbrush_t	*bb = NULL;
 	int			c;
 
 	c = (int)&(((bspbrush_t *)0)->sides[numsides]);
-	bb = (bspbrush_t*)malloc(c);
+
+	// A pooled brush was allocated with at least as many sides as it has now.
+	// Threads we didn't start share the main thread's pool, under the lock.
+	int iThread = GetThreadIndex();
+	brushpool_t *pPool = &g_BrushPools[iThread];
+	if (iThread == THREADINDEX_MAIN)
+		ThreadLock();
+	if (numsides < ARRAYSIZE(pPool->m_pFree) && pPool->m_pFree[numsides])
+	{
+		bb = pPool->m_pFree[numsides];
+		pPool->m_pFree[numsides] = bb->next;
+		pPool->m_nFree[numsides]--;
+	}
+	if (iThread == THREADINDEX_MAIN)
+		ThreadUnlock();
+
+	if (!bb)
+	{
+		bb = (bspbrush_t*)malloc(c);
+	}
+
 	memset (bb, 0, c);
-	bb->id = s_BrushId++;
-	if (numthreads == 1)
-		c_active_brushes++;
+	bb->id = g_nBrushId++;
 	return bb;
 }
 
@@ -358,9 +405,27 @@ void FreeBrush (bspbrush_t *brushes)
 	for (i=0 ; i<brushes->numsides ; i++)
 		if (brushes->sides[i].winding)
 			FreeWinding(brushes->sides[i].winding);
-	free (brushes);
-	if (numthreads == 1)
-		c_active_brushes--;
+
+	int iThread = GetThreadIndex();
+	brushpool_t *pPool = &g_BrushPools[iThread];
+	int numsides = brushes->numsides;
+	bool bPooled = false;
+	if (iThread == THREADINDEX_MAIN)
+		ThreadLock();
+	if (numsides < ARRAYSIZE(pPool->m_pFree) && pPool->m_nFree[numsides] < BRUSH_POOL_MAX_FREE)
+	{
+		brushes->next = pPool->m_pFree[numsides];
+		pPool->m_pFree[numsides] = brushes;
+		pPool->m_nFree[numsides]++;
+		bPooled = true;
+	}
+	if (iThread == THREADINDEX_MAIN)
+		ThreadUnlock();
+
+	if (!bPooled)
+	{
+		free (brushes);
+	}
 }
 
 
@@ -974,14 +1039,7 @@ side_t *SelectSplitSide (bspbrush_t *brushes, node_t *node)
 		// if we found a good plane, don't bother trying any
 		// other passes
 		if (bestside)
-		{
-			if (pass > 0)
-			{
-				if (numthreads == 1)
-					c_nonvis++;
-			}
 			break;
-		}
 	}
 
 	//
@@ -1329,17 +1387,16 @@ void SplitBrushList (bspbrush_t *brushes,
 BuildTree_r
 ================
 */
+static void QueueBuildTreeTask (node_t *node, bspbrush_t *brushes, buildtree_t *pBuild);
 
-
-node_t *BuildTree_r (node_t *node, bspbrush_t *brushes)
+static node_t *BuildTree_r (node_t *node, bspbrush_t *brushes, buildtree_t *pBuild)
 {
 	node_t		*newnode;
 	side_t		*bestside;
 	int			i;
 	bspbrush_t	*children[2];
 
-	if (numthreads == 1)
-		c_nodes++;
+	++pBuild->m_nNodes;
 
 	// find the best plane to use as a splitter
 	bestside = SelectSplitSide (brushes, node);
@@ -1352,6 +1409,10 @@ node_t *BuildTree_r (node_t *node, bspbrush_t *brushes)
 		LeafNode (node, brushes);
 		return node;
 	}
+
+	// only the second pass of SelectSplitSide picks nonvisible sides
+	if (!bestside->visible)
+		++pBuild->m_nNonVis;
 			 
 	// this is a splitplane node
 	node->side = bestside;
@@ -1371,14 +1432,74 @@ node_t *BuildTree_r (node_t *node, bspbrush_t *brushes)
 	SplitBrush (node->volume, node->planenum, &node->children[0]->volume,
 		&node->children[1]->volume);
 
+	// hand a big front subtree to whichever thread is free and build the back one here.
+	// The subtrees don't share any brushes, so they come out the same either way.
+	if (g_bBuildTreeTasks && CountBrushList (children[0]) >= BUILDTREE_TASK_BRUSHES)
+	{
+		QueueBuildTreeTask (node->children[0], children[0], pBuild);
+		node->children[1] = BuildTree_r (node->children[1], children[1], pBuild);
+		return node;
+	}
+
 	// recursively process children
 	for (i=0 ; i<2 ; i++)
 	{
-		node->children[i] = BuildTree_r (node->children[i], children[i]);
+		node->children[i] = BuildTree_r (node->children[i], children[i], pBuild);
 	}
 
 	return node;
 }
+
+
+/*
+================
+BuildTree tasks
+
+While g_bBuildTreeTasks is set, BuildTree_r queues big subtrees here.  Any
+thread can build them: BrushBSP works on the queue while it waits for its
+own subtrees, and threads with nothing else to do call RunBuildTreeTask.
+================
+*/
+static void QueueBuildTreeTask (node_t *node, bspbrush_t *brushes, buildtree_t *pBuild)
+{
+	buildtreetask_t task;
+	task.m_pNode = node;
+	task.m_pBrushes = brushes;
+	task.m_pBuild = pBuild;
+
+	++pBuild->m_nTasks;
+
+	AUTO_LOCK( g_BuildTreeTaskMutex );
+	g_BuildTreeTasks.AddToTail (task);
+}
+
+
+bool RunBuildTreeTask (void)
+{
+	buildtreetask_t task;
+	{
+		AUTO_LOCK( g_BuildTreeTaskMutex );
+		if (!g_BuildTreeTasks.Count())
+			return false;
+
+		// the oldest task is usually the biggest
+		task = g_BuildTreeTasks.Head();
+		g_BuildTreeTasks.Remove (0);
+	}
+
+	BuildTree_r (task.m_pNode, task.m_pBrushes, task.m_pBuild);
+
+	// any subtrees it queued have already been counted
+	--task.m_pBuild->m_nTasks;
+	return true;
+}
+
+
+void EnableBuildTreeTasks (bool bEnable)
+{
+	Assert (!g_BuildTreeTasks.Count());
+	g_bBuildTreeTasks = bEnable;
+}
 	  
 
 //===========================================================
@@ -1439,18 +1560,25 @@ tree_t *BrushBSP (bspbrush_t *brushlist, Vector& mins, Vector& maxs)
 	qprintf ("%5i visible faces\n", c_faces);
 	qprintf ("%5i nonvisible faces\n", c_nonvisfaces);
 
-	c_nodes = 0;
-	c_nonvis = 0;
+	buildtree_t build;
 	node = AllocNode ();
 
 	node->volume = BrushFromBounds (mins, maxs);
 
 	tree->headnode = node;
 
-	node = BuildTree_r (node, brushlist);
-	qprintf ("%5i visible nodes\n", c_nodes/2 - c_nonvis);
-	qprintf ("%5i nonvis nodes\n", c_nonvis);
-	qprintf ("%5i leafs\n", (c_nodes+1)/2);
+	node = BuildTree_r (node, brushlist, &build);
+
+	// help out with whatever is queued until our own subtrees are done
+	while (build.m_nTasks > 0)
+	{
+		if (!RunBuildTreeTask ())
+			ThreadPause ();
+	}
+
+	qprintf ("%5i visible nodes\n", build.m_nNodes/2 - build.m_nNonVis);
+	qprintf ("%5i nonvis nodes\n", (int)build.m_nNonVis);
+	qprintf ("%5i leafs\n", (build.m_nNodes+1)/2);
 #if 0
 {	// debug code
 static node_t	*tnode;
@@ -156,9 +156,6 @@ qboolean BrushesDisjoint (bspbrush_t *a, bspbrush_t *b)
 }
 
 
-int		minplanenums[3];
-int		maxplanenums[3];
-
 /*
 ===============
 ClipBrushToBox
@@ -166,7 +163,8 @@ ClipBrushToBox
 Any planes shared with the box edge will be set to no texinfo
 ===============
 */
-bspbrush_t	*ClipBrushToBox (bspbrush_t *brush, const Vector& clipmins, const Vector& clipmaxs)
+bspbrush_t	*ClipBrushToBox (bspbrush_t *brush, const Vector& clipmins, const Vector& clipmaxs,
+	const int *minplanenums, const int *maxplanenums)
 {
 	int		i, j;
 	bspbrush_t	*front,	*back;
@@ -210,10 +208,13 @@ bspbrush_t	*ClipBrushToBox (bspbrush_t *brush, const Vector& clipmins, const Vec
 }
 
 
+static bspbrush_t *CopyMapBrush( mapbrush_t *mb );
+
 //-----------------------------------------------------------------------------
 // Creates a clipped brush from a map brush
 //-----------------------------------------------------------------------------
-static bspbrush_t *CreateClippedBrush( mapbrush_t *mb, const Vector& clipmins, const Vector& clipmaxs )
+static bspbrush_t *CreateClippedBrush( mapbrush_t *mb, const Vector& clipmins, const Vector& clipmaxs,
+	const int *minplanenums, const int *maxplanenums )
 {
 	int nNumSides = mb->numsides;
 	if (!nNumSides)
@@ -228,6 +229,18 @@ static bspbrush_t *CreateClippedBrush( mapbrush_t *mb, const Vector& clipmins, c
 		}
 	}
 
+	// carve off anything outside the clip box
+	bspbrush_t *newbrush = CopyMapBrush( mb );
+	return ClipBrushToBox (newbrush, clipmins, clipmaxs, minplanenums, maxplanenums);
+}
+
+//-----------------------------------------------------------------------------
+// Makes an unclipped bspbrush_t copy of a map brush
+//-----------------------------------------------------------------------------
+static bspbrush_t *CopyMapBrush( mapbrush_t *mb )
+{
+	int nNumSides = mb->numsides;
+
 	// make a copy of the brush
 	bspbrush_t *newbrush = AllocBrush( nNumSides );
 	newbrush->original = mb;
@@ -252,17 +265,15 @@ static bspbrush_t *CreateClippedBrush( mapbrush_t *mb, const Vector& clipmins, c
 
 	VectorCopy (mb->mins, newbrush->mins);
 	VectorCopy (mb->maxs, newbrush->maxs);
-
-	// carve off anything outside the clip box
-	newbrush = ClipBrushToBox (newbrush, clipmins, clipmaxs);
 	return newbrush;
 }
 
 
 //-----------------------------------------------------------------------------
-// Creates a clipped brush from a map brush
+// Finds the planes of the sides of the clip box.  They're returned to the
+// caller rather than kept in globals because the blocks are clipped in parallel.
 //-----------------------------------------------------------------------------
-static void ComputeBoundingPlanes( const Vector& clipmins, const Vector& clipmaxs )
+static void ComputeBoundingPlanes( const Vector& clipmins, const Vector& clipmaxs, int *minplanenums, int *maxplanenums )
 {
 	Vector normal;
 	float dist;
@@ -281,7 +292,7 @@ static void ComputeBoundingPlanes( const Vector& clipmins, const Vector& clipmax
 //-----------------------------------------------------------------------------
 // This forces copies of texinfo data for matching sides of a brush
 //-----------------------------------------------------------------------------
-void CopyMatchingTexinfos( side_t *pDestSides, int numDestSides, const bspbrush_t *pSource )
+void CopyMatchingTexinfos( side_t *pDestSides, int numDestSides, const bspbrush_t *pSource, bool bUpdateOriginal )
 {
 	for ( int i = 0; i < numDestSides; i++ )
 	{
@@ -322,7 +333,7 @@ void CopyMatchingTexinfos( side_t *pDestSides, int numDestSides, const bspbrush_
 		if ( pBestSide )
 		{
 			pSide->texinfo = pBestSide->texinfo;
-			if ( pSide->original )
+			if ( bUpdateOriginal && pSide->original )
 			{
 				pSide->original->texinfo = pSide->texinfo;
 			}
@@ -342,7 +353,12 @@ void CopyMatchingTexinfos( side_t *pDestSides, int numDestSides, const bspbrush_
 // If an areaportal is found inside water, then the water contents and 
 // texture information is copied over to the areaportal so that the 
 // resulting space has the same properties as the water (normal areaportals assume "empty" surroundings)
-void FixupAreaportalWaterBrushes( bspbrush_t *pList )
+//
+// With bUpdateMapBrushes, the merged contents and textures are written back to the
+// map brushes.  The world blocks are built in parallel, so that's only done once for
+// the whole world by FixupAreaportalWaterMapBrushes(); each block then only retextures
+// its own clipped copies, which also covers the sides the block's clip box added.
+void FixupAreaportalWaterBrushes( bspbrush_t *pList, bool bUpdateMapBrushes )
 {
 	for ( bspbrush_t *pAreaportal = pList; pAreaportal; pAreaportal = pAreaportal->next )
 	{
@@ -365,25 +381,59 @@ void FixupAreaportalWaterBrushes( bspbrush_t *pList )
 			if ( !pIntersect )
 				continue;
 			FreeBrush( pIntersect );
+
+			CopyMatchingTexinfos( pAreaportal->sides, pAreaportal->numsides, pWater, bUpdateMapBrushes );
+			if ( !bUpdateMapBrushes )
+				continue;
+
 			pAreaportal->original->contents |= pWater->original->contents;
 
 			// HACKHACK: Ideally, this should have been done before the bspbrush_t was 
 			// created from the map brush.  But since it hasn't been, retexture the original map
 			// brush's sides
-			CopyMatchingTexinfos( pAreaportal->sides, pAreaportal->numsides, pWater );
-			CopyMatchingTexinfos( pAreaportal->original->original_sides, pAreaportal->original->numsides, pWater );
+			CopyMatchingTexinfos( pAreaportal->original->original_sides, pAreaportal->original->numsides, pWater, true );
 		}
 	}
 }
 
 
+//-----------------------------------------------------------------------------
+// Runs the areaportal/water fixup over the structural brushes of the whole
+// world at once, before the blocks are built, so that every block sees the
+// same merged areaportals whichever order the threads build them in
+//-----------------------------------------------------------------------------
+void FixupAreaportalWaterMapBrushes( int startbrush, int endbrush )
+{
+	bspbrush_t *pList = NULL;
+	for ( int i = startbrush; i < endbrush; i++ )
+	{
+		mapbrush_t *mb = &g_MainMap->mapbrushes[i];
+
+		// the blocks are only made of structural brushes
+		if ( !mb->numsides || (mb->contents & CONTENTS_DETAIL) )
+			continue;
+
+		if ( !(mb->contents & (CONTENTS_AREAPORTAL | MASK_SPLITAREAPORTAL)) )
+			continue;
+
+		bspbrush_t *pNewBrush = CopyMapBrush( mb );
+		pNewBrush->next = pList;
+		pList = pNewBrush;
+	}
+
+	FixupAreaportalWaterBrushes( pList, true );
+	FreeBrushList( pList );
+}
+
+
 //-----------------------------------------------------------------------------
 // MakeBspBrushList 
 //-----------------------------------------------------------------------------
 // UNDONE: Put detail brushes in a separate brush array and pass that instead of "onlyDetail" ?
 bspbrush_t *MakeBspBrushList (int startbrush, int endbrush, const Vector& clipmins, const Vector& clipmaxs, int detailScreen)
 {
-	ComputeBoundingPlanes( clipmins, clipmaxs );
+	int minplanenums[2], maxplanenums[2];
+	ComputeBoundingPlanes( clipmins, clipmaxs, minplanenums, maxplanenums );
 
 	bspbrush_t	*pBrushList = NULL;
 
@@ -402,7 +452,7 @@ bspbrush_t *MakeBspBrushList (int startbrush, int endbrush, const Vector& clipmi
 			}
 		}
 
-		bspbrush_t *pNewBrush = CreateClippedBrush( mb, clipmins, clipmaxs );
+		bspbrush_t *pNewBrush = CreateClippedBrush( mb, clipmins, clipmaxs, minplanenums, maxplanenums );
 		if ( pNewBrush )
 		{
 			pNewBrush->next = pBrushList;
@@ -419,12 +469,13 @@ bspbrush_t *MakeBspBrushList (int startbrush, int endbrush, const Vector& clipmi
 //-----------------------------------------------------------------------------
 bspbrush_t *MakeBspBrushList (mapbrush_t **pBrushes, int nBrushCount, const Vector& clipmins, const Vector& clipmaxs)
 {
-	ComputeBoundingPlanes( clipmins, clipmaxs );
+	int minplanenums[2], maxplanenums[2];
+	ComputeBoundingPlanes( clipmins, clipmaxs, minplanenums, maxplanenums );
 
 	bspbrush_t	*pBrushList = NULL;
 	for ( int i=0; i < nBrushCount; ++i )
 	{
-		bspbrush_t *pNewBrush = CreateClippedBrush( pBrushes[i], clipmins, clipmaxs );
+		bspbrush_t *pNewBrush = CreateClippedBrush( pBrushes[i], clipmins, clipmaxs, minplanenums, maxplanenums );
 		if ( pNewBrush )
 		{
 			pNewBrush->next = pBrushList;
@@ -631,7 +682,7 @@ qboolean BrushGE (bspbrush_t *b1, bspbrush_t *b2)
 {
 	// Areaportals are allowed to bite water + slime
 	// NOTE: This brush combo should have been fixed up
-	// in a first pass (FixupAreaportalWaterBrushes)
+	// in a first pass (FixupAreaportalWaterMapBrushes)
 	if( (b2->original->contents & MASK_SPLITAREAPORTAL) && 
 		(b1->original->contents & CONTENTS_AREAPORTAL) )
 	{
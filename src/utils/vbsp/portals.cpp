@@ -13,8 +13,6 @@
 #include "csg.h"
 #include "fmtstr.h"
 
-int		c_active_portals;
-int		c_peak_portals;
 int		c_boundary;
 int		c_boundary_sides;
 
@@ -29,11 +27,6 @@ portal_t *AllocPortal (void)
 
 	portal_t	*p;
 	
-	if (numthreads == 1)
-		c_active_portals++;
-	if (c_active_portals > c_peak_portals)
-		c_peak_portals = c_active_portals;
-	
 	p = (portal_t*)malloc (sizeof(portal_t));
 	memset (p, 0, sizeof(portal_t));
 	p->id = s_PortalCount;
@@ -46,8 +39,6 @@ void FreePortal (portal_t *p)
 {
 	if (p->winding)
 		FreeWinding (p->winding);
-	if (numthreads == 1)
-		c_active_portals--;
 	free (p);
 }
 
@@ -12,6 +12,7 @@
 #include "disp_vbsp.h"
 #include "writebsp.h"
 #include "tier0/icommandline.h"
+#include "tier0/threadtools.h"
 #include "materialsystem/imaterialsystem.h"
 #include "map.h"
 #include "tools_minidump.h"
@@ -82,6 +83,73 @@ int			entity_num;
 
 node_t		*block_nodes[BLOCKS_SPACE+2][BLOCKS_SPACE+2];
 
+
+//-----------------------------------------------------------------------------
+// Wall time of each stage of the compile, summed over all the models that go
+// through it and printed at the end.
+//-----------------------------------------------------------------------------
+#define MAX_VBSP_PHASES		32
+
+struct vbspphase_t
+{
+	const char	*m_pName;
+	int			m_nRuns;
+	double		m_flTime;
+};
+
+static vbspphase_t g_Phases[MAX_VBSP_PHASES];
+static int g_nPhases;
+
+static void AddPhaseTime( const char *pName, double flStartTime )
+{
+	double flTime = Plat_FloatTime() - flStartTime;
+
+	vbspphase_t *pPhase = NULL;
+	for ( int i=0; i < g_nPhases; i++ )
+	{
+		if ( !Q_stricmp( g_Phases[i].m_pName, pName ) )
+		{
+			pPhase = &g_Phases[i];
+			break;
+		}
+	}
+
+	if ( !pPhase )
+	{
+		if ( g_nPhases >= MAX_VBSP_PHASES )
+			return;
+
+		pPhase = &g_Phases[g_nPhases++];
+		pPhase->m_pName = pName;
+		pPhase->m_nRuns = 0;
+		pPhase->m_flTime = 0;
+	}
+
+	pPhase->m_nRuns++;
+	pPhase->m_flTime += flTime;
+}
+
+static void PrintPhaseTimes( void )
+{
+	if ( g_nPhases == 0 )
+		return;
+
+	double flTotal = 0;
+	for ( int i=0; i < g_nPhases; i++ )
+	{
+		flTotal += g_Phases[i].m_flTime;
+	}
+
+	Msg( "\nPhases:\n" );
+	Msg( "%-24s %5s %10s %7s\n", "phase", "runs", "time (s)", "share" );
+	for ( int i=0; i < g_nPhases; i++ )
+	{
+		vbspphase_t *pPhase = &g_Phases[i];
+		Msg( "%-24s %5d %10.2f %6.1f%%\n", pPhase->m_pName, pPhase->m_nRuns, pPhase->m_flTime,
+			flTotal > 0 ? 100.0 * pPhase->m_flTime / flTotal : 0.0 );
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Assign occluder areas (must happen *after* the world model is processed)
 //-----------------------------------------------------------------------------
@@ -182,7 +250,7 @@ void ProcessBlock_Thread (int threadnum, int blocknum)
 		return;
 	}    
 
-	FixupAreaportalWaterBrushes( brushes );
+	FixupAreaportalWaterBrushes( brushes, false );
 	if (!nocsg)
 		brushes = ChopBrushes (brushes);
 
@@ -192,6 +260,72 @@ void ProcessBlock_Thread (int threadnum, int blocknum)
 }
 
 
+/*
+============
+ProcessBlocks_Thread
+
+Builds blocks until there are none left to start, then helps
+build the subtrees the blocks that are still running have queued.
+============
+*/
+static CInterlockedInt g_nBlocksLeft;
+
+void ProcessBlocks_Thread (int threadnum, void *pUserData)
+{
+	int		blocknum;
+
+	while ((blocknum = GetThreadWork ()) != -1)
+	{
+		ProcessBlock_Thread (threadnum, blocknum);
+		--g_nBlocksLeft;
+	}
+
+	while (g_nBlocksLeft > 0)
+	{
+		if (!RunBuildTreeTask ())
+			ThreadPause ();
+	}
+}
+
+
+/*
+============
+CreateBlockPlanes
+
+Creates every plane the blocks are clipped to and bounded by before the
+blocks are built in parallel.  The threads then never add planes, so the
+plane numbers don't depend on which block gets to a plane first.
+============
+*/
+static void CreateBlockPlanes (void)
+{
+	Vector	normal;
+	vec_t	dist;
+	int		i;
+
+	for (i = block_xl ; i <= block_xh+1 ; i++)
+	{
+		normal.Init (1, 0, 0);
+		dist = i*BLOCKS_SIZE;
+		g_MainMap->FindFloatPlane (normal, dist);
+	}
+
+	for (i = block_yl ; i <= block_yh+1 ; i++)
+	{
+		normal.Init (0, 1, 0);
+		dist = i*BLOCKS_SIZE;
+		g_MainMap->FindFloatPlane (normal, dist);
+	}
+
+	normal.Init (0, 0, 1);
+	dist = MIN_COORD_INTEGER;
+	g_MainMap->FindFloatPlane (normal, dist);
+	normal.Init (0, 0, 1);
+	dist = MAX_COORD_INTEGER;
+	g_MainMap->FindFloatPlane (normal, dist);
+}
+
+
 /*
 ============
 ProcessWorldModel
@@ -205,7 +339,8 @@ void ProcessWorldModel (void)
 	tree_t		*tree = NULL;
 	qboolean	leaked;
 	int	optimize;
-	int			start;
+	double		flPhaseStart;
+	double		flWriteStart;
 
 	e = &entities[entity_num];
 
@@ -251,12 +386,20 @@ void ProcessWorldModel (void)
 		block_yh = BLOCKS_MAX;
 	}
 
+	CreateBlockPlanes ();
+	FixupAreaportalWaterMapBrushes (brush_start, brush_end);
+
 	for (optimize = 0 ; optimize <= 1 ; optimize++)
 	{
 		qprintf ("--------------------------------------------\n");
 
-		RunThreadsOnIndividual ((block_xh-block_xl+1)*(block_yh-block_yl+1),
-			!verbose, ProcessBlock_Thread);
+		flPhaseStart = Plat_FloatTime();
+		int nBlocks = (block_xh-block_xl+1)*(block_yh-block_yl+1);
+		g_nBlocksLeft = nBlocks;
+		EnableBuildTreeTasks (true);
+		RunThreadsOn (nBlocks, !verbose, ProcessBlocks_Thread);
+		EnableBuildTreeTasks (false);
+		AddPhaseTime ("BrushBSP", flPhaseStart);
 
 		//
 		// build the division tree
@@ -282,8 +425,11 @@ void ProcessWorldModel (void)
 		//
 
 		// make the portals/faces by traversing down to each empty leaf
+		flPhaseStart = Plat_FloatTime();
 		MakeTreePortals (tree);
+		AddPhaseTime ("MakeTreePortals", flPhaseStart);
 
+		flPhaseStart = Plat_FloatTime();
 		if (FloodEntities (tree))
 		{
 			// turns everthing outside into solid
@@ -300,9 +446,12 @@ void ProcessWorldModel (void)
 				exit (0);
 			}
 		}
+		AddPhaseTime ("FloodEntities", flPhaseStart);
 
 		// mark the brush sides that actually turned into faces
+		flPhaseStart = Plat_FloatTime();
 		MarkVisibleSides (tree, brush_start, brush_end, NO_DETAIL);
+		AddPhaseTime ("MarkVisibleSides", flPhaseStart);
 		if (noopt || leaked)
 			break;
 		if (!optimize)
@@ -314,16 +463,19 @@ void ProcessWorldModel (void)
 		}
 	}
 
+	flPhaseStart = Plat_FloatTime();
 	FloodAreas (tree);
 
 	RemoveAreaPortalBrushes_R( tree->headnode );
+	AddPhaseTime ("FloodAreas", flPhaseStart);
 
-	start = Plat_FloatTime();
+	flPhaseStart = Plat_FloatTime();
 	Msg("Building Faces...");
 	// this turns portals with one solid side into faces
 	// it also subdivides each face if necessary to fit max lightmap dimensions
 	MakeFaces (tree->headnode);
-	Msg("done (%d)\n", (int)(Plat_FloatTime() - start) );
+	Msg("done (%d)\n", (int)(Plat_FloatTime() - flPhaseStart) );
+	AddPhaseTime ("MakeFaces", flPhaseStart);
 
 	if (glview)
 	{
@@ -335,35 +487,44 @@ void ProcessWorldModel (void)
 	face_t *pLeafFaceList = NULL;
 	if ( !nodetail )
 	{
+		flPhaseStart = Plat_FloatTime();
 		pLeafFaceList = MergeDetailTree( tree, brush_start, brush_end );
+		AddPhaseTime( "MergeDetailTree", flPhaseStart );
 	}
 
-	start = Plat_FloatTime();
+	// FixTjuncs through WriteBSP are reported as one step as well as phase by phase
+	flWriteStart = Plat_FloatTime();
+	flPhaseStart = flWriteStart;
 
 	Msg("FixTjuncs...\n");
 	
 	// This unifies the vertex list for all edges (splits collinear edges to remove t-junctions)
 	// It also welds the list of vertices out of each winding/portal and rounds nearly integer verts to integer
 	pLeafFaceList = FixTjuncs (tree->headnode, pLeafFaceList);
+	AddPhaseTime ("FixTjuncs", flPhaseStart);
 
 	// this merges all of the solid nodes that have separating planes
 	if (!noprune)
 	{
+		flPhaseStart = Plat_FloatTime();
 		Msg("PruneNodes...\n");
 		PruneNodes (tree->headnode);
+		AddPhaseTime ("PruneNodes", flPhaseStart);
 	}
 
 //	Msg( "SplitSubdividedFaces...\n" );
 //	SplitSubdividedFaces( tree->headnode );
 
+	flPhaseStart = Plat_FloatTime();
 	Msg("WriteBSP...\n");
 	WriteBSP (tree->headnode, pLeafFaceList);
-	Msg("done (%d)\n", (int)(Plat_FloatTime() - start) );
+	Msg("done (%d)\n", (int)(Plat_FloatTime() - flWriteStart) );
 
 	if (!leaked)
 	{
 		WritePortalFile (tree);
 	}
+	AddPhaseTime ("WriteBSP", flPhaseStart);
 
 	FreeTree( tree );
 	FreeLeafFaces( pLeafFaceList );
@@ -827,7 +988,9 @@ void ProcessModels (void)
 
 	// Clip occluder brushes against each other, 
 	// Remove them from the list of models to process below
+	double flPhaseStart = Plat_FloatTime();
 	EmitOccluderBrushes( );
+	AddPhaseTime( "EmitOccluderBrushes", flPhaseStart );
 
 	for ( entity_num=0; entity_num < num_entities; ++entity_num )
 	{
@@ -845,7 +1008,9 @@ void ProcessModels (void)
 		}
 		else
 		{
+			flPhaseStart = Plat_FloatTime();
 			ProcessSubModel( );
+			AddPhaseTime( "ProcessSubModel", flPhaseStart );
 		}
 
 		EndModel ();
@@ -1242,7 +1407,6 @@ int RunVBSP( int argc, char **argv )
 	}
 
 	ThreadSetDefault ();
-	numthreads = 1;		// multiple threads aren't helping...
 
 	// Setup the logfile.
 	char logFile[512];
@@ -1360,7 +1524,9 @@ int RunVBSP( int argc, char **argv )
 			AddBufferToPak( GetPakFile(), "stale.txt", "stale", strlen( "stale" ) + 1, false );
 		}
 
+		double flPhaseStart = Plat_FloatTime();
 		LoadMapFile (name);
+		AddPhaseTime( "LoadMapFile", flPhaseStart );
 		WorldVertexTransitionFixup();
 		if( ( g_nDXLevel == 0 ) || ( g_nDXLevel >= 70 ) )
 		{
@@ -1374,6 +1540,9 @@ int RunVBSP( int argc, char **argv )
 		ProcessModels ();
 	}
 
+	PrintPhaseTimes();
+	PrintThreadPhaseStats();
+
 	end = Plat_FloatTime();
 	
 	char str[512];
@@ -483,6 +483,12 @@ node_t	*PointInLeaf (node_t *node, Vector& point);
 
 tree_t *BrushBSP (bspbrush_t *brushlist, Vector& mins, Vector& maxs);
 
+// Lets BuildTree_r queue big subtrees for other threads while BrushBSP is
+// being run from several threads at once.  RunBuildTreeTask builds one of
+// them and returns false when the queue is empty.
+void EnableBuildTreeTasks (bool bEnable);
+bool RunBuildTreeTask (void);
+
 #define	PSIDE_FRONT			1
 #define	PSIDE_BACK			2
 #define	PSIDE_BOTH			(PSIDE_FRONT|PSIDE_BACK)
@@ -89,50 +89,98 @@ float Engine_WorldLightDistanceFalloff( const dworldlight_t *wl, const Vector& d
 }
 
 
-void AddEmitSurfaceLights( const Vector &vStart, Vector lightBoxColor[6] )
+static void AddEmitSurfaceLight( dworldlight_t *wl, const Vector &vStart, float flFractionVisible, Vector lightBoxColor[6] )
 {
-	fltx4 fractionVisible;
+	// Can this light see the point?
+	if ( flFractionVisible <= 0.0f )
+		return;
+
+	// Add this light's contribution.
+	Vector vDelta = wl->origin - vStart;
+	float flDistanceScale = Engine_WorldLightDistanceFalloff( wl, vDelta );
 
-	FourVectors vStart4, wlOrigin4;
-	vStart4.DuplicateVector ( vStart );
+	Vector vDeltaNorm = vDelta;
+	VectorNormalize( vDeltaNorm );
+	float flAngleScale = Engine_WorldLightAngle( wl, wl->normal, vDeltaNorm, vDeltaNorm );
+
+	float ratio = flDistanceScale * flAngleScale * flFractionVisible;
+	if ( ratio == 0 )
+		return;
 
-	for ( int iLight=0; iLight < *pNumworldlights; iLight++ )
+	for ( int i=0; i < 6; i++ )
 	{
-		dworldlight_t *wl = &dworldlights[iLight];
+		float t = DotProduct( g_BoxDirections[i], vDeltaNorm );
+		if ( t > 0 )
+		{
+			lightBoxColor[i] += wl->intensity * (t * ratio);
+		}
+	}
+}
 
-		// Should this light even go in the ambient cubes?
-		if ( !( wl->flags & DWL_FLAGS_INAMBIENTCUBE ) )
-			continue;
 
-		Assert( wl->type == emit_surface );
+// The lights that go in the ambient cube, found once by ComputePerLeafAmbientLighting()
+static CUtlVector<int> s_AmbientCubeLights;
 
-		// Can this light see the point?
-		wlOrigin4.DuplicateVector ( wl->origin );
-		TestLine ( vStart4, wlOrigin4, &fractionVisible );
-		if ( !TestSignSIMD ( CmpGtSIMD ( fractionVisible, Four_Zeros ) ) )
-			continue;
+void AddEmitSurfaceLights( const Vector &vStart, Vector lightBoxColor[6] )
+{
+	int nLights = s_AmbientCubeLights.Count();
+	if ( !nLights )
+		return;
+
+	// Group the lights by which way they are from vStart, so the lines to them can be traced
+	// eight at a time with the rays in a packet going the same way. This runs for every
+	// sample, so it's a counting sort on the stack rather than a list per octant.
+	byte *pOctants = (byte *)stackalloc( nLights * sizeof( byte ) );
+	int *pLights = (int *)stackalloc( nLights * sizeof( int ) );
+	int nOctantStart[9] = { 0 };
+	for ( int i = 0; i < nLights; i++ )
+	{
+		Vector vDelta = dworldlights[s_AmbientCubeLights[i]].origin - vStart;
+		pOctants[i] = ( vDelta.x > 0.0f ? 1 : 0 ) | ( vDelta.y > 0.0f ? 2 : 0 ) | ( vDelta.z > 0.0f ? 4 : 0 );
+		nOctantStart[pOctants[i] + 1]++;
+	}
+	for ( int i = 1; i < 9; i++ )
+	{
+		nOctantStart[i] += nOctantStart[i - 1];
+	}
+	for ( int i = 0; i < nLights; i++ )
+	{
+		pLights[nOctantStart[pOctants[i]]++] = s_AmbientCubeLights[i];
+	}
 
-		// Add this light's contribution.
-		Vector vDelta = wl->origin - vStart;
-		float flDistanceScale = Engine_WorldLightDistanceFalloff( wl, vDelta );
+	FourVectors vStart4[2];
+	vStart4[0].DuplicateVector( vStart );
+	vStart4[1] = vStart4[0];
 
-		Vector vDeltaNorm = vDelta;
-		VectorNormalize( vDeltaNorm );
-		float flAngleScale = Engine_WorldLightAngle( wl, wl->normal, vDeltaNorm, vDeltaNorm );
+	for ( int iFirst = 0; iFirst < nLights; iFirst += 8 )
+	{
+		int nBatch = min( nLights - iFirst, 8 );
 
-		float ratio = flDistanceScale * flAngleScale * SubFloat ( fractionVisible, 0 );
-		if ( ratio == 0 )
-			continue;
+		// pad a short batch with its last light
+		FourVectors wlOrigin4[2];
+		for ( int k = 0; k < 8; k++ )
+		{
+			const Vector &vOrigin = dworldlights[pLights[iFirst + min( k, nBatch - 1 )]].origin;
+			wlOrigin4[k / 4].X( k & 3 ) = vOrigin.x;
+			wlOrigin4[k / 4].Y( k & 3 ) = vOrigin.y;
+			wlOrigin4[k / 4].Z( k & 3 ) = vOrigin.z;
+		}
 
-		for ( int i=0; i < 6; i++ )
+		fltx4 fractionVisible[2];
+		if ( nBatch > 4 )
 		{
-			float t = DotProduct( g_BoxDirections[i], vDeltaNorm );
-			if ( t > 0 )
-			{
-				lightBoxColor[i] += wl->intensity * (t * ratio);
-			}
+			TestLine8( vStart4, wlOrigin4, fractionVisible );
 		}
-	}	
+		else
+		{
+			TestLine( vStart4[0], wlOrigin4[0], &fractionVisible[0] );
+		}
+
+		for ( int k = 0; k < nBatch; k++ )
+		{
+			AddEmitSurfaceLight( &dworldlights[pLights[iFirst + k]], vStart, SubFloat( fractionVisible[k / 4], k & 3 ), lightBoxColor );
+		}
+	}
 }
 
 
@@ -622,6 +670,7 @@ void ComputePerLeafAmbientLighting()
 	// Figure out which lights should go in the per-leaf ambient cubes.
 	int nInAmbientCube = 0;
 	int nSurfaceLights = 0;
+	s_AmbientCubeLights.RemoveAll();
 	for ( int i=0; i < *pNumworldlights; i++ )
 	{
 		dworldlight_t *wl = &dworldlights[i];
@@ -635,7 +684,11 @@ void ComputePerLeafAmbientLighting()
 			++nSurfaceLights;
 
 		if ( wl->flags & DWL_FLAGS_INAMBIENTCUBE )
+		{
+			Assert( wl->type == emit_surface );
+			s_AmbientCubeLights.AddToTail( i );
 			++nInAmbientCube;
+		}
 	}
 
 	Msg( "%d of %d (%d%% of) surface lights went in leaf ambient cubes.\n", nInAmbientCube, nSurfaceLights, nSurfaceLights ? ((nInAmbientCube*100) / nSurfaceLights) : 0 );
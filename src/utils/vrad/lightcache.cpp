@@ -0,0 +1,1031 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: -lightcache: keeps, for every face, its final direct lighting and
+//			each light's falloff * dot * visibility at its samples. A face
+//			whose samples hash the same as last run reuses whatever wasn't
+//			touched since: lights with the same key reuse their visibility,
+//			unless a changed part of the world lies between them and the
+//			face, and if nothing reaching the face changed its lighting is
+//			copied as is, supersampling included.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightmap.h"
+#include "lightcache.h"
+#include "utlbuffer.h"
+#include "filesystem.h"
+#include "collisionutils.h"
+
+CLightCache *g_pLightCache = NULL;
+
+#define LIGHTCACHE_CELL_RANGE	512		// cells per axis on either side of the origin, 10 bits each
+
+//-----------------------------------------------------------------------------
+// 64-bit FNV-1a, for keys that have to stay the same from one run to the next
+//-----------------------------------------------------------------------------
+class CLightCacheHash
+{
+public:
+	CLightCacheHash( uint64 nSeed = 0xcbf29ce484222325ull ) : m_nHash( nSeed ) {}
+
+	void Add( const void *pData, int nBytes )
+	{
+		const byte *pBytes = (const byte *)pData;
+		for ( int i = 0; i < nBytes; i++ )
+		{
+			m_nHash = ( m_nHash ^ pBytes[i] ) * 0x100000001b3ull;
+		}
+	}
+
+	template < class T > void Add( const T &value )	{ Add( &value, sizeof( value ) ); }
+
+	uint64 Get() const	{ return m_nHash; }
+
+private:
+	uint64 m_nHash;
+};
+
+static int __cdecl CompareUint64( const uint64 *a, const uint64 *b )
+{
+	return ( *a < *b ) ? -1 : ( ( *a > *b ) ? 1 : 0 );
+}
+
+static int __cdecl CompareContributions( const LightCacheContribution_t *a, const LightCacheContribution_t *b )
+{
+	return CompareUint64( &a->m_nLightKey, &b->m_nLightKey );
+}
+
+// Returns the index of the first element not less than key
+template < class T, class K, class F >
+static int LowerBound( const CUtlVector<T> &vec, const K &key, F pfnLess )
+{
+	int nLow = 0, nHigh = vec.Count();
+	while ( nLow < nHigh )
+	{
+		int nMid = ( nLow + nHigh ) / 2;
+		if ( pfnLess( vec[nMid], key ) )
+		{
+			nLow = nMid + 1;
+		}
+		else
+		{
+			nHigh = nMid;
+		}
+	}
+	return nLow;
+}
+
+static bool Uint64Less( const uint64 &a, const uint64 &b )	{ return a < b; }
+static bool ContributionLess( const LightCacheContribution_t &a, const uint64 &nKey )	{ return a.m_nLightKey < nKey; }
+
+static int OccluderCellCoord( float flCoord )
+{
+	int nCoord = (int)floor( flCoord / LIGHTCACHE_CELL_SIZE );
+	return clamp( nCoord, -LIGHTCACHE_CELL_RANGE, LIGHTCACHE_CELL_RANGE - 1 );
+}
+
+static int OccluderCellIndex( int x, int y, int z )
+{
+	return ( x + LIGHTCACHE_CELL_RANGE ) | ( ( y + LIGHTCACHE_CELL_RANGE ) << 10 ) | ( ( z + LIGHTCACHE_CELL_RANGE ) << 20 );
+}
+
+static void OccluderCellBounds( int nCell, Vector &mins, Vector &maxs )
+{
+	for ( int i = 0; i < 3; i++ )
+	{
+		int nCoord = ( ( nCell >> ( i * 10 ) ) & 1023 ) - LIGHTCACHE_CELL_RANGE;
+		mins[i] = nCoord * LIGHTCACHE_CELL_SIZE;
+		maxs[i] = mins[i] + LIGHTCACHE_CELL_SIZE;
+	}
+}
+
+static void SweptBounds( const LightCacheRegion_t &region, Vector &mins, Vector &maxs )
+{
+	for ( int i = 0; i < 3; i++ )
+	{
+		mins[i] = region.m_vecMins[i] + MIN( region.m_vecSweep[i], 0.0f );
+		maxs[i] = region.m_vecMaxs[i] + MAX( region.m_vecSweep[i], 0.0f );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Separating axis test of a box against a box swept along a segment: the swept
+// hull's faces are the box's and the sweep crossed with each axis
+//-----------------------------------------------------------------------------
+static bool RegionTouchesBox( const LightCacheRegion_t &region, const Vector &mins, const Vector &maxs )
+{
+	Vector vecSweptMins, vecSweptMaxs;
+	SweptBounds( region, vecSweptMins, vecSweptMaxs );
+	if ( !IsBoxIntersectingBox( vecSweptMins, vecSweptMaxs, mins, maxs ) )
+		return false;
+
+	if ( region.m_vecSweep.IsZero() )
+		return true;
+
+	Vector vecRegionCenter = ( region.m_vecMins + region.m_vecMaxs ) * 0.5f;
+	Vector vecRegionExtent = ( region.m_vecMaxs - region.m_vecMins ) * 0.5f;
+	Vector vecBoxCenter = ( mins + maxs ) * 0.5f;
+	Vector vecBoxExtent = ( maxs - mins ) * 0.5f;
+	for ( int i = 0; i < 3; i++ )
+	{
+		Vector vecAxis( 0, 0, 0 );
+		vecAxis[i] = 1.0f;
+		Vector vecNormal = CrossProduct( region.m_vecSweep, vecAxis );
+
+		// the sweep doesn't move the region along this normal
+		float flRegionRadius = fabs( vecRegionExtent.x * vecNormal.x ) + fabs( vecRegionExtent.y * vecNormal.y ) + fabs( vecRegionExtent.z * vecNormal.z );
+		float flBoxRadius = fabs( vecBoxExtent.x * vecNormal.x ) + fabs( vecBoxExtent.y * vecNormal.y ) + fabs( vecBoxExtent.z * vecNormal.z );
+		if ( fabs( DotProduct( vecBoxCenter - vecRegionCenter, vecNormal ) ) > flRegionRadius + flBoxRadius )
+			return false;
+	}
+	return true;
+}
+
+const LightCacheContribution_t *LightCacheFace_t::FindContribution( uint64 nLightKey ) const
+{
+	int i = LowerBound( m_Contributions, nLightKey, ContributionLess );
+	if ( i < m_Contributions.Count() && m_Contributions[i].m_nLightKey == nLightKey )
+		return &m_Contributions[i];
+	return NULL;
+}
+
+
+//-----------------------------------------------------------------------------
+// CLightCache
+//-----------------------------------------------------------------------------
+CLightCache::CLightCache() : m_OccluderCells( DefLessFunc( int ) ), m_CachedFaces( DefLessFunc( uint64 ) )
+{
+	m_vecChangedMins.Init();
+	m_vecChangedMaxs.Init();
+	m_nReusedFaces = 0;
+	m_nPartialFaces = 0;
+	m_nRelitFaces = 0;
+	m_nReusedPairs = 0;
+	m_nTracedPairs = 0;
+	m_flStartTime = 0.0;
+}
+
+CLightCache::~CLightCache()
+{
+	FreeFaces();
+}
+
+void CLightCache::FreeFaces()
+{
+	// faces copied from the file as is are owned by m_CachedFaces
+	for ( int i = 0; i < m_NewFaces.Count(); i++ )
+	{
+		if ( m_NewFaces[i] && !m_NewFaces[i]->m_bLoaded )
+		{
+			delete m_NewFaces[i];
+		}
+	}
+	m_NewFaces.Purge();
+
+	for ( unsigned short i = m_CachedFaces.FirstInorder(); i != m_CachedFaces.InvalidIndex(); i = m_CachedFaces.NextInorder( i ) )
+	{
+		delete m_CachedFaces[i];
+	}
+	m_CachedFaces.RemoveAll();
+}
+
+//-----------------------------------------------------------------------------
+// Hashes the triangles into a coarse grid of the world, so that the next run
+// can tell where the occluders changed
+//-----------------------------------------------------------------------------
+void CLightCache::HashOccluders( RayTracingEnvironment &env )
+{
+	m_OccluderCells.RemoveAll();
+	for ( int i = 0; i < env.OptimizedTriangleList.Count(); i++ )
+	{
+		TriGeometryData_t &tri = env.OptimizedTriangleList[i].m_Data.m_GeometryData;
+
+		// static prop ids shift whenever a prop is added or removed, and faces only care about the kind of occluder
+		int nKind = tri.m_nTriangleID & 0xff000000;
+
+		CLightCacheHash hash;
+		hash.Add( tri.m_VertexCoordData, sizeof( tri.m_VertexCoordData ) );
+		hash.Add( tri.m_nFlags );
+		hash.Add( nKind );
+		if ( i < env.TriangleColors.Count() )
+		{
+			hash.Add( env.TriangleColors[i] );
+		}
+		if ( i < env.TriangleMaterials.Count() )
+		{
+			hash.Add( env.TriangleMaterials[i] );
+		}
+
+		Vector mins, maxs;
+		ClearBounds( mins, maxs );
+		for ( int v = 0; v < 3; v++ )
+		{
+			AddPointToBounds( tri.Vertex( v ), mins, maxs );
+		}
+
+		// cells add their triangles' hashes up, so the order the triangles come in doesn't matter
+		for ( int z = OccluderCellCoord( mins.z ); z <= OccluderCellCoord( maxs.z ); z++ )
+		{
+			for ( int y = OccluderCellCoord( mins.y ); y <= OccluderCellCoord( maxs.y ); y++ )
+			{
+				for ( int x = OccluderCellCoord( mins.x ); x <= OccluderCellCoord( maxs.x ); x++ )
+				{
+					int nCell = OccluderCellIndex( x, y, z );
+					unsigned short nIndex = m_OccluderCells.Find( nCell );
+					if ( nIndex == m_OccluderCells.InvalidIndex() )
+					{
+						nIndex = m_OccluderCells.Insert( nCell, 0 );
+					}
+					m_OccluderCells[nIndex] += hash.Get();
+				}
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Anything that changes the direct lighting of a face without changing its
+// samples, the lights or the occluders
+//-----------------------------------------------------------------------------
+uint64 CLightCache::HashSettings() const
+{
+	CLightCacheHash hash;
+	hash.Add( (int)LIGHTCACHE_VERSION );
+	hash.Add( do_extra );
+	hash.Add( extrapasses );
+	hash.Add( do_fast );
+	hash.Add( do_centersamples );
+	hash.Add( debug_extra );
+	hash.Add( g_flSkySampleScale );
+	hash.Add( g_bTextureShadows );
+	hash.Add( g_bFastAmbient );
+	hash.Add( g_bNoSkyRecurse );
+	hash.Add( g_bLargeDispSampleRadius );
+	hash.Add( g_flMaxDispSampleSize );
+	hash.Add( g_bStaticPropPolys );
+	hash.Add( g_bDisablePropSelfShadowing );
+	hash.Add( dlight_map );
+	hash.Add( g_bHDR );
+	hash.Add( lightscale );
+	hash.Add( smoothing_threshold );
+	hash.Add( num_sky_cameras );
+	for ( int i = 0; i < num_sky_cameras; i++ )
+	{
+		hash.Add( sky_cameras[i].origin );
+		hash.Add( sky_cameras[i].world_to_sky );
+		hash.Add( sky_cameras[i].area );
+	}
+	return hash.Get();
+}
+
+//-----------------------------------------------------------------------------
+// A light's key is everything about it but its intensity, which is applied
+// after the cached falloff * dot
+//-----------------------------------------------------------------------------
+void CLightCache::ComputeLightKeys()
+{
+	m_LightKeys.SetCount( numdlights );
+	memset( m_LightKeys.Base(), 0, m_LightKeys.Count() * sizeof( m_LightKeys[0] ) );
+	m_SortedLightKeys.RemoveAll();
+
+	CUtlMap<uint64, int> occurrences( DefLessFunc( uint64 ) );
+	int nPVSBytes = ( dvis->numclusters / 8 ) + 1;
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		const dworldlight_t &light = dl->light;
+
+		CLightCacheHash hash;
+		hash.Add( light.type );
+		hash.Add( light.style );
+		hash.Add( light.origin );
+		hash.Add( light.normal );
+		hash.Add( light.stopdot );
+		hash.Add( light.stopdot2 );
+		hash.Add( light.exponent );
+		hash.Add( light.radius );
+		hash.Add( light.constant_attn );
+		hash.Add( light.linear_attn );
+		hash.Add( light.quadratic_attn );
+		hash.Add( light.flags );
+		hash.Add( dl->facenum == -1 );
+		hash.Add( dl->m_flStartFadeDistance );
+		hash.Add( dl->m_flEndFadeDistance );
+		hash.Add( dl->m_flCapDist );
+		if ( dl->pvs )
+		{
+			hash.Add( dl->pvs, nPVSBytes );
+		}
+		if ( light.type == emit_skylight )
+		{
+			hash.Add( g_SunAngularExtent );
+		}
+
+		// identical lights are told apart by the order they come in
+		unsigned short nIndex = occurrences.Find( hash.Get() );
+		if ( nIndex == occurrences.InvalidIndex() )
+		{
+			nIndex = occurrences.Insert( hash.Get(), 0 );
+		}
+		hash.Add( occurrences[nIndex]++ );
+
+		m_LightKeys[dl->index] = hash.Get();
+		m_SortedLightKeys.AddToTail( hash.Get() );
+	}
+	m_SortedLightKeys.Sort( CompareUint64 );
+}
+
+int __cdecl CLightCache::CompareCachedLights( const CachedLight_t *a, const CachedLight_t *b )
+{
+	return CompareUint64( &a->m_nKey, &b->m_nKey );
+}
+
+bool CLightCache::IsCurrentLight( uint64 nLightKey ) const
+{
+	int i = LowerBound( m_SortedLightKeys, nLightKey, Uint64Less );
+	return i < m_SortedLightKeys.Count() && m_SortedLightKeys[i] == nLightKey;
+}
+
+const LightCacheFace_t *CLightCache::FindFace( uint64 nFaceKey ) const
+{
+	unsigned short i = m_CachedFaces.Find( nFaceKey );
+	return ( i != m_CachedFaces.InvalidIndex() ) ? m_CachedFaces[i] : NULL;
+}
+
+void CLightCache::FindChangedCells( const CUtlVector<OccluderCell_t> &oldCells )
+{
+	m_ChangedCells.RemoveAll();
+	ClearBounds( m_vecChangedMins, m_vecChangedMaxs );
+
+	CUtlVector<int> changed;
+	for ( int i = 0; i < oldCells.Count(); i++ )
+	{
+		unsigned short nIndex = m_OccluderCells.Find( oldCells[i].m_nCell );
+		if ( nIndex == m_OccluderCells.InvalidIndex() || m_OccluderCells[nIndex] != oldCells[i].m_nHash )
+		{
+			changed.AddToTail( oldCells[i].m_nCell );
+		}
+	}
+
+	// the old cells were written in order
+	int nOld = 0;
+	for ( unsigned short i = m_OccluderCells.FirstInorder(); i != m_OccluderCells.InvalidIndex(); i = m_OccluderCells.NextInorder( i ) )
+	{
+		int nCell = m_OccluderCells.Key( i );
+		while ( nOld < oldCells.Count() && oldCells[nOld].m_nCell < nCell )
+		{
+			nOld++;
+		}
+		if ( nOld == oldCells.Count() || oldCells[nOld].m_nCell != nCell )
+		{
+			changed.AddToTail( nCell );
+		}
+	}
+
+	for ( int i = 0; i < changed.Count(); i++ )
+	{
+		LightCacheRegion_t &cell = m_ChangedCells[m_ChangedCells.AddToTail()];
+		OccluderCellBounds( changed[i], cell.m_vecMins, cell.m_vecMaxs );
+		cell.m_vecSweep.Init();
+		AddPointToBounds( cell.m_vecMins, m_vecChangedMins, m_vecChangedMaxs );
+		AddPointToBounds( cell.m_vecMaxs, m_vecChangedMins, m_vecChangedMaxs );
+	}
+}
+
+bool CLightCache::RegionChanged( const LightCacheRegion_t &region ) const
+{
+	if ( !m_ChangedCells.Count() )
+		return false;
+
+	Vector mins, maxs;
+	SweptBounds( region, mins, maxs );
+	if ( !IsBoxIntersectingBox( mins, maxs, m_vecChangedMins, m_vecChangedMaxs ) )
+		return false;
+
+	for ( int i = 0; i < m_ChangedCells.Count(); i++ )
+	{
+		if ( RegionTouchesBox( region, m_ChangedCells[i].m_vecMins, m_ChangedCells[i].m_vecMaxs ) )
+			return true;
+	}
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// File layout: version, settings hash, occluder cells, lights, faces
+//-----------------------------------------------------------------------------
+static bool GetCount( CUtlBuffer &buf, int nElementSize, int &nCount )
+{
+	nCount = buf.GetInt();
+	return buf.IsValid() && nCount >= 0 && nCount <= buf.GetBytesRemaining() / nElementSize;
+}
+
+template < class T >
+static bool GetArray( CUtlBuffer &buf, CUtlVector<T> &vec )
+{
+	int nCount;
+	if ( !GetCount( buf, sizeof( T ), nCount ) )
+		return false;
+
+	vec.SetCount( nCount );
+	buf.Get( vec.Base(), nCount * sizeof( T ) );
+	return buf.IsValid();
+}
+
+template < class T >
+static void PutArray( CUtlBuffer &buf, const CUtlVector<T> &vec )
+{
+	buf.PutInt( vec.Count() );
+	buf.Put( vec.Base(), vec.Count() * sizeof( T ) );
+}
+
+// Checks that everything CLightCacheFace indexes with a loaded face lies inside its arrays
+static bool IsLoadedFaceConsistent( const LightCacheFace_t *pFace )
+{
+	if ( pFace->m_nSamples <= 0 || pFace->m_nNormals <= 0 || pFace->m_nNormals > NUM_BUMP_VECTS + 1 )
+		return false;
+
+	// the styles in use come first, then only empty slots
+	int nStyles = 0;
+	while ( nStyles < MAXLIGHTMAPS && pFace->m_Styles[nStyles] != 255 )
+	{
+		nStyles++;
+	}
+	for ( int i = nStyles; i < MAXLIGHTMAPS; i++ )
+	{
+		if ( pFace->m_Styles[i] != 255 )
+			return false;
+	}
+
+	int64 nSampleCount = (int64)pFace->m_nNormals * pFace->m_nSamples;
+	if ( pFace->m_Lighting.Count() != nStyles * nSampleCount )
+		return false;
+
+	for ( int i = 0; i < pFace->m_Contributions.Count(); i++ )
+	{
+		const LightCacheContribution_t &contribution = pFace->m_Contributions[i];
+		if ( contribution.m_nFirstDot < 0 || contribution.m_nFirstDot + nSampleCount > pFace->m_Dots.Count() )
+			return false;
+
+		if ( contribution.m_nFirstSun != -1 &&
+			 ( contribution.m_nFirstSun < 0 || (int64)contribution.m_nFirstSun + pFace->m_nSamples > pFace->m_SunAmount.Count() ) )
+			return false;
+	}
+
+	return true;
+}
+
+bool CLightCache::ReadFile( const char *pFileName )
+{
+	CUtlBuffer buf;
+	if ( !g_pFileSystem->ReadFile( pFileName, NULL, buf ) )
+	{
+		Msg( "Light cache: no %s yet, lighting every face\n", pFileName );
+		return false;
+	}
+
+	int nVersion = buf.GetInt();
+	uint64 nSettings = (uint64)buf.GetInt64();
+	if ( !buf.IsValid() || nVersion != LIGHTCACHE_VERSION || nSettings != HashSettings() )
+	{
+		Msg( "Light cache: %s was written by another version or with other settings, lighting every face\n", pFileName );
+		return false;
+	}
+
+	CUtlVector<OccluderCell_t> oldCells;
+	int nCount;
+	int nDropped = 0;
+	bool bValid = GetArray( buf, oldCells ) && GetArray( buf, m_CachedLights ) && GetCount( buf, sizeof( uint64 ), nCount );
+	for ( int i = 0; bValid && i < nCount; i++ )
+	{
+		LightCacheFace_t *pFace = new LightCacheFace_t;
+		pFace->m_bLoaded = true;
+		pFace->m_nFaceKey = (uint64)buf.GetInt64();
+		pFace->m_nSamples = buf.GetInt();
+		pFace->m_nNormals = buf.GetInt();
+		buf.Get( pFace->m_Styles, sizeof( pFace->m_Styles ) );
+		bValid = GetArray( buf, pFace->m_Lighting ) && GetArray( buf, pFace->m_Contributions ) &&
+			GetArray( buf, pFace->m_Dots ) && GetArray( buf, pFace->m_SunAmount );
+
+		if ( !bValid || m_CachedFaces.Find( pFace->m_nFaceKey ) != m_CachedFaces.InvalidIndex() )
+		{
+			delete pFace;
+			continue;
+		}
+
+		if ( !IsLoadedFaceConsistent( pFace ) )
+		{
+			delete pFace;
+			nDropped++;
+			continue;
+		}
+		m_CachedFaces.Insert( pFace->m_nFaceKey, pFace );
+	}
+
+	if ( !bValid )
+	{
+		Warning( "Light cache: %s is truncated, lighting every face\n", pFileName );
+		return false;
+	}
+
+	if ( nDropped )
+	{
+		Warning( "Light cache: dropped %d inconsistent faces from %s, they will be relit\n", nDropped, pFileName );
+	}
+
+	FindChangedCells( oldCells );
+	return true;
+}
+
+void CLightCache::Load( const char *pFileName )
+{
+	m_flStartTime = Plat_FloatTime();
+
+	ComputeLightKeys();
+	m_NewFaces.SetCount( numfaces );
+	memset( m_NewFaces.Base(), 0, m_NewFaces.Count() * sizeof( m_NewFaces[0] ) );
+
+	if ( !ReadFile( pFileName ) )
+	{
+		FreeFaces();
+		m_NewFaces.SetCount( numfaces );
+		memset( m_NewFaces.Base(), 0, m_NewFaces.Count() * sizeof( m_NewFaces[0] ) );
+		m_CachedLights.Purge();
+		m_ChangedCells.Purge();
+	}
+
+	// written in the order the lights came in
+	m_CachedLights.Sort( CompareCachedLights );
+
+	int nKnownLights = 0, nChangedLights = 0;
+	m_LightKnown.SetCount( numdlights );
+	memset( m_LightKnown.Base(), 0, m_LightKnown.Count() * sizeof( m_LightKnown[0] ) );
+	m_LightSameIntensity.SetCount( numdlights );
+	memset( m_LightSameIntensity.Base(), 0, m_LightSameIntensity.Count() * sizeof( m_LightSameIntensity[0] ) );
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		CachedLight_t light;
+		light.m_nKey = m_LightKeys[dl->index];
+		int i = LowerBound( m_CachedLights, light, CachedLightLessFunc );
+		if ( i < m_CachedLights.Count() && m_CachedLights[i].m_nKey == light.m_nKey )
+		{
+			m_LightKnown[dl->index] = 1;
+			m_LightSameIntensity[dl->index] = ( m_CachedLights[i].m_vecIntensity == dl->light.intensity );
+			nKnownLights++;
+		}
+		else
+		{
+			nChangedLights++;
+		}
+	}
+
+	if ( m_CachedFaces.Count() )
+	{
+		Msg( "Light cache: %d cached faces, %d lights unchanged, %d new or changed, %d of %d occluder cells changed\n",
+			m_CachedFaces.Count(), nKnownLights, nChangedLights, m_ChangedCells.Count(), m_OccluderCells.Count() );
+	}
+}
+
+void CLightCache::FinishFace( int facenum, LightCacheFace_t *pFace, int nReusedPairs, int nTracedPairs, bool bReusedLighting )
+{
+	m_NewFaces[facenum] = pFace;
+
+	ThreadLock();
+	if ( bReusedLighting )
+	{
+		m_nReusedFaces++;
+	}
+	else if ( nReusedPairs )
+	{
+		m_nPartialFaces++;
+	}
+	else
+	{
+		m_nRelitFaces++;
+	}
+	m_nReusedPairs += nReusedPairs;
+	m_nTracedPairs += nTracedPairs;
+	ThreadUnlock();
+}
+
+void CLightCache::Save( const char *pFileName )
+{
+	CUtlBuffer buf;
+	buf.PutInt( LIGHTCACHE_VERSION );
+	buf.PutInt64( (int64)HashSettings() );
+
+	buf.PutInt( m_OccluderCells.Count() );
+	for ( unsigned short i = m_OccluderCells.FirstInorder(); i != m_OccluderCells.InvalidIndex(); i = m_OccluderCells.NextInorder( i ) )
+	{
+		OccluderCell_t cell;
+		memset( &cell, 0, sizeof( cell ) );
+		cell.m_nCell = m_OccluderCells.Key( i );
+		cell.m_nHash = m_OccluderCells[i];
+		buf.Put( &cell, sizeof( cell ) );
+	}
+
+	CUtlVector<CachedLight_t> lights;
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		CachedLight_t &light = lights[lights.AddToTail()];
+		memset( &light, 0, sizeof( light ) );
+		light.m_nKey = m_LightKeys[dl->index];
+		light.m_vecIntensity = dl->light.intensity;
+	}
+	PutArray( buf, lights );
+
+	int nFaces = 0;
+	for ( int i = 0; i < m_NewFaces.Count(); i++ )
+	{
+		if ( m_NewFaces[i] )
+		{
+			nFaces++;
+		}
+	}
+
+	buf.PutInt( nFaces );
+	for ( int i = 0; i < m_NewFaces.Count(); i++ )
+	{
+		const LightCacheFace_t *pFace = m_NewFaces[i];
+		if ( !pFace )
+			continue;
+
+		buf.PutInt64( (int64)pFace->m_nFaceKey );
+		buf.PutInt( pFace->m_nSamples );
+		buf.PutInt( pFace->m_nNormals );
+		buf.Put( pFace->m_Styles, sizeof( pFace->m_Styles ) );
+		PutArray( buf, pFace->m_Lighting );
+		PutArray( buf, pFace->m_Contributions );
+		PutArray( buf, pFace->m_Dots );
+		PutArray( buf, pFace->m_SunAmount );
+	}
+
+	if ( !g_pFileSystem->WriteFile( pFileName, NULL, buf ) )
+	{
+		Warning( "Light cache: can't write %s\n", pFileName );
+	}
+	else
+	{
+		Msg( "Light cache: wrote %d faces to %s (%.1f MB)\n", nFaces, pFileName, buf.TellPut() / ( 1024.0f * 1024.0f ) );
+	}
+
+	FreeFaces();
+}
+
+void CLightCache::PrintStats()
+{
+	int64 nPairs = m_nReusedPairs + m_nTracedPairs;
+	Msg( "Light cache: %d faces reused, %d relit from cached visibility, %d relit from scratch\n",
+		m_nReusedFaces, m_nPartialFaces, m_nRelitFaces );
+	Msg( "Light cache: %lld of %lld face/light pairs reused (%.1f%%), direct lighting took %.2f seconds\n",
+		m_nReusedPairs, nPairs, nPairs ? 100.0 * m_nReusedPairs / nPairs : 0.0, Plat_FloatTime() - m_flStartTime );
+}
+
+
+//-----------------------------------------------------------------------------
+// CLightCacheFace
+//-----------------------------------------------------------------------------
+CLightCacheFace::CLightCacheFace()
+{
+	m_FaceNum = -1;
+	m_NumSamples = 0;
+	m_NormalCount = 0;
+	m_flLuxelSize = 0.0f;
+	m_nFaceKey = 0;
+	m_pCached = NULL;
+	m_bReusedLighting = false;
+	m_pNew = NULL;
+	m_nReusedPairs = 0;
+	m_nTracedPairs = 0;
+}
+
+CLightCacheFace::~CLightCacheFace()
+{
+	// only left over if the face was never finished
+	delete m_pNew;
+}
+
+void CLightCacheFace::Init( const lightinfo_t &l, facelight_t *fl, int nNormals )
+{
+	m_FaceNum = l.facenum;
+	m_NumSamples = fl->numsamples;
+	m_NormalCount = nNormals;
+
+	// supersampling traces from anywhere within the face's luxels
+	m_flLuxelSize = MAX( l.luxelToWorldSpace[0].Length(), l.luxelToWorldSpace[1].Length() ) + 1.0f;
+	ClearBounds( m_vecMins, m_vecMaxs );
+
+	CLightCacheHash hash;
+	hash.Add( m_NumSamples );
+	hash.Add( m_NormalCount );
+	for ( int i = 0; i < fl->numsamples; i++ )
+	{
+		const sample_t &sample = fl->sample[i];
+		hash.Add( sample.s );
+		hash.Add( sample.t );
+		hash.Add( sample.coord );
+		hash.Add( sample.mins );
+		hash.Add( sample.maxs );
+		hash.Add( sample.pos );
+		hash.Add( sample.normal );
+		hash.Add( sample.area );
+	}
+	hash.Add( fl->numluxels );
+	if ( fl->luxel )
+	{
+		hash.Add( fl->luxel, fl->numluxels * sizeof( Vector ) );
+	}
+	m_nFaceKey = hash.Get();
+}
+
+void CLightCacheFace::AddSampleGroup( const SSE_SampleInfo_t &info, int numSamples )
+{
+	SampleGroup_t &group = m_Groups[m_Groups.AddToTail()];
+	group.m_Points = info.m_Points;
+	for ( int b = 0; b < m_NormalCount; b++ )
+	{
+		group.m_PointNormals[b] = info.m_PointNormals[b];
+	}
+	memcpy( group.m_Clusters, info.m_Clusters, sizeof( group.m_Clusters ) );
+	group.m_NumSamples = numSamples;
+
+	CLightCacheHash hash( m_nFaceKey );
+	hash.Add( group.m_Points );
+	hash.Add( group.m_PointNormals, m_NormalCount * sizeof( FourVectors ) );
+	hash.Add( group.m_Clusters );
+	m_nFaceKey = hash.Get();
+
+	for ( int i = 0; i < numSamples; i++ )
+	{
+		AddPointToBounds( info.m_Points.Vec( i ), m_vecMins, m_vecMaxs );
+		if ( m_Clusters.Find( info.m_Clusters[i] ) == m_Clusters.InvalidIndex() )
+		{
+			m_Clusters.AddToTail( info.m_Clusters[i] );
+		}
+	}
+}
+
+int CLightCacheFace::RestoreSampleGroup( int grp, SSE_SampleInfo_t &info ) const
+{
+	const SampleGroup_t &group = m_Groups[grp];
+	info.m_Points = group.m_Points;
+	for ( int b = 0; b < m_NormalCount; b++ )
+	{
+		info.m_PointNormals[b] = group.m_PointNormals[b];
+	}
+	memcpy( info.m_Clusters, group.m_Clusters, sizeof( info.m_Clusters ) );
+	return group.m_NumSamples;
+}
+
+bool CLightCacheFace::IsVisibleToLight( directlight_t *dl ) const
+{
+	for ( int i = 0; i < m_Clusters.Count(); i++ )
+	{
+		if ( PVSCheck( dl->pvs, m_Clusters[i] ) )
+			return true;
+	}
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// Whether anything that changed could block or unblock the light's rays to the face
+//-----------------------------------------------------------------------------
+bool CLightCacheFace::LightRegionChanged( directlight_t *dl ) const
+{
+	if ( !g_pLightCache->HasChangedOccluders() )
+		return false;
+
+	LightCacheRegion_t region;
+	region.m_vecMins = m_vecMins - Vector( m_flLuxelSize, m_flLuxelSize, m_flLuxelSize );
+	region.m_vecMaxs = m_vecMaxs + Vector( m_flLuxelSize, m_flLuxelSize, m_flLuxelSize );
+	region.m_vecSweep.Init();
+
+	switch ( dl->light.type )
+	{
+	case emit_skyambient:
+		// traced in every direction to the edge of the world
+		return true;
+
+	case emit_skylight:
+		{
+			// the sun's jitter, twice over for the rays recursing into the 3D skybox
+			float flJitter = 2.0f * (float)MAX_TRACE_LENGTH * g_SunAngularExtent;
+			Vector vecJitter( flJitter, flJitter, flJitter );
+			region.m_vecMins -= vecJitter;
+			region.m_vecMaxs += vecJitter;
+			region.m_vecSweep = dl->light.normal * -(float)MAX_TRACE_LENGTH;
+			if ( g_pLightCache->RegionChanged( region ) )
+				return true;
+
+			if ( g_bNoSkyRecurse )
+				return false;
+
+			for ( int i = 0; i < num_sky_cameras; i++ )
+			{
+				LightCacheRegion_t skyRegion = region;
+				skyRegion.m_vecMins = sky_cameras[i].origin + m_vecMins * sky_cameras[i].world_to_sky - vecJitter;
+				skyRegion.m_vecMaxs = sky_cameras[i].origin + m_vecMaxs * sky_cameras[i].world_to_sky + vecJitter;
+				if ( g_pLightCache->RegionChanged( skyRegion ) )
+					return true;
+			}
+			return false;
+		}
+
+	default:
+		// attached lights shine from the origin
+		AddPointToBounds( ( dl->facenum == -1 ) ? dl->light.origin : vec3_origin, region.m_vecMins, region.m_vecMaxs );
+		return g_pLightCache->RegionChanged( region );
+	}
+}
+
+bool CLightCacheFace::IsLightReusable( directlight_t *dl )
+{
+	byte &nReuse = m_LightReuse[dl->index];
+	if ( nReuse == 0 )
+	{
+		bool bReusable = m_pCached && g_pLightCache->IsKnownLight( dl ) && !LightRegionChanged( dl );
+		nReuse = bReusable ? 1 : 2;
+		if ( bReusable )
+		{
+			m_nReusedPairs++;
+		}
+		else
+		{
+			m_nTracedPairs++;
+		}
+	}
+	return nReuse == 1;
+}
+
+bool CLightCacheFace::IsCachedLightingCurrent()
+{
+	if ( !m_pCached )
+		return false;
+
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		if ( !IsVisibleToLight( dl ) )
+			continue;
+
+		if ( !IsLightReusable( dl ) )
+			return false;
+
+		// a light that reached the face has to be as bright as it was
+		if ( !g_pLightCache->HasSameIntensity( dl ) && m_pCached->FindContribution( g_pLightCache->GetLightKey( dl ) ) )
+			return false;
+	}
+
+	// and every light that reached it must still be there
+	for ( int i = 0; i < m_pCached->m_Contributions.Count(); i++ )
+	{
+		if ( !g_pLightCache->IsCurrentLight( m_pCached->m_Contributions[i].m_nLightKey ) )
+			return false;
+	}
+	return true;
+}
+
+bool CLightCacheFace::CanReuseLighting()
+{
+	m_pCached = g_pLightCache->FindFace( m_nFaceKey );
+	if ( m_pCached && ( m_pCached->m_nSamples != m_NumSamples || m_pCached->m_nNormals != m_NormalCount ) )
+	{
+		m_pCached = NULL;
+	}
+
+	m_LightReuse.SetCount( numdlights );
+	memset( m_LightReuse.Base(), 0, m_LightReuse.Count() * sizeof( m_LightReuse[0] ) );
+
+	m_bReusedLighting = IsCachedLightingCurrent();
+	if ( m_bReusedLighting )
+		return true;
+
+	m_LightContribution.SetCount( numdlights );
+	memset( m_LightContribution.Base(), 0xff, m_LightContribution.Count() * sizeof( m_LightContribution[0] ) );
+
+	m_pNew = new LightCacheFace_t;
+	m_pNew->m_nFaceKey = m_nFaceKey;
+	m_pNew->m_nSamples = m_NumSamples;
+	m_pNew->m_nNormals = m_NormalCount;
+	m_pNew->m_bLoaded = false;
+	return false;
+}
+
+void CLightCacheFace::CopyLighting( facelight_t *fl ) const
+{
+	for ( int s = 0; s < MAXLIGHTMAPS && m_pCached->m_Styles[s] != 255; s++ )
+	{
+		for ( int n = 0; n < m_NormalCount; n++ )
+		{
+			memcpy( fl->light[s][n], &m_pCached->m_Lighting[( s * m_NormalCount + n ) * m_NumSamples], m_NumSamples * sizeof( LightingValue_t ) );
+		}
+	}
+}
+
+bool CLightCacheFace::GetContribution( directlight_t *dl, int sampleIdx, int numSamples, fltx4 *pDots, fltx4 &sunAmount )
+{
+	if ( !IsLightReusable( dl ) )
+		return false;
+
+	for ( int b = 0; b < m_NormalCount; b++ )
+	{
+		pDots[b] = Four_Zeros;
+	}
+	sunAmount = Four_Zeros;
+
+	// it didn't reach the face last time either
+	const LightCacheContribution_t *pContribution = m_pCached->FindContribution( g_pLightCache->GetLightKey( dl ) );
+	if ( !pContribution )
+		return true;
+
+	for ( int b = 0; b < m_NormalCount; b++ )
+	{
+		const float *pCachedDots = &m_pCached->m_Dots[pContribution->m_nFirstDot + b * m_NumSamples + sampleIdx];
+		for ( int i = 0; i < numSamples; i++ )
+		{
+			SubFloat( pDots[b], i ) = pCachedDots[i];
+		}
+	}
+
+	if ( pContribution->m_nFirstSun >= 0 )
+	{
+		const float *pCachedSun = &m_pCached->m_SunAmount[pContribution->m_nFirstSun + sampleIdx];
+		for ( int i = 0; i < numSamples; i++ )
+		{
+			SubFloat( sunAmount, i ) = pCachedSun[i];
+		}
+	}
+	return true;
+}
+
+void CLightCacheFace::AddContribution( directlight_t *dl, int sampleIdx, int numSamples, const fltx4 *pDots, fltx4 sunAmount )
+{
+	int &nContribution = m_LightContribution[dl->index];
+	if ( nContribution < 0 )
+	{
+		nContribution = m_pNew->m_Contributions.AddToTail();
+		LightCacheContribution_t &contribution = m_pNew->m_Contributions[nContribution];
+		contribution.m_nLightKey = g_pLightCache->GetLightKey( dl );
+		contribution.m_nFirstDot = m_pNew->m_Dots.AddMultipleToTail( m_NormalCount * m_NumSamples );
+		contribution.m_nFirstSun = -1;
+		memset( &m_pNew->m_Dots[contribution.m_nFirstDot], 0, m_NormalCount * m_NumSamples * sizeof( float ) );
+	}
+
+	LightCacheContribution_t &contribution = m_pNew->m_Contributions[nContribution];
+	for ( int b = 0; b < m_NormalCount; b++ )
+	{
+		float *pDstDots = &m_pNew->m_Dots[contribution.m_nFirstDot + b * m_NumSamples + sampleIdx];
+		for ( int i = 0; i < numSamples; i++ )
+		{
+			pDstDots[i] = SubFloat( pDots[b], i );
+		}
+	}
+
+	if ( contribution.m_nFirstSun < 0 )
+	{
+		if ( IsAllZeros( sunAmount ) )
+			return;
+
+		contribution.m_nFirstSun = m_pNew->m_SunAmount.AddMultipleToTail( m_NumSamples );
+		memset( &m_pNew->m_SunAmount[contribution.m_nFirstSun], 0, m_NumSamples * sizeof( float ) );
+	}
+
+	float *pDstSun = &m_pNew->m_SunAmount[contribution.m_nFirstSun + sampleIdx];
+	for ( int i = 0; i < numSamples; i++ )
+	{
+		pDstSun[i] = SubFloat( sunAmount, i );
+	}
+}
+
+void CLightCacheFace::Finish( dface_t *f, facelight_t *fl )
+{
+	if ( m_bReusedLighting )
+	{
+		g_pLightCache->FinishFace( m_FaceNum, const_cast<LightCacheFace_t *>( m_pCached ), m_nReusedPairs, m_nTracedPairs, true );
+		return;
+	}
+
+	LightCacheFace_t *pFace = m_pNew;
+	m_pNew = NULL;
+
+	int nStyles = 0;
+	for ( int s = 0; s < MAXLIGHTMAPS; s++ )
+	{
+		pFace->m_Styles[s] = f->styles[s];
+		if ( f->styles[s] != 255 )
+		{
+			nStyles = s + 1;
+		}
+	}
+
+	pFace->m_Lighting.SetCount( nStyles * m_NormalCount * m_NumSamples );
+	for ( int s = 0; s < nStyles; s++ )
+	{
+		for ( int n = 0; n < m_NormalCount; n++ )
+		{
+			memcpy( &pFace->m_Lighting[( s * m_NormalCount + n ) * m_NumSamples], fl->light[s][n], m_NumSamples * sizeof( LightingValue_t ) );
+		}
+	}
+	pFace->m_Contributions.Sort( CompareContributions );
+
+	g_pLightCache->FinishFace( m_FaceNum, pFace, m_nReusedPairs, m_nTracedPairs, false );
+}
@@ -0,0 +1,196 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: -lightcache: keeps the direct lighting of every face between runs,
+//			so that a run only relights the faces touched by lights or
+//			geometry that changed since the last one.
+//
+// $NoKeywords: $
+//=============================================================================//
+
+#ifndef LIGHTCACHE_H
+#define LIGHTCACHE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "utlvector.h"
+#include "utlmap.h"
+#include "vrad.h"
+
+#define LIGHTCACHE_VERSION		1
+#define LIGHTCACHE_CELL_SIZE	256.0f		// world units per side of an occluder grid cell
+
+class RayTracingEnvironment;
+struct SSE_SampleInfo_t;
+struct lightinfo_t;
+
+// One light's falloff * dot * visibility at every sample of a face
+struct LightCacheContribution_t
+{
+	uint64	m_nLightKey;
+	int		m_nFirstDot;	// into LightCacheFace_t::m_Dots, normals x samples
+	int		m_nFirstSun;	// into LightCacheFace_t::m_SunAmount, samples, or -1 if the light adds no sun
+};
+
+struct LightCacheFace_t
+{
+	uint64	m_nFaceKey;		// sample positions, normals and clusters
+	int		m_nSamples;
+	int		m_nNormals;
+	byte	m_Styles[MAXLIGHTMAPS];
+	bool	m_bLoaded;		// read from the file rather than built this run
+
+	CUtlVector<LightingValue_t> m_Lighting;		// final direct lighting, styles x normals x samples
+	CUtlVector<LightCacheContribution_t> m_Contributions;	// sorted by light key
+	CUtlVector<float> m_Dots;
+	CUtlVector<float> m_SunAmount;
+
+	const LightCacheContribution_t *FindContribution( uint64 nLightKey ) const;
+};
+
+// A box swept along m_vecSweep, which a changed part of the world can't touch
+// for a light's contribution to a face to be reused
+struct LightCacheRegion_t
+{
+	Vector	m_vecMins;
+	Vector	m_vecMaxs;
+	Vector	m_vecSweep;
+};
+
+class CLightCache
+{
+public:
+	CLightCache();
+	~CLightCache();
+
+	// Call after the triangles have been added to g_RtEnv and before its tree is built
+	void HashOccluders( RayTracingEnvironment &env );
+
+	// Call once the direct lights exist, before BuildFacelights
+	void Load( const char *pFileName );
+
+	// Call after BuildFacelights: writes what this run lit and frees the cache
+	void Save( const char *pFileName );
+
+	void PrintStats();
+
+	// Used by CLightCacheFace while faces are lit
+	const LightCacheFace_t *FindFace( uint64 nFaceKey ) const;
+	uint64 GetLightKey( const directlight_t *dl ) const		{ return m_LightKeys[dl->index]; }
+	bool IsCurrentLight( uint64 nLightKey ) const;
+	bool IsKnownLight( const directlight_t *dl ) const		{ return m_LightKnown[dl->index] != 0; }
+	bool HasSameIntensity( const directlight_t *dl ) const	{ return m_LightSameIntensity[dl->index] != 0; }
+	bool HasChangedOccluders() const						{ return m_ChangedCells.Count() != 0; }
+	bool RegionChanged( const LightCacheRegion_t &region ) const;
+	void FinishFace( int facenum, LightCacheFace_t *pFace, int nReusedPairs, int nTracedPairs, bool bReusedLighting );
+
+private:
+	struct CachedLight_t
+	{
+		uint64	m_nKey;
+		Vector	m_vecIntensity;
+	};
+
+	struct OccluderCell_t
+	{
+		int		m_nCell;
+		uint64	m_nHash;
+	};
+
+	static bool CachedLightLessFunc( const CachedLight_t &a, const CachedLight_t &b )	{ return a.m_nKey < b.m_nKey; }
+	static int __cdecl CompareCachedLights( const CachedLight_t *a, const CachedLight_t *b );
+
+	uint64 HashSettings() const;
+	void ComputeLightKeys();
+	void FindChangedCells( const CUtlVector<OccluderCell_t> &oldCells );
+	bool ReadFile( const char *pFileName );
+	void FreeFaces();
+
+	// this run
+	CUtlMap<int, uint64> m_OccluderCells;
+	CUtlVector<uint64> m_LightKeys;				// by directlight_t::index
+	CUtlVector<uint64> m_SortedLightKeys;
+	CUtlVector<byte> m_LightKnown;				// by directlight_t::index
+	CUtlVector<byte> m_LightSameIntensity;		// by directlight_t::index
+	CUtlVector<LightCacheFace_t *> m_NewFaces;	// by face
+
+	// the last run
+	CUtlVector<CachedLight_t> m_CachedLights;	// sorted by key
+	CUtlMap<uint64, LightCacheFace_t *> m_CachedFaces;
+	CUtlVector<LightCacheRegion_t> m_ChangedCells;
+	Vector m_vecChangedMins;
+	Vector m_vecChangedMaxs;
+
+	int m_nReusedFaces;
+	int m_nPartialFaces;
+	int m_nRelitFaces;
+	int64 m_nReusedPairs;
+	int64 m_nTracedPairs;
+	double m_flStartTime;
+};
+
+//-----------------------------------------------------------------------------
+// What BuildFacelights knows about the face it's lighting
+//-----------------------------------------------------------------------------
+class CLightCacheFace
+{
+public:
+	CLightCacheFace();
+	~CLightCacheFace();
+
+	void Init( const lightinfo_t &l, facelight_t *fl, int nNormals );
+
+	// First pass: every sample group's points, normals and clusters, in order
+	void AddSampleGroup( const SSE_SampleInfo_t &info, int numSamples );
+
+	// After the first pass: true if the face's lighting can be copied from the cache as is
+	bool CanReuseLighting();
+	int GetStyle( int nStyle ) const		{ return m_pCached->m_Styles[nStyle]; }
+	void CopyLighting( facelight_t *fl ) const;
+
+	// Second pass: puts a group's points back into info and returns its sample count
+	int RestoreSampleGroup( int grp, SSE_SampleInfo_t &info ) const;
+
+	// true if the light's falloff * dot at these samples came from the cache
+	bool GetContribution( directlight_t *dl, int sampleIdx, int numSamples, fltx4 *pDots, fltx4 &sunAmount );
+	void AddContribution( directlight_t *dl, int sampleIdx, int numSamples, const fltx4 *pDots, fltx4 sunAmount );
+
+	// Hands the face's final direct lighting to the cache
+	void Finish( dface_t *f, facelight_t *fl );
+
+private:
+	struct SampleGroup_t
+	{
+		FourVectors	m_Points;
+		FourVectors	m_PointNormals[NUM_BUMP_VECTS + 1];
+		int			m_Clusters[4];
+		int			m_NumSamples;
+	};
+
+	bool IsVisibleToLight( directlight_t *dl ) const;
+	bool LightRegionChanged( directlight_t *dl ) const;
+	bool IsLightReusable( directlight_t *dl );
+	bool IsCachedLightingCurrent();
+
+	int m_FaceNum;
+	int m_NumSamples;
+	int m_NormalCount;
+	float m_flLuxelSize;
+	uint64 m_nFaceKey;
+	Vector m_vecMins;
+	Vector m_vecMaxs;
+	CUtlVector< SampleGroup_t, CUtlMemoryAligned<SampleGroup_t, 16> > m_Groups;
+	CUtlVector<int> m_Clusters;
+
+	const LightCacheFace_t *m_pCached;
+	bool m_bReusedLighting;
+	CUtlVector<byte> m_LightReuse;			// by directlight_t::index: 0 unknown, 1 reusable, 2 traced
+	CUtlVector<int> m_LightContribution;	// by directlight_t::index, into m_pNew->m_Contributions
+	LightCacheFace_t *m_pNew;
+	int m_nReusedPairs;
+	int m_nTracedPairs;
+};
+
+extern CLightCache *g_pLightCache;
+
+#endif // LIGHTCACHE_H
@@ -16,6 +16,7 @@
 #include "map_utils.h"
 #include "mathlib/halton.h"
 #include "imagepacker.h"
+#include "lightcache.h"
 #include "tier1/utlrbtree.h"
 #include "tier1/utlbuffer.h"
 #include "bitmap/tgawriter.h"
@@ -1703,26 +1704,41 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, i
 
 	DirectionalSampler_t sampler;
 
-	for ( int d = 0; d < nsamples; d++ )
+	// the samples are traced two at a time
+	for ( int d = 0; d < nsamples; d += 2 )
 	{
-		// determine visibility of skylight
-		// serach back to see if we can hit a sky brush
-		Vector delta;
-		VectorScale( dl->light.normal, -MAX_TRACE_LENGTH, delta );
-		if ( d )
+		int nLines = min( nsamples - d, 2 );
+		FourVectors start4[2], delta4[2];
+		for ( int k = 0; k < nLines; k++ )
 		{
-			// jitter light source location
-			Vector ofs = sampler.NextValue();
-			ofs *= MAX_TRACE_LENGTH * g_SunAngularExtent;
-			delta += ofs;
+			// determine visibility of skylight
+			// serach back to see if we can hit a sky brush
+			Vector delta;
+			VectorScale( dl->light.normal, -MAX_TRACE_LENGTH, delta );
+			if ( d + k )
+			{
+				// jitter light source location
+				Vector ofs = sampler.NextValue();
+				ofs *= MAX_TRACE_LENGTH * g_SunAngularExtent;
+				delta += ofs;
+			}
+			start4[k] = pos;
+			delta4[k].DuplicateVector ( delta );
+			delta4[k] += pos;
 		}
-		FourVectors delta4;
-		delta4.DuplicateVector ( delta );
-		delta4 += pos;
-
-		TestLine_DoesHitSky ( pos, delta4, &fractionVisible, true, static_prop_index_to_ignore );
 
-		totalFractionVisible = AddSIMD ( totalFractionVisible, fractionVisible );
+		if ( nLines == 2 )
+		{
+			fltx4 fractionVisible8[2];
+			TestLine_DoesHitSky8 ( start4, delta4, fractionVisible8, true, static_prop_index_to_ignore );
+			totalFractionVisible = AddSIMD ( totalFractionVisible, fractionVisible8[0] );
+			totalFractionVisible = AddSIMD ( totalFractionVisible, fractionVisible8[1] );
+		}
+		else
+		{
+			TestLine_DoesHitSky ( pos, delta4[0], &fractionVisible, true, static_prop_index_to_ignore );
+			totalFractionVisible = AddSIMD ( totalFractionVisible, fractionVisible );
+		}
 	}
 
 	fltx4 seeAmount = MulSIMD ( totalFractionVisible, ReplicateX4 ( 1.0f / nsamples ) );
@@ -1741,6 +1757,39 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, i
 	}
 }
 
+// One direction of GatherSampleAmbientSkySSE, waiting to be traced
+struct AmbientSkyLine_t
+{
+	FourVectors m_Start;
+	FourVectors m_Stop;
+	fltx4 m_Dots[NUM_BUMP_VECTS+1];
+};
+
+static void TraceAmbientSkyLines( AmbientSkyLine_t *pLines, int nLines, int normalCount,
+								  int static_prop_index_to_ignore, fltx4 *ambient_intensity )
+{
+	fltx4 fractionVisible[2];
+	if ( nLines == 2 )
+	{
+		FourVectors start[2] = { pLines[0].m_Start, pLines[1].m_Start };
+		FourVectors stop[2] = { pLines[0].m_Stop, pLines[1].m_Stop };
+		TestLine_DoesHitSky8( start, stop, fractionVisible, true, static_prop_index_to_ignore );
+	}
+	else
+	{
+		TestLine_DoesHitSky( pLines[0].m_Start, pLines[0].m_Stop, &fractionVisible[0], true, static_prop_index_to_ignore );
+	}
+
+	for ( int k = 0; k < nLines; k++ )
+	{
+		for ( int i = 0; i < normalCount; i++ )
+		{
+			fltx4 addedAmount = MulSIMD( fractionVisible[k], pLines[k].m_Dots[i] );
+			ambient_intensity[i] = AddSIMD( ambient_intensity[i], addedAmount );
+		}
+	}
+}
+
 // Helper function - gathers light from ambient sky light
 void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum, 
 							   FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
@@ -1754,7 +1803,11 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 	fltx4 sumdot = Four_Zeros;
 	fltx4 ambient_intensity[NUM_BUMP_VECTS+1];
 	fltx4 possibleHitCount[NUM_BUMP_VECTS+1];
-	fltx4 dots[NUM_BUMP_VECTS+1];
+
+	// directions are traced in pairs. A direction waits in its octant's slot until another
+	// one going the same way turns up, so that the pair can be traced as one packet.
+	AmbientSkyLine_t pendingLines[8][2];
+	bool bPending[8] = { false, false, false, false, false, false, false, false };
 
 	for ( int i = 0; i < normalCount; i++ )
 	{
@@ -1771,8 +1824,13 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 
 	for (int j = 0; j < nsky_samples; j++)
 	{
+		Vector vecDir = sampler.NextValue();
 		FourVectors anorm;
-		anorm.DuplicateVector( sampler.NextValue() );
+		anorm.DuplicateVector( vecDir );
+
+		int nOctant = ( vecDir.x > 0.0f ? 1 : 0 ) | ( vecDir.y > 0.0f ? 2 : 0 ) | ( vecDir.z > 0.0f ? 4 : 0 );
+		AmbientSkyLine_t &line = pendingLines[nOctant][bPending[nOctant] ? 1 : 0];
+		fltx4 *dots = line.m_Dots;
 
 		if ( bIgnoreNormals )
 			dots[0] = ReplicateX4( CONSTANT_DOT );
@@ -1809,14 +1867,30 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 		offset *= -flEpsilon;
 		surfacePos -= offset;
 
-		fltx4 fractionVisible = Four_Ones;
-		TestLine_DoesHitSky( surfacePos, delta, &fractionVisible, true, static_prop_index_to_ignore );
-		for ( int i = 0; i < normalCount; i++ )
+		line.m_Start = surfacePos;
+		line.m_Stop = delta;
+		if ( bPending[nOctant] )
 		{
-			fltx4 addedAmount = MulSIMD( fractionVisible, dots[i] );
-			ambient_intensity[i] = AddSIMD( ambient_intensity[i], addedAmount );
+			TraceAmbientSkyLines( pendingLines[nOctant], 2, normalCount, static_prop_index_to_ignore, ambient_intensity );
+			bPending[nOctant] = false;
+		}
+		else
+		{
+			bPending[nOctant] = true;
 		}
+	}
 
+	// pair up the leftovers even though they go different ways; Trace8Rays copes
+	AmbientSkyLine_t leftoverLines[8];
+	int nLeftovers = 0;
+	for ( int o = 0; o < 8; o++ )
+	{
+		if ( bPending[o] )
+			leftoverLines[nLeftovers++] = pendingLines[o][0];
+	}
+	for ( int k = 0; k < nLeftovers; k += 2 )
+	{
+		TraceAmbientSkyLines( &leftoverLines[k], min( nLeftovers - k, 2 ), normalCount, static_prop_index_to_ignore, ambient_intensity );
 	}
 
 	out.m_flFalloff = Four_Ones;
@@ -2509,15 +2583,24 @@ static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, i
 		if ( skipLight )
 			continue;
 
-		GatherSampleLightSSE( out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
-		
 		// Apply the PVS check filter and compute falloff x dot
 		fltx4 fxdot[NUM_BUMP_VECTS + 1];
+		fltx4 sunAmount;
+		if ( !info.m_pLightCache || !info.m_pLightCache->GetContribution( dl, sampleIdx, numSamples, fxdot, sunAmount ) )
+		{
+			GatherSampleLightSSE( out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
+
+			for ( int b = 0; b < info.m_NormalCount; b++ )
+			{
+				fxdot[b] = MulSIMD( out.m_flDot[b], dotMask );
+				fxdot[b] = MulSIMD( fxdot[b], out.m_flFalloff );
+			}
+			sunAmount = out.m_flSunAmount;
+		}
+
 		skipLight = true;
 		for ( int b = 0; b < info.m_NormalCount; b++ )
 		{
-			fxdot[b] = MulSIMD( out.m_flDot[b], dotMask );
-			fxdot[b] = MulSIMD( fxdot[b], out.m_flFalloff );
 			if ( !IsAllZeros( fxdot[b] ) )
 			{
 				skipLight = false;
@@ -2526,6 +2609,11 @@ static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, i
 		if ( skipLight )
 			continue;
 
+		if ( info.m_pLightCache )
+		{
+			info.m_pLightCache->AddContribution( dl, sampleIdx, numSamples, fxdot, sunAmount );
+		}
+
 		// Figure out the lightstyle for this particular sample
 		int lightStyleIndex = FindOrAllocateLightstyleSamples( info.m_pFace, info.m_pFaceLight, 
 			dl->light.style, info.m_NormalCount );
@@ -2558,7 +2646,7 @@ static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, i
 		{
 			for ( int i = 0; i < numSamples; i++ )
 			{
-				pLightmaps[n][sampleIdx + i].AddLight( SubFloat( fxdot[n], i ), dl->light.intensity, SubFloat( out.m_flSunAmount, i ) );
+				pLightmaps[n][sampleIdx + i].AddLight( SubFloat( fxdot[n], i ), dl->light.intensity, SubFloat( sunAmount, i ) );
 			}
 		}
 	}
@@ -3031,6 +3119,7 @@ static void InitSampleInfo( lightinfo_t const& l, int iThread, SSE_SampleInfo_t&
 	info.m_IsDispFace = ValidDispFace( info.m_pFace );
 	info.m_iThread = iThread;
 	info.m_WarnFace = -1;
+	info.m_pLightCache = NULL;
 
 	info.m_NumSamples = info.m_pFaceLight->numsamples;
 	info.m_NumSampleGroups = ( info.m_NumSamples & 0x3) ? ( info.m_NumSamples / 4 ) + 1 : ( info.m_NumSamples / 4 );
@@ -3056,6 +3145,40 @@ static void InitSampleInfo( lightinfo_t const& l, int iThread, SSE_SampleInfo_t&
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Puts the points, normals and clusters of a group of up to 4 samples into info
+//-----------------------------------------------------------------------------
+static int SetupSampleGroup( lightinfo_t const& l, SSE_SampleInfo_t& info, int grp )
+{
+	int nSample = 4 * grp;
+
+	sample_t *sample = info.m_pFaceLight->sample + nSample;
+	int numSamples = min ( 4, info.m_pFaceLight->numsamples - nSample );
+
+	FourVectors positions;
+	FourVectors normals;
+	Vector v[4], n[4];
+
+	for ( int i = 0; i < 4; i++ )
+	{
+		v[i] = ( i < numSamples ) ? sample[i].pos : sample[numSamples - 1].pos;
+		n[i] = ( i < numSamples ) ? sample[i].normal : sample[numSamples - 1].normal;
+	}
+	positions.LoadAndSwizzle( v[0], v[1], v[2], v[3] );
+	normals.LoadAndSwizzle( n[0], n[1], n[2], n[3] );
+
+	ComputeIlluminationPointAndNormalsSSE( l, positions, normals, &info, numSamples );
+
+	// Fixup sample normals in case of smooth faces
+	if ( !l.isflat )
+	{
+		for ( int i = 0; i < numSamples; i++ )
+			sample[i].normal = info.m_PointNormals[0].Vec( i );
+	}
+
+	return numSamples;
+}
+
 void BuildFacelights (int iThread, int facenum)
 {
 	int	i, j;
@@ -3066,7 +3189,6 @@ void BuildFacelights (int iThread, int facenum)
 	SSE_SampleInfo_t sampleInfo;
 	directlight_t *dl;
 	Vector spot;
-	Vector v[4], n[4];
 
 	if( g_bInterrupt )
 		return;
@@ -3113,36 +3235,48 @@ void BuildFacelights (int iThread, int facenum)
 	f->styles[0] = 0;
 	AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
 
-	// sample the lights at each sample location
-	for ( int grp = 0; grp < numGroups; ++grp )
+	// The cache needs every sample's position before it can tell what to reuse
+	CLightCacheFace cacheFace;
+	bool bLightingFromCache = false;
+	if ( g_pLightCache )
 	{
-		int nSample = 4 * grp;
-
-		sample_t *sample = sampleInfo.m_pFaceLight->sample + nSample;
-		int numSamples = min ( 4, sampleInfo.m_pFaceLight->numsamples - nSample );
-
-		FourVectors positions;
-		FourVectors normals;
-
-		for ( int i = 0; i < 4; i++ )
+		sampleInfo.m_pLightCache = &cacheFace;
+		cacheFace.Init( l, fl, sampleInfo.m_NormalCount );
+		for ( int grp = 0; grp < numGroups; ++grp )
 		{
-			v[i] = ( i < numSamples ) ? sample[i].pos : sample[numSamples - 1].pos;
-			n[i] = ( i < numSamples ) ? sample[i].normal : sample[numSamples - 1].normal;
+			int numSamples = SetupSampleGroup( l, sampleInfo, grp );
+			cacheFace.AddSampleGroup( sampleInfo, numSamples );
 		}
-		positions.LoadAndSwizzle( v[0], v[1], v[2], v[3] );
-		normals.LoadAndSwizzle( n[0], n[1], n[2], n[3] );
-
-		ComputeIlluminationPointAndNormalsSSE( l, positions, normals, &sampleInfo, numSamples );
+		bLightingFromCache = cacheFace.CanReuseLighting();
+	}
 
-		// Fixup sample normals in case of smooth faces
-		if ( !l.isflat )
+	if ( bLightingFromCache )
+	{
+		for ( i = 1; i < MAXLIGHTMAPS && cacheFace.GetStyle( i ) != 255; ++i )
 		{
-			for ( int i = 0; i < numSamples; i++ )
-				sample[i].normal = sampleInfo.m_PointNormals[0].Vec( i );
+			f->styles[i] = cacheFace.GetStyle( i );
+			AllocateLightstyleSamples( fl, i, sampleInfo.m_NormalCount );
 		}
+		cacheFace.CopyLighting( fl );
+	}
+	else
+	{
+		// sample the lights at each sample location
+		for ( int grp = 0; grp < numGroups; ++grp )
+		{
+			int numSamples;
+			if ( sampleInfo.m_pLightCache )
+			{
+				numSamples = cacheFace.RestoreSampleGroup( grp, sampleInfo );
+			}
+			else
+			{
+				numSamples = SetupSampleGroup( l, sampleInfo, grp );
+			}
 
-		// Iterate over all the lights and add their contribution to this group of spots
-		GatherSampleLightAt4Points( sampleInfo, nSample, numSamples );
+			// Iterate over all the lights and add their contribution to this group of spots
+			GatherSampleLightAt4Points( sampleInfo, 4 * grp, numSamples );
+		}
 	}
 	
 	// Tell the incremental light manager that we're done with this face.
@@ -3161,7 +3295,7 @@ void BuildFacelights (int iThread, int facenum)
 	}
 
 	// get rid of the -extra functionality on displacement surfaces
-	if (do_extra && !sampleInfo.m_IsDispFace)
+	if (do_extra && !sampleInfo.m_IsDispFace && !bLightingFromCache)
 	{
 		// For each lightstyle, perform a supersampling pass
 		for ( i = 0; i < MAXLIGHTMAPS; ++i )
@@ -3174,6 +3308,11 @@ void BuildFacelights (int iThread, int facenum)
 		}
 	}
 
+	if ( sampleInfo.m_pLightCache )
+	{
+		cacheFace.Finish( f, fl );
+	}
+
 	if (!g_bUseMPI) 
 	{
 		//
@@ -110,6 +110,8 @@ struct lightinfo_t
 	int		hasbumpmap;
 };
 
+class CLightCacheFace;
+
 struct SSE_SampleInfo_t
 {
 	int		m_FaceNum;
@@ -129,6 +131,8 @@ struct SSE_SampleInfo_t
 	int	        m_Clusters[4];
 	FourVectors	m_Points;
 	FourVectors	m_PointNormals[ NUM_BUMP_VECTS + 1 ];
+
+	CLightCacheFace	*m_pLightCache;		// -lightcache, NULL otherwise
 };
 
 extern void InitLightinfo( lightinfo_t *l, int facenum );
@@ -36,9 +36,6 @@
 CUtlVector<char> g_LightResultsFilename;
 
 
-extern int total_transfer;
-extern int max_transfer;
-
 extern void BuildVisLeafs(int);
 extern void BuildPatchLights( int facenum );
 
@@ -294,11 +291,15 @@ void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWor
 		patch->numtransfers = numtransfers;
 		if (numtransfers) 
 		{
-			patch->transfers = new transfer_t[numtransfers];
-			pBuf->read(patch->transfers, numtransfers * sizeof(transfer_t));
+			// compressed the way MakeScales leaves them
+			pBuf->read( &patch->transferScale, sizeof(patch->transferScale) );
+			pBuf->read( &patch->transferBytes, sizeof(patch->transferBytes) );
+			patch->transfers = (byte *)malloc( patch->transferBytes );
+			pBuf->read(patch->transfers, patch->transferBytes);
 		}
 		
 		total_transfer += numtransfers;
+		total_transfer_bytes += patch->transferBytes;
 		if (max_transfer < numtransfers) 
 			max_transfer = numtransfers;
 	}
@@ -330,7 +331,12 @@ void MPI_AddPatchData( int iThread, int patchnum, CPatch *patch )
 		++pData->m_nPatchesInCluster;
 		pData->m_pVisLeafsMB->write(&patchnum, sizeof(patchnum));
 		pData->m_pVisLeafsMB->write(&patch->numtransfers, sizeof(patch->numtransfers));
-		pData->m_pVisLeafsMB->write( patch->transfers, patch->numtransfers * sizeof(transfer_t) );
+		if ( patch->numtransfers )
+		{
+			pData->m_pVisLeafsMB->write( &patch->transferScale, sizeof(patch->transferScale) );
+			pData->m_pVisLeafsMB->write( &patch->transferBytes, sizeof(patch->transferBytes) );
+			pData->m_pVisLeafsMB->write( patch->transfers, patch->transferBytes );
+		}
 	}
 }
 
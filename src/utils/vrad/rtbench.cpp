@@ -0,0 +1,216 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: -rtbench: builds the ray tracing kd-tree for the map with the binned
+//			builder and with the exhaustive one, and traces the same fixed sets
+//			of rays through both, 4 and 8 rays at a time.
+//
+// $NoKeywords: $
+//
+//===========================================================================//
+
+#include "vrad.h"
+
+#define RTBENCH_RAYS			( 1 << 20 )				// per ray set, multiple of RTBENCH_WORK_RAYS
+#define RTBENCH_WORK_RAYS		1024					// rays per work item
+#define RTBENCH_COHERENT_GROUP	64						// coherent rays sharing an origin and direction
+
+struct RTBenchRays_t
+{
+	const char *m_pName;
+	CUtlVector<Vector> m_Origins;
+	CUtlVector<Vector> m_Dirs;
+};
+
+static RayTracingEnvironment *s_pBenchEnv;
+static RTBenchRays_t *s_pBenchRays;
+static int32 *s_pBenchHitIds;
+static bool s_bBench8Wide;
+
+// fixed seed, so every run and every map traces the same rays relative to its bounds
+static unsigned int s_nBenchSeed;
+
+static float BenchRandomFloat()
+{
+	s_nBenchSeed = s_nBenchSeed * 1664525 + 1013904223;
+	return ( s_nBenchSeed >> 8 ) * ( 1.0f / 16777216.0f );
+}
+
+static Vector BenchRandomPoint( const Vector &mins, const Vector &maxs )
+{
+	return Vector( mins.x + BenchRandomFloat() * ( maxs.x - mins.x ),
+				   mins.y + BenchRandomFloat() * ( maxs.y - mins.y ),
+				   mins.z + BenchRandomFloat() * ( maxs.z - mins.z ) );
+}
+
+static Vector BenchRandomDir( float flSpread )
+{
+	Vector vecDir;
+	do
+	{
+		vecDir.Init( BenchRandomFloat() * 2.0f - 1.0f, BenchRandomFloat() * 2.0f - 1.0f, BenchRandomFloat() * 2.0f - 1.0f );
+	} while ( vecDir.LengthSqr() > 1.0f || vecDir.LengthSqr() < 0.0001f );
+	VectorNormalize( vecDir );
+	return vecDir * flSpread;
+}
+
+static void GenerateBenchRays( RTBenchRays_t &rays, const Vector &mins, const Vector &maxs, bool bCoherent )
+{
+	s_nBenchSeed = bCoherent ? 2 : 1;
+	rays.m_pName = bCoherent ? "coherent" : "incoherent";
+	rays.m_Origins.SetCount( RTBENCH_RAYS );
+	rays.m_Dirs.SetCount( RTBENCH_RAYS );
+
+	Vector vecOrigin, vecDir;
+	for ( int i = 0; i < RTBENCH_RAYS; i++ )
+	{
+		if ( !bCoherent )
+		{
+			rays.m_Origins[i] = BenchRandomPoint( mins, maxs );
+			rays.m_Dirs[i] = BenchRandomDir( 1.0f );
+			continue;
+		}
+
+		// like a sample position shooting shadow rays at an area light
+		if ( ( i % RTBENCH_COHERENT_GROUP ) == 0 )
+		{
+			vecOrigin = BenchRandomPoint( mins, maxs );
+			vecDir = BenchRandomDir( 1.0f );
+		}
+		rays.m_Origins[i] = vecOrigin;
+		rays.m_Dirs[i] = vecDir + BenchRandomDir( 0.05f );
+		VectorNormalize( rays.m_Dirs[i] );
+	}
+}
+
+static void TraceBenchRays( int iThread, int iWorkItem )
+{
+	RayTracingEnvironment *pEnv = s_pBenchEnv;
+	const Vector *pOrigins = s_pBenchRays->m_Origins.Base();
+	const Vector *pDirs = s_pBenchRays->m_Dirs.Base();
+	fltx4 TMax = ReplicateX4( ( pEnv->m_MaxBound - pEnv->m_MinBound ).Length() );
+
+	int nFirst = iWorkItem * RTBENCH_WORK_RAYS;
+	if ( s_bBench8Wide )
+	{
+		fltx4 TMin8[2] = { Four_Zeros, Four_Zeros };
+		fltx4 TMax8[2] = { TMax, TMax };
+		for ( int i = nFirst; i < nFirst + RTBENCH_WORK_RAYS; i += 8 )
+		{
+			EightRays rays;
+			for ( int h = 0; h < 2; h++ )
+			{
+				int j = i + h * 4;
+				rays.half[h].origin.LoadAndSwizzle( pOrigins[j], pOrigins[j + 1], pOrigins[j + 2], pOrigins[j + 3] );
+				rays.half[h].direction.LoadAndSwizzle( pDirs[j], pDirs[j + 1], pDirs[j + 2], pDirs[j + 3] );
+			}
+
+			EightRayTracingResult result;
+			pEnv->Trace8Rays( rays, TMin8, TMax8, &result );
+			for ( int k = 0; k < 8; k++ )
+			{
+				s_pBenchHitIds[i + k] = result.half[k / 4].HitIds[k & 3];
+			}
+		}
+		return;
+	}
+
+	for ( int i = nFirst; i < nFirst + RTBENCH_WORK_RAYS; i += 4 )
+	{
+		FourRays rays;
+		rays.origin.LoadAndSwizzle( pOrigins[i], pOrigins[i + 1], pOrigins[i + 2], pOrigins[i + 3] );
+		rays.direction.LoadAndSwizzle( pDirs[i], pDirs[i + 1], pDirs[i + 2], pDirs[i + 3] );
+
+		RayTracingResult result;
+		pEnv->Trace4Rays( rays, Four_Zeros, TMax, &result );
+		for ( int k = 0; k < 4; k++ )
+		{
+			s_pBenchHitIds[i + k] = result.HitIds[k];
+		}
+	}
+}
+
+// Returns Mrays/s, and the triangle each ray hit in hitIds
+static double TraceBench( RayTracingEnvironment &env, RTBenchRays_t &rays, bool b8Wide, CUtlVector<int32> &hitIds )
+{
+	hitIds.SetCount( RTBENCH_RAYS );
+	s_bBench8Wide = b8Wide;
+	s_pBenchEnv = &env;
+	s_pBenchRays = &rays;
+	s_pBenchHitIds = hitIds.Base();
+
+	double flStart = Plat_FloatTime();
+	RunThreadsOnIndividual( RTBENCH_RAYS / RTBENCH_WORK_RAYS, false, TraceBenchRays );
+	double flElapsed = Plat_FloatTime() - flStart;
+
+	s_pBenchEnv = NULL;
+	s_pBenchRays = NULL;
+	s_pBenchHitIds = NULL;
+	return RTBENCH_RAYS / ( flElapsed * 1000000.0 );
+}
+
+static void BuildBenchEnv( RayTracingEnvironment &env, const char *pName, uint32 nFlags )
+{
+	// the bench doesn't shade, so the colors and materials are left out
+	env.Flags = nFlags | RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS | RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS;
+	env.MakeRoomForTriangles( g_RtEnv.OptimizedTriangleList.Count() );
+	for ( int i = 0; i < g_RtEnv.OptimizedTriangleList.Count(); i++ )
+	{
+		env.OptimizedTriangleList.AddToTail( g_RtEnv.OptimizedTriangleList[i] );
+	}
+
+	double flStart = Plat_FloatTime();
+	env.SetupAccelerationStructure();
+	double flElapsed = Plat_FloatTime() - flStart;
+
+	int nLeaves = 0;
+	for ( int i = 0; i < env.OptimizedKDTree.Count(); i++ )
+	{
+		if ( env.OptimizedKDTree[i].NodeType() == KDNODE_STATE_LEAF )
+			nLeaves++;
+	}
+	Msg( "  %-10s build %8.2f s  %9d nodes  %9d leaves  %9d triangle refs\n", pName, flElapsed,
+		env.OptimizedKDTree.Count(), nLeaves, env.TriangleIndexList.Count() );
+}
+
+//-----------------------------------------------------------------------------
+// Call after the triangles have been added to g_RtEnv and before its tree is built
+//-----------------------------------------------------------------------------
+void RunRayTraceBenchmark()
+{
+	Msg( "Ray trace benchmark: %d triangles, %d threads, %d rays per set, 8-wide packets %s\n",
+		g_RtEnv.OptimizedTriangleList.Count(), numthreads, RTBENCH_RAYS,
+		RayTracingEnvironment::CanTrace8Wide() ? "use AVX" : "are traced as two 4-wide ones (no AVX)" );
+
+	RayTracingEnvironment binnedEnv;
+	RayTracingEnvironment exhaustiveEnv;
+	BuildBenchEnv( binnedEnv, "binned", g_RtEnv.Flags & ~RTE_FLAGS_EXHAUSTIVE_TREE_GENERATION );
+	BuildBenchEnv( exhaustiveEnv, "exhaustive", g_RtEnv.Flags | RTE_FLAGS_EXHAUSTIVE_TREE_GENERATION );
+
+	for ( int nSet = 0; nSet < 2; nSet++ )
+	{
+		RTBenchRays_t rays;
+		GenerateBenchRays( rays, binnedEnv.m_MinBound, binnedEnv.m_MaxBound, nSet != 0 );
+
+		CUtlVector<int32> binnedHits, exhaustiveHits, binned8Hits;
+		double flBinned = TraceBench( binnedEnv, rays, false, binnedHits );
+		double flExhaustive = TraceBench( exhaustiveEnv, rays, false, exhaustiveHits );
+		double flBinned8 = TraceBench( binnedEnv, rays, true, binned8Hits );
+
+		// everything finds the closest hit, so only exact ties may differ
+		int nHits = 0, nTreeDiffer = 0, n8WideDiffer = 0;
+		for ( int i = 0; i < RTBENCH_RAYS; i++ )
+		{
+			if ( binnedHits[i] != -1 )
+				nHits++;
+			if ( binnedHits[i] != exhaustiveHits[i] )
+				nTreeDiffer++;
+			if ( binnedHits[i] != binned8Hits[i] )
+				n8WideDiffer++;
+		}
+
+		Msg( "  %-10s rays: binned %7.2f Mrays/s  exhaustive %7.2f Mrays/s  binned 8-wide %7.2f Mrays/s\n",
+			rays.m_pName, flBinned, flExhaustive, flBinned8 );
+		Msg( "  %-10s       %d hits, %d differ between the trees, %d differ 8-wide\n",
+			"", nHits, nTreeDiffer, n8WideDiffer );
+	}
+}
@@ -148,21 +148,17 @@ public:
 	}
 };
 
-void TestLine( const FourVectors& start, const FourVectors& stop,
-               fltx4 *pFractionVisible, int static_prop_index_to_ignore )
+static void SetupLineRays( FourRays &rays, FourVectors const& start, FourVectors const& stop, fltx4 *pLen )
 {
-	FourRays myrays;
-	myrays.origin = start;
-	myrays.direction = stop;
-	myrays.direction -= myrays.origin;
-	fltx4 len = myrays.direction.length();
-	myrays.direction *= ReciprocalSIMD( len );
-
-	RayTracingResult rt_result;
-	CCoverageCountTexture coverageCallback;
-
-	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_index_to_ignore, g_bTextureShadows ? &coverageCallback : 0 );
+	rays.origin = start;
+	rays.direction = stop;
+	rays.direction -= rays.origin;
+	*pLen = rays.direction.length();
+	rays.direction *= ReciprocalSIMD( *pLen );
+}
 
+static fltx4 LineVisibility( const RayTracingResult &rt_result, const fltx4 &len )
+{
 	// Assume we can see the targets unless we get hits
 	float visibility[4];
 	for ( int i = 0; i < 4; i++ )
@@ -174,11 +170,50 @@ void TestLine( const FourVectors& start, const FourVectors& stop,
 			visibility[i] = 0.0f;
 		}
 	}
-	*pFractionVisible = LoadUnalignedSIMD( visibility );
+	return LoadUnalignedSIMD( visibility );
+}
+
+void TestLine( const FourVectors& start, const FourVectors& stop,
+               fltx4 *pFractionVisible, int static_prop_index_to_ignore )
+{
+	FourRays myrays;
+	fltx4 len;
+	SetupLineRays( myrays, start, stop, &len );
+
+	RayTracingResult rt_result;
+	CCoverageCountTexture coverageCallback;
+
+	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_index_to_ignore, g_bTextureShadows ? &coverageCallback : 0 );
+
+	*pFractionVisible = LineVisibility( rt_result, len );
 	if ( g_bTextureShadows )
 		*pFractionVisible = MinSIMD( *pFractionVisible, coverageCallback.GetFractionVisible() );
 }
 
+void TestLine8( FourVectors const start[2], FourVectors const stop[2],
+                fltx4 pFractionVisible[2], int static_prop_index_to_ignore )
+{
+	if ( g_bTextureShadows )
+	{
+		// the coverage callback needs Trace4Rays
+		TestLine( start[0], stop[0], &pFractionVisible[0], static_prop_index_to_ignore );
+		TestLine( start[1], stop[1], &pFractionVisible[1], static_prop_index_to_ignore );
+		return;
+	}
+
+	EightRays myrays;
+	fltx4 len[2];
+	SetupLineRays( myrays.half[0], start[0], stop[0], &len[0] );
+	SetupLineRays( myrays.half[1], start[1], stop[1], &len[1] );
+
+	fltx4 TMin[2] = { Four_Zeros, Four_Zeros };
+	EightRayTracingResult rt_result;
+	g_RtEnv.Trace8Rays( myrays, TMin, len, &rt_result, TRACE_ID_STATICPROP | static_prop_index_to_ignore );
+
+	pFractionVisible[0] = LineVisibility( rt_result.half[0], len[0] );
+	pFractionVisible[1] = LineVisibility( rt_result.half[1], len[1] );
+}
+
 
 
 /*
@@ -349,25 +384,8 @@ void DM_ClipBoxToBrush( CToolTrace *trace, const Vector& mins, const Vector& max
 	}
 }
 
-void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
-	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
+static fltx4 SkyLineOcclusion( const RayTracingResult &rt_result, const fltx4 &len )
 {
-	FourRays myrays;
-	myrays.origin = start;
-	myrays.direction = stop;
-	myrays.direction -= myrays.origin;
-	fltx4 len = myrays.direction.length();
-	myrays.direction *= ReciprocalSIMD( len );
-	RayTracingResult rt_result;
-	CCoverageCountTexture coverageCallback;
-
-	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows? &coverageCallback : 0);
-
-	if ( bDoDebug )
-	{
-		WriteTrace( "trace.txt", myrays, rt_result );
-	}
-
 	float aOcclusion[4];
 	for ( int i = 0; i < 4; i++ )
 	{
@@ -380,10 +398,14 @@ void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
 				aOcclusion[i] = 1.0f;
 		}
 	}
-	fltx4 occlusion = LoadUnalignedSIMD( aOcclusion );
-	if (g_bTextureShadows)
-		occlusion = MaxSIMD ( occlusion, coverageCallback.GetCoverage() );
+	return LoadUnalignedSIMD( aOcclusion );
+}
 
+// Takes the occlusion of the traced lines, adds what the 3D skybox occludes of the ones that
+// hit sky, and returns the visibility
+static void FinishSkyLines( FourVectors const& start, FourVectors const& stop, fltx4 occlusion,
+	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
+{
 	bool fullyOccluded = ( TestSignSIMD( CmpGeSIMD( occlusion, Four_Ones ) ) == 0xF );
 
 	// if we hit sky, and we're not in a sky camera's area, try clipping into the 3D sky boxes
@@ -430,6 +452,58 @@ void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
 
 
 
+void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
+	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
+{
+	FourRays myrays;
+	fltx4 len;
+	SetupLineRays( myrays, start, stop, &len );
+	RayTracingResult rt_result;
+	CCoverageCountTexture coverageCallback;
+
+	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows? &coverageCallback : 0);
+
+	if ( bDoDebug )
+	{
+		WriteTrace( "trace.txt", myrays, rt_result );
+	}
+
+	fltx4 occlusion = SkyLineOcclusion( rt_result, len );
+	if (g_bTextureShadows)
+		occlusion = MaxSIMD ( occlusion, coverageCallback.GetCoverage() );
+
+	FinishSkyLines( start, stop, occlusion, pFractionVisible, canRecurse, static_prop_to_skip, bDoDebug );
+}
+
+void TestLine_DoesHitSky8( FourVectors const start[2], FourVectors const stop[2],
+	fltx4 pFractionVisible[2], bool canRecurse, int static_prop_to_skip )
+{
+	if ( g_bTextureShadows )
+	{
+		// the coverage callback needs Trace4Rays
+		TestLine_DoesHitSky( start[0], stop[0], &pFractionVisible[0], canRecurse, static_prop_to_skip );
+		TestLine_DoesHitSky( start[1], stop[1], &pFractionVisible[1], canRecurse, static_prop_to_skip );
+		return;
+	}
+
+	EightRays myrays;
+	fltx4 len[2];
+	SetupLineRays( myrays.half[0], start[0], stop[0], &len[0] );
+	SetupLineRays( myrays.half[1], start[1], stop[1], &len[1] );
+
+	fltx4 TMin[2] = { Four_Zeros, Four_Zeros };
+	EightRayTracingResult rt_result;
+	g_RtEnv.Trace8Rays( myrays, TMin, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip );
+
+	for ( int h = 0; h < 2; h++ )
+	{
+		FinishSkyLines( start[h], stop[h], SkyLineOcclusion( rt_result.half[h], len[h] ), &pFractionVisible[h],
+			canRecurse, static_prop_to_skip, false );
+	}
+}
+
+
+
 //-----------------------------------------------------------------------------
 //-----------------------------------------------------------------------------
 int PointLeafnum_r( const Vector &point, int ndxNode )
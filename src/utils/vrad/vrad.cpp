@@ -19,6 +19,7 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "lightcache.h"
 
 #define ALLOWDEBUGOPTIONS (0 || _DEBUG)
 
@@ -39,6 +40,8 @@ CUtlVector<int>			faceParents;		// contains only root patches, use next parent t
 CUtlVector<int>			clusterChildren;
 CUtlVector<Vector>		emitlight;
 CUtlVector<bumplights_t>	addlight;
+CUtlVector<int>			g_TransferPatchOrder;
+CUtlVector<int>			g_TransferPatchRank;
 
 int num_sky_cameras;
 sky_camera_t sky_cameras[MAX_MAP_AREAS];
@@ -49,6 +52,7 @@ Vector		face_offset[MAX_MAP_FACES];		// for rotating bmodels
 int			fakeplanes;
 
 unsigned	numbounce = 100; // 25; /* Originally this was 8 */
+float		g_flBounceThreshold = 0.0f;	// "-bouncethreshold" stop once a bounce adds less than this fraction of the first
 
 float		maxchop = 4; // coarsest allowed number of luxel widths for a patch
 float		minchop = 4; // "-chop" tightest number of luxel widths for a patch, used on edges
@@ -57,6 +61,8 @@ float		g_MaxDispPatchRadius = 1500.0f;			// Maximum radius allowed for displacem
 qboolean	g_bDumpPatches;
 bool	    bDumpNormals = false;
 bool		g_bDumpRtEnv = false;
+bool		g_bRayTraceBench = false;
+bool		g_bLightCache = false;
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
@@ -79,6 +85,7 @@ char		level_lights[MAX_PATH] = "";
 
 char		vismatfile[_MAX_PATH] = "";
 char		incrementfile[_MAX_PATH] = "";
+char		lightcachefile[_MAX_PATH] = "";
 
 IIncremental *g_pIncremental = 0;
 bool		g_bInterrupt = false;	// Wsed with background lighting in WC. Tells VRAD
@@ -1198,11 +1205,132 @@ void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers )
 }
 
 
+//-----------------------------------------------------------------------------
+// Transfer lists are the bulk of vrad's memory, and every bounce streams all of
+// them, so they're stored compressed.  Shooters are referred to by their
+// position in a Morton order of the patch origins, so a patch's transfers go
+// to nearby, ascending positions and delta code to a byte or two each.
+//-----------------------------------------------------------------------------
+#define TRANSFER_MORTON_BITS	10			// per axis
+
+struct TransferOrder_t
+{
+	unsigned int	m_nMorton;
+	int				m_nPatch;
+};
+
+static int __cdecl TransferOrderCompare( const TransferOrder_t *pA, const TransferOrder_t *pB )
+{
+	if ( pA->m_nMorton != pB->m_nMorton )
+		return ( pA->m_nMorton < pB->m_nMorton ) ? -1 : 1;
+
+	// every vmpi worker has to come up with the same order
+	return pA->m_nPatch - pB->m_nPatch;
+}
+
+static unsigned int SpreadMortonBits( unsigned int n )
+{
+	n = ( n | ( n << 16 ) ) & 0x030000FF;
+	n = ( n | ( n << 8 ) ) & 0x0300F00F;
+	n = ( n | ( n << 4 ) ) & 0x030C30C3;
+	n = ( n | ( n << 2 ) ) & 0x09249249;
+	return n;
+}
+
+static void BuildTransferPatchOrder( void )
+{
+	int nPatches = g_Patches.Count();
+
+	Vector mins( FLT_MAX, FLT_MAX, FLT_MAX );
+	Vector maxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		VectorMin( g_Patches[i].origin, mins, mins );
+		VectorMax( g_Patches[i].origin, maxs, maxs );
+	}
+
+	Vector vecScale;
+	for ( int i = 0; i < 3; i++ )
+	{
+		vecScale[i] = ( maxs[i] > mins[i] ) ? ( ( 1 << TRANSFER_MORTON_BITS ) - 1 ) / ( maxs[i] - mins[i] ) : 0.0f;
+	}
+
+	CUtlVector<TransferOrder_t> order;
+	order.SetCount( nPatches );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		unsigned int nMorton = 0;
+		for ( int j = 0; j < 3; j++ )
+		{
+			unsigned int n = (unsigned int)( ( g_Patches[i].origin[j] - mins[j] ) * vecScale[j] );
+			nMorton |= SpreadMortonBits( MIN( n, ( 1u << TRANSFER_MORTON_BITS ) - 1 ) ) << j;
+		}
+		order[i].m_nMorton = nMorton;
+		order[i].m_nPatch = i;
+	}
+	order.Sort( TransferOrderCompare );
+
+	g_TransferPatchOrder.SetCount( nPatches );
+	g_TransferPatchRank.SetCount( nPatches );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		g_TransferPatchOrder[i] = order[i].m_nPatch;
+		g_TransferPatchRank[order[i].m_nPatch] = i;
+	}
+}
+
+static int TransferRankBytes( unsigned int nDelta )
+{
+	int nBytes = 1;
+	while ( nDelta >= 0x80 )
+	{
+		nDelta >>= 7;
+		nBytes++;
+	}
+	return nBytes;
+}
+
+static byte *WriteTransferRank( byte *pOut, unsigned int nDelta )
+{
+	while ( nDelta >= 0x80 )
+	{
+		*pOut++ = (byte)( nDelta | 0x80 );
+		nDelta >>= 7;
+	}
+	*pOut++ = (byte)nDelta;
+	return pOut;
+}
+
+static FORCEINLINE int ReadTransferRank( const byte *&pIn )
+{
+	unsigned int nDelta = *pIn++;
+	if ( nDelta & 0x80 )
+	{
+		nDelta &= 0x7F;
+		int nShift = 7;
+		unsigned int nByte;
+		do
+		{
+			nByte = *pIn++;
+			nDelta |= ( nByte & 0x7F ) << nShift;
+			nShift += 7;
+		} while ( nByte & 0x80 );
+	}
+	return nDelta;
+}
+
+static int __cdecl TransferRankCompare( const void *pA, const void *pB )
+{
+	return ( (const transfer_t *)pA )->patch - ( (const transfer_t *)pB )->patch;
+}
+
+int64 total_transfer_bytes;
+
 void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 {
 	int		j;
 	float	total;
-	transfer_t	*t, *t2;
+	transfer_t	*t;
 	total = 0;
 
 	if( ndxPatch == g_Patches.InvalidIndex() )
@@ -1217,18 +1345,13 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 			max_transfer = patch->numtransfers;
 		}
 
-
-		patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
-		if (!patch->transfers)
-			Error ("Memory allocation failure");
-
 		// get total transfer energy
-		t2 = all_transfers;
+		t = all_transfers;
 
 		// overflow check!
-		for (j=0 ; j<patch->numtransfers ; j++, t2++)
+		for (j=0 ; j<patch->numtransfers ; j++, t++)
 		{
-			total += t2->transfer;
+			total += t->transfer;
 		}
 
 		// the total transfer should be PI, but we need to correct errors due to overlaping surfaces
@@ -1237,17 +1360,70 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		else	
 			total = 1.0f/M_PI;
 
-		t = patch->transfers;
-		t2 = all_transfers;
-		for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
+		// bumped patches use the transfers with the normal already factored into
+		// them removed again, so quantise those.  A shooter behind the flat normal
+		// adds nothing to it, and would only take light away from the bump vectors.
+		if ( patch->needsBumpmap )
 		{
-			t->transfer = t2->transfer*total;
-			t->patch = t2->patch;
+			t = all_transfers;
+			for (j=0 ; j<patch->numtransfers ; j++, t++)
+			{
+				Vector delta;
+				VectorSubtract( g_Patches[t->patch].origin, patch->origin, delta );
+				float dot = DotProduct( delta, patch->normal );
+				t->transfer = ( dot > 0 ) ? t->transfer * VectorLength( delta ) / dot : 0.0f;
+			}
 		}
-		if (patch->numtransfers > max_transfer)
+
+		float flMaxTransfer = 0;
+		t = all_transfers;
+		for (j=0 ; j<patch->numtransfers ; j++, t++)
 		{
-			max_transfer = patch->numtransfers;
+			flMaxTransfer = MAX( flMaxTransfer, t->transfer );
+		}
+
+		// quantise to 16 bits of the largest, dropping the ones that round to nothing,
+		// and put the shooters in ascending order for the delta coding
+		patch->transferScale = flMaxTransfer * total / 65535.0f;
+		float flQuantise = ( flMaxTransfer > 0 ) ? 65535.0f / flMaxTransfer : 0.0f;
+		int nKept = 0;
+		t = all_transfers;
+		for (j=0 ; j<patch->numtransfers ; j++, t++)
+		{
+			int nWeight = (int)( t->transfer * flQuantise + 0.5f );
+			if ( nWeight > 0 )
+			{
+				all_transfers[nKept].patch = g_TransferPatchRank[t->patch];
+				all_transfers[nKept].transfer = (float)nWeight;
+				nKept++;
+			}
 		}
+		patch->numtransfers = nKept;
+		qsort( all_transfers, nKept, sizeof( transfer_t ), TransferRankCompare );
+
+		int nBytes = nKept * sizeof( uint16 );
+		int nLastRank = 0;
+		for (j=0 ; j<nKept ; j++)
+		{
+			nBytes += TransferRankBytes( all_transfers[j].patch - nLastRank );
+			nLastRank = all_transfers[j].patch;
+		}
+
+		patch->transferBytes = nBytes;
+		patch->transfers = nBytes ? ( byte* )malloc( nBytes ) : NULL;
+		if (nBytes && !patch->transfers)
+			Error ("Memory allocation failure");
+
+		uint16 *pWeights = (uint16 *)patch->transfers;
+		byte *pRanks = patch->transfers + nKept * sizeof( uint16 );
+		nLastRank = 0;
+		for (j=0 ; j<nKept ; j++)
+		{
+			pWeights[j] = (uint16)all_transfers[j].transfer;
+			pRanks = WriteTransferRank( pRanks, all_transfers[j].patch - nLastRank );
+			nLastRank = all_transfers[j].patch;
+		}
+		Assert( pRanks == patch->transfers + nBytes );
 	}
 	else
 	{
@@ -1257,6 +1433,7 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 
 	ThreadLock ();
 	total_transfer += patch->numtransfers;
+	total_transfer_bytes += patch->transferBytes;
 	ThreadUnlock ();
 }
 
@@ -1531,110 +1708,200 @@ void PreGetBumpNormalsForDisp( texinfo_t *pTexinfo, Vector &vecU, Vector &vecV,
 	vecV = vecTexV;
 }
 
-void GatherLight (int threadnum, void *pUserData)
+//-----------------------------------------------------------------------------
+// The patches used for the bump lightmap vectors, normals[0] is the flat normal
+//-----------------------------------------------------------------------------
+static void GetPatchBumpNormals( CPatch *patch, Vector normals[NUM_BUMP_VECTS+1] )
 {
-	int			i, j, k;
-	transfer_t	*trans;
-	int			num;
-	CPatch		*patch;
-	Vector		sum, v;
+	// Disps
+	bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 ); 
+	if ( bDisp )
+	{
+		normals[0] = patch->normal;
+		texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+		Vector vecTexU, vecTexV;
+		PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
 
-	while (1)
+		// use facenormal along with the smooth normal to build the three bump map vectors
+		GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] ); 
+	}
+	else
 	{
-		j = GetThreadWork ();
-		if (j == -1)
-			break;
+		GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
 
-		patch = &g_Patches[j];
+		texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+		// use facenormal along with the smooth normal to build the three bump map vectors
+		GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0], 
+			pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal, 
+			normals[0], &normals[1] );
+	}
 
-		trans = patch->transfers;
-		num = patch->numtransfers;
-		if ( patch->needsBumpmap )
+	// force the base lightmap to use the flat normal instead of the phong normal
+	// FIXME: why does the patch not use the phong normal?
+	normals[0] = patch->normal;
+}
+
+//-----------------------------------------------------------------------------
+// GatherLight works on blocks of receivers that are next to each other in
+// g_TransferPatchOrder, and walks the shooters a tile at a time, so the shooters
+// a block needs stay in cache while every receiver in it takes its light from them.
+//-----------------------------------------------------------------------------
+#define TRANSFER_BLOCK_PATCHES	64
+#define TRANSFER_TILE_PATCHES	4096		// 128k of shooter light and origins
+
+// per shooter, in g_TransferPatchOrder: emitlight * reflectivity, updated every bounce
+static CUtlVector< fltx4, CUtlMemoryAligned<fltx4, 16> > s_ShooterLight;
+static CUtlVector< fltx4, CUtlMemoryAligned<fltx4, 16> > s_ShooterOrigin;
+
+struct TransferGather_t
+{
+	fltx4			m_Sum[NUM_BUMP_VECTS+1];
+	fltx4			m_NormalX;				// the bump normals, transposed
+	fltx4			m_NormalY;
+	fltx4			m_NormalZ;
+	fltx4			m_Origin;
+	const uint16	*m_pWeight;
+	const byte		*m_pRank;
+	int				m_nLeft;
+	int				m_nRank;				// shooter of the next transfer, INT_MAX when done
+	int				m_nPatch;
+	bool			m_bBump;
+};
+
+static FORCEINLINE void NextTransfer( TransferGather_t &gather )
+{
+	gather.m_pWeight++;
+	if ( --gather.m_nLeft > 0 )
+	{
+		gather.m_nRank += ReadTransferRank( gather.m_pRank );
+	}
+	else
+	{
+		gather.m_nRank = INT_MAX;
+	}
+}
+
+static void StartGather( TransferGather_t &gather, int ndxPatch )
+{
+	CPatch *patch = &g_Patches[ndxPatch];
+
+	gather.m_nPatch = ndxPatch;
+	gather.m_bBump = patch->needsBumpmap;
+	for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+	{
+		gather.m_Sum[i] = Four_Zeros;
+	}
+
+	gather.m_nLeft = patch->numtransfers;
+	gather.m_nRank = INT_MAX;
+	if ( gather.m_nLeft )
+	{
+		gather.m_pWeight = (const uint16 *)patch->transfers;
+		gather.m_pRank = patch->transfers + patch->numtransfers * sizeof( uint16 );
+		gather.m_nRank = ReadTransferRank( gather.m_pRank );
+	}
+
+	if ( gather.m_bBump )
+	{
+		Vector normals[NUM_BUMP_VECTS+1];
+		GetPatchBumpNormals( patch, normals );
+		for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
 		{
-			Vector delta;
-			Vector bumpSum[NUM_BUMP_VECTS+1];
-			Vector normals[NUM_BUMP_VECTS+1];
+			SubFloat( gather.m_NormalX, i ) = normals[i].x;
+			SubFloat( gather.m_NormalY, i ) = normals[i].y;
+			SubFloat( gather.m_NormalZ, i ) = normals[i].z;
+		}
+		gather.m_Origin = s_ShooterOrigin[g_TransferPatchRank[ndxPatch]];
+	}
+}
 
-			// Disps
-			bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 ); 
-			if ( bDisp )
-			{
-				normals[0] = patch->normal;
-				texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				Vector vecTexU, vecTexV;
-				PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
+static void GatherTile( TransferGather_t &gather, int nTileEnd )
+{
+	const fltx4 *pShooterLight = s_ShooterLight.Base();
+	if ( !gather.m_bBump )
+	{
+		fltx4 sum = gather.m_Sum[0];
+		while ( gather.m_nRank < nTileEnd )
+		{
+			sum = MaddSIMD( pShooterLight[gather.m_nRank], ReplicateX4( (float)*gather.m_pWeight ), sum );
+			NextTransfer( gather );
+		}
+		gather.m_Sum[0] = sum;
+		return;
+	}
 
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] ); 
-			}
-			else
-			{
-				GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
+	const fltx4 *pShooterOrigin = s_ShooterOrigin.Base();
+	while ( gather.m_nRank < nTileEnd )
+	{
+		// the transfer (without the flat normal, see MakeScales) times the dot of
+		// the direction to the shooter with each bump normal
+		fltx4 delta = SubSIMD( pShooterOrigin[gather.m_nRank], gather.m_Origin );
+		fltx4 dots = MulSIMD( gather.m_NormalX, SplatXSIMD( delta ) );
+		dots = MaddSIMD( gather.m_NormalY, SplatYSIMD( delta ), dots );
+		dots = MaddSIMD( gather.m_NormalZ, SplatZSIMD( delta ), dots );
 
-				texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0], 
-					pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal, 
-					normals[0], &normals[1] );
-			}
+		fltx4 scale = MulSIMD( ReplicateX4( (float)*gather.m_pWeight ), ReciprocalSqrtSIMD( Dot3SIMD( delta, delta ) ) );
+		fltx4 weights = MulSIMD( AndSIMD( CmpGtSIMD( dots, Four_Zeros ), dots ), scale );
 
-			// force the base lightmap to use the flat normal instead of the phong normal
-			// FIXME: why does the patch not use the phong normal?
-			normals[0] = patch->normal;
+		fltx4 light = pShooterLight[gather.m_nRank];
+		gather.m_Sum[0] = MaddSIMD( light, SplatXSIMD( weights ), gather.m_Sum[0] );
+		gather.m_Sum[1] = MaddSIMD( light, SplatYSIMD( weights ), gather.m_Sum[1] );
+		gather.m_Sum[2] = MaddSIMD( light, SplatZSIMD( weights ), gather.m_Sum[2] );
+		gather.m_Sum[3] = MaddSIMD( light, SplatWSIMD( weights ), gather.m_Sum[3] );
+		NextTransfer( gather );
+	}
+}
 
-			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
-			{
-				VectorFill( bumpSum[i], 0 );
-			}
+static void FinishGather( TransferGather_t &gather )
+{
+	CPatch *patch = &g_Patches[gather.m_nPatch];
+	fltx4 scale = ReplicateX4( patch->transferScale );
+	int normalCount = gather.m_bBump ? NUM_BUMP_VECTS+1 : 1;
+	for ( int i = 0; i < normalCount; i++ )
+	{
+		fltx4 sum = MulSIMD( gather.m_Sum[i], scale );
+		addlight[gather.m_nPatch].light[i].Init( SubFloat( sum, 0 ), SubFloat( sum, 1 ), SubFloat( sum, 2 ) );
+	}
+}
 
-			float dot;
-			for (k=0 ; k<num ; k++, trans++)
-			{
-				CPatch *patch2 = &g_Patches[trans->patch];
+void GatherLight (int threadnum, void *pUserData)
+{
+	TransferGather_t gathers[TRANSFER_BLOCK_PATCHES];
+	int nPatches = g_TransferPatchOrder.Count();
 
-				// get vector to other patch
-				VectorSubtract (patch2->origin, patch->origin, delta);
-				VectorNormalize (delta);
-				// find light emitted from other patch
-				for(i=0; i<3; i++)
-				{
-					v[i] = emitlight[trans->patch][i] * patch2->reflectivity[i];
-				}
-				// remove normal already factored into transfer steradian
-				float scale = 1.0f / DotProduct (delta, patch->normal);
-				VectorScale( v, trans->transfer * scale, v );
-				
-				Vector bumpTransfer;
-				for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
-				{
-					dot = DotProduct( delta, normals[i] );
-					if ( dot <= 0 )
-					{
-//						Assert( i > 0 ); // if this hits, then the transfer shouldn't be here.  It doesn't face the flat normal of this face!
-						continue;
-					}
-					bumpTransfer = v * dot;
-					VectorAdd( bumpSum[i], bumpTransfer, bumpSum[i] );
-				}
-			}
-			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
-			{
-				VectorCopy( bumpSum[i], addlight[j].light[i] );
-			}
+	while (1)
+	{
+		int nBlock = GetThreadWork ();
+		if (nBlock == -1)
+			break;
+
+		int nFirst = nBlock * TRANSFER_BLOCK_PATCHES;
+		int nCount = MIN( TRANSFER_BLOCK_PATCHES, nPatches - nFirst );
+		int nFirstRank = INT_MAX;
+		for ( int k = 0; k < nCount; k++ )
+		{
+			StartGather( gathers[k], g_TransferPatchOrder[nFirst + k] );
+			nFirstRank = MIN( nFirstRank, gathers[k].m_nRank );
 		}
-		else
+
+		if ( nFirstRank != INT_MAX )
 		{
-			VectorFill( sum, 0 );
-			for (k=0 ; k<num ; k++, trans++)
+			for ( int nTileEnd = ( nFirstRank / TRANSFER_TILE_PATCHES + 1 ) * TRANSFER_TILE_PATCHES; ; nTileEnd += TRANSFER_TILE_PATCHES )
 			{
-				for(i=0; i<3; i++)
+				bool bDone = true;
+				for ( int k = 0; k < nCount; k++ )
 				{
-					v[i] = emitlight[trans->patch][i] * g_Patches[trans->patch].reflectivity[i];
+					GatherTile( gathers[k], nTileEnd );
+					bDone = bDone && gathers[k].m_nRank == INT_MAX;
 				}
-				VectorScale( v, trans->transfer, v );
-				VectorAdd( sum, v, sum );
+				if ( bDone )
+					break;
 			}
-			VectorCopy( sum, addlight[j].light[0] );
+		}
+
+		for ( int k = 0; k < nCount; k++ )
+		{
+			FinishGather( gathers[k] );
 		}
 	}
 }
@@ -1699,23 +1966,62 @@ void BounceLight (void)
 	}
 #endif
 
+	// shooters are read through s_ShooterLight and s_ShooterOrigin, in the order the transfers use
+	int nPatches = g_TransferPatchOrder.Count();
+	s_ShooterLight.SetCount( nPatches );
+	s_ShooterOrigin.SetCount( nPatches );
+	for ( int nRank = 0; nRank < nPatches; nRank++ )
+	{
+		const Vector &origin = g_Patches[g_TransferPatchOrder[nRank]].origin;
+		s_ShooterOrigin[nRank] = Four_Zeros;
+		SubFloat( s_ShooterOrigin[nRank], 0 ) = origin.x;
+		SubFloat( s_ShooterOrigin[nRank], 1 ) = origin.y;
+		SubFloat( s_ShooterOrigin[nRank], 2 ) = origin.z;
+	}
+
+	double flBounceStart = Plat_FloatTime();
+	float flFirstBounce = 0.0f;
+
 	i = 0;
 	while ( bouncing )
 	{
+		double flStart = Plat_FloatTime();
+
+		for ( int nRank = 0; nRank < nPatches; nRank++ )
+		{
+			int ndxPatch = g_TransferPatchOrder[nRank];
+			const Vector &reflectivity = g_Patches[ndxPatch].reflectivity;
+			s_ShooterLight[nRank] = Four_Zeros;
+			SubFloat( s_ShooterLight[nRank], 0 ) = emitlight[ndxPatch].x * reflectivity.x;
+			SubFloat( s_ShooterLight[nRank], 1 ) = emitlight[ndxPatch].y * reflectivity.y;
+			SubFloat( s_ShooterLight[nRank], 2 ) = emitlight[ndxPatch].z * reflectivity.z;
+		}
+
 		// transfer light from to the leaf patches from other patches via transfers
 		// this moves shooter->emitlight to receiver->addlight
-		unsigned int uiPatchCount = g_Patches.Size();
-		RunThreadsOn (uiPatchCount, true, GatherLight);
+		RunThreadsOn ((nPatches + TRANSFER_BLOCK_PATCHES - 1) / TRANSFER_BLOCK_PATCHES, true, GatherLight);
 		// move newly received light (addlight) to light to be sent out (emitlight)
 		// start at children and pull light up to parents
 		// light is always received to leaf patches
 		CollectLight( added );
 
-		qprintf ("\tBounce #%i added RGB(%.0f, %.0f, %.0f)\n", i+1, added[0], added[1], added[2] );
+		qprintf ("\tBounce #%i added RGB(%.0f, %.0f, %.0f) in %.2f seconds\n", i+1, added[0], added[1], added[2], Plat_FloatTime() - flStart );
 
 		if ( i+1 == numbounce || (added[0] < 1.0 && added[1] < 1.0 && added[2] < 1.0) )
 			bouncing = false;
 
+		// "-bouncethreshold": the rest would only add a sliver of what the first bounce did
+		float flAdded = added[0] + added[1] + added[2];
+		if ( i == 0 )
+		{
+			flFirstBounce = flAdded;
+		}
+		else if ( bouncing && flAdded < g_flBounceThreshold * flFirstBounce )
+		{
+			qprintf ("\tBounce #%i added under %g of the first bounce, stopping\n", i+1, g_flBounceThreshold );
+			bouncing = false;
+		}
+
 		i++;
 		if ( g_bDumpPatches && !bouncing && i != 1)
 		{
@@ -1723,6 +2029,12 @@ void BounceLight (void)
 			WriteWorld (name, 0);
 		}
 	}
+
+	double flBounceTime = Plat_FloatTime() - flBounceStart;
+	Msg("BounceLight: %d bounces in %.1f seconds (%.2f seconds per bounce)\n", i, flBounceTime, i ? flBounceTime / i : 0.0 );
+
+	s_ShooterLight.Purge();
+	s_ShooterOrigin.Purge();
 }
 
 
@@ -1923,6 +2235,9 @@ void BuildFacesVisibleToLights( bool bAllVisible )
 
 void MakeAllScales (void)
 {
+	// shooters are coded by their place in this, so every machine needs it before building transfers
+	BuildTransferPatchOrder ();
+
 	// determine visibility between patches
 	BuildVisMatrix ();
 	
@@ -1931,8 +2246,12 @@ void MakeAllScales (void)
 
 	Msg("transfers %d, max %d\n", total_transfer, max_transfer );
 
-	qprintf ("transfer lists: %5.1f megs\n"
-		, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+	// each thread building transfers has a MAX_PATCHES scratch list on top of the compressed ones
+	float flScratch = (float)numthreads * MAX_PATCHES * sizeof(transfer_t);
+	Msg ("transfer lists: %5.1f megs (%5.1f megs uncompressed), peak %5.1f megs while building\n"
+		, (float)total_transfer_bytes / (1024*1024)
+		, (float)total_transfer * sizeof(transfer_t) / (1024*1024)
+		, ((float)total_transfer_bytes + flScratch) / (1024*1024));
 }
 
 
@@ -2026,7 +2345,20 @@ bool RadWorld_Go()
 	}
 	else 
 	{
+		if ( g_pLightCache )
+		{
+			g_pLightCache->Load( lightcachefile );
+		}
+
 		RunThreadsOnIndividual (numfaces, true, BuildFacelights);
+
+		if ( g_pLightCache )
+		{
+			g_pLightCache->PrintStats();
+			g_pLightCache->Save( lightcachefile );
+			delete g_pLightCache;
+			g_pLightCache = NULL;
+		}
 	}
 
 	// Was the process interrupted?
@@ -2176,6 +2508,7 @@ void VRAD_LoadBSP( char const *pFilename )
 
 	strcpy(incrementfile, source);
 	Q_DefaultExtension(incrementfile, ".r0", sizeof(incrementfile));
+	Q_snprintf( lightcachefile, sizeof( lightcachefile ), "%s%s", source, g_bHDR ? "_hdr.vlc" : ".vlc" );
 	Q_DefaultExtension(source, ".bsp", sizeof( source ));
 
 	GetPlatformMapPath( source, platformPath, 0, MAX_PATH );
@@ -2254,6 +2587,27 @@ void VRAD_LoadBSP( char const *pFilename )
 	if ( g_bDumpRtEnv )
 		WriteRTEnv("trace.txt");
 
+	if ( g_bRayTraceBench )
+	{
+		RunRayTraceBenchmark();
+		exit( 0 );
+	}
+
+	if ( g_bLightCache )
+	{
+		// workers light their faces in other processes, and incremental lighting keeps its own file
+		if ( g_bUseMPI || g_pIncremental )
+		{
+			Warning( "-lightcache can't be used with -mpi or incremental lighting, ignoring it\n" );
+		}
+		else
+		{
+			// the triangles can't be read back once the tree is built over them
+			g_pLightCache = new CLightCache;
+			g_pLightCache->HashOccluders( g_RtEnv );
+		}
+	}
+
 	// Build acceleration structure
 	printf ( "Setting up ray-trace acceleration structure... ");
 	float start = Plat_FloatTime();
@@ -2333,6 +2687,8 @@ void VRAD_Finish()
 	GetHourMinuteSecondsString( (int)( end - g_flStartTime ), str, sizeof( str ) );
 	Msg( "%s elapsed\n", str );
 
+	PrintThreadPhaseStats();
+
 	ReleasePakFileLumps();
 }
 
@@ -2400,6 +2756,14 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bDumpRtEnv = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-rtbench" ) )
+		{
+			g_bRayTraceBench = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-lightcache" ) )
+		{
+			g_bLightCache = true;
+		}
 		else if ( !Q_stricmp( argv[i], "-LargeDispSampleRadius" ) )
 		{
 			g_bLargeDispSampleRadius = true;
@@ -2422,6 +2786,23 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 				return 1;
 			}
 		}
+		else if (!Q_stricmp(argv[i],"-bouncethreshold"))
+		{
+			if ( ++i < argc )
+			{
+				g_flBounceThreshold = (float)atof (argv[i]);
+				if ( g_flBounceThreshold < 0.0f )
+				{
+					Warning("Error: expected non-negative value after '-bouncethreshold'\n" );
+					return 1;
+				}
+			}
+			else
+			{
+				Warning("Error: expected a value after '-bouncethreshold'\n" );
+				return 1;
+			}
+		}
 		else if (!Q_stricmp(argv[i],"-verbose") || !Q_stricmp(argv[i],"-v"))
 		{
 			verbose = true;
@@ -2776,11 +3157,15 @@ void PrintUsage( int argc, char **argv )
 		"\n"
 		"  -v (or -verbose): Turn on verbose output (also shows more command\n"
 		"  -bounce #       : Set max number of bounces (default: 100).\n"
+		"  -bouncethreshold #: Stop bouncing once a bounce adds less than this fraction\n"
+		"                    of the light the first bounce added (default: 0).\n"
 		"  -fast           : Quick and dirty lighting.\n"
 		"  -fastambient    : Per-leaf ambient sampling is lower quality to save compute time.\n"
 		"  -final          : High quality processing. equivalent to -extrasky 16.\n"
 		"  -extrasky n     : trace N times as many rays for indirect light and sky ambient.\n"
 		"  -low            : Run as an idle-priority process.\n"
+		"  -lightcache     : Keep each face's direct lighting in <map>.vlc and only relight\n"
+		"                    the faces that lights or geometry changed since the last run.\n"
 		"  -mpi            : Use VMPI to distribute computations.\n"
 		"  -rederror       : Show errors in red.\n"
 		"\n"
@@ -2792,6 +3177,8 @@ void PrintUsage( int argc, char **argv )
 		"  -dump           : Write debugging .txt files.\n"
 		"  -dumpnormals    : Write normals to debug files.\n"
 		"  -dumptrace      : Write ray-tracing environment to debug files.\n"
+		"  -rtbench        : Time building the ray-tracing acceleration structure and\n"
+		"                    tracing a fixed set of rays through it, then exit.\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -lights <file>  : Load a lights file in addition to lights.rad and the\n"
@@ -236,8 +236,14 @@ struct CPatch
 //	struct		patch_s		*nextparent;		    // next in face
 //	struct		patch_s		*nextclusterchild;		// next terminal child in cluster
 
+	// transfers are stored compressed: numtransfers weights quantised to 16 bits
+	// (multiply by transferScale; bumped patches have the flat normal's cosine
+	// divided out), then the shooters' positions in
+	// g_TransferPatchOrder in ascending order, delta coded 7 bits per byte
 	int			numtransfers;
-	transfer_t	*transfers;
+	int			transferBytes;
+	float		transferScale;
+	byte		*transfers;
 
 	short		indices[3];				// displacement use these for subdivision
 };
@@ -247,6 +253,8 @@ extern CUtlVector<CPatch>	g_Patches;
 extern CUtlVector<int>		g_FacePatches;		// constains all patches, children first
 extern CUtlVector<int>		faceParents;		// contains only root patches, use next parent to iterate
 extern CUtlVector<int>		clusterChildren;
+extern CUtlVector<int>		g_TransferPatchOrder;	// all patches, sorted so that patches close in space are close in the list
+extern CUtlVector<int>		g_TransferPatchRank;	// position of each patch in g_TransferPatchOrder
 
 
 struct sky_camera_t
@@ -300,6 +308,10 @@ extern bool IsModelTextureShadowsForced( const char *pModelName );
 #define TRACE_ID_OPAQUE        0x02000000  // everyday light blocking face
 #define TRACE_ID_STATICPROP    0x04000000  // static prop - lower bits are prop ID
 extern RayTracingEnvironment g_RtEnv;
+extern bool g_bRayTraceBench;
+
+// rtbench.cpp
+void RunRayTraceBenchmark();
 
 #include "mpivrad.h"
 
@@ -323,6 +335,7 @@ extern  int extrapasses;
 extern	Vector ambient;
 extern  float maxlight;
 extern	unsigned numbounce;
+extern	float g_flBounceThreshold;
 extern  qboolean g_bLogHashData;
 extern  bool	debug_extra;
 extern	directlight_t	*activelights;
@@ -386,6 +399,11 @@ void TestLine( FourVectors const& start, FourVectors const& stop, fltx4 *pFracti
 void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
                           fltx4 *pFractionVisible, bool canRecurse = true, int static_prop_to_skip=-1, bool bDoDebug = false );
 
+// the same for two sets of four lines at once, traced as one 8-wide packet where the cpu allows
+void TestLine8( FourVectors const start[2], FourVectors const stop[2], fltx4 pFractionVisible[2], int static_prop_index_to_ignore=-1 );
+void TestLine_DoesHitSky8( FourVectors const start[2], FourVectors const stop[2],
+                           fltx4 pFractionVisible[2], bool canRecurse = true, int static_prop_to_skip=-1 );
+
 // converts any marked brush entities to triangles for shadow casting
 void ExtractBrushEntityShadowCasters ( void );
 void AddBrushesForRayTrace ( void );
@@ -397,6 +415,10 @@ int LightForString( char *pLight, Vector& intensity );
 void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers );
 void MakeScales( int ndxPatch, transfer_t *all_transfers );
 
+extern int total_transfer;
+extern int max_transfer;
+extern int64 total_transfer_bytes;
+
 // Run startup code like initialize mathlib.
 void VRAD_Init();
 